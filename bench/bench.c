@@ -0,0 +1,324 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#include "nethervm/nethervm.h"
+
+#ifndef NETHERVM_BENCH_PROGS
+#define NETHERVM_BENCH_PROGS "progs.dat"
+#endif
+
+#define BENCH_EDICTS 1024
+
+typedef struct
+{
+    const char* name;
+    const char* function;
+    const char* setup;      /* run once before timing, may be NULL */
+    int iterations;         /* calls of function per run at --scale 1 */
+} workload_t;
+
+static const workload_t workloads[] =
+{
+    { "arith",     "bench_arith",     NULL,                 50 },
+    { "vector",    "bench_vector",    NULL,                 50 },
+    { "fields",    "bench_fields",    "bench_fields_setup", 200 },
+    { "recursion", "bench_recursion", NULL,                 50 },
+    { "builtins",  "bench_builtins",  NULL,                 50 },
+    { "strings",   "bench_strings",   NULL,                 50 },
+};
+
+typedef struct
+{
+    unsigned long long allocs;
+    unsigned long long reallocs;
+    unsigned long long frees;
+    unsigned long long bytes;
+} allocstats_t;
+
+static allocstats_t allocstats;
+static unsigned int rand_state = 0x12345678;
+static float sink;
+
+static void* alloc_callback(NVM* vm, void* oldptr, size_t size, const char* name)
+{
+    if (oldptr == NULL) {
+        allocstats.allocs++;
+        allocstats.bytes += size;
+        return malloc(size);
+    }
+    else if (size > 0) {
+        allocstats.reallocs++;
+        allocstats.bytes += size;
+        return realloc(oldptr, size);
+    }
+    else {
+        allocstats.frees++;
+        free(oldptr);
+        return NULL;
+    }
+}
+
+static void print_callback(NVM* vm, const char* msg, bool debug)
+{
+    if (!debug)
+        fprintf(stderr, "%s", msg);
+}
+
+static void error_callback(NVM* vm, const char* msg)
+{
+    fprintf(stderr, "NVM error: %s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+static void builtin_edict_num(NVM* qcvm)
+{
+    int n = (int)G_FLOAT(OFS_PARM0);
+    if (n < 0 || n >= qcvm->num_edicts)
+        n = 0;
+    G_INT(OFS_RETURN) = n * qcvm->edict_size;
+}
+
+static void builtin_num_edicts(NVM* qcvm)
+{
+    G_FLOAT(OFS_RETURN) = (float)qcvm->num_edicts;
+}
+
+static void builtin_bmin(NVM* qcvm)
+{
+    float a = G_FLOAT(OFS_PARM0), b = G_FLOAT(OFS_PARM1);
+    G_FLOAT(OFS_RETURN) = a < b ? a : b;
+}
+
+static void builtin_bmax(NVM* qcvm)
+{
+    float a = G_FLOAT(OFS_PARM0), b = G_FLOAT(OFS_PARM1);
+    G_FLOAT(OFS_RETURN) = a > b ? a : b;
+}
+
+static void builtin_brandom(NVM* qcvm)
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    G_FLOAT(OFS_RETURN) = (float)((rand_state >> 8) & 0xffff) / 65536.0f;
+}
+
+static void builtin_bsink(NVM* qcvm)
+{
+    sink += G_FLOAT(OFS_PARM0);
+}
+
+static unsigned long long TimeNanoseconds(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if (!freq.QuadPart)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (unsigned long long)((double)now.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + (unsigned long long)ts.tv_nsec;
+#endif
+}
+
+static bool ReadFile(const char* filename, char** data, size_t* size)
+{
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+        return false;
+    fseek(f, 0, SEEK_END);
+    long fsize = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    char* content = malloc(fsize + 1);
+    if (fread(content, 1, fsize, f) != (size_t)fsize) {
+        fclose(f);
+        free(content);
+        return false;
+    }
+    fclose(f);
+
+    content[fsize] = 0;
+
+    *data = content;
+    *size = fsize;
+    return true;
+}
+
+static void Usage(const char* argv0)
+{
+    fprintf(stderr,
+        "usage: %s [options] [progs.dat]\n"
+        "  --json        one JSON object per workload\n"
+        "  --csv         CSV with a header line\n"
+        "  --runs N      timed runs per workload, the fastest is reported (default 5)\n"
+        "  --scale N     multiply every workload's iterations (default 1)\n"
+        "  --filter NAME only run workloads whose name contains NAME\n"
+        "  --inline N    inline leaf functions of up to N statements (default off)\n"
+        "  --layout FILE lay the statements out by a profile written with --count\n"
+        "  --count FILE  count statements over every run and save them as a layout profile\n"
+        "  --capture FILE log every run for nethervm_replay\n",
+        argv0);
+}
+
+int main(int argc, char** argv)
+{
+    enum { FORMAT_TABLE, FORMAT_JSON, FORMAT_CSV } format = FORMAT_TABLE;
+    const char* progs_filename = NETHERVM_BENCH_PROGS;
+    const char* filter = NULL;
+    int runs = 5;
+    int scale = 1;
+    int inline_statements = 0;
+    const char* layout_filename = NULL;
+    const char* count_filename = NULL;
+    const char* capture_filename = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--json"))
+            format = FORMAT_JSON;
+        else if (!strcmp(argv[i], "--csv"))
+            format = FORMAT_CSV;
+        else if (!strcmp(argv[i], "--runs") && i + 1 < argc)
+            runs = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--scale") && i + 1 < argc)
+            scale = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--filter") && i + 1 < argc)
+            filter = argv[++i];
+        else if (!strcmp(argv[i], "--inline") && i + 1 < argc)
+            inline_statements = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--layout") && i + 1 < argc)
+            layout_filename = argv[++i];
+        else if (!strcmp(argv[i], "--count") && i + 1 < argc)
+            count_filename = argv[++i];
+        else if (!strcmp(argv[i], "--capture") && i + 1 < argc)
+            capture_filename = argv[++i];
+        else if (argv[i][0] == '-') {
+            Usage(argv[0]);
+            return 1;
+        }
+        else
+            progs_filename = argv[i];
+    }
+    if (runs < 1)
+        runs = 1;
+    if (scale < 1)
+        scale = 1;
+
+    char* progs_data = NULL;
+    size_t progs_size = 0;
+    if (!ReadFile(progs_filename, &progs_data, &progs_size)) {
+        fprintf(stderr, "could not read %s\n", progs_filename);
+        return 1;
+    }
+
+    NVM* vm = nvmCreateVM(alloc_callback, print_callback, error_callback, NULL);
+    nvmSetInlining(vm, inline_statements);
+    nvmSetLayoutProfile(vm, layout_filename);
+    if (!nvmLoadProgs(vm, progs_filename, progs_data, progs_size, true)) {
+        nvmDestroyVM(vm);
+        free(progs_data);
+        return 1;
+    }
+    nvmAddExtBuiltin(vm, 0, "edict_num", builtin_edict_num);
+    nvmAddExtBuiltin(vm, 0, "num_edicts", builtin_num_edicts);
+    nvmAddExtBuiltin(vm, 0, "bmin", builtin_bmin);
+    nvmAddExtBuiltin(vm, 0, "bmax", builtin_bmax);
+    nvmAddExtBuiltin(vm, 0, "brandom", builtin_brandom);
+    nvmAddExtBuiltin(vm, 0, "bsink", builtin_bsink);
+
+    nvmAllocEdicts(vm, BENCH_EDICTS);
+    memset(vm->edicts, 0, BENCH_EDICTS * vm->edict_size);
+    vm->num_edicts = vm->max_edicts = BENCH_EDICTS;
+    if (count_filename && !nvmLayoutProfileBegin(vm))
+        count_filename = NULL;
+    if (capture_filename && !nvmCaptureBegin(vm, capture_filename))
+        return 1;
+
+    if (format == FORMAT_CSV)
+        printf("workload,iterations,ns,statements,ns_per_statement,function_calls,builtin_calls,calls_per_sec,allocations,allocated_bytes\n");
+    else if (format == FORMAT_TABLE)
+        printf("%-10s %10s %12s %12s %10s %12s %8s\n", "workload", "ms", "statements", "ns/stmt", "calls", "calls/sec", "allocs");
+
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++)
+    {
+        const workload_t* wl = &workloads[w];
+        if (filter && !strstr(wl->name, filter))
+            continue;
+
+        func_t func = nvmFindFunction(vm, wl->function);
+        if (!func) {
+            fprintf(stderr, "%s: no function %s\n", wl->name, wl->function);
+            continue;
+        }
+        if (wl->setup)
+            nvmExecuteFunction(vm, nvmFindFunction(vm, wl->setup));
+
+        /* warm up caches and anything the VM sets up lazily */
+        nvmExecuteFunction(vm, func);
+
+        int iterations = wl->iterations * scale;
+        unsigned long long best = ~0ull;
+        nvmstats_t stats = { 0 };
+        allocstats_t allocs = { 0 };
+        for (int r = 0; r < runs; r++)
+        {
+            nvmResetStats(vm);
+            allocstats_t before = allocstats;
+            unsigned long long start = TimeNanoseconds();
+            for (int i = 0; i < iterations; i++)
+                nvmExecuteFunction(vm, func);
+            unsigned long long elapsed = TimeNanoseconds() - start;
+            if (elapsed < best) {
+                best = elapsed;
+                nvmGetStats(vm, &stats);
+                allocs.allocs = allocstats.allocs - before.allocs;
+                allocs.reallocs = allocstats.reallocs - before.reallocs;
+                allocs.bytes = allocstats.bytes - before.bytes;
+            }
+        }
+        if (!best)
+            best = 1;
+
+        /* counters are compiled out with NETHERVM_STATS=OFF, report what is left */
+        unsigned long long calls = stats.function_calls + stats.builtin_calls;
+        double ns_per_statement = stats.statements ? (double)best / (double)stats.statements : 0.0;
+        double calls_per_sec = (double)calls * 1e9 / (double)best;
+        unsigned long long allocations = allocs.allocs + allocs.reallocs;
+
+        switch (format)
+        {
+        case FORMAT_JSON:
+            printf("{\"workload\":\"%s\",\"iterations\":%d,\"ns\":%llu,\"statements\":%llu,\"ns_per_statement\":%.4f,"
+                "\"function_calls\":%llu,\"builtin_calls\":%llu,\"calls_per_sec\":%.0f,\"allocations\":%llu,\"allocated_bytes\":%llu}\n",
+                wl->name, iterations, best, stats.statements, ns_per_statement,
+                stats.function_calls, stats.builtin_calls, calls_per_sec, allocations, allocs.bytes);
+            break;
+        case FORMAT_CSV:
+            printf("%s,%d,%llu,%llu,%.4f,%llu,%llu,%.0f,%llu,%llu\n",
+                wl->name, iterations, best, stats.statements, ns_per_statement,
+                stats.function_calls, stats.builtin_calls, calls_per_sec, allocations, allocs.bytes);
+            break;
+        default:
+            printf("%-10s %10.3f %12llu %12.3f %10llu %12.0f %8llu\n",
+                wl->name, (double)best / 1e6, stats.statements, ns_per_statement, calls, calls_per_sec, allocations);
+            break;
+        }
+    }
+
+    if (count_filename && !nvmLayoutProfileSave(vm, count_filename))
+        fprintf(stderr, "could not write %s\n", count_filename);
+
+    nvmCaptureEnd(vm);
+    nvmDestroyVM(vm);
+    free(progs_data);
+    return 0;
+}
@@ -0,0 +1,175 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#include "nethervm/nethervm.h"
+
+/* runs a log written with nvmCaptureBegin, no builtins needed */
+
+static void* alloc_callback(NVM* vm, void* oldptr, size_t size, const char* name)
+{
+    if (oldptr == NULL)
+        return malloc(size);
+    else if (size > 0)
+        return realloc(oldptr, size);
+    free(oldptr);
+    return NULL;
+}
+
+static void print_callback(NVM* vm, const char* msg, bool debug)
+{
+    if (!debug)
+        fprintf(stderr, "%s", msg);
+}
+
+static void error_callback(NVM* vm, const char* msg)
+{
+    fprintf(stderr, "NVM error: %s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+static unsigned long long TimeNanoseconds(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if (!freq.QuadPart)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (unsigned long long)((double)now.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + (unsigned long long)ts.tv_nsec;
+#endif
+}
+
+static bool ReadFile(const char* filename, char** data, size_t* size)
+{
+    FILE *f = fopen(filename, "rb");
+    if (!f)
+        return false;
+    fseek(f, 0, SEEK_END);
+    long fsize = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    char* content = malloc(fsize + 1);
+    if (fread(content, 1, fsize, f) != (size_t)fsize) {
+        fclose(f);
+        free(content);
+        return false;
+    }
+    fclose(f);
+
+    content[fsize] = 0;
+
+    *data = content;
+    *size = fsize;
+    return true;
+}
+
+static void Usage(const char* argv0)
+{
+    fprintf(stderr,
+        "usage: %s [options] progs.dat capture\n"
+        "  --json        print a JSON object\n"
+        "  --runs N      timed replays, the fastest is reported (default 5)\n"
+        "  --inline N    inline leaf functions of up to N statements (default off)\n"
+        "  --layout FILE lay the statements out by a profile written with nethervm_bench --count\n",
+        argv0);
+}
+
+int main(int argc, char** argv)
+{
+    const char* progs_filename = NULL;
+    const char* capture_filename = NULL;
+    bool json = false;
+    int runs = 5;
+    int inline_statements = 0;
+    const char* layout_filename = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--json"))
+            json = true;
+        else if (!strcmp(argv[i], "--runs") && i + 1 < argc)
+            runs = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--inline") && i + 1 < argc)
+            inline_statements = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--layout") && i + 1 < argc)
+            layout_filename = argv[++i];
+        else if (argv[i][0] == '-' || capture_filename) {
+            Usage(argv[0]);
+            return 1;
+        }
+        else if (!progs_filename)
+            progs_filename = argv[i];
+        else
+            capture_filename = argv[i];
+    }
+    if (!capture_filename) {
+        Usage(argv[0]);
+        return 1;
+    }
+    if (runs < 1)
+        runs = 1;
+
+    char* progs_data = NULL;
+    size_t progs_size = 0;
+    if (!ReadFile(progs_filename, &progs_data, &progs_size)) {
+        fprintf(stderr, "could not read %s\n", progs_filename);
+        return 1;
+    }
+
+    /* every run starts from a freshly loaded VM, the way the capture did */
+    unsigned long long best = ~0ull;
+    nvmstats_t stats = { 0 };
+    for (int r = 0; r < runs; r++)
+    {
+        char* data = malloc(progs_size + 1);
+        memcpy(data, progs_data, progs_size + 1);
+        NVM* vm = nvmCreateVM(alloc_callback, print_callback, error_callback, NULL);
+        nvmSetInlining(vm, inline_statements);
+        nvmSetLayoutProfile(vm, layout_filename);
+        if (!nvmLoadProgs(vm, progs_filename, data, progs_size, true)) {
+            nvmDestroyVM(vm);
+            free(data);
+            free(progs_data);
+            return 1;
+        }
+
+        unsigned long long start = TimeNanoseconds();
+        bool ok = nvmReplay(vm, capture_filename);
+        unsigned long long elapsed = TimeNanoseconds() - start;
+        if (ok && elapsed < best) {
+            best = elapsed;
+            nvmGetStats(vm, &stats);
+        }
+        nvmDestroyVM(vm);
+        free(data);
+        if (!ok) {
+            fprintf(stderr, "could not replay %s\n", capture_filename);
+            free(progs_data);
+            return 1;
+        }
+    }
+    if (!best)
+        best = 1;
+
+    double ns_per_statement = stats.statements ? (double)best / (double)stats.statements : 0.0;
+    if (json)
+        printf("{\"capture\":\"%s\",\"ns\":%llu,\"statements\":%llu,\"ns_per_statement\":%.4f,\"function_calls\":%llu,\"builtin_calls\":%llu}\n",
+            capture_filename, best, stats.statements, ns_per_statement, stats.function_calls, stats.builtin_calls);
+    else
+        printf("%s: %.3f ms, %llu statements, %.3f ns/stmt, %llu calls, %llu builtin calls\n",
+            capture_filename, (double)best / 1e6, stats.statements, ns_per_statement, stats.function_calls, stats.builtin_calls);
+
+    free(progs_data);
+    return 0;
+}
@@ -3,8 +3,19 @@
 
 #include "types.h"
 
+/* bumped with any change to what nvmLoadProgs makes of an image, the progs cache is keyed on it */
+#define	NVM_VERSION	1
+
 NVM* nvmCreateVM(AllocCallback acb, PrintCallback pcb, ErrorCallback ecb, void* user_data);
 
+NVM* nvmCreateVMEx(AllocCallback acb, PrintCallback pcb, ErrorCallback ecb, void* user_data, const nvmoptions_t* options);
+
+void* nvmAllocCallback(NVM* vm, void* ptr, size_t size, const char* name);
+
+bool nvmSetHugePages(NVM* vm, bool enable);
+
+int nvmGetAllocStats(NVM* vm, nvmalloctag_t* tags, int max_tags);
+
 void nvmDestroyVM(NVM* vm);
 
 void nvmAddExtBuiltin(NVM* qcvm, int num, const char* name, BuiltinFunction builtin);
@@ -13,6 +24,22 @@ void nvmLoadBuiltins(NVM* vm, BuiltinFunction* builtins, size_t num_builtins);
 
 bool nvmLoadProgs(NVM* vm, const char* filename, const char* data, size_t size, bool fatal);
 
+bool nvmReloadProgs(NVM* vm, const char* filename, const char* data, size_t size, bool fatal);
+
+void nvmSetChecked(NVM* vm, bool checked);
+
+void nvmSetInlining(NVM* vm, int max_statements);
+
+void nvmSetStripping(NVM* vm, const char* const* entry_points, int count, int flags);
+
+void nvmSetLayoutProfile(NVM* vm, const char* path);
+
+void nvmSetProgsCache(NVM* vm, bool enable);
+
+void nvmSetParallelThreads(NVM* vm, int threads);
+
+void nvmSetParallelSafe(NVM* vm, BuiltinFunction builtin, bool safe);
+
 bool nvmAllocEdicts(NVM* vm, size_t count);
 
 func_t nvmFindFunction(NVM* vm, const char* name);
@@ -21,8 +48,80 @@ global_t nvmFindGlobal(NVM* vm, const char* name);
 
 field_t nvmFindField(NVM* vm, const char* name);
 
+nvmhandle_t nvmGlobalHandle(NVM* vm, const char* name, etype_t type);
+
+nvmhandle_t nvmFieldHandle(NVM* vm, const char* name, etype_t type);
+
+int nvmGatherField(NVM* vm, nvmhandle_t field, const int* edict_nums, int count, void* values);
+
+int nvmScatterField(NVM* vm, nvmhandle_t field, const int* edict_nums, int count, const void* values);
+
 const char* nvmGetString(NVM* vm, int str_ofs);
 
+string_t nvmTempString(NVM* vm, char** buffer);
+
+void nvmAddStringBuiltins(NVM* vm);
+
+void nvmBuiltinFtos(NVM* vm);
+
+void nvmBuiltinVtos(NVM* vm);
+
+void nvmBuiltinEtos(NVM* vm);
+
+void nvmBuiltinStrcat(NVM* vm);
+
+void nvmBuiltinSprintf(NVM* vm);
+
 void nvmExecuteFunction(NVM* vm, func_t func_ofs);
 
+nvmstatus_t nvmExecuteBudget(NVM* vm, func_t func_ofs, int max_statements);
+
+nvmstatus_t nvmResume(NVM* vm, int max_statements);
+
+int nvmExecuteForEdicts(NVM* vm, int field_or_func, const int* edict_nums, int count, int flags, nvmedictstatus_t* results);
+
+int nvmSuspend(NVM* vm);
+
+void nvmWake(NVM* vm, int thread, const eval_t* result);
+
+void nvmKillThread(NVM* vm, int thread);
+
+nvmthreadstate_t nvmThreadState(NVM* vm, int thread);
+
+int nvmRunThreads(NVM* vm, int max_threads, int max_statements);
+
+void nvmGetStats(NVM* vm, nvmstats_t* stats);
+
+void nvmResetStats(NVM* vm);
+
+void nvmProfileBegin(NVM* vm);
+
+void nvmProfileEnd(NVM* vm);
+
+void nvmProfileReport(NVM* vm, int max_lines);
+
+bool nvmLayoutProfileBegin(NVM* vm);
+
+bool nvmLayoutProfileSave(NVM* vm, const char* path);
+
+void nvmLayoutProfileEnd(NVM* vm);
+
+size_t nvmProfileExportFolded(NVM* vm, char* buffer, size_t size, nvmprofilemetric_t metric);
+
+bool nvmSamplingBegin(NVM* vm, int hz);
+
+void nvmSample(NVM* vm);
+
+int nvmSamplingCollect(NVM* vm);
+
+void nvmSamplingEnd(NVM* vm);
+
+void nvmSamplingReport(NVM* vm, int max_lines);
+
+bool nvmCaptureBegin(NVM* vm, const char* path);
+
+void nvmCaptureEnd(NVM* vm);
+
+bool nvmReplay(NVM* vm, const char* path);
+
 #endif
\ No newline at end of file
@@ -143,23 +143,236 @@ enum
 	OP_OR,
 
 	OP_BITAND,
-	OP_BITOR
+	OP_BITOR,
+
+	/* fteqcc extensions, numbered the way it emits them */
+	OP_MULSTORE_F,
+	OP_MULSTORE_VF,
+	OP_MULSTOREP_F,
+	OP_MULSTOREP_VF,
+
+	OP_DIVSTORE_F,
+	OP_DIVSTOREP_F,
+
+	OP_ADDSTORE_F,
+	OP_ADDSTORE_V,
+	OP_ADDSTOREP_F,
+	OP_ADDSTOREP_V,
+
+	OP_SUBSTORE_F,
+	OP_SUBSTORE_V,
+	OP_SUBSTOREP_F,
+	OP_SUBSTOREP_V,
+
+	OP_FETCH_GBL_F,
+	OP_FETCH_GBL_V,
+	OP_FETCH_GBL_S,
+	OP_FETCH_GBL_E,
+	OP_FETCH_GBL_FNC,
+
+	OP_CSTATE,
+	OP_CWSTATE,
+	OP_THINKTIME,
+
+	OP_BITSETSTORE_F,
+	OP_BITSETSTOREP_F,
+	OP_BITCLRSTORE_F,
+	OP_BITCLRSTOREP_F,
+
+	OP_RAND0,
+	OP_RAND1,
+	OP_RAND2,
+	OP_RANDV0,
+	OP_RANDV1,
+	OP_RANDV2,
+
+	OP_SWITCH_F,
+	OP_SWITCH_V,
+	OP_SWITCH_S,
+	OP_SWITCH_E,
+	OP_SWITCH_FNC,
+
+	OP_CASE,
+	OP_CASERANGE,
+
+	OP_CALL1H,
+	OP_CALL2H,
+	OP_CALL3H,
+	OP_CALL4H,
+	OP_CALL5H,
+	OP_CALL6H,
+	OP_CALL7H,
+	OP_CALL8H,
+
+	OP_STORE_I,
+	OP_STORE_IF,
+	OP_STORE_FI,
+
+	OP_ADD_I,
+	OP_ADD_FI,
+	OP_ADD_IF,
+
+	OP_SUB_I,
+	OP_SUB_FI,
+	OP_SUB_IF,
+
+	OP_CONV_ITOF,
+	OP_CONV_FTOI,
+	OP_CP_ITOF,
+	OP_CP_FTOI,
+
+	OP_LOAD_I,
+	OP_STOREP_I,
+	OP_STOREP_IF,
+	OP_STOREP_FI,
+
+	OP_BITAND_I,
+	OP_BITOR_I,
+
+	OP_MUL_I,
+	OP_DIV_I,
+	OP_EQ_I,
+	OP_NE_I,
+
+	OP_IFNOT_S,
+	OP_IF_S,
+
+	OP_NOT_I,
+
+	OP_DIV_VF,
+
+	OP_BITXOR_I,
+	OP_RSHIFT_I,
+	OP_LSHIFT_I,
+
+	OP_GLOBALADDRESS,
+	OP_ADD_PIW,
+
+	OP_LOADA_F,
+	OP_LOADA_V,
+	OP_LOADA_S,
+	OP_LOADA_ENT,
+	OP_LOADA_FLD,
+	OP_LOADA_FNC,
+	OP_LOADA_I,
+
+	OP_STORE_P,
+	OP_LOAD_P,
+
+	OP_LOADP_F,
+	OP_LOADP_V,
+	OP_LOADP_S,
+	OP_LOADP_ENT,
+	OP_LOADP_FLD,
+	OP_LOADP_FNC,
+	OP_LOADP_I,
+
+	OP_LE_I,
+	OP_GE_I,
+	OP_LT_I,
+	OP_GT_I,
+
+	OP_LE_IF,
+	OP_GE_IF,
+	OP_LT_IF,
+	OP_GT_IF,
+
+	OP_LE_FI,
+	OP_GE_FI,
+	OP_LT_FI,
+	OP_GT_FI,
+
+	OP_EQ_IF,
+	OP_EQ_FI,
+
+	OP_ADD_SF,
+	OP_SUB_S,
+	OP_STOREP_C,
+	OP_LOADP_C,
+
+	OP_MUL_IF,
+	OP_MUL_FI,
+	OP_MUL_VI,
+	OP_MUL_IV,
+
+	OP_DIV_IF,
+	OP_DIV_FI,
+
+	OP_BITAND_IF,
+	OP_BITOR_IF,
+	OP_BITAND_FI,
+	OP_BITOR_FI,
+
+	OP_AND_I,
+	OP_OR_I,
+	OP_AND_IF,
+	OP_OR_IF,
+	OP_AND_FI,
+	OP_OR_FI,
+
+	OP_NE_IF,
+	OP_NE_FI,
+
+	OP_GSTOREP_I,
+	OP_GSTOREP_F,
+	OP_GSTOREP_ENT,
+	OP_GSTOREP_FLD,
+	OP_GSTOREP_S,
+	OP_GSTOREP_FNC,
+	OP_GSTOREP_V,
+
+	OP_GADDRESS,
+	OP_GLOAD_I,
+	OP_GLOAD_F,
+	OP_GLOAD_FLD,
+	OP_GLOAD_ENT,
+	OP_GLOAD_S,
+	OP_GLOAD_FNC,
+
+	OP_BOUNDCHECK,
+	OP_UNUSED,
+	OP_PUSH,
+	OP_POP,
+
+	OP_SWITCH_I,
+	OP_GLOAD_V,
+
+	OP_IF_F,
+	OP_IFNOT_F,
+
+	OP_NUMOPS
 };
 
+// statements and defs as the VM keeps them, which is also how version 7
+// progs with 32 bit lumps store them, so those are used in place
 typedef struct statement_s
 {
-	unsigned short	op;
-	short	a, b, c;
+	unsigned int	op;
+	unsigned int	a, b, c;	// branch offsets are read as int
 } dstatement_t;
 
 typedef struct
 {
-	unsigned short	type;	// if DEF_SAVEGLOBAL bit is set
+	unsigned int	type;	// if DEF_SAVEGLOBAL bit is set
 				// the variable needs to be saved in savegames
-	unsigned short	ofs;
+	unsigned int	ofs;
 	int		s_name;
 } ddef_t;
 
+// the 16 bit lumps of version 6 progs, widened at load
+typedef struct
+{
+	unsigned short	op;
+	unsigned short	a, b, c;
+} dstatement16_t;
+
+typedef struct
+{
+	unsigned short	type;
+	unsigned short	ofs;
+	int		s_name;
+} ddef16_t;
+
 #define	DEF_SAVEGLOBAL	(1<<15)
 
 #define	MAX_PARMS	8
@@ -181,6 +394,9 @@ typedef struct
 
 
 #define	PROG_VERSION	6
+#define	PROG_EXTENDEDVERSION	7	// fteqcc, look at secondaryversion
+#define	PROG_SECONDARYVERSION16	(('1' | 'F' << 8 | 'T' << 16 | 'E' << 24) ^ ('P' | 'R' << 8 | 'O' << 16 | 'G' << 24))
+#define	PROG_SECONDARYVERSION32	(('1' | 'F' << 8 | 'T' << 16 | 'E' << 24) ^ ('3' | '2' << 8 | 'B' << 16 | ' ' << 24))
 typedef struct
 {
 	int		version;
@@ -205,7 +421,21 @@ typedef struct
 	int		numglobals;
 
 	int		entityfields;
+
+	// PROG_EXTENDEDVERSION only, these are lump data in version 6 progs
+	int		ofsfiles;
+	int		ofslinenums;
+	int		ofsbodylessfuncs;
+	int		numbodylessfuncs;
+
+	int		ofs_types;
+	int		numtypes;
+	int		blockscompressed;
+
+	int		secondaryversion;
 } dprograms_t;
 
+#define	PROG_V6_HEADERSIZE	((int)(sizeof(int) * 15))
+
 #endif	/* __PR_COMP_H */
 
@@ -5,6 +5,8 @@
 #include "nethervm/progdefs.h"
 
 #define MAX_BUILTINS 1024
+#define	MAX_STACK_DEPTH		1024 /*was 64*/	/* was 32 */
+#define	LOCALSTACK_SIZE		16384 /* was 2048*/
 #define AREA_NODES 32
 
 #define	NEXT_EDICT(e)		((edict_t *)( (byte *)e + qcvm->edict_size))
@@ -26,6 +28,11 @@
 #define	E_INT(e,o)		    (*(int *)&((float*)&e->v)[o])
 #define	E_VECTOR(e,o)		(&((float*)&e->v)[o])
 #define	E_STRING(e,o)		(nvmGetString(qcvm, *(string_t *)&((float*)&e->v)[o]))
+#define	E_HEADER(e,type)	((type *)((byte *)(e) + qcvm->edict_headerofs))
+
+/* typed access through an nvmhandle_t, e.g. NVM_FIELD(ed, origin, vec3_t).x */
+#define	NVM_GLOBAL(vm,h,type)	(*(type *)&(vm)->globals[(h).ofs])
+#define	NVM_FIELD(e,h,type)		(*(type *)&((float *)&(e)->v)[(h).ofs])
 
 typedef struct NVM_s NVM;
 
@@ -50,6 +57,13 @@ typedef void(*PrintCallback)(NVM* vm, const char* msg, bool debug);
 
 typedef void(*ErrorCallback)(NVM* vm, const char* msg);
 
+/* a global or field looked up once by nvmGlobalHandle or nvmFieldHandle, ofs is -1 if the progs have none of that name and type */
+typedef struct
+{
+	int			ofs;
+	etype_t		type;
+} nvmhandle_t;
+
 typedef union eval_s
 {
 	string_t	string;
@@ -60,24 +74,13 @@ typedef union eval_s
 	int		edict;
 } eval_t;
 
-#define	MAX_ENT_LEAFS	32
 typedef struct edict_s
 {
 	qboolean	free;
-	//link_t		area;			/* linked to a division node or leaf */
-
-	unsigned int		num_leafs;
-	int		leafnums[MAX_ENT_LEAFS];
-
-	//entity_state_t	baseline;
-	unsigned char	alpha;			/* johnfitz -- hack to support alpha since it's not part of entvars_t */
-	qboolean	sendinterval;		/* johnfitz -- send time until nextthink to client for better lerp timing */
-	qboolean	onladder;			/* spike -- content_ladder stuff */
-
-	float		freetime;		/* sv.time when the object was freed */
 	entvars_t	v;			/* C exported fields from progs */
 
-	/* other fields from progs come immediately after */
+	/* other fields from progs come immediately after, then the
+	   nvmoptions_t edict_header bytes of engine data, see E_HEADER */
 } edict_t;
 
 typedef struct
@@ -86,6 +89,282 @@ typedef struct
 	dfunction_t	*f;
 } prstack_t;
 
+/* nvmTempString's ring, a temp string lasts until NVM_TEMPSTRINGS more are made */
+#define	NVM_TEMPSTRINGS		16
+#define	NVM_TEMPSTRING_SIZE	1024
+
+/* one way of an OP_CALL site's inline cache, filled by PR_CallCacheMiss */
+#define	NVM_CALLCACHE_WAYS	2
+typedef struct
+{
+	int		statement;		/* the call site, -1 when empty */
+	func_t		function;
+	dfunction_t	*f;
+	int		builtin;		/* builtin number, -1 for QC functions */
+	BuiltinFunction	call;	/* what builtin was bound to when it was cached */
+} prcallcache_t;
+
+/* statements the inliner spliced in from a function, for stack traces */
+typedef struct
+{
+	int		first, end;		/* [first, end) in qcvm->statements */
+	int		function;
+} prinlined_t;
+
+/* nvmCaptureBegin's log being written, or nvmReplay's being read */
+typedef struct
+{
+	void		*f;				/* FILE, while capturing */
+	byte		*log;			/* all of it, while replaying */
+	size_t		logsize, logpos;
+	qboolean	replaying;
+	qboolean	failed;			/* the log is incomplete, or the replay went wrong */
+	func_t		direct;			/* a builtin nvmExecuteForEdicts calls itself, 0 for OP_CALL */
+	int			*shadow;		/* globals as QC last left them, then edicts as last logged */
+	int			shadowsize;		/* in ints */
+	char		**strings;		/* knownstrings as QC last left them, copies */
+	int			numstrings;
+} prcapture_t;
+
+/* one node of the profiler's calling context tree: a function as reached from its parent node */
+typedef struct
+{
+	int		func;			/* index into qcvm->functions, 0 for the host */
+	int		parent;			/* -1 for the root */
+	unsigned int	calls;
+	unsigned long long	self_statements;
+	unsigned long long	self_time;	/* nanoseconds */
+} prprofnode_t;
+
+typedef struct
+{
+	prprofnode_t	*nodes;
+	int			numnodes;
+	int			maxnodes;
+	int			*hash;		/* (parent, func) -> node, open addressing */
+	int			hashsize;
+	int			current;
+	unsigned long long	lasttime;
+	unsigned long long	begintime;
+	unsigned long long	endtime;
+} prprofile_t;
+
+typedef enum
+{
+	NVM_PROFILE_TIME,			/* self time in microseconds */
+	NVM_PROFILE_STATEMENTS		/* self statement count */
+} nvmprofilemetric_t;
+
+#define	NVM_SAMPLE_FRAMES	16
+
+typedef struct
+{
+	int		statement;
+	int		numfuncs;
+	int		funcs[NVM_SAMPLE_FRAMES];	/* innermost first */
+} prsample_t;
+
+/* the sampler's ring is single producer (nvmSample) single consumer (nvmSamplingCollect) */
+typedef struct
+{
+	prsample_t	*ring;
+	unsigned int	ringsize;		/* power of two */
+	volatile unsigned int	head;
+	volatile unsigned int	tail;
+	volatile unsigned int	dropped;	/* ring was full */
+	volatile unsigned int	torn;		/* caught in the middle of a call or return */
+	volatile unsigned int	idle;		/* no QC running */
+	int			hz;
+
+	unsigned int	samples;
+	int			numfunctions;
+	int			numstatements;
+	unsigned int	*selfhits;		/* [numfunctions] */
+	unsigned int	*totalhits;		/* [numfunctions], once per sample however deep the recursion */
+	unsigned int	*statementhits;	/* [numstatements] */
+} prsampler_t;
+
+/* runtime counters, see nvmGetStats; compiled out with NVM_NO_STATS */
+typedef struct
+{
+	unsigned long long	statements;
+	unsigned long long	opcodes[OP_NUMOPS];
+	unsigned long long	function_calls;		/* QC functions entered */
+	unsigned long long	builtin_calls;		/* all builtins, per builtin in builtin_calls_by_num */
+	unsigned long long	strings_allocated;
+	int			max_depth;
+	int			max_localstack_used;
+	int			live_edicts;
+	int			numbuiltins;
+	const unsigned int	*builtin_calls_by_num;
+	unsigned long long	parallel_thinks;	/* edicts run by NVM_EDICTS_PARALLEL batches */
+	unsigned long long	parallel_replays;	/* of those, how many had to run again serially */
+	unsigned long long	lane_thinks;		/* edicts run in lanes by NVM_EDICTS_LANES batches */
+	unsigned long long	lane_replays;		/* of those, how many had to run again serially */
+	unsigned long long	tail_calls;		/* QC functions entered in place of their caller's frame */
+} nvmstats_t;
+
+/* nvmCreateVMEx, zero fields get the defaults */
+typedef struct
+{
+	int		max_builtins;		/* builtin numbers are below this, MAX_BUILTINS */
+	int		max_stack_depth;	/* QC call depth, MAX_STACK_DEPTH */
+	int		max_localstack;		/* ints of locals saved by active calls, LOCALSTACK_SIZE */
+	int		edict_header;		/* bytes of engine data after each edict's fields, none */
+} nvmoptions_t;
+
+/* nvmGetAllocStats, one per allocation name */
+typedef struct
+{
+	const char	*name;
+	size_t		bytes;			/* live */
+	size_t		peak;
+	unsigned int	count;			/* live blocks */
+	unsigned long long	allocations;	/* ever made, reallocations not counted */
+} nvmalloctag_t;
+
+/* flags of nvmSetStripping */
+#define	NVM_STRIP_FUNCTIONS	1	/* drop the bodies of functions the entry points can't reach, see STRIPPING in nethervm.c */
+#define	NVM_STRIP_DEFS		2	/* and the global defs of their locals and of the functions themselves */
+
+/* what the last load stripped, vm->stripped. The rest are packed in place, the
+   memory isn't given back */
+typedef struct
+{
+	int		functions;
+	int		statements;	/* removed from the image */
+	int		defs;
+} nvmstripstats_t;
+
+typedef enum
+{
+	NVM_COMPLETED,
+	NVM_YIELDED,		/* out of statements, continue with nvmResume */
+	NVM_SUSPENDED		/* a builtin called nvmSuspend, the QC now lives in a thread */
+} nvmstatus_t;
+
+typedef enum
+{
+	NVM_THREAD_NONE,
+	NVM_THREAD_RUNNING,
+	NVM_THREAD_WAITING,	/* suspended, waiting for nvmWake */
+	NVM_THREAD_READY	/* will run on the next nvmRunThreads */
+} nvmthreadstate_t;
+
+/* flags of nvmExecuteForEdicts */
+#define	NVM_EDICTS_FIELD		1	/* run the function each edict holds in a field, not one function for all */
+#define	NVM_EDICTS_THINKTIME	2	/* time is the edict's nextthink, which is cleared first, as SV_RunThink does */
+#define	NVM_EDICTS_PARALLEL		4	/* spread over nvmSetParallelThreads workers, see PARALLEL in nethervm.c */
+#define	NVM_EDICTS_LANES		8	/* edicts with the same function run NVM_LANES at a time in lockstep, see LANES in nethervm.c */
+
+#define	NVM_LANES	8
+
+/* what nvmExecuteForEdicts did with one edict */
+typedef enum
+{
+	NVM_EDICT_RAN,
+	NVM_EDICT_SKIPPED,		/* out of range, free, or no function in the field */
+	NVM_EDICT_SUSPENDED,	/* a builtin called nvmSuspend, the rest runs as a thread */
+	NVM_EDICT_ERROR			/* a run time error, which only stopped this edict */
+} nvmedictstatus_t;
+
+/* a suspended QC execution: its frames and their local slots, detached from the VM */
+typedef struct
+{
+	int			id;
+	nvmthreadstate_t	state;
+	qboolean	wakepending;	/* woken before it got to suspend */
+	qboolean	killed;
+	int			next;			/* ready queue */
+
+	int			statement;		/* resumes after this one */
+	float		returnvalue[3];	/* what the suspending builtin returned, or nvmWake's result */
+
+	prstack_t	*frames;		/* outermost first; s is where the previous frame resumes */
+	int			numframes;
+	int			maxframes;
+	int			*locals;		/* every frame's local slots, outermost first */
+	int			numlocals;
+	int			maxlocals;
+} prthread_t;
+
+/* one lane's value of a global */
+typedef union
+{
+	float		_float;
+	int			_int;
+} prlaneval_t;
+
+/* NVM_EDICTS_LANES state, lane l of global g is globals[g * NVM_LANES + l] */
+typedef struct
+{
+	prlaneval_t	*globals;
+	int			numglobals;
+	int			*shared;		/* the globals lanes only read, see PR_ParallelUnsafe, but self and time */
+	int			numshared;
+	qboolean	stale;			/* they may have changed since they were copied into the lanes */
+	int			read[NVM_LANES];	/* the edict a lane last read, it is logged already */
+	int			wrote[NVM_LANES];	/* and the one it last wrote */
+	unsigned int	serial;		/* stamps the edicts the running chunk touched */
+	unsigned int	*stamp;		/* [maxedicts] */
+	unsigned char	*owner;		/* [maxedicts], the lane that touched an edict, PR_LANE_SHARED for several */
+	byte		*written;		/* [maxedicts] */
+	int			maxedicts;
+	int			*undo;			/* int offset into the edicts, old value, for every store of the running chunk */
+	int			numundo, maxundo;
+	int			*list;			/* [count], the batch when it has no edict list */
+	int			maxlist;
+	byte		*unsupported;	/* [numfunctions], functions that left the lanes for something they can't run */
+	qboolean	busy;			/* a batch from a builtin of a serial chunk runs serially */
+} prlanes_t;
+
+/* one thread of an NVM_EDICTS_PARALLEL batch: a copy of the VM with its own globals and stacks */
+typedef struct prworker_s
+{
+	NVM			*vm;
+	struct prparallel_s	*parallel;
+	void		*block;			/* everything below, in one allocation */
+	size_t		blocksize;
+	int			first, end;		/* its part of the batch */
+	int			think;			/* the one running */
+	unsigned int	serial;		/* stamps the edicts the running think touched */
+	unsigned int	*readstamp, *writestamp;	/* [maxedicts] */
+	int			*shadow;		/* [maxedicts], the slot of an edict written by the running think */
+	byte		*slots;			/* copies of edicts written, maxslots * edict_size */
+	int			*slotowner;		/* think, edict for each slot */
+	int			numslots, maxslots;
+	int			*touches;		/* think, edict << 1 | written for every edict a think read or wrote */
+	int			numtouches, maxtouches;
+	qboolean	overflowed;		/* ran out of slots or touches, they grow for the next batch */
+	prcallcache_t	*callcache;	/* its own, a copy of the VM's as of callcacheserial */
+	unsigned int	callcacheserial;
+} prworker_t;
+
+typedef struct prparallel_s
+{
+	BuiltinFunction	*safe;		/* nvmSetParallelSafe */
+	int			numsafe, maxsafe;
+	byte		*unsafe;		/* [numfunctions], QC functions that write shared globals, NULL until a batch */
+	byte		*shared;		/* [numglobals], in the same allocation */
+	prlanes_t	*lanes;			/* NVM_EDICTS_LANES, which runs what unsafe allows */
+
+	prworker_t	*workers;
+	int			numworkers, maxworkers;
+
+	/* the batch */
+	const int	*edict_nums;
+	int			count, ofs, flags;
+	func_t		func;
+	float		time;
+	unsigned char	*status;		/* [count] nvmedictstatus_t, or PR_REPLAY */
+	nvmedictstatus_t	*replayresults;
+	int			*replays;
+	int			*owner;			/* [max_edicts] */
+	void		*block;			/* status to owner */
+	size_t		blocksize;
+	qboolean	busy;			/* a batch from a builtin of the serial pass runs serially */
+} prparallel_t;
+
 typedef struct areanode_s
 {
 	int		axis;		// -1 = leaf node
@@ -102,15 +381,32 @@ typedef struct NVM_s
 	dstatement_t	*statements;
 	float		*globals;	/* same as qcvm->global_struct */
 	ddef_t		*fielddefs;	//yay reflection.
+	void		*lumps;		/* 16 bit statements and defs widened at load, NULL when used in place */
+	void		*cache;		/* the nvmSetProgsCache file the progs were mapped from, NULL if they weren't */
+	size_t		cachesize;
+	qboolean	usecache;	/* nvmSetProgsCache */
+	void		*inlined;	/* the inliner's statements and globals, NULL when nothing was inlined */
+	prinlined_t	*inlinedranges;	/* sorted by first */
+	int			numinlinedranges;
+	int			inlinelimit;	/* nvmSetInlining */
+	prcallcache_t	*callcache;	/* NVM_CALLCACHE_WAYS per set, sets picked by statement */
+	unsigned int	callcachemask;
+	unsigned int	callcacheserial;	/* changes when the cache is flushed */
 
 	int			edict_size;	/* in bytes */
 
-	BuiltinFunction	builtins[MAX_BUILTINS];
+	BuiltinFunction	*builtins;		/* by number, grown to the highest one bound */
 	int			    numbuiltins;
+	BuiltinFunction	*extbuiltins;	/* nvmAddExtBuiltin by name, numbered down from maxbuiltins - 1 */
+	int			numextbuiltins;
+	int			maxbuiltins;
 
 	int			argc;
+	unsigned int	randseed;	/* OP_RAND*, never 0 */
 
-	qboolean	trace;
+	qboolean	trace;		/* print each statement, runs the checked interpreter from the next call in */
+	qboolean	verified;	/* passed PR_VerifyProgs, runs the unchecked interpreter */
+	qboolean	checked;	/* nvmSetChecked, always run the checked interpreter */
 	dfunction_t	*xfunction;
 	int			xstatement;
 
@@ -139,14 +435,46 @@ typedef struct NVM_s
 	size_t knownzonesize;
 
 	//originally defined in pr_exec, but moved into the switchable qcvm struct
-#define	MAX_STACK_DEPTH		1024 /*was 64*/	/* was 32 */
-	prstack_t	stack[MAX_STACK_DEPTH];
+	prstack_t	*stack;			/* allocated on the first call, grown up to maxstackdepth */
+	int			stacksize;
+	int			maxstackdepth;
 	int			depth;
 
-#define	LOCALSTACK_SIZE		16384 /* was 2048*/
-	int			localstack[LOCALSTACK_SIZE];
+	int			*localstack;
+	int			localstacksize;
+	int			maxlocalstack;
 	int			localstack_used;
 
+	/* a budgeted execution that ran out of statements, resumes after suspendstatement */
+	qboolean	suspended;
+	int			suspendstatement;
+	int			suspendexitdepth;
+	int			suspendprofnode;
+	float		suspendreturn[3];
+
+	prthread_t	*threads;
+	int			numthreads;
+	int			threadserial;
+	int			readyhead, readytail;	/* -1 when empty */
+	int			xthread;			/* id of the thread the innermost loop is running, 0 if none */
+	qboolean	suspendrequest;
+	void		*errorjmp;			/* jmp_buf of the innermost nvmExecuteForEdicts, run time errors go there */
+	int			parallelthreads;	/* nvmSetParallelThreads */
+	prparallel_t	*parallel;
+	prworker_t	*worker;			/* set on a worker's copy of the VM */
+
+	qboolean	profiling;
+	prprofile_t	*profile;
+
+	/* published for nvmSample: sampleseq is odd while a call or return is updating the stack */
+	qboolean	sampling;
+	volatile unsigned int	sampleseq;
+	volatile int	samplestatement;	/* kept up to date whether sampling or not */
+	prsampler_t	*sampler;
+
+	nvmstats_t	stats;
+	unsigned int	*builtincalls;	/* [maxbuiltins], allocated when the first builtin is called */
+
 	//originally part of the sv_state_t struct
 	//FIXME: put worldmodel in here too.
 	double		time;
@@ -167,6 +495,27 @@ typedef struct NVM_s
     PrintCallback print_callback;
     int auto_ext_builtin_number;
 	void* user_data;
+
+	char		*striproots;	/* nvmSetStripping's entry points, each NUL terminated, an empty name ends them */
+	int			striprootssize;
+	int			stripflags;
+	nvmstripstats_t	stripped;
+	byte		*strippedfuncs;	/* a bit per function stripped at load, NULL when none were */
+
+	char		*layoutpath;		/* nvmSetLayoutProfile */
+	unsigned int	layouthash;		/* of the profile read at load, 0 without one */
+	qboolean	laidout;			/* the statements are in the order a profile asked for */
+	void		*layout;			/* the layout pass's statements, NULL when it didn't run */
+	unsigned int	*statementcounts;	/* [numstatements] while nvmLayoutProfileBegin collects */
+
+	prcapture_t	*capture;			/* nvmCaptureBegin or nvmReplay */
+
+	int			edict_header;		/* nvmoptions_t, in bytes */
+	int			edict_headerofs;	/* where it starts in an edict, past the progs fields */
+
+	char		*tempstrings;		/* [NVM_TEMPSTRINGS][NVM_TEMPSTRING_SIZE], allocated by the first nvmTempString */
+	string_t	tempstringslots[NVM_TEMPSTRINGS];
+	unsigned int	tempstringcount;	/* made so far, the next one is this modulo NVM_TEMPSTRINGS */
 } NVM;
 
 #endif
\ No newline at end of file
@@ -1,8 +1,18 @@
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <setjmp.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <pthread.h>
+#endif
 #include "nethervm/nethervm.h"
 #include "nethervm/types.h"
 
@@ -10,6 +20,73 @@ static const char* PR_GetString(NVM* qcvm, int ofs);
 
 static int PR_SetEngineString(NVM* vm, const char* str);
 
+static void PR_ProfileFree(NVM* qcvm);
+
+static void PR_SamplerFree(NVM* qcvm);
+
+static void PR_FreeThreads(NVM* qcvm);
+
+static qboolean PR_VerifyProgs(NVM* qcvm, const char* filename);
+
+static void PR_WidenLumps(NVM* qcvm);
+
+static qboolean PR_InlineFunctions(NVM* qcvm);
+
+static void PR_StripFunctions(NVM* qcvm);
+
+static void *PR_LayoutRead(NVM* qcvm, size_t *size);
+
+static qboolean PR_LayoutStatements(NVM* qcvm, const void *data, size_t size);
+
+static void PR_MarkTailCalls(NVM* qcvm);
+
+static dfunction_t *PR_InlinedFunction(NVM* qcvm, int statement);
+
+static void PR_CallCacheAlloc(NVM* qcvm);
+
+static void PR_CallCacheFlush(NVM* qcvm);
+
+static void PR_CaptureEnter(NVM* qcvm, func_t fnum);
+
+static void PR_CaptureEdicts(NVM* qcvm, int field_or_func, const int* edict_nums, int count, int flags);
+
+static void PR_CaptureLeave(NVM* qcvm);
+
+static void PR_CaptureBuiltin(NVM* qcvm);
+
+static void PR_ReplayBuiltin(NVM* qcvm);
+
+static void PR_FreeStrings(NVM* qcvm);
+
+static void PR_GrowStack(NVM* qcvm, int depth);
+
+static unsigned short PR_CRC(const byte *data, size_t size);
+
+static unsigned int PR_BlockChecksum(const byte *data, size_t size);
+
+static qboolean PR_CacheLoad(NVM* qcvm, const char *filename);
+
+static void PR_CacheWrite(NVM* qcvm, const char *filename);
+
+static void PR_CacheFree(NVM* qcvm);
+
+static void PR_ParallelAbort(NVM* qcvm);
+
+static void PR_ParallelFree(NVM* qcvm);
+
+static void PR_LanesFree(NVM* qcvm);
+
+static nvmstatus_t PR_ExecuteParallel(NVM* qcvm, int statement, int exitdepth, int budget, int thread);
+
+/* f was stripped at load, its first_statement is 0 */
+#define	PR_Stripped(f)	(qcvm->strippedfuncs && (qcvm->strippedfuncs[((f) - qcvm->functions) >> 3] & (1 << (((f) - qcvm->functions) & 7))))
+
+#ifdef NVM_NO_STATS
+#define STAT(x)
+#else
+#define STAT(x) x
+#endif
+
 static short LittleShort(short s)
 {
     return s;
@@ -25,8 +102,13 @@ static void Errorf(NVM* vm, const char* fmt, ...)
     char buffer[2048];
     va_list args;
     va_start(args, fmt);
-    vsprintf_s(buffer, sizeof(buffer), fmt, args);
+    vsnprintf(buffer, sizeof(buffer), fmt, args);
     va_end(args);
+    if (vm->worker)
+        PR_ParallelAbort(vm);	// the serial pass reports it
+    vm->errorjmp = NULL;	// the host unwinds past any nvmExecuteForEdicts
+    if (vm->parallel)
+        vm->parallel->busy = false;
     vm->error_callback(vm, buffer);
 }
 
@@ -35,7 +117,7 @@ static void DPrintf(NVM* vm, const char* fmt, ...)
     char buffer[2048];
     va_list args;
     va_start(args, fmt);
-    vsprintf_s(buffer, sizeof(buffer), fmt, args);
+    vsnprintf(buffer, sizeof(buffer), fmt, args);
     va_end(args);
     vm->print_callback(vm, buffer, true);
 }
@@ -45,7 +127,7 @@ static void Printf(NVM* vm, const char* fmt, ...)
     char buffer[2048];
     va_list args;
     va_start(args, fmt);
-    vsprintf_s(buffer, sizeof(buffer), fmt, args);
+    vsnprintf(buffer, sizeof(buffer), fmt, args);
     va_end(args);
     vm->print_callback(vm, buffer, false);
 }
@@ -171,15 +253,23 @@ static const char *PR_ValueString (NVM* qcvm, int type, eval_t *val)
 		sprintf (line, "%s", PR_GetString(qcvm, val->string));
 		break;
 	case ev_entity:
-		sprintf (line, "entity %i", NUM_FOR_EDICT(qcvm, PROG_TO_EDICT(val->edict)) );
+		sprintf (line, "entity %i", val->edict / qcvm->edict_size);	/* unchecked, PR_RunError prints bad references */
 		break;
 	case ev_function:
+		if (val->function < 0 || val->function >= qcvm->progs->numfunctions)
+		{
+			sprintf (line, "bad function %i", val->function);
+			break;
+		}
 		f = qcvm->functions + val->function;
 		sprintf (line, "%s()", PR_GetString(qcvm, f->s_name));
 		break;
 	case ev_field:
 		def = ED_FieldAtOfs ( qcvm, val->_int );
-		sprintf (line, ".%s", PR_GetString(qcvm, def->s_name));
+		if (!def)
+			sprintf (line, "bad field %i", val->_int);
+		else
+			sprintf (line, ".%s", PR_GetString(qcvm, def->s_name));
 		break;
 	case ev_void:
 		sprintf (line, "void");
@@ -259,6 +349,19 @@ static const char *PR_GlobalStringNoContents (NVM* qcvm, int ofs)
 }
 
 NVM* nvmCreateVM(AllocCallback acb, PrintCallback pcb, ErrorCallback ecb, void* user_data)
+{
+	return nvmCreateVMEx(acb, pcb, ecb, user_data, NULL);
+}
+
+/*
+====================
+nvmCreateVMEx
+
+The stacks and builtin tables aren't allocated here, they grow as they are
+used up to the limits in options.
+====================
+*/
+NVM* nvmCreateVMEx(AllocCallback acb, PrintCallback pcb, ErrorCallback ecb, void* user_data, const nvmoptions_t* options)
 {
     NVM* vm = (NVM*)acb(NULL, NULL, sizeof(NVM), "NVM struct");
 	if (vm == NULL) { return NULL; }
@@ -266,19 +369,122 @@ NVM* nvmCreateVM(AllocCallback acb, PrintCallback pcb, ErrorCallback ecb, void*
     vm->alloc_callback = acb;
     vm->print_callback = pcb;
     vm->error_callback = ecb;
-    vm->auto_ext_builtin_number = MAX_BUILTINS - 1;
-	vm->numbuiltins = MAX_BUILTINS;
+	vm->maxbuiltins = options && options->max_builtins > 0 ? options->max_builtins : MAX_BUILTINS;
+	vm->maxstackdepth = options && options->max_stack_depth > 0 ? options->max_stack_depth : MAX_STACK_DEPTH;
+	vm->maxlocalstack = options && options->max_localstack > 0 ? options->max_localstack : LOCALSTACK_SIZE;
+	vm->edict_header = options && options->edict_header > 0 ? options->edict_header : 0;
+    vm->auto_ext_builtin_number = vm->maxbuiltins - 1;
+	vm->readyhead = vm->readytail = -1;
+	vm->randseed = 0x2545f491;
 	vm->user_data = user_data;
     return vm;
 }
 
 void nvmDestroyVM(NVM* qcvm)
 {
-	free(qcvm);
+	nvmSamplingEnd(qcvm);
+	PR_SamplerFree(qcvm);
+	PR_FreeThreads(qcvm);
+	PR_ProfileFree(qcvm);
+	PR_ParallelFree(qcvm);
+	if (qcvm->lumps)
+		qcvm->alloc_callback(qcvm, qcvm->lumps, 0, "progs lumps");
+	if (qcvm->inlined)
+		qcvm->alloc_callback(qcvm, qcvm->inlined, 0, "inlined progs");
+	if (qcvm->striproots)
+		qcvm->alloc_callback(qcvm, qcvm->striproots, 0, "strip roots");
+	if (qcvm->strippedfuncs)
+		qcvm->alloc_callback(qcvm, qcvm->strippedfuncs, 0, "stripped functions");
+	if (qcvm->layout)
+		qcvm->alloc_callback(qcvm, qcvm->layout, 0, "laid out statements");
+	if (qcvm->layoutpath)
+		qcvm->alloc_callback(qcvm, qcvm->layoutpath, 0, "layout profile path");
+	nvmLayoutProfileEnd(qcvm);
+	nvmCaptureEnd(qcvm);
+	if (qcvm->callcache)
+		qcvm->alloc_callback(qcvm, qcvm->callcache, 0, "call cache");
+	if (qcvm->builtincalls)
+		qcvm->alloc_callback(qcvm, qcvm->builtincalls, 0, "builtin call counts");
+	if (qcvm->builtins)
+		qcvm->alloc_callback(qcvm, qcvm->builtins, 0, "builtins");
+	if (qcvm->extbuiltins)
+		qcvm->alloc_callback(qcvm, qcvm->extbuiltins, 0, "builtins");
+	if (qcvm->stack)
+		qcvm->alloc_callback(qcvm, qcvm->stack, 0, "stack");
+	if (qcvm->localstack)
+		qcvm->alloc_callback(qcvm, qcvm->localstack, 0, "locals stack");
+	if (qcvm->edicts)
+		qcvm->alloc_callback(qcvm, qcvm->edicts, 0, "edicts");
+	if (qcvm->tempstrings)
+		qcvm->alloc_callback(qcvm, qcvm->tempstrings, 0, "temp strings");
+	PR_CacheFree(qcvm);
+	PR_FreeStrings(qcvm);
+	qcvm->alloc_callback(qcvm, qcvm, 0, "NVM struct");
+}
+
+/*
+====================
+PR_SetBuiltin
+
+Grows whichever table num lives in, auto numbered #0 builtins count down
+from the top so they never collide with the ones the progs number.
+====================
+*/
+static void PR_SetBuiltin (NVM* qcvm, int num, BuiltinFunction builtin)
+{
+	BuiltinFunction	*table;
+	int		i, n;
+
+	if (num < 0 || num >= qcvm->maxbuiltins)
+	{
+		Errorf(qcvm, "builtin #%i is out of range, the VM was created for %i\n", num, qcvm->maxbuiltins);
+		return;
+	}
+	if (num > qcvm->auto_ext_builtin_number)
+	{
+		qcvm->extbuiltins[qcvm->maxbuiltins - 1 - num] = builtin;
+		return;
+	}
+	if (num >= qcvm->numbuiltins)
+	{
+		for (n = qcvm->numbuiltins ? qcvm->numbuiltins : 64; n <= num; n *= 2)
+			;
+		if (n > qcvm->auto_ext_builtin_number + 1)
+			n = qcvm->auto_ext_builtin_number + 1;
+		table = (BuiltinFunction *) qcvm->alloc_callback(qcvm, qcvm->builtins, n * sizeof(BuiltinFunction), "builtins");
+		if (!table)
+		{
+			Errorf(qcvm, "Out of memory for builtin #%i\n", num);
+			return;
+		}
+		for (i = qcvm->numbuiltins; i < n; i++)
+			table[i] = NULL;
+		qcvm->builtins = table;
+		qcvm->numbuiltins = n;
+	}
+	qcvm->builtins[num] = builtin;
+}
+
+/*
+====================
+PR_Builtin
+
+What builtin number num calls, NULL when nothing is bound to it
+====================
+*/
+static BuiltinFunction PR_Builtin (NVM* qcvm, int num)
+{
+	if (num > qcvm->auto_ext_builtin_number && num < qcvm->maxbuiltins)
+		return qcvm->extbuiltins[qcvm->maxbuiltins - 1 - num];
+	if (num < qcvm->numbuiltins)
+		return qcvm->builtins[num];
+	return NULL;
 }
 
 void nvmAddExtBuiltin(NVM* qcvm, int num, const char* name, BuiltinFunction builtin)
 {
+	BuiltinFunction	*table;
+
 	if (!qcvm->progs)
 	{
 		Errorf(qcvm, "Trying to add extension builtin without loading progs\n");
@@ -287,7 +493,7 @@ void nvmAddExtBuiltin(NVM* qcvm, int num, const char* name, BuiltinFunction buil
 
     if (num)
     {
-        qcvm->builtins[num] = builtin;
+        PR_SetBuiltin(qcvm, num, builtin);
     }
     else
     {
@@ -299,20 +505,108 @@ void nvmAddExtBuiltin(NVM* qcvm, int num, const char* name, BuiltinFunction buil
                 const char *vm_func_name = PR_GetString(qcvm, qcvm->functions[i].s_name);
                 if (!strcmp(name, vm_func_name))
                 {	//okay, map it
+					if (qcvm->auto_ext_builtin_number <= 0 || PR_Builtin(qcvm, qcvm->auto_ext_builtin_number))
+					{
+						Errorf(qcvm, "No builtin numbers left for %s\n", name);
+						return;
+					}
+					table = (BuiltinFunction *) qcvm->alloc_callback(qcvm, qcvm->extbuiltins, (qcvm->numextbuiltins + 1) * sizeof(BuiltinFunction), "builtins");
+					if (!table)
+					{
+						Errorf(qcvm, "Out of memory for builtin %s\n", name);
+						return;
+					}
+					qcvm->extbuiltins = table;
+					qcvm->extbuiltins[qcvm->numextbuiltins++] = builtin;
                     qcvm->functions[i].first_statement = -(qcvm->auto_ext_builtin_number);
-                    qcvm->builtins[qcvm->auto_ext_builtin_number] = builtin;
 					qcvm->auto_ext_builtin_number--;
                     break;
                 }
             }
         }
     }
+	PR_CallCacheFlush(qcvm);
 }
 
 void nvmLoadBuiltins(NVM* qcvm, BuiltinFunction* builtins, size_t numbuiltins)
 {
-    memcpy(qcvm->builtins, builtins, numbuiltins*sizeof(qcvm->builtins[0]));
-	qcvm->numbuiltins = numbuiltins;
+	int		i;
+
+	if (numbuiltins > (size_t)qcvm->maxbuiltins)
+	{
+		Errorf(qcvm, "%u builtins, the VM was created for %i\n", (unsigned int)numbuiltins, qcvm->maxbuiltins);
+		return;
+	}
+	for (i = 0; i < (int)numbuiltins; i++)
+		PR_SetBuiltin(qcvm, i, builtins[i]);
+	PR_CallCacheFlush(qcvm);
+}
+
+static qboolean PR_LumpValid (size_t filesize, int ofs, int count, size_t elementsize)
+{
+	return ofs >= 0 && count >= 0 && (size_t)ofs <= filesize && (size_t)count <= (filesize - ofs) / elementsize;
+}
+
+/*
+====================
+PR_EdictSize
+
+How big an edict of a progs with entityfields fields is, and where the
+engine's header goes in it
+====================
+*/
+static int PR_EdictSize (NVM* qcvm, int entityfields, int *headerofs)
+{
+	int		size;
+
+	size = entityfields * 4 + offsetof(edict_t, v);
+	// round off to next highest whole word address (esp for Alpha)
+	// this ensures that pointers in the engine data area are always
+	// properly aligned
+	size += sizeof(void *) - 1;
+	size &= ~(sizeof(void *) - 1);
+	// the engine's header goes last, away from the fields QC scans
+	*headerofs = size;
+	size += qcvm->edict_header + sizeof(void *) - 1;
+	size &= ~(sizeof(void *) - 1);
+	return size;
+}
+
+/*
+====================
+PR_FindGlobalStruct
+
+Where globalvars_t is in the globals: at 0 for progs built from the defs
+progdefs.h came from, otherwise wherever self is, as long as the system
+globals after it are in the same order. NULL if the progs don't have them.
+====================
+*/
+static globalvars_t *PR_FindGlobalStruct (NVM* qcvm)
+{
+	static const struct { const char *name; int ofs; } system[] =
+	{
+		{ "self", offsetof(globalvars_t, self) / sizeof(float) },
+		{ "other", offsetof(globalvars_t, other) / sizeof(float) },
+		{ "world", offsetof(globalvars_t, world) / sizeof(float) },
+		{ "time", offsetof(globalvars_t, time) / sizeof(float) },
+	};
+	ddef_t	*def;
+	int		i, base = 0;
+
+	if (qcvm->progs->crc == PROGHEADER_CRC)
+		return (globalvars_t *)qcvm->globals;
+	for (i = 0; i < (int)(sizeof(system) / sizeof(system[0])); i++)
+	{
+		if (!(def = ED_FindGlobal(qcvm, system[i].name)))
+			return NULL;
+		if (!i)
+			base = (int)def->ofs - system[i].ofs;
+		else if ((int)def->ofs != base + system[i].ofs)
+			return NULL;
+	}
+	if (base < 0 || base + (int)(sizeof(globalvars_t) / sizeof(float)) > qcvm->progs->numglobals)
+		return NULL;
+	return (globalvars_t *)(qcvm->globals + base);
 }
 
 bool nvmLoadProgs(NVM* qcvm, const char* filename, const char* data, size_t size, bool fatal)
@@ -320,19 +614,86 @@ bool nvmLoadProgs(NVM* qcvm, const char* filename, const char* data, size_t size
     int			i;
 	unsigned int u;
 
+	qboolean	wide, cached;
+	void		*layout;
+	size_t		layoutsize = 0;
+
 	//PR_ClearProgs(qcvm);	//just in case.
+	if (qcvm->lumps)
+	{
+		qcvm->alloc_callback(qcvm, qcvm->lumps, 0, "progs lumps");
+		qcvm->lumps = NULL;
+	}
+	if (qcvm->inlined)
+	{
+		qcvm->alloc_callback(qcvm, qcvm->inlined, 0, "inlined progs");
+		qcvm->inlined = NULL;
+		qcvm->inlinedranges = NULL;
+		qcvm->numinlinedranges = 0;
+	}
+	if (qcvm->strippedfuncs)
+	{
+		qcvm->alloc_callback(qcvm, qcvm->strippedfuncs, 0, "stripped functions");
+		qcvm->strippedfuncs = NULL;
+	}
+	if (qcvm->layout)
+	{
+		qcvm->alloc_callback(qcvm, qcvm->layout, 0, "laid out statements");
+		qcvm->layout = NULL;
+	}
+	qcvm->laidout = false;
+	nvmLayoutProfileEnd(qcvm);
+	nvmCaptureEnd(qcvm);
+	if (qcvm->callcache)
+	{
+		qcvm->alloc_callback(qcvm, qcvm->callcache, 0, "call cache");
+		qcvm->callcache = NULL;
+	}
+	if (qcvm->parallel && qcvm->parallel->unsafe)
+	{
+		qcvm->alloc_callback(qcvm, qcvm->parallel->unsafe, 0, "parallel");
+		qcvm->parallel->unsafe = NULL;
+		qcvm->parallel->shared = NULL;
+	}
+	PR_LanesFree(qcvm);
+	PR_CacheFree(qcvm);
 
 	qcvm->progs = (dprograms_t *)data;
-	if (!qcvm->progs)
+	if (!qcvm->progs || size < PROG_V6_HEADERSIZE)
 		return false;
 
+	// before anything is swapped in place
 	qcvm->progssize = size;
+	qcvm->progscrc = PR_CRC(data, size);
+	qcvm->progshash = PR_BlockChecksum(data, size);
 
 	// byte swap the header
-	for (i = 0; i < (int) sizeof(*qcvm->progs) / 4; i++)
+	for (i = 0; i < PROG_V6_HEADERSIZE / 4; i++)
 		((int *)qcvm->progs)[i] = LittleLong ( ((int *)qcvm->progs)[i] );
 
-	if (qcvm->progs->version != PROG_VERSION)
+	wide = false;
+	if (qcvm->progs->version == PROG_EXTENDEDVERSION && size >= sizeof(*qcvm->progs))
+	{
+		const char	*unsupported = NULL;
+
+		for ( ; i < (int) sizeof(*qcvm->progs) / 4; i++)
+			((int *)qcvm->progs)[i] = LittleLong ( ((int *)qcvm->progs)[i] );
+
+		wide = qcvm->progs->secondaryversion == PROG_SECONDARYVERSION32;
+		if (!wide && qcvm->progs->secondaryversion != PROG_SECONDARYVERSION16)
+			unsupported = "is not an fteqcc version 7 progs";
+		else if (qcvm->progs->blockscompressed)
+			unsupported = "has compressed lumps";
+		if (unsupported)
+		{
+			if (fatal)
+				Errorf (qcvm, "%s %s", filename, unsupported);
+			Printf (qcvm, "%s ABI set not supported\n", filename);
+			qcvm->progs = NULL;
+			return false;
+		}
+	}
+	else if (qcvm->progs->version != PROG_VERSION)
 	{
 		if (fatal)
 			Errorf (qcvm, "%s has wrong version number (%i should be %i)", filename, qcvm->progs->version, PROG_VERSION);
@@ -346,61 +707,88 @@ bool nvmLoadProgs(NVM* qcvm, const char* filename, const char* data, size_t size
 
 	DPrintf (qcvm, "%s occupies %iK.\n", filename, size/1024);
 
+	if (!PR_LumpValid(size, qcvm->progs->ofs_statements, qcvm->progs->numstatements, wide ? sizeof(dstatement_t) : sizeof(dstatement16_t)) ||
+		!PR_LumpValid(size, qcvm->progs->ofs_globaldefs, qcvm->progs->numglobaldefs, wide ? sizeof(ddef_t) : sizeof(ddef16_t)) ||
+		!PR_LumpValid(size, qcvm->progs->ofs_fielddefs, qcvm->progs->numfielddefs, wide ? sizeof(ddef_t) : sizeof(ddef16_t)) ||
+		!PR_LumpValid(size, qcvm->progs->ofs_functions, qcvm->progs->numfunctions, sizeof(dfunction_t)) ||
+		!PR_LumpValid(size, qcvm->progs->ofs_globals, qcvm->progs->numglobals, sizeof(float)) ||
+		!PR_LumpValid(size, qcvm->progs->ofs_strings, qcvm->progs->numstrings, 1) || qcvm->progs->ofs_strings + qcvm->progs->numstrings >= size)
+	{
+		if (fatal)
+			Errorf (qcvm, "%s lumps go past end of file", filename);
+		Printf (qcvm, "%s lumps go past end of file\n", filename);
+		qcvm->progs = NULL;
+		return false;
+	}
+
 	qcvm->functions = (dfunction_t *)((byte *)qcvm->progs + qcvm->progs->ofs_functions);
 	qcvm->strings = (char *)qcvm->progs + qcvm->progs->ofs_strings;
-	if (qcvm->progs->ofs_strings + qcvm->progs->numstrings >= size)
-		Errorf (qcvm, "%s strings go past end of file\n", filename);
-
-	qcvm->globaldefs = (ddef_t *)((byte *)qcvm->progs + qcvm->progs->ofs_globaldefs);
-	qcvm->fielddefs = (ddef_t *)((byte *)qcvm->progs + qcvm->progs->ofs_fielddefs);
-	qcvm->statements = (dstatement_t *)((byte *)qcvm->progs + qcvm->progs->ofs_statements);
 
 	qcvm->globals = (float *)((byte *)qcvm->progs + qcvm->progs->ofs_globals);
-	//qcvm->global_struct = (globalvars_t*)qcvm->globals;
+	qcvm->global_struct = NULL;
 
 	qcvm->stringssize = qcvm->progs->numstrings;
 
-	// byte swap the lumps
-	for (i = 0; i < qcvm->progs->numstatements; i++)
-	{
-		qcvm->statements[i].op = LittleShort(qcvm->statements[i].op);
-		qcvm->statements[i].a = LittleShort(qcvm->statements[i].a);
-		qcvm->statements[i].b = LittleShort(qcvm->statements[i].b);
-		qcvm->statements[i].c = LittleShort(qcvm->statements[i].c);
-	}
+	layout = PR_LayoutRead(qcvm, &layoutsize);
+	cached = qcvm->usecache && PR_CacheLoad(qcvm, filename);
 
-	for (i = 0; i < qcvm->progs->numfunctions; i++)
+	// 32 bit lumps are used in place, 16 bit ones are widened to match
+	if (cached)
+		;	// mapped from the cache, already widened
+	else if (wide)
 	{
-		qcvm->functions[i].first_statement = LittleLong (qcvm->functions[i].first_statement);
-		qcvm->functions[i].parm_start = LittleLong (qcvm->functions[i].parm_start);
-		qcvm->functions[i].s_name = LittleLong (qcvm->functions[i].s_name);
-		qcvm->functions[i].s_file = LittleLong (qcvm->functions[i].s_file);
-		qcvm->functions[i].numparms = LittleLong (qcvm->functions[i].numparms);
-		qcvm->functions[i].locals = LittleLong (qcvm->functions[i].locals);
+		qcvm->globaldefs = (ddef_t *)((byte *)qcvm->progs + qcvm->progs->ofs_globaldefs);
+		qcvm->fielddefs = (ddef_t *)((byte *)qcvm->progs + qcvm->progs->ofs_fielddefs);
+		qcvm->statements = (dstatement_t *)((byte *)qcvm->progs + qcvm->progs->ofs_statements);
+
+		// byte swap the lumps
+		for (i = 0; i < qcvm->progs->numstatements; i++)
+		{
+			qcvm->statements[i].op = LittleLong(qcvm->statements[i].op);
+			qcvm->statements[i].a = LittleLong(qcvm->statements[i].a);
+			qcvm->statements[i].b = LittleLong(qcvm->statements[i].b);
+			qcvm->statements[i].c = LittleLong(qcvm->statements[i].c);
+		}
+		for (i = 0; i < qcvm->progs->numglobaldefs; i++)
+		{
+			qcvm->globaldefs[i].type = LittleLong (qcvm->globaldefs[i].type);
+			qcvm->globaldefs[i].ofs = LittleLong (qcvm->globaldefs[i].ofs);
+			qcvm->globaldefs[i].s_name = LittleLong (qcvm->globaldefs[i].s_name);
+		}
+		for (i = 0; i < qcvm->progs->numfielddefs; i++)
+		{
+			qcvm->fielddefs[i].type = LittleLong (qcvm->fielddefs[i].type);
+			qcvm->fielddefs[i].ofs = LittleLong (qcvm->fielddefs[i].ofs);
+			qcvm->fielddefs[i].s_name = LittleLong (qcvm->fielddefs[i].s_name);
+		}
 	}
+	else
+		PR_WidenLumps(qcvm);
 
-	for (i = 0; i < qcvm->progs->numglobaldefs; i++)
+	if (!cached)
 	{
-		qcvm->globaldefs[i].type = LittleShort (qcvm->globaldefs[i].type);
-		qcvm->globaldefs[i].ofs = LittleShort (qcvm->globaldefs[i].ofs);
-		qcvm->globaldefs[i].s_name = LittleLong (qcvm->globaldefs[i].s_name);
-        //Con_Printf("globaldefs: %s - %d %d\n", qcvm->strings + qcvm->globaldefs[i].s_name, qcvm->globaldefs[i].type, qcvm->globaldefs[i].ofs);
-	}
+		for (i = 0; i < qcvm->progs->numfunctions; i++)
+		{
+			qcvm->functions[i].first_statement = LittleLong (qcvm->functions[i].first_statement);
+			qcvm->functions[i].parm_start = LittleLong (qcvm->functions[i].parm_start);
+			qcvm->functions[i].s_name = LittleLong (qcvm->functions[i].s_name);
+			qcvm->functions[i].s_file = LittleLong (qcvm->functions[i].s_file);
+			qcvm->functions[i].numparms = LittleLong (qcvm->functions[i].numparms);
+			qcvm->functions[i].locals = LittleLong (qcvm->functions[i].locals);
+		}
 
-	//for (u = 0; u < sizeof(qcvm->extfields)/sizeof(int); u++)
-		//((int*)&qcvm->extfields)[u] = -1;
+		//for (u = 0; u < sizeof(qcvm->extfields)/sizeof(int); u++)
+			//((int*)&qcvm->extfields)[u] = -1;
 
-	for (i = 0; i < qcvm->progs->numfielddefs; i++)
-	{
-		qcvm->fielddefs[i].type = LittleShort (qcvm->fielddefs[i].type);
-		if (qcvm->fielddefs[i].type & DEF_SAVEGLOBAL)
-			Errorf (qcvm, "PR_LoadProgs: pr_fielddefs[i].type & DEF_SAVEGLOBAL");
-		qcvm->fielddefs[i].ofs = LittleShort (qcvm->fielddefs[i].ofs);
-		qcvm->fielddefs[i].s_name = LittleLong (qcvm->fielddefs[i].s_name);
-	}
+		for (i = 0; i < qcvm->progs->numfielddefs; i++)
+		{
+			if (qcvm->fielddefs[i].type & DEF_SAVEGLOBAL)
+				Errorf (qcvm, "PR_LoadProgs: pr_fielddefs[i].type & DEF_SAVEGLOBAL");
+		}
 
-	for (i = 0; i < qcvm->progs->numglobals; i++)
-		((int *)qcvm->globals)[i] = LittleLong (((int *)qcvm->globals)[i]);
+		for (i = 0; i < qcvm->progs->numglobals; i++)
+			((int *)qcvm->globals)[i] = LittleLong (((int *)qcvm->globals)[i]);
+	}
 
 /*
 	//spike: detect extended fields from progs
@@ -417,24 +805,48 @@ bool nvmLoadProgs(NVM* qcvm, const char* filename, const char* data, size_t size
 	if (qcvm->extfields.traileffectnum < 0)
 		qcvm->extfields.traileffectnum = i++;*/
 
-	i = qcvm->progs->entityfields;
-
-	qcvm->edict_size = i * 4 + sizeof(edict_t) - sizeof(entvars_t);
-	// round off to next highest whole word address (esp for Alpha)
-	// this ensures that pointers in the engine data area are always
-	// properly aligned
-	qcvm->edict_size += sizeof(void *) - 1;
-	qcvm->edict_size &= ~(sizeof(void *) - 1);
+	qcvm->edict_size = PR_EdictSize(qcvm, qcvm->progs->entityfields, &qcvm->edict_headerofs);
 
 	PR_SetEngineString(qcvm, "");
 	//PR_EnableExtensions(qcvm, qcvm->globaldefs);
+	qcvm->global_struct = PR_FindGlobalStruct(qcvm);
+
+	if (cached)
+	{
+		// the file may not hold what PR_CacheWrite put in it, the tail call marks included
+		if (qcvm->verified)
+			qcvm->verified = PR_VerifyProgs(qcvm, filename);
+		if (qcvm->verified)
+			PR_MarkTailCalls(qcvm);
+	}
+	else
+	{
+		qcvm->verified = PR_VerifyProgs(qcvm, filename);
+		memset(&qcvm->stripped, 0, sizeof(qcvm->stripped));
+		if (qcvm->verified && qcvm->striproots)
+			PR_StripFunctions(qcvm);
+		if (qcvm->verified && qcvm->inlinelimit > 0 && PR_InlineFunctions(qcvm))
+			qcvm->verified = PR_VerifyProgs(qcvm, filename);
+		if (qcvm->verified && layout && PR_LayoutStatements(qcvm, layout, layoutsize))
+			qcvm->verified = PR_VerifyProgs(qcvm, filename);
+		if (qcvm->verified)
+			PR_MarkTailCalls(qcvm);
+		if (qcvm->usecache)
+			PR_CacheWrite(qcvm, filename);
+	}
+	if (layout)
+		qcvm->alloc_callback(qcvm, layout, 0, "layout profile");
+	PR_CallCacheAlloc(qcvm);
 
 	return true;
 }
 
 bool nvmAllocEdicts(NVM* qcvm, size_t count)
 {
+	if (qcvm->edicts)
+		qcvm->alloc_callback(qcvm, qcvm->edicts, 0, "edicts");
 	qcvm->edicts = (edict_t *) qcvm->alloc_callback(qcvm, NULL, count*qcvm->edict_size, "edicts"); // ericw -- sv.edicts switched to use malloc()
+	qcvm->max_edicts = qcvm->edicts ? count : 0;
 	return qcvm->edicts != NULL;
 }
 
@@ -469,6 +881,162 @@ func_t nvmFindFunction(NVM* vm, const char* name)
         return -1;
 }
 
+/*
+====================
+nvmGlobalHandle
+
+Looks up a global of the given type once, for NVM_GLOBAL. The handle's ofs
+is -1 if there is none; it holds until progs are loaded or reloaded.
+====================
+*/
+nvmhandle_t nvmGlobalHandle(NVM* vm, const char* name, etype_t type)
+{
+	ddef_t		*def = ED_FindGlobal(vm, name);
+	nvmhandle_t	h;
+
+	h.type = type;
+	h.ofs = def && (etype_t)(def->type & ~DEF_SAVEGLOBAL) == type ? (int)def->ofs : -1;
+	return h;
+}
+
+/*
+====================
+nvmFieldHandle
+
+The same for a field, for NVM_FIELD, nvmGatherField and nvmScatterField.
+====================
+*/
+nvmhandle_t nvmFieldHandle(NVM* vm, const char* name, etype_t type)
+{
+	ddef_t		*def = ED_FindField(vm, name);
+	nvmhandle_t	h;
+
+	h.type = type;
+	h.ofs = def && (etype_t)def->type == type ? (int)def->ofs : -1;
+	return h;
+}
+
+/*
+====================
+PR_CopyField
+
+Copies a field between count edicts and an array with its values one after
+another, 3 floats a vector. Edicts out of range are skipped, and read as 0.
+Returns how many were copied.
+====================
+*/
+static int PR_CopyField (NVM* qcvm, nvmhandle_t field, const int* edict_nums, int count, int* values, qboolean scatter)
+{
+	byte	*base;
+	int		*p;
+	int		i, j, n, size = field.type == ev_vector ? 3 : 1, copied = 0;
+
+	if (field.ofs < 0 || field.ofs + size > qcvm->progs->entityfields || count <= 0)
+		return 0;
+	base = (byte *)qcvm->edicts + offsetof(edict_t, v) + field.ofs * sizeof(int);
+
+	// every edict in range, the common case, without the checks
+	if (!edict_nums && count <= qcvm->num_edicts)
+	{
+		for (i = 0; i < count; i++)
+		{
+			p = (int *)(base + (size_t)i * qcvm->edict_size);
+			for (j = 0; j < size; j++)
+			{
+				if (scatter)
+					p[j] = values[i * size + j];
+				else
+					values[i * size + j] = p[j];
+			}
+		}
+		return count;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		n = edict_nums ? edict_nums[i] : i;
+		if (n < 0 || n >= qcvm->num_edicts)
+		{
+			for (j = 0; j < size && !scatter; j++)
+				values[i * size + j] = 0;
+			continue;
+		}
+		p = (int *)(base + (size_t)n * qcvm->edict_size);
+		for (j = 0; j < size; j++)
+		{
+			if (scatter)
+				p[j] = values[i * size + j];
+			else
+				values[i * size + j] = p[j];
+		}
+		copied++;
+	}
+	return copied;
+}
+
+/*
+====================
+nvmGatherField
+
+Reads a field of count edicts (0 to count - 1 when edict_nums is NULL) into
+values, one after another. Returns how many edicts were in range.
+====================
+*/
+int nvmGatherField(NVM* vm, nvmhandle_t field, const int* edict_nums, int count, void* values)
+{
+	return PR_CopyField(vm, field, edict_nums, count, (int *)values, false);
+}
+
+/*
+====================
+nvmScatterField
+
+Writes values into a field of count edicts, the other way around.
+====================
+*/
+int nvmScatterField(NVM* vm, nvmhandle_t field, const int* edict_nums, int count, const void* values)
+{
+	return PR_CopyField(vm, field, edict_nums, count, (int *)values, true);
+}
+
+/*
+============
+nvmGetStats
+
+Fills in the runtime counters. Safe to call from a builtin while QC is
+running; the statement count lags behind by the statements of the functions
+that are still active.
+============
+*/
+void nvmGetStats(NVM* qcvm, nvmstats_t* stats)
+{
+	edict_t	*ed;
+	int		i;
+
+	*stats = qcvm->stats;
+	stats->numbuiltins = qcvm->builtincalls ? qcvm->maxbuiltins : 0;
+	stats->builtin_calls_by_num = qcvm->builtincalls;
+
+	stats->live_edicts = 0;
+	if (qcvm->edicts)
+	{
+		for (i = 0, ed = qcvm->edicts; i < qcvm->num_edicts; i++, ed = NEXT_EDICT(ed))
+		{
+			if (!ed->free)
+				stats->live_edicts++;
+		}
+	}
+}
+
+void nvmResetStats(NVM* qcvm)
+{
+	memset(&qcvm->stats, 0, sizeof(qcvm->stats));
+	qcvm->stats.max_depth = qcvm->depth;
+	qcvm->stats.max_localstack_used = qcvm->localstack_used;
+	if (qcvm->builtincalls)
+		memset(qcvm->builtincalls, 0, qcvm->maxbuiltins * sizeof(unsigned int));
+}
+
 static const char *pr_opnames[] =
 {
 	"DONE",
@@ -555,25 +1123,604 @@ static const char *pr_opnames[] =
 	"OR",
 
 	"BITAND",
-	"BITOR"
+	"BITOR",
+
+	/* fteqcc extensions */
+	"MULSTORE_F",
+	"MULSTORE_VF",
+	"MULSTOREP_F",
+	"MULSTOREP_VF",
+
+	"DIVSTORE_F",
+	"DIVSTOREP_F",
+
+	"ADDSTORE_F",
+	"ADDSTORE_V",
+	"ADDSTOREP_F",
+	"ADDSTOREP_V",
+
+	"SUBSTORE_F",
+	"SUBSTORE_V",
+	"SUBSTOREP_F",
+	"SUBSTOREP_V",
+
+	"FETCH_GBL_F",
+	"FETCH_GBL_V",
+	"FETCH_GBL_S",
+	"FETCH_GBL_E",
+	"FETCH_GBL_FNC",
+
+	"CSTATE",
+	"CWSTATE",
+	"THINKTIME",
+
+	"BITSETSTORE_F",
+	"BITSETSTOREP_F",
+	"BITCLRSTORE_F",
+	"BITCLRSTOREP_F",
+
+	"RAND0",
+	"RAND1",
+	"RAND2",
+	"RANDV0",
+	"RANDV1",
+	"RANDV2",
+
+	"SWITCH_F",
+	"SWITCH_V",
+	"SWITCH_S",
+	"SWITCH_E",
+	"SWITCH_FNC",
+
+	"CASE",
+	"CASERANGE",
+
+	"CALL1H",
+	"CALL2H",
+	"CALL3H",
+	"CALL4H",
+	"CALL5H",
+	"CALL6H",
+	"CALL7H",
+	"CALL8H",
+
+	"STORE_I",
+	"STORE_IF",
+	"STORE_FI",
+
+	"ADD_I",
+	"ADD_FI",
+	"ADD_IF",
+
+	"SUB_I",
+	"SUB_FI",
+	"SUB_IF",
+
+	"CONV_ITOF",
+	"CONV_FTOI",
+	"CP_ITOF",
+	"CP_FTOI",
+
+	"LOAD_I",
+	"STOREP_I",
+	"STOREP_IF",
+	"STOREP_FI",
+
+	"BITAND_I",
+	"BITOR_I",
+
+	"MUL_I",
+	"DIV_I",
+	"EQ_I",
+	"NE_I",
+
+	"IFNOT_S",
+	"IF_S",
+
+	"NOT_I",
+
+	"DIV_VF",
+
+	"BITXOR_I",
+	"RSHIFT_I",
+	"LSHIFT_I",
+
+	"GLOBALADDRESS",
+	"ADD_PIW",
+
+	"LOADA_F",
+	"LOADA_V",
+	"LOADA_S",
+	"LOADA_ENT",
+	"LOADA_FLD",
+	"LOADA_FNC",
+	"LOADA_I",
+
+	"STORE_P",
+	"LOAD_P",
+
+	"LOADP_F",
+	"LOADP_V",
+	"LOADP_S",
+	"LOADP_ENT",
+	"LOADP_FLD",
+	"LOADP_FNC",
+	"LOADP_I",
+
+	"LE_I",
+	"GE_I",
+	"LT_I",
+	"GT_I",
+
+	"LE_IF",
+	"GE_IF",
+	"LT_IF",
+	"GT_IF",
+
+	"LE_FI",
+	"GE_FI",
+	"LT_FI",
+	"GT_FI",
+
+	"EQ_IF",
+	"EQ_FI",
+
+	"ADD_SF",
+	"SUB_S",
+	"STOREP_C",
+	"LOADP_C",
+
+	"MUL_IF",
+	"MUL_FI",
+	"MUL_VI",
+	"MUL_IV",
+
+	"DIV_IF",
+	"DIV_FI",
+
+	"BITAND_IF",
+	"BITOR_IF",
+	"BITAND_FI",
+	"BITOR_FI",
+
+	"AND_I",
+	"OR_I",
+	"AND_IF",
+	"OR_IF",
+	"AND_FI",
+	"OR_FI",
+
+	"NE_IF",
+	"NE_FI",
+
+	"GSTOREP_I",
+	"GSTOREP_F",
+	"GSTOREP_ENT",
+	"GSTOREP_FLD",
+	"GSTOREP_S",
+	"GSTOREP_FNC",
+	"GSTOREP_V",
+
+	"GADDRESS",
+	"GLOAD_I",
+	"GLOAD_F",
+	"GLOAD_FLD",
+	"GLOAD_ENT",
+	"GLOAD_S",
+	"GLOAD_FNC",
+
+	"BOUNDCHECK",
+	"UNUSED",
+	"PUSH",
+	"POP",
+
+	"SWITCH_I",
+	"GLOAD_V",
+
+	"IF_F",
+	"IFNOT_F"
 };
 
-#define	PR_STRING_ALLOCSLOTS	256
+#define	PR_OPBRANCH	-1
 
-static void PR_AllocStringSlots (NVM* qcvm)
+/* global slots used through each operand, PR_OPBRANCH for a relative jump */
+typedef struct
 {
-	qcvm->maxknownstrings += PR_STRING_ALLOCSLOTS;
-	DPrintf(qcvm, "PR_AllocStringSlots: realloc'ing for %d slots\n", qcvm->maxknownstrings);
-	//qcvm->knownstrings = (const char **) Z_Realloc ((void *)qcvm->knownstrings, qcvm->maxknownstrings * sizeof(char *));
-	qcvm->knownstrings = (const char **) qcvm->alloc_callback(
-		qcvm, (void *)qcvm->knownstrings, qcvm->maxknownstrings * sizeof(char *), "PR_AllocStringSlots"
-	);
-}
+	signed char	a, b, c;
+	qboolean	unsupported;	/* no interpreter runs it, the verifier rejects it */
+} propinfo_t;
 
-static const char *PR_GetString (NVM* qcvm, int num)
+static const propinfo_t pr_opinfo[OP_NUMOPS] =
 {
-	if (num >= 0 && num < qcvm->stringssize)
-		return qcvm->strings + num;
+	{3, 0, 0},	/* DONE */
+
+	{1, 1, 1},	/* MUL_F */
+	{3, 3, 1},	/* MUL_V */
+	{1, 3, 3},	/* MUL_FV */
+	{3, 1, 3},	/* MUL_VF */
+
+	{1, 1, 1},	/* DIV */
+
+	{1, 1, 1},	/* ADD_F */
+	{3, 3, 3},	/* ADD_V */
+
+	{1, 1, 1},	/* SUB_F */
+	{3, 3, 3},	/* SUB_V */
+
+	{1, 1, 1},	/* EQ_F */
+	{3, 3, 1},	/* EQ_V */
+	{1, 1, 1},	/* EQ_S */
+	{1, 1, 1},	/* EQ_E */
+	{1, 1, 1},	/* EQ_FNC */
+
+	{1, 1, 1},	/* NE_F */
+	{3, 3, 1},	/* NE_V */
+	{1, 1, 1},	/* NE_S */
+	{1, 1, 1},	/* NE_E */
+	{1, 1, 1},	/* NE_FNC */
+
+	{1, 1, 1},	/* LE */
+	{1, 1, 1},	/* GE */
+	{1, 1, 1},	/* LT */
+	{1, 1, 1},	/* GT */
+
+	{1, 1, 1},	/* INDIRECT (LOAD_F) */
+	{1, 1, 3},	/* INDIRECT (LOAD_V) */
+	{1, 1, 1},	/* INDIRECT (LOAD_S) */
+	{1, 1, 1},	/* INDIRECT (LOAD_ENT) */
+	{1, 1, 1},	/* INDIRECT (LOAD_FLD) */
+	{1, 1, 1},	/* INDIRECT (LOAD_FNC) */
+
+	{1, 1, 1},	/* ADDRESS */
+
+	{1, 1, 0},	/* STORE_F */
+	{3, 3, 0},	/* STORE_V */
+	{1, 1, 0},	/* STORE_S */
+	{1, 1, 0},	/* STORE_ENT */
+	{1, 1, 0},	/* STORE_FLD */
+	{1, 1, 0},	/* STORE_FNC */
+
+	{1, 1, 0},	/* STOREP_F */
+	{3, 1, 0},	/* STOREP_V */
+	{1, 1, 0},	/* STOREP_S */
+	{1, 1, 0},	/* STOREP_ENT */
+	{1, 1, 0},	/* STOREP_FLD */
+	{1, 1, 0},	/* STOREP_FNC */
+
+	{3, 0, 0},	/* RETURN */
+
+	{1, 0, 1},	/* NOT_F */
+	{3, 0, 1},	/* NOT_V */
+	{1, 0, 1},	/* NOT_S */
+	{1, 0, 1},	/* NOT_ENT */
+	{1, 0, 1},	/* NOT_FNC */
+
+	{1, PR_OPBRANCH, 0},	/* IF */
+	{1, PR_OPBRANCH, 0},	/* IFNOT */
+
+	{1, 0, 0},	/* CALL0 */
+	{1, 0, 0},	/* CALL1 */
+	{1, 0, 0},	/* CALL2 */
+	{1, 0, 0},	/* CALL3 */
+	{1, 0, 0},	/* CALL4 */
+	{1, 0, 0},	/* CALL5 */
+	{1, 0, 0},	/* CALL6 */
+	{1, 0, 0},	/* CALL7 */
+	{1, 0, 0},	/* CALL8 */
+
+	{1, 1, 0},	/* STATE */
+
+	{PR_OPBRANCH, 0, 0},	/* GOTO */
+
+	{1, 1, 1},	/* AND */
+	{1, 1, 1},	/* OR */
+
+	{1, 1, 1},	/* BITAND */
+	{1, 1, 1},	/* BITOR */
+
+	/* fteqcc extensions, numbered the way it emits them */
+	{1, 1, 0},	/* MULSTORE_F */
+	{1, 3, 0},	/* MULSTORE_VF */
+	{1, 1, 1},	/* MULSTOREP_F */
+	{1, 1, 3},	/* MULSTOREP_VF */
+
+	{1, 1, 0},	/* DIVSTORE_F */
+	{1, 1, 1},	/* DIVSTOREP_F */
+
+	{1, 1, 0},	/* ADDSTORE_F */
+	{3, 3, 0},	/* ADDSTORE_V */
+	{1, 1, 1},	/* ADDSTOREP_F */
+	{3, 1, 3},	/* ADDSTOREP_V */
+
+	{1, 1, 0},	/* SUBSTORE_F */
+	{3, 3, 0},	/* SUBSTORE_V */
+	{1, 1, 1},	/* SUBSTOREP_F */
+	{3, 1, 3},	/* SUBSTOREP_V */
+
+	{0, 0, 0, true},	/* FETCH_GBL_F */
+	{0, 0, 0, true},	/* FETCH_GBL_V */
+	{0, 0, 0, true},	/* FETCH_GBL_S */
+	{0, 0, 0, true},	/* FETCH_GBL_E */
+	{0, 0, 0, true},	/* FETCH_GBL_FNC */
+
+	{0, 0, 0, true},	/* CSTATE */
+	{0, 0, 0, true},	/* CWSTATE */
+	{0, 0, 0, true},	/* THINKTIME */
+
+	{1, 1, 0},	/* BITSETSTORE_F */
+	{1, 1, 0},	/* BITSETSTOREP_F */
+	{1, 1, 0},	/* BITCLRSTORE_F */
+	{1, 1, 0},	/* BITCLRSTOREP_F */
+
+	{0, 0, 1},	/* RAND0 */
+	{1, 0, 1},	/* RAND1 */
+	{1, 1, 1},	/* RAND2 */
+	{0, 0, 3},	/* RANDV0 */
+	{3, 0, 3},	/* RANDV1 */
+	{3, 3, 3},	/* RANDV2 */
+
+	{1, PR_OPBRANCH, 0},	/* SWITCH_F */
+	{3, PR_OPBRANCH, 0},	/* SWITCH_V */
+	{1, PR_OPBRANCH, 0},	/* SWITCH_S */
+	{1, PR_OPBRANCH, 0},	/* SWITCH_E */
+	{1, PR_OPBRANCH, 0},	/* SWITCH_FNC */
+
+	{3, PR_OPBRANCH, 0},	/* CASE */
+	{1, 1, PR_OPBRANCH},	/* CASERANGE */
+
+	{0, 0, 0, true},	/* CALL1H */
+	{0, 0, 0, true},	/* CALL2H */
+	{0, 0, 0, true},	/* CALL3H */
+	{0, 0, 0, true},	/* CALL4H */
+	{0, 0, 0, true},	/* CALL5H */
+	{0, 0, 0, true},	/* CALL6H */
+	{0, 0, 0, true},	/* CALL7H */
+	{0, 0, 0, true},	/* CALL8H */
+
+	{1, 1, 0},	/* STORE_I */
+	{1, 1, 0},	/* STORE_IF */
+	{1, 1, 0},	/* STORE_FI */
+
+	{1, 1, 1},	/* ADD_I */
+	{1, 1, 1},	/* ADD_FI */
+	{1, 1, 1},	/* ADD_IF */
+
+	{1, 1, 1},	/* SUB_I */
+	{1, 1, 1},	/* SUB_FI */
+	{1, 1, 1},	/* SUB_IF */
+
+	{1, 0, 1},	/* CONV_ITOF */
+	{1, 0, 1},	/* CONV_FTOI */
+	{1, 0, 1},	/* CP_ITOF */
+	{1, 0, 1},	/* CP_FTOI */
+
+	{1, 1, 1},	/* LOAD_I */
+	{1, 1, 0},	/* STOREP_I */
+	{1, 1, 0},	/* STOREP_IF */
+	{1, 1, 0},	/* STOREP_FI */
+
+	{1, 1, 1},	/* BITAND_I */
+	{1, 1, 1},	/* BITOR_I */
+
+	{1, 1, 1},	/* MUL_I */
+	{1, 1, 1},	/* DIV_I */
+	{1, 1, 1},	/* EQ_I */
+	{1, 1, 1},	/* NE_I */
+
+	{1, PR_OPBRANCH, 0},	/* IFNOT_S */
+	{1, PR_OPBRANCH, 0},	/* IF_S */
+
+	{1, 0, 1},	/* NOT_I */
+
+	{3, 1, 3},	/* DIV_VF */
+
+	{1, 1, 1},	/* BITXOR_I */
+	{1, 1, 1},	/* RSHIFT_I */
+	{1, 1, 1},	/* LSHIFT_I */
+
+	{0, 0, 0, true},	/* GLOBALADDRESS */
+	{1, 1, 1},	/* ADD_PIW */
+
+	{1, 1, 1},	/* LOADA_F */
+	{1, 1, 3},	/* LOADA_V */
+	{1, 1, 1},	/* LOADA_S */
+	{1, 1, 1},	/* LOADA_ENT */
+	{1, 1, 1},	/* LOADA_FLD */
+	{1, 1, 1},	/* LOADA_FNC */
+	{1, 1, 1},	/* LOADA_I */
+
+	{1, 1, 0},	/* STORE_P */
+	{0, 0, 0, true},	/* LOAD_P */
+
+	{1, 1, 1},	/* LOADP_F */
+	{1, 1, 3},	/* LOADP_V */
+	{1, 1, 1},	/* LOADP_S */
+	{1, 1, 1},	/* LOADP_ENT */
+	{1, 1, 1},	/* LOADP_FLD */
+	{1, 1, 1},	/* LOADP_FNC */
+	{1, 1, 1},	/* LOADP_I */
+
+	{1, 1, 1},	/* LE_I */
+	{1, 1, 1},	/* GE_I */
+	{1, 1, 1},	/* LT_I */
+	{1, 1, 1},	/* GT_I */
+
+	{1, 1, 1},	/* LE_IF */
+	{1, 1, 1},	/* GE_IF */
+	{1, 1, 1},	/* LT_IF */
+	{1, 1, 1},	/* GT_IF */
+
+	{1, 1, 1},	/* LE_FI */
+	{1, 1, 1},	/* GE_FI */
+	{1, 1, 1},	/* LT_FI */
+	{1, 1, 1},	/* GT_FI */
+
+	{1, 1, 1},	/* EQ_IF */
+	{1, 1, 1},	/* EQ_FI */
+
+	{0, 0, 0, true},	/* ADD_SF */
+	{0, 0, 0, true},	/* SUB_S */
+	{0, 0, 0, true},	/* STOREP_C */
+	{0, 0, 0, true},	/* LOADP_C */
+
+	{1, 1, 1},	/* MUL_IF */
+	{1, 1, 1},	/* MUL_FI */
+	{3, 1, 3},	/* MUL_VI */
+	{1, 3, 3},	/* MUL_IV */
+
+	{1, 1, 1},	/* DIV_IF */
+	{1, 1, 1},	/* DIV_FI */
+
+	{1, 1, 1},	/* BITAND_IF */
+	{1, 1, 1},	/* BITOR_IF */
+	{1, 1, 1},	/* BITAND_FI */
+	{1, 1, 1},	/* BITOR_FI */
+
+	{1, 1, 1},	/* AND_I */
+	{1, 1, 1},	/* OR_I */
+	{1, 1, 1},	/* AND_IF */
+	{1, 1, 1},	/* OR_IF */
+	{1, 1, 1},	/* AND_FI */
+	{1, 1, 1},	/* OR_FI */
+
+	{1, 1, 1},	/* NE_IF */
+	{1, 1, 1},	/* NE_FI */
+
+	{0, 0, 0, true},	/* GSTOREP_I */
+	{0, 0, 0, true},	/* GSTOREP_F */
+	{0, 0, 0, true},	/* GSTOREP_ENT */
+	{0, 0, 0, true},	/* GSTOREP_FLD */
+	{0, 0, 0, true},	/* GSTOREP_S */
+	{0, 0, 0, true},	/* GSTOREP_FNC */
+	{0, 0, 0, true},	/* GSTOREP_V */
+
+	{0, 0, 0, true},	/* GADDRESS */
+	{0, 0, 0, true},	/* GLOAD_I */
+	{0, 0, 0, true},	/* GLOAD_F */
+	{0, 0, 0, true},	/* GLOAD_FLD */
+	{0, 0, 0, true},	/* GLOAD_ENT */
+	{0, 0, 0, true},	/* GLOAD_S */
+	{0, 0, 0, true},	/* GLOAD_FNC */
+
+	{1, 0, 0},	/* BOUNDCHECK */
+	{0, 0, 0, true},	/* UNUSED */
+	{0, 0, 0, true},	/* PUSH */
+	{0, 0, 0, true},	/* POP */
+
+	{1, PR_OPBRANCH, 0},	/* SWITCH_I */
+	{0, 0, 0, true},	/* GLOAD_V */
+
+	{1, PR_OPBRANCH, 0},	/* IF_F */
+	{1, PR_OPBRANCH, 0}	/* IFNOT_F */
+};
+
+/*
+====================
+PR_WidenLumps
+
+Version 6 progs, and fteqcc's 16 bit version 7 ones, have 16 bit statements
+and defs. They get widened into one allocation so the interpreter only ever
+sees dstatement_t: branch offsets are sign extended, all other operands are
+unsigned.
+====================
+*/
+static void PR_WidenLumps (NVM* qcvm)
+{
+	dstatement16_t	*st16;
+	ddef16_t	*def16;
+	dstatement_t	*st;
+	const propinfo_t	*info;
+	int		i, numdefs;
+
+	numdefs = qcvm->progs->numglobaldefs + qcvm->progs->numfielddefs;
+	qcvm->lumps = qcvm->alloc_callback(qcvm, NULL, qcvm->progs->numstatements * sizeof(dstatement_t) + numdefs * sizeof(ddef_t), "progs lumps");
+	if (!qcvm->lumps)
+		Errorf (qcvm, "PR_WidenLumps: out of memory");
+	qcvm->statements = (dstatement_t *)qcvm->lumps;
+	qcvm->globaldefs = (ddef_t *)(qcvm->statements + qcvm->progs->numstatements);
+	qcvm->fielddefs = qcvm->globaldefs + qcvm->progs->numglobaldefs;
+
+	st16 = (dstatement16_t *)((byte *)qcvm->progs + qcvm->progs->ofs_statements);
+	for (i = 0; i < qcvm->progs->numstatements; i++)
+	{
+		st = &qcvm->statements[i];
+		st->op = (unsigned short)LittleShort(st16[i].op);
+		st->a = (unsigned short)LittleShort(st16[i].a);
+		st->b = (unsigned short)LittleShort(st16[i].b);
+		st->c = (unsigned short)LittleShort(st16[i].c);
+		if (st->op >= OP_NUMOPS)
+			continue;
+		info = &pr_opinfo[st->op];
+		if (info->a == PR_OPBRANCH)
+			st->a = (short)st->a;
+		if (info->b == PR_OPBRANCH)
+			st->b = (short)st->b;
+		if (info->c == PR_OPBRANCH)
+			st->c = (short)st->c;
+	}
+
+	def16 = (ddef16_t *)((byte *)qcvm->progs + qcvm->progs->ofs_globaldefs);
+	for (i = 0; i < qcvm->progs->numglobaldefs; i++)
+	{
+		qcvm->globaldefs[i].type = (unsigned short)LittleShort(def16[i].type);
+		qcvm->globaldefs[i].ofs = (unsigned short)LittleShort(def16[i].ofs);
+		qcvm->globaldefs[i].s_name = LittleLong(def16[i].s_name);
+	}
+	def16 = (ddef16_t *)((byte *)qcvm->progs + qcvm->progs->ofs_fielddefs);
+	for (i = 0; i < qcvm->progs->numfielddefs; i++)
+	{
+		qcvm->fielddefs[i].type = (unsigned short)LittleShort(def16[i].type);
+		qcvm->fielddefs[i].ofs = (unsigned short)LittleShort(def16[i].ofs);
+		qcvm->fielddefs[i].s_name = LittleLong(def16[i].s_name);
+	}
+}
+
+#define	PR_STRING_ALLOCSLOTS	256
+
+static void PR_AllocStringSlots (NVM* qcvm)
+{
+	qcvm->maxknownstrings += PR_STRING_ALLOCSLOTS;
+	DPrintf(qcvm, "PR_AllocStringSlots: realloc'ing for %d slots\n", qcvm->maxknownstrings);
+	//qcvm->knownstrings = (const char **) Z_Realloc ((void *)qcvm->knownstrings, qcvm->maxknownstrings * sizeof(char *));
+	qcvm->knownstrings = (const char **) qcvm->alloc_callback(
+		qcvm, (void *)qcvm->knownstrings, qcvm->maxknownstrings * sizeof(char *), "PR_AllocStringSlots"
+	);
+	// one bit per slot, set when the VM owns the string
+	qcvm->knownzone = (unsigned char *) qcvm->alloc_callback(qcvm, qcvm->knownzone, qcvm->maxknownstrings / 8, "knownzone");
+	memset(qcvm->knownzone + qcvm->knownzonesize, 0, qcvm->maxknownstrings / 8 - qcvm->knownzonesize);
+	qcvm->knownzonesize = qcvm->maxknownstrings / 8;
+}
+
+/*
+====================
+PR_FreeStrings
+
+Everything the string slots hold on to, for nvmDestroyVM.
+====================
+*/
+static void PR_FreeStrings (NVM* qcvm)
+{
+	int	i;
+
+	for (i = 0; i < qcvm->numknownstrings; i++)
+	{
+		if (qcvm->knownzone[i >> 3] & (1u << (i & 7)))
+			qcvm->alloc_callback(qcvm, (void *)qcvm->knownstrings[i], 0, "string");
+	}
+	if (qcvm->knownstrings)
+		qcvm->alloc_callback(qcvm, (void *)qcvm->knownstrings, 0, "PR_AllocStringSlots");
+	if (qcvm->knownzone)
+		qcvm->alloc_callback(qcvm, qcvm->knownzone, 0, "knownzone");
+	qcvm->knownstrings = NULL;
+	qcvm->knownzone = NULL;
+	qcvm->numknownstrings = qcvm->maxknownstrings = 0;
+	qcvm->knownzonesize = 0;
+}
+
+static const char *PR_GetString (NVM* qcvm, int num)
+{
+	if (num >= 0 && num < qcvm->stringssize)
+		return qcvm->strings + num;
 	else if (num < 0 && num >= -qcvm->numknownstrings)
 	{
 		if (!qcvm->knownstrings[-1 - num])
@@ -601,6 +1748,11 @@ static void PR_ClearEngineString(NVM* qcvm, int num)
 	if (num < 0 && num >= -qcvm->numknownstrings)
 	{
 		num = -1 - num;
+		if (qcvm->knownzone[num >> 3] & (1u << (num & 7)))
+		{
+			qcvm->alloc_callback(qcvm, (void *)qcvm->knownstrings[num], 0, "string");
+			qcvm->knownzone[num >> 3] &= ~(1u << (num & 7));
+		}
 		qcvm->knownstrings[num] = NULL;
 		if (qcvm->freeknownstrings > num)
 			qcvm->freeknownstrings = num;
@@ -644,6 +1796,7 @@ static int PR_SetEngineString (NVM* qcvm, const char *s)
 	}
 	qcvm->freeknownstrings = i+1;
 	qcvm->knownstrings[i] = s;
+	STAT(qcvm->stats.strings_allocated++);
 	return -1 - i;
 }
 
@@ -658,18 +1811,28 @@ static int PR_AllocString (NVM* qcvm, int size, char **ptr)
 		if (!qcvm->knownstrings[i])
 			break;
 	}
-//	if (i >= pr_numknownstrings)
-//	{
+	if (i >= qcvm->numknownstrings)
+	{
 		if (i >= qcvm->maxknownstrings)
 			PR_AllocStringSlots(qcvm);
 		qcvm->numknownstrings++;
-//	}
-	qcvm->knownstrings[i] = (char *)Hunk_AllocName(size, "string");
+	}
+	qcvm->knownstrings[i] = (char *)qcvm->alloc_callback(qcvm, NULL, size, "string");
+	qcvm->knownzone[i >> 3] |= 1u << (i & 7);
+	STAT(qcvm->stats.strings_allocated++);
 	if (ptr)
 		*ptr = (char *) qcvm->knownstrings[i];
 	return -1 - i;
 }
 
+static void PR_PrintOperand (NVM* qcvm, int kind, int operand, qboolean contents)
+{
+	if (kind == PR_OPBRANCH)
+		Printf(qcvm, "branch %i", operand);
+	else if (kind && operand)
+		Printf(qcvm, "%s", contents ? PR_GlobalString(qcvm, operand) : PR_GlobalStringNoContents(qcvm, operand));
+}
+
 /*
 =================
 PR_PrintStatement
@@ -687,25 +1850,18 @@ void PR_PrintStatement (NVM* qcvm, dstatement_t *s)
 			Printf(qcvm, " ");
 	}
 
-	if (s->op == OP_IF || s->op == OP_IFNOT)
-		Printf(qcvm, "%sbranch %i", PR_GlobalString(qcvm, s->a), s->b);
-	else if (s->op == OP_GOTO)
-	{
-		Printf(qcvm, "branch %i", s->a);
-	}
+	if (s->op == OP_BOUNDCHECK)
+		Printf(qcvm, "%s%u <= x < %u", PR_GlobalString(qcvm, s->a), s->c, s->b);
 	else if ((unsigned int)(s->op-OP_STORE_F) < 6)
 	{
 		Printf(qcvm, "%s", PR_GlobalString(qcvm, s->a));
 		Printf(qcvm, "%s", PR_GlobalStringNoContents(qcvm, s->b));
 	}
-	else
+	else if (s->op < OP_NUMOPS)
 	{
-		if (s->a)
-			Printf(qcvm, "%s", PR_GlobalString(qcvm, s->a));
-		if (s->b)
-			Printf(qcvm, "%s", PR_GlobalString(qcvm, s->b));
-		if (s->c)
-			Printf(qcvm, "%s", PR_GlobalStringNoContents(qcvm, s->c));
+		PR_PrintOperand(qcvm, pr_opinfo[s->op].a, s->a, true);
+		PR_PrintOperand(qcvm, pr_opinfo[s->op].b, s->b, true);
+		PR_PrintOperand(qcvm, pr_opinfo[s->op].c, s->c, false);
 	}
 	Printf(qcvm, "\n");
 }
@@ -726,6 +1882,10 @@ static void PR_StackTrace (NVM* qcvm)
 		return;
 	}
 
+	f = PR_InlinedFunction(qcvm, qcvm->xstatement);
+	if (f)
+		Printf(qcvm, "%12s : %s (inlined)\n", PR_GetString(qcvm, f->s_file), PR_GetString(qcvm, f->s_name));
+
 	qcvm->stack[qcvm->depth].f = qcvm->xfunction;
 	for (i = qcvm->depth; i >= 0; i--)
 	{
@@ -741,402 +1901,6658 @@ static void PR_StackTrace (NVM* qcvm)
 	}
 }
 
+/*
+===============================================================================
+
+PROFILER
+
+Builds a calling context tree while profiling is enabled, every node holding
+the statements and wall-clock time spent in one function as reached through
+one particular chain of callers. Builtins get nodes of their own, so the time
+spent in host code is charged to them rather than to the calling QC function.
+Inclusive figures and per-function totals are only derived at report time.
+
+===============================================================================
+*/
+
+static unsigned long long PR_ProfileTime (void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER	freq;
+	LARGE_INTEGER	count;
+
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (unsigned long long)(count.QuadPart / freq.QuadPart) * 1000000000ull
+		+ (unsigned long long)(count.QuadPart % freq.QuadPart) * 1000000000ull / freq.QuadPart;
+#else
+	struct timespec	ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+static unsigned int PR_ProfileHash (int parent, int func)
+{
+	return (unsigned int)parent * 2654435761u ^ (unsigned int)func * 40503u;
+}
+
+static qboolean PR_ProfileRehash (NVM* qcvm, int hashsize)
+{
+	prprofile_t	*p = qcvm->profile;
+	unsigned int	h;
+	int		i, *hash;
+
+	hash = (int *) qcvm->alloc_callback(qcvm, p->hash, hashsize * sizeof(int), "profiler hash");
+	if (!hash)
+		return false;
+	p->hash = hash;
+	p->hashsize = hashsize;
+	for (i = 0; i < hashsize; i++)
+		p->hash[i] = -1;
+	for (i = 1; i < p->numnodes; i++)
+	{
+		h = PR_ProfileHash(p->nodes[i].parent, p->nodes[i].func) & (hashsize - 1);
+		while (p->hash[h] >= 0)
+			h = (h + 1) & (hashsize - 1);
+		p->hash[h] = i;
+	}
+	return true;
+}
+
 /*
 ============
-PR_RunError
+PR_ProfileOutOfMemory
 
-Aborts the currently executing function
+Ends the profile where it is when the tree can't grow, what was counted
+so far can still be reported
 ============
 */
-void PR_RunError (NVM* qcvm, const char *error, ...)
+static int PR_ProfileOutOfMemory (NVM* qcvm)
 {
-	va_list	argptr;
-	char	string[1024];
-
-	va_start (argptr, error);
-	vsnprintf (string, sizeof(string), error, argptr);
-	va_end (argptr);
+	Printf(qcvm, "profiler: out of memory, profiling stopped\n");
+	nvmProfileEnd(qcvm);
+	return -1;
+}
 
-	PR_PrintStatement(qcvm, qcvm->statements + qcvm->xstatement);
-	PR_StackTrace(qcvm);
+/*
+============
+PR_ProfileNode
 
-	Printf(qcvm, "%s\n", string);
+Returns the node for func called from parent, creating it if needed, or -1
+when that needs memory there isn't
+============
+*/
+static int PR_ProfileNode (NVM* qcvm, int parent, int func)
+{
+	prprofile_t	*p = qcvm->profile;
+	prprofnode_t	*n;
+	unsigned int	h;
+	int		i;
 
-	qcvm->depth = 0;	// dump the stack so host_error can shutdown functions
+	h = PR_ProfileHash(parent, func) & (p->hashsize - 1);
+	while ((i = p->hash[h]) >= 0)
+	{
+		if (p->nodes[i].parent == parent && p->nodes[i].func == func)
+			return i;
+		h = (h + 1) & (p->hashsize - 1);
+	}
 
-	Errorf(qcvm, "Program error");
+	if (p->numnodes == p->maxnodes)
+	{
+		n = (prprofnode_t *) qcvm->alloc_callback(qcvm, p->nodes, 2 * p->maxnodes * sizeof(prprofnode_t), "profiler nodes");
+		if (!n)
+			return PR_ProfileOutOfMemory(qcvm);
+		p->nodes = n;
+		p->maxnodes *= 2;
+	}
+	i = p->numnodes++;
+	n = &p->nodes[i];
+	memset(n, 0, sizeof(*n));
+	n->func = func;
+	n->parent = parent;
+
+	if (p->numnodes * 2 <= p->hashsize)
+		p->hash[h] = i;
+	else if (!PR_ProfileRehash(qcvm, p->hashsize * 2))
+	{
+		p->numnodes--;
+		return PR_ProfileOutOfMemory(qcvm);
+	}
+	return i;
 }
 
 /*
-====================
-PR_EnterFunction
+============
+PR_ProfileFlush
 
-Returns the new program statement counter
-====================
+Charges the statements and time since the last profiler event to the current node
+============
 */
-static int PR_EnterFunction (NVM* qcvm, dfunction_t *f)
+static void PR_ProfileFlush (NVM* qcvm, int statements)
 {
-	int	i, j, c, o;
+	prprofile_t	*p = qcvm->profile;
+	prprofnode_t	*n = &p->nodes[p->current];
+	unsigned long long	now = PR_ProfileTime();
 
-	qcvm->stack[qcvm->depth].s = qcvm->xstatement;
-	qcvm->stack[qcvm->depth].f = qcvm->xfunction;
-	qcvm->depth++;
-	if (qcvm->depth >= MAX_STACK_DEPTH)
-		PR_RunError(qcvm, "stack overflow");
+	n->self_statements += statements;
+	n->self_time += now - p->lasttime;
+	p->lasttime = now;
+}
 
-	// save off any locals that the new function steps on
-	c = f->locals;
-	if (qcvm->localstack_used + c > LOCALSTACK_SIZE)
-		PR_RunError(qcvm, "PR_ExecuteProgram: locals stack overflow\n");
+static qboolean PR_ProfilePush (NVM* qcvm, dfunction_t *f, int statements)
+{
+	prprofile_t	*p = qcvm->profile;
+	int		i;
 
-	for (i = 0; i < c ; i++)
-		qcvm->localstack[qcvm->localstack_used + i] = ((int *)qcvm->globals)[f->parm_start + i];
-	qcvm->localstack_used += c;
+	PR_ProfileFlush(qcvm, statements);
+	i = PR_ProfileNode(qcvm, p->current, f - qcvm->functions);
+	if (i < 0)
+		return false;
+	p->current = i;
+	return true;
+}
 
-	// copy parameters
-	o = f->parm_start;
-	for (i = 0; i < f->numparms; i++)
+static void PR_ProfileEnter (NVM* qcvm, dfunction_t *f, int statements)
+{
+	if (PR_ProfilePush(qcvm, f, statements))
+		qcvm->profile->nodes[qcvm->profile->current].calls++;
+}
+
+static void PR_ProfileLeave (NVM* qcvm, int statements)
+{
+	prprofile_t	*p = qcvm->profile;
+
+	PR_ProfileFlush(qcvm, statements);
+	if (p->nodes[p->current].parent >= 0)
+		p->current = p->nodes[p->current].parent;
+}
+
+static void PR_ProfileFree (NVM* qcvm)
+{
+	if (!qcvm->profile)
+		return;
+	if (qcvm->profile->nodes)
+		qcvm->alloc_callback(qcvm, qcvm->profile->nodes, 0, "profiler nodes");
+	if (qcvm->profile->hash)
+		qcvm->alloc_callback(qcvm, qcvm->profile->hash, 0, "profiler hash");
+	qcvm->alloc_callback(qcvm, qcvm->profile, 0, "profiler");
+	qcvm->profile = NULL;
+	qcvm->profiling = false;
+}
+
+void nvmProfileBegin(NVM* qcvm)
+{
+	prprofile_t	*p = qcvm->profile;
+	int		i;
+
+	if (!p)
 	{
-		for (j = 0; j < f->parm_size[i]; j++)
+		p = (prprofile_t *) qcvm->alloc_callback(qcvm, NULL, sizeof(prprofile_t), "profiler");
+		if (!p)
 		{
-			((int *)qcvm->globals)[o] = ((int *)qcvm->globals)[OFS_PARM0 + i*3 + j];
-			o++;
+			Printf(qcvm, "nvmProfileBegin: out of memory\n");
+			return;
+		}
+		memset(p, 0, sizeof(*p));
+		p->maxnodes = 256;
+		p->nodes = (prprofnode_t *) qcvm->alloc_callback(qcvm, NULL, p->maxnodes * sizeof(prprofnode_t), "profiler nodes");
+		qcvm->profile = p;
+		if (!p->nodes)
+		{
+			PR_ProfileFree(qcvm);
+			Printf(qcvm, "nvmProfileBegin: out of memory\n");
+			return;
 		}
 	}
 
-	qcvm->xfunction = f;
-	return f->first_statement - 1;	// offset the s++
+	// the root stands for the host and anything called from outside the VM
+	memset(&p->nodes[0], 0, sizeof(p->nodes[0]));
+	p->nodes[0].parent = -1;
+	p->numnodes = 1;
+	p->current = 0;
+	if (!PR_ProfileRehash(qcvm, 2 * p->maxnodes))
+	{
+		PR_ProfileFree(qcvm);
+		Printf(qcvm, "nvmProfileBegin: out of memory\n");
+		return;
+	}
+
+	if (qcvm->progs)
+	{
+		for (i = 0; i < qcvm->progs->numfunctions; i++)
+			qcvm->functions[i].profile = 0;
+	}
+
+	p->begintime = p->lasttime = PR_ProfileTime();
+	p->endtime = 0;
+	qcvm->profiling = true;
 }
 
-/*
-====================
-PR_LeaveFunction
-====================
-*/
-static int PR_LeaveFunction (NVM* qcvm)
+void nvmProfileEnd(NVM* qcvm)
 {
-	int	i, c;
+	if (!qcvm->profiling)
+		return;
+	PR_ProfileFlush(qcvm, 0);
+	qcvm->profile->endtime = qcvm->profile->lasttime;
+	qcvm->profiling = false;
+}
 
-	if (qcvm->depth <= 0)
-		Errorf(qcvm, "prog stack underflow");
+typedef struct
+{
+	int		func;
+	int		callee;		/* edges only */
+	unsigned int	calls;
+	unsigned long long	self_statements, total_statements;
+	unsigned long long	self_time, total_time;
+} prprofsum_t;
+
+static int PR_ProfileSumCompare (const void *a, const void *b)
+{
+	const prprofsum_t	*x = (const prprofsum_t *)a;
+	const prprofsum_t	*y = (const prprofsum_t *)b;
 
-	// Restore locals from the stack
-	c = qcvm->xfunction->locals;
-	qcvm->localstack_used -= c;
-	if (qcvm->localstack_used < 0)
-		PR_RunError(qcvm, "PR_ExecuteProgram: locals stack underflow");
+	if (x->self_time != y->self_time)
+		return x->self_time < y->self_time ? 1 : -1;
+	return x->func - y->func;
+}
 
-	for (i = 0; i < c; i++)
-		((int *)qcvm->globals)[qcvm->xfunction->parm_start + i] = qcvm->localstack[qcvm->localstack_used + i];
+static int PR_ProfileEdgeKeyCompare (const void *a, const void *b)
+{
+	const prprofsum_t	*x = (const prprofsum_t *)a;
+	const prprofsum_t	*y = (const prprofsum_t *)b;
 
-	// up stack
-	qcvm->depth--;
-	qcvm->xfunction = qcvm->stack[qcvm->depth].f;
-	return qcvm->stack[qcvm->depth].s;
+	if (x->func != y->func)
+		return x->func - y->func;
+	return x->callee - y->callee;
 }
 
-#define OPA ((eval_t *)&qcvm->globals[(unsigned short)st->a])
-#define OPB ((eval_t *)&qcvm->globals[(unsigned short)st->b])
-#define OPC ((eval_t *)&qcvm->globals[(unsigned short)st->c])
+static int PR_ProfileEdgeCompare (const void *a, const void *b)
+{
+	const prprofsum_t	*x = (const prprofsum_t *)a;
+	const prprofsum_t	*y = (const prprofsum_t *)b;
 
-void nvmExecuteFunction(NVM* qcvm, func_t fnum)
+	if (x->total_time != y->total_time)
+		return x->total_time < y->total_time ? 1 : -1;
+	return PR_ProfileEdgeKeyCompare(a, b);
+}
+
+/*
+============
+PR_ProfileRecursive
+
+True if the node's function (or with edges, its caller -> callee pair) already
+appears further up the context, in which case its inclusive figures are part
+of the outer one's
+============
+*/
+static qboolean PR_ProfileRecursive (prprofile_t *p, int node, qboolean edge)
 {
-	eval_t		*ptr;
-	dstatement_t	*st;
-	dfunction_t	*f, *newf;
-	int profile, startprofile;
-	edict_t		*ed;
-	int		exitdepth;
+	prprofnode_t	*n = &p->nodes[node];
+	int		i;
 
-	if (!fnum || fnum >= qcvm->progs->numfunctions)
+	for (i = n->parent; i > 0; i = p->nodes[i].parent)
 	{
-		// if (qcvm->global_struct->self) ED_Print (PROG_TO_EDICT(qcvm->global_struct->self));
-		Errorf (qcvm, "PR_ExecuteProgram: NULL function");
+		if (p->nodes[i].func != n->func)
+			continue;
+		if (!edge || p->nodes[p->nodes[i].parent].func == p->nodes[n->parent].func)
+			return true;
 	}
+	return false;
+}
 
-	f = &qcvm->functions[fnum];
+static const char *PR_ProfileName (NVM* qcvm, int func)
+{
+	return func ? PR_GetString(qcvm, qcvm->functions[func].s_name) : "<host>";
+}
 
-	//FIXME: if this is a builtin, then we're going to crash.
+/*
+============
+nvmProfileReport
 
-	qcvm->trace = true;
+Prints the maxlines most expensive functions by self time, followed by the
+most expensive caller -> callee edges by inclusive time
+============
+*/
+void nvmProfileReport(NVM* qcvm, int maxlines)
+{
+	prprofile_t	*p = qcvm->profile;
+	prprofsum_t	*funcs, *edges, *s;
+	unsigned long long	*total_statements, *total_time, wall, statements;
+	int		i, j, numfuncs, numedges;
 
-// make a stack frame
-	exitdepth = qcvm->depth;
+	if (!p || !qcvm->progs)
+	{
+		Printf(qcvm, "no profile\n");
+		return;
+	}
+	if (qcvm->profiling)
+		PR_ProfileFlush(qcvm, 0);
 
-	st = &qcvm->statements[PR_EnterFunction(qcvm, f)];
-	startprofile = profile = 0;
+	// children always come after their parents, so one backwards pass gives the inclusive figures
+	total_statements = (unsigned long long *) qcvm->alloc_callback(qcvm, NULL, 2 * p->numnodes * sizeof(unsigned long long), "profiler report");
+	total_time = total_statements + p->numnodes;
+	for (i = 0; i < p->numnodes; i++)
+	{
+		total_statements[i] = p->nodes[i].self_statements;
+		total_time[i] = p->nodes[i].self_time;
+	}
+	for (i = p->numnodes - 1; i > 0; i--)
+	{
+		total_statements[p->nodes[i].parent] += total_statements[i];
+		total_time[p->nodes[i].parent] += total_time[i];
+	}
 
-    while (1)
-    {
-		st++;	/* next statement */
+	funcs = (prprofsum_t *) qcvm->alloc_callback(qcvm, NULL, (qcvm->progs->numfunctions + p->numnodes) * sizeof(prprofsum_t), "profiler report");
+	edges = funcs + qcvm->progs->numfunctions;
+	memset(funcs, 0, qcvm->progs->numfunctions * sizeof(prprofsum_t));
+	for (i = 0; i < qcvm->progs->numfunctions; i++)
+		funcs[i].func = i;
 
-		if (++profile > 0x10000000)	//spike -- was decimal 100000
+	numedges = 0;
+	for (i = 1; i < p->numnodes; i++)
+	{
+		s = &funcs[p->nodes[i].func];
+		s->calls += p->nodes[i].calls;
+		s->self_statements += p->nodes[i].self_statements;
+		s->self_time += p->nodes[i].self_time;
+		// recursive calls are already part of an outer call's inclusive figures
+		if (!PR_ProfileRecursive(p, i, false))
 		{
-			qcvm->xstatement = st - qcvm->statements;
-			PR_RunError(qcvm, "runaway loop error");
+			s->total_statements += total_statements[i];
+			s->total_time += total_time[i];
 		}
 
-		if (qcvm->trace)
-			PR_PrintStatement(qcvm, st);
+		s = &edges[numedges++];
+		s->func = p->nodes[p->nodes[i].parent].func;
+		s->callee = p->nodes[i].func;
+		s->calls = p->nodes[i].calls;
+		s->total_time = PR_ProfileRecursive(p, i, true) ? 0 : total_time[i];
+	}
 
-		switch (st->op)
+	// merge the edges that were reached through different contexts
+	qsort(edges, numedges, sizeof(prprofsum_t), PR_ProfileEdgeKeyCompare);
+	for (i = 0, j = 0; i < numedges; i++)
+	{
+		if (j > 0 && edges[j-1].func == edges[i].func && edges[j-1].callee == edges[i].callee)
 		{
-		case OP_ADD_F:
-			OPC->_float = OPA->_float + OPB->_float;
-			break;
-		case OP_ADD_V:
-			OPC->vector[0] = OPA->vector[0] + OPB->vector[0];
-			OPC->vector[1] = OPA->vector[1] + OPB->vector[1];
-			OPC->vector[2] = OPA->vector[2] + OPB->vector[2];
-			break;
+			edges[j-1].calls += edges[i].calls;
+			edges[j-1].total_time += edges[i].total_time;
+		}
+		else
+			edges[j++] = edges[i];
+	}
+	numedges = j;
+	qsort(edges, numedges, sizeof(prprofsum_t), PR_ProfileEdgeCompare);
 
-		case OP_SUB_F:
-			OPC->_float = OPA->_float - OPB->_float;
-			break;
-		case OP_SUB_V:
-			OPC->vector[0] = OPA->vector[0] - OPB->vector[0];
-			OPC->vector[1] = OPA->vector[1] - OPB->vector[1];
-			OPC->vector[2] = OPA->vector[2] - OPB->vector[2];
-			break;
+	for (i = 0, numfuncs = 0; i < qcvm->progs->numfunctions; i++)
+	{
+		if (funcs[i].calls)
+			funcs[numfuncs++] = funcs[i];
+	}
+	qsort(funcs, numfuncs, sizeof(prprofsum_t), PR_ProfileSumCompare);
 
-		case OP_MUL_F:
-			OPC->_float = OPA->_float * OPB->_float;
-			break;
-		case OP_MUL_V:
-			OPC->_float = OPA->vector[0] * OPB->vector[0] +
-					  OPA->vector[1] * OPB->vector[1] +
-					  OPA->vector[2] * OPB->vector[2];
-			break;
-		case OP_MUL_FV:
-			OPC->vector[0] = OPA->_float * OPB->vector[0];
-			OPC->vector[1] = OPA->_float * OPB->vector[1];
-			OPC->vector[2] = OPA->_float * OPB->vector[2];
-			break;
-		case OP_MUL_VF:
-			OPC->vector[0] = OPB->_float * OPA->vector[0];
-			OPC->vector[1] = OPB->_float * OPA->vector[1];
-			OPC->vector[2] = OPB->_float * OPA->vector[2];
-			break;
+	wall = (p->endtime ? p->endtime : p->lasttime) - p->begintime;
+	statements = total_statements[0];
+	Printf(qcvm, "profile: %.3f ms wall, %.3f ms in QC, %llu statements\n",
+		wall / 1e6, (total_time[0] - p->nodes[0].self_time) / 1e6, statements);
 
-		case OP_DIV_F:
-			OPC->_float = OPA->_float / OPB->_float;
-			break;
+	Printf(qcvm, "%10s %12s %12s %10s %10s  %s\n", "calls", "self stmts", "total stmts", "self ms", "total ms", "function");
+	for (i = 0; i < numfuncs && i < maxlines; i++)
+	{
+		s = &funcs[i];
+		Printf(qcvm, "%10u %12llu %12llu %10.3f %10.3f  %s\n", s->calls, s->self_statements, s->total_statements,
+			s->self_time / 1e6, s->total_time / 1e6, PR_ProfileName(qcvm, s->func));
+	}
 
-		case OP_BITAND:
-			OPC->_float = (int)OPA->_float & (int)OPB->_float;
-			break;
+	Printf(qcvm, "%10s %10s  %s\n", "calls", "total ms", "caller -> callee");
+	for (i = 0; i < numedges && i < maxlines; i++)
+	{
+		s = &edges[i];
+		Printf(qcvm, "%10u %10.3f  %s -> %s\n", s->calls, s->total_time / 1e6,
+			PR_ProfileName(qcvm, s->func), PR_ProfileName(qcvm, s->callee));
+	}
 
-		case OP_BITOR:
-			OPC->_float = (int)OPA->_float | (int)OPB->_float;
-			break;
+	qcvm->alloc_callback(qcvm, funcs, 0, "profiler report");
+	qcvm->alloc_callback(qcvm, total_statements, 0, "profiler report");
+}
 
-		case OP_GE:
-			OPC->_float = OPA->_float >= OPB->_float;
-			break;
-		case OP_LE:
-			OPC->_float = OPA->_float <= OPB->_float;
-			break;
-		case OP_GT:
-			OPC->_float = OPA->_float > OPB->_float;
-			break;
-		case OP_LT:
-			OPC->_float = OPA->_float < OPB->_float;
-			break;
-		case OP_AND:
-			OPC->_float = OPA->_float && OPB->_float;
-			break;
-		case OP_OR:
-			OPC->_float = OPA->_float || OPB->_float;
-			break;
+/*
+============
+nvmProfileExportFolded
 
-		case OP_NOT_F:
-			OPC->_float = !OPA->_float;
-			break;
-		case OP_NOT_V:
-			OPC->_float = !OPA->vector[0] && !OPA->vector[1] && !OPA->vector[2];
-			break;
-		case OP_NOT_S:
-			OPC->_float = !OPA->string || !*PR_GetString(qcvm, OPA->string);
-			break;
-		case OP_NOT_FNC:
-			OPC->_float = !OPA->function;
-			break;
-		case OP_NOT_ENT:
-			OPC->_float = (PROG_TO_EDICT(OPA->edict) == qcvm->edicts);
-			break;
+Writes one "caller;...;callee value" line per calling context, the format
+taken by flamegraph tools. Behaves like snprintf: the return value is the
+full length of the output, which may exceed size.
+============
+*/
+size_t nvmProfileExportFolded(NVM* qcvm, char* buffer, size_t size, nvmprofilemetric_t metric)
+{
+	prprofile_t	*p = qcvm->profile;
+	char		line[4096];
+	int		path[256];
+	int		i, n, depth;
+	size_t	len, total;
+	unsigned long long	value;
+
+	if (size)
+		buffer[0] = 0;
+	if (!p)
+		return 0;
+	if (qcvm->profiling)
+		PR_ProfileFlush(qcvm, 0);
 
-		case OP_EQ_F:
-			OPC->_float = OPA->_float == OPB->_float;
-			break;
-		case OP_EQ_V:
-			OPC->_float = (OPA->vector[0] == OPB->vector[0]) &&
-					  (OPA->vector[1] == OPB->vector[1]) &&
-					  (OPA->vector[2] == OPB->vector[2]);
-			break;
-		case OP_EQ_S:
-			OPC->_float = !strcmp(PR_GetString(qcvm, OPA->string), PR_GetString(qcvm, OPB->string));
-			break;
-		case OP_EQ_E:
-			OPC->_float = OPA->_int == OPB->_int;
-			break;
-		case OP_EQ_FNC:
-			OPC->_float = OPA->function == OPB->function;
-			break;
+	total = 0;
+	for (i = 1; i < p->numnodes; i++)
+	{
+		if (metric == NVM_PROFILE_STATEMENTS)
+			value = p->nodes[i].self_statements;
+		else
+			value = p->nodes[i].self_time / 1000;
+		if (!value)
+			continue;
+
+		for (depth = 0, n = i; n > 0 && depth < 256; n = p->nodes[n].parent)
+			path[depth++] = p->nodes[n].func;
+
+		len = 0;
+		while (depth-- > 0 && len < sizeof(line))
+			len += snprintf(line + len, sizeof(line) - len, "%s%s", PR_ProfileName(qcvm, path[depth]), depth ? ";" : "");
+		if (len < sizeof(line))
+			len += snprintf(line + len, sizeof(line) - len, " %llu\n", value);
+		if (len >= sizeof(line))
+			continue;	// absurdly deep stack, drop it rather than emit a truncated path
+
+		if (total + len < size)
+			memcpy(buffer + total, line, len + 1);
+		total += len;
+	}
+	return total;
+}
 
-		case OP_NE_F:
-			OPC->_float = OPA->_float != OPB->_float;
-			break;
-		case OP_NE_V:
-			OPC->_float = (OPA->vector[0] != OPB->vector[0]) ||
-					  (OPA->vector[1] != OPB->vector[1]) ||
-					  (OPA->vector[2] != OPB->vector[2]);
-			break;
-		case OP_NE_S:
-			OPC->_float = strcmp(PR_GetString(qcvm, OPA->string), PR_GetString(qcvm, OPB->string));
-			break;
-		case OP_NE_E:
-			OPC->_float = OPA->_int != OPB->_int;
-			break;
-		case OP_NE_FNC:
-			OPC->_float = OPA->function != OPB->function;
-			break;
+/*
+===============================================================================
 
-		case OP_STORE_F:
-		case OP_STORE_ENT:
-		case OP_STORE_FLD:	// integers
-		case OP_STORE_S:
-		case OP_STORE_FNC:	// pointers
-			OPB->_int = OPA->_int;
-			break;
-		case OP_STORE_V:
-			OPB->vector[0] = OPA->vector[0];
-			OPB->vector[1] = OPA->vector[1];
-			OPB->vector[2] = OPA->vector[2];
-			break;
+SAMPLING PROFILER
 
-		case OP_STOREP_F:
-		case OP_STOREP_ENT:
-		case OP_STOREP_FLD:	// integers
-		case OP_STOREP_S:
-		case OP_STOREP_FNC:	// pointers
-			ptr = (eval_t *)((byte *)qcvm->edicts + OPB->_int);
-			ptr->_int = OPA->_int;
-			break;
-		case OP_STOREP_V:
-			ptr = (eval_t *)((byte *)qcvm->edicts + OPB->_int);
-			ptr->vector[0] = OPA->vector[0];
-			ptr->vector[1] = OPA->vector[1];
-			ptr->vector[2] = OPA->vector[2];
-			break;
+nvmSample takes one sample of the running VM: the current statement and the
+function chain on the QC stack. It only reads VM state and writes to a
+preallocated ring, so it may run in a signal handler or on another thread.
+Calls and returns bracket their stack updates with sampleseq, seqlock style,
+so a sample that overlaps one is retried or discarded instead of recording
+a half-updated stack.
 
-		case OP_ADDRESS:
-			ed = PROG_TO_EDICT(OPA->edict);
-	#ifdef PARANOID
-			NUM_FOR_EDICT(ed);	// Make sure it's in range
-	#endif
-	#if 0
-			if (ed == (edict_t *)qcvm->edicts && sv.state == ss_active)
+===============================================================================
+*/
+
+#ifdef _MSC_VER
+#define PR_BARRIER()	MemoryBarrier()
+#else
+#define PR_BARRIER()	__sync_synchronize()
+#endif
+
+#define	PR_SAMPLE_RINGSIZE	4096
+
+#ifndef _WIN32
+static NVM *volatile	pr_sampledvm;	// the VM driven by the SIGPROF timer, only one per process
+static struct sigaction	pr_oldsigprof;
+
+static void PR_SigProf (int sig)
+{
+	NVM		*qcvm = pr_sampledvm;
+
+	if (qcvm)
+		nvmSample(qcvm);
+}
+#endif
+
+static void PR_SamplerFree (NVM* qcvm)
+{
+	prsampler_t	*s = qcvm->sampler;
+
+	if (!s)
+		return;
+	if (s->ring)
+		qcvm->alloc_callback(qcvm, s->ring, 0, "sampler ring");
+	if (s->selfhits)
+		qcvm->alloc_callback(qcvm, s->selfhits, 0, "sampler hits");
+	qcvm->alloc_callback(qcvm, s, 0, "sampler");
+	qcvm->sampler = NULL;
+}
+
+void nvmSample(NVM* qcvm)
+{
+	prsampler_t	*s = qcvm->sampler;
+	prsample_t	*e;
+	unsigned int	head, seq;
+	int		i, tries;
+
+	if (!s || !qcvm->sampling)
+		return;
+
+	head = s->head;
+	if (head - s->tail >= s->ringsize)
+	{
+		s->dropped++;
+		return;
+	}
+	e = &s->ring[head & (s->ringsize - 1)];
+
+	for (tries = 0; ; tries++)
+	{
+		seq = qcvm->sampleseq;
+		PR_BARRIER();
+		if (!(seq & 1))
+		{
+			if (qcvm->depth <= 0)
+			{
+				s->idle++;
+				return;
+			}
+			e->statement = qcvm->samplestatement;
+			e->numfuncs = 0;
+			if (qcvm->xfunction)
+				e->funcs[e->numfuncs++] = qcvm->xfunction - qcvm->functions;
+			// stack[0] holds whatever ran before the outermost nvmExecuteFunction
+			for (i = qcvm->depth - 1; i > 0 && e->numfuncs < NVM_SAMPLE_FRAMES; i--)
 			{
-				qcvm->xstatement = st - qcvm->statements;
-				PR_RunError("assignment to world entity");
+				if (qcvm->stack[i].f)
+					e->funcs[e->numfuncs++] = qcvm->stack[i].f - qcvm->functions;
 			}
-	#endif
-			OPC->_int = (byte *)((int *)&ed->v + OPB->_int) - (byte *)qcvm->edicts;
+			PR_BARRIER();
+			if (qcvm->sampleseq == seq)
+				break;
+		}
+		// from a signal handler the interrupted update can't finish, so don't spin for long;
+		// the statement is still good, it's the call or return doing the update
+		if (tries == 64)
+		{
+			e->statement = qcvm->samplestatement;
+			e->numfuncs = 0;
+			s->torn++;
 			break;
+		}
+	}
 
-		case OP_LOAD_F:
-		case OP_LOAD_FLD:
-		case OP_LOAD_ENT:
-		case OP_LOAD_S:
-		case OP_LOAD_FNC:
-			ed = PROG_TO_EDICT(OPA->edict);
-	#ifdef PARANOID
-			NUM_FOR_EDICT(ed);	// Make sure it's in range
-	#endif
-			OPC->_int = ((eval_t *)((int *)&ed->v + OPB->_int))->_int;
-			break;
+	PR_BARRIER();
+	s->head = head + 1;
+}
 
-		case OP_LOAD_V:
-			ed = PROG_TO_EDICT(OPA->edict);
-	#ifdef PARANOID
-			NUM_FOR_EDICT(ed);	// Make sure it's in range
-	#endif
-			ptr = (eval_t *)((int *)&ed->v + OPB->_int);
-			OPC->vector[0] = ptr->vector[0];
-			OPC->vector[1] = ptr->vector[1];
-			OPC->vector[2] = ptr->vector[2];
-			break;
+/*
+============
+nvmSamplingBegin
 
-		case OP_IFNOT:
-			if (!OPA->_int)
-				st += st->b - 1;	/* -1 to offset the st++ */
-			break;
+Starts sampling with a SIGPROF timer at hz samples per second of CPU time.
+With hz 0 the host drives the sampling by calling nvmSample itself, e.g.
+from a timer thread, which is also the only option on Windows.
+============
+*/
+bool nvmSamplingBegin(NVM* qcvm, int hz)
+{
+	prsampler_t	*s = qcvm->sampler;
+	size_t	hitssize;
 
-		case OP_IF:
-			if (OPA->_int)
-				st += st->b - 1;	/* -1 to offset the st++ */
-			break;
+	if (!qcvm->progs || qcvm->sampling)
+		return false;
 
-		case OP_GOTO:
-			st += st->a - 1;		/* -1 to offset the st++ */
-			break;
+	if (s && (s->numfunctions != qcvm->progs->numfunctions || s->numstatements != qcvm->progs->numstatements))
+		PR_SamplerFree(qcvm);
+	s = qcvm->sampler;
+	if (!s)
+	{
+		s = (prsampler_t *) qcvm->alloc_callback(qcvm, NULL, sizeof(prsampler_t), "sampler");
+		if (!s)
+			return false;
+		memset(s, 0, sizeof(*s));
+		qcvm->sampler = s;
+		s->ringsize = PR_SAMPLE_RINGSIZE;
+		s->ring = (prsample_t *) qcvm->alloc_callback(qcvm, NULL, s->ringsize * sizeof(prsample_t), "sampler ring");
+		s->numfunctions = qcvm->progs->numfunctions;
+		s->numstatements = qcvm->progs->numstatements;
+		hitssize = (2 * s->numfunctions + s->numstatements) * sizeof(unsigned int);
+		s->selfhits = (unsigned int *) qcvm->alloc_callback(qcvm, NULL, hitssize, "sampler hits");
+		if (!s->ring || !s->selfhits)
+		{
+			PR_SamplerFree(qcvm);
+			return false;
+		}
+		s->totalhits = s->selfhits + s->numfunctions;
+		s->statementhits = s->totalhits + s->numfunctions;
+	}
 
-		case OP_CALL0:
-		case OP_CALL1:
-		case OP_CALL2:
-		case OP_CALL3:
-		case OP_CALL4:
-		case OP_CALL5:
-		case OP_CALL6:
-		case OP_CALL7:
-		case OP_CALL8:
-			qcvm->xfunction->profile += profile - startprofile;
-			startprofile = profile;
-			qcvm->xstatement = st - qcvm->statements;
-			qcvm->argc = st->op - OP_CALL0;
-			if (!OPA->function)
-				PR_RunError(qcvm, "NULL function");
-			newf = &qcvm->functions[OPA->function];
-			if (newf->first_statement < 0)
-			{ // Built-in function
-				int i = -newf->first_statement;
-				if (i >= qcvm->numbuiltins)
-					i = 0;	//just invoke the fixme builtin.
-				qcvm->builtins[i](qcvm);
-				break;
+	s->head = s->tail = 0;
+	s->dropped = s->torn = s->idle = 0;
+	s->samples = 0;
+	memset(s->selfhits, 0, (2 * s->numfunctions + s->numstatements) * sizeof(unsigned int));
+	s->hz = hz;
+
+	// nvmSample may read the stack from another thread, so it can't move while sampling
+	if (qcvm->stacksize < qcvm->maxstackdepth)
+		PR_GrowStack(qcvm, qcvm->maxstackdepth);
+
+	qcvm->sampleseq = 0;
+	qcvm->samplestatement = qcvm->xstatement;
+	qcvm->sampling = true;
+
+	if (hz > 0)
+	{
+#ifdef _WIN32
+		qcvm->sampling = false;
+		return false;
+#else
+		struct sigaction	sa;
+		struct itimerval	timer;
+
+		if (pr_sampledvm)
+		{
+			qcvm->sampling = false;
+			return false;
+		}
+		pr_sampledvm = qcvm;
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = PR_SigProf;
+		sa.sa_flags = SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGPROF, &sa, &pr_oldsigprof);
+
+		timer.it_interval.tv_sec = 0;
+		timer.it_interval.tv_usec = hz >= 1000000 ? 1 : 1000000 / hz;
+		timer.it_value = timer.it_interval;
+		setitimer(ITIMER_PROF, &timer, NULL);
+#endif
+	}
+	return true;
+}
+
+/*
+============
+nvmSamplingCollect
+
+Drains the ring into the per-function and per-statement hit counts, returns
+the number of samples taken. Hosts sampling for a long time should call this
+every frame or so, samples are dropped while the ring is full.
+============
+*/
+int nvmSamplingCollect(NVM* qcvm)
+{
+	prsampler_t	*s = qcvm->sampler;
+	prsample_t	*e;
+	unsigned int	tail, head;
+	int		i, j, n;
+
+	if (!s)
+		return 0;
+
+	head = s->head;
+	PR_BARRIER();
+	for (tail = s->tail, n = 0; tail != head; tail++, n++)
+	{
+		e = &s->ring[tail & (s->ringsize - 1)];
+		if ((unsigned int)e->statement < (unsigned int)s->numstatements)
+			s->statementhits[e->statement]++;
+		for (i = 0; i < e->numfuncs; i++)
+		{
+			if ((unsigned int)e->funcs[i] >= (unsigned int)s->numfunctions)
+				continue;
+			if (!i)
+				s->selfhits[e->funcs[i]]++;
+			for (j = 0; j < i && e->funcs[j] != e->funcs[i]; j++)
+				;
+			if (j == i)
+				s->totalhits[e->funcs[i]]++;
+		}
+	}
+	PR_BARRIER();
+	s->tail = tail;
+	s->samples += n;
+	return n;
+}
+
+void nvmSamplingEnd(NVM* qcvm)
+{
+	if (!qcvm->sampling)
+		return;
+
+#ifndef _WIN32
+	if (pr_sampledvm == qcvm)
+	{
+		struct itimerval	timer;
+
+		memset(&timer, 0, sizeof(timer));
+		setitimer(ITIMER_PROF, &timer, NULL);
+		sigaction(SIGPROF, &pr_oldsigprof, NULL);
+		pr_sampledvm = NULL;
+	}
+#endif
+	qcvm->sampling = false;
+	nvmSamplingCollect(qcvm);
+}
+
+static int PR_SampleFunctionForStatement (NVM* qcvm, int statement)
+{
+	int		i, best;
+
+	for (i = 1, best = 0; i < qcvm->progs->numfunctions; i++)
+	{
+		if (qcvm->functions[i].first_statement > 0 && qcvm->functions[i].first_statement <= statement
+			&& (!best || qcvm->functions[i].first_statement > qcvm->functions[best].first_statement))
+			best = i;
+	}
+	return best;
+}
+
+void nvmSamplingReport(NVM* qcvm, int maxlines)
+{
+	prsampler_t	*s = qcvm->sampler;
+	unsigned int	*done, best;
+	int		i, j, line, which;
+
+	if (!s || !qcvm->progs)
+	{
+		Printf(qcvm, "no samples\n");
+		return;
+	}
+	nvmSamplingCollect(qcvm);
+
+	Printf(qcvm, "samples: %u in QC (%u without a stack), %u idle, %u dropped\n", s->samples, s->torn, s->idle, s->dropped);
+	if (!s->samples)
+		return;
+
+	// selection rather than a sort, the hit arrays belong to the sampler and maxlines is small
+	done = (unsigned int *) qcvm->alloc_callback(qcvm, NULL, (s->numfunctions + s->numstatements) * sizeof(unsigned int), "sampler report");
+	memset(done, 0, (s->numfunctions + s->numstatements) * sizeof(unsigned int));
+
+	Printf(qcvm, "%8s %7s %8s %7s  %s\n", "self", "self%", "total", "total%", "function");
+	for (line = 0; line < maxlines; line++)
+	{
+		for (i = 0, which = -1, best = 0; i < s->numfunctions; i++)
+		{
+			if (!done[i] && s->selfhits[i] > best)
+			{
+				best = s->selfhits[i];
+				which = i;
 			}
-			// Normal function
-			st = &qcvm->statements[PR_EnterFunction(qcvm, newf)];
+		}
+		if (which < 0)
 			break;
+		done[which] = 1;
+		Printf(qcvm, "%8u %6.2f%% %8u %6.2f%%  %s\n", s->selfhits[which], 100.0 * s->selfhits[which] / s->samples,
+			s->totalhits[which], 100.0 * s->totalhits[which] / s->samples, PR_GetString(qcvm, qcvm->functions[which].s_name));
+	}
 
-		case OP_DONE:
-		case OP_RETURN:
-			qcvm->xfunction->profile += profile - startprofile;
-			startprofile = profile;
-			qcvm->xstatement = st - qcvm->statements;
-			qcvm->globals[OFS_RETURN] = qcvm->globals[(unsigned short)st->a];
-			qcvm->globals[OFS_RETURN + 1] = qcvm->globals[(unsigned short)st->a + 1];
-			qcvm->globals[OFS_RETURN + 2] = qcvm->globals[(unsigned short)st->a + 2];
-			st = &qcvm->statements[PR_LeaveFunction(qcvm)];
-			if (qcvm->depth == exitdepth)
-			{ // Done
-				return;
+	Printf(qcvm, "%8s %7s %10s  %s\n", "hits", "hits%", "statement", "function");
+	for (line = 0; line < maxlines; line++)
+	{
+		for (i = 0, which = -1, best = 0; i < s->numstatements; i++)
+		{
+			if (!done[s->numfunctions + i] && s->statementhits[i] > best)
+			{
+				best = s->statementhits[i];
+				which = i;
 			}
+		}
+		if (which < 0)
 			break;
+		done[s->numfunctions + which] = 1;
+		j = PR_SampleFunctionForStatement(qcvm, which);
+		Printf(qcvm, "%8u %6.2f%% %10i  %s+%i %s\n", best, 100.0 * best / s->samples, which,
+			PR_GetString(qcvm, qcvm->functions[j].s_name), which - qcvm->functions[j].first_statement,
+			qcvm->statements[which].op < OP_NUMOPS ? pr_opnames[qcvm->statements[which].op] : "?");
+	}
 
-		case OP_STATE:
-			ed = PROG_TO_EDICT(qcvm->global_struct->self);
-			ed->v.nextthink = qcvm->global_struct->time + 0.1;
-			ed->v.frame = OPA->_float;
-			ed->v.think = OPB->function;
-			break;
+	qcvm->alloc_callback(qcvm, done, 0, "sampler report");
+}
 
-		default:
-			qcvm->xstatement = st - qcvm->statements;
-			PR_RunError(qcvm, "Bad opcode %i", st->op);
+/*
+============
+PR_RunError
+
+Aborts the currently executing function
+============
+*/
+void PR_RunError (NVM* qcvm, const char *error, ...)
+{
+	va_list	argptr;
+	char	string[1024];
+	int		i;
+
+	if (qcvm->worker)
+		PR_ParallelAbort(qcvm);	// the serial pass runs it again and reports it
+
+	va_start (argptr, error);
+	vsnprintf (string, sizeof(string), error, argptr);
+	va_end (argptr);
+
+	PR_PrintStatement(qcvm, qcvm->statements + qcvm->xstatement);
+	PR_StackTrace(qcvm);
+
+	Printf(qcvm, "%s\n", string);
+
+	qcvm->sampleseq += qcvm->sampleseq & 1;
+	if (qcvm->errorjmp)
+		longjmp(*(jmp_buf *)qcvm->errorjmp, 1);	// nvmExecuteForEdicts unwinds just the one edict's QC
+
+	qcvm->depth = 0;	// dump the stack so host_error can shutdown functions
+	qcvm->suspended = false;
+	qcvm->suspendrequest = false;
+	qcvm->xthread = 0;
+	for (i = 0; i < qcvm->numthreads; i++)
+	{	// their frames went with the stack
+		if (qcvm->threads[i].state == NVM_THREAD_RUNNING)
+			qcvm->threads[i].state = NVM_THREAD_NONE;
 	}
-    }	/* end of while(1) loop */
+	if (qcvm->profile)
+		qcvm->profile->current = 0;
+
+	Errorf(qcvm, "Program error");
+}
+
+/*
+====================
+PR_GrowStack
+
+Makes room for depth frames, doubling the stack so deep recursion doesn't
+reallocate on every call
+====================
+*/
+static void PR_GrowStack (NVM* qcvm, int depth)
+{
+	prstack_t	*stack;
+	int		n;
+
+	if (qcvm->worker)
+		PR_ParallelAbort(qcvm);	// a worker's stacks are as big as the VM's were
+
+	if (depth > qcvm->maxstackdepth)
+		PR_RunError(qcvm, "stack overflow");
+	for (n = qcvm->stacksize ? qcvm->stacksize : 16; n < depth; n *= 2)
+		;
+	if (n > qcvm->maxstackdepth)
+		n = qcvm->maxstackdepth;
+	stack = (prstack_t *) qcvm->alloc_callback(qcvm, qcvm->stack, n * sizeof(prstack_t), "stack");
+	if (!stack)
+		PR_RunError(qcvm, "out of memory for the stack");
+	qcvm->stack = stack;
+	qcvm->stacksize = n;
+}
+
+static void PR_GrowLocalStack (NVM* qcvm, int size)
+{
+	int		*localstack;
+	int		n;
+
+	if (qcvm->worker)
+		PR_ParallelAbort(qcvm);
+
+	if (size > qcvm->maxlocalstack)
+		PR_RunError(qcvm, "PR_ExecuteProgram: locals stack overflow\n");
+	for (n = qcvm->localstacksize ? qcvm->localstacksize : 256; n < size; n *= 2)
+		;
+	if (n > qcvm->maxlocalstack)
+		n = qcvm->maxlocalstack;
+	localstack = (int *) qcvm->alloc_callback(qcvm, qcvm->localstack, n * sizeof(int), "locals stack");
+	if (!localstack)
+		PR_RunError(qcvm, "out of memory for the locals stack");
+	qcvm->localstack = localstack;
+	qcvm->localstacksize = n;
+}
+
+/*
+====================
+PR_EnterFunction
+
+Returns the new program statement counter
+====================
+*/
+static int PR_EnterFunction (NVM* qcvm, dfunction_t *f)
+{
+	int	i, j, c, o;
+	qboolean	sampling = qcvm->sampling;
+
+	if (sampling)
+	{
+		qcvm->sampleseq++;
+		PR_BARRIER();
+	}
+
+	// PR_StackTrace uses the frame above the top one
+	if (qcvm->depth + 1 >= qcvm->stacksize)
+		PR_GrowStack(qcvm, qcvm->depth + 2);
+	qcvm->stack[qcvm->depth].s = qcvm->xstatement;
+	qcvm->stack[qcvm->depth].f = qcvm->xfunction;
+	qcvm->depth++;
+	STAT(qcvm->stats.function_calls++);
+	STAT(if (qcvm->depth > qcvm->stats.max_depth) qcvm->stats.max_depth = qcvm->depth);
+
+	// save off any locals that the new function steps on
+	c = f->locals;
+	if (qcvm->localstack_used + c > qcvm->localstacksize)
+	{	// an error in here must not leave a frame without saved locals to unwind
+		qcvm->depth--;
+		PR_GrowLocalStack(qcvm, qcvm->localstack_used + c);
+		qcvm->depth++;
+	}
+
+	for (i = 0; i < c ; i++)
+		qcvm->localstack[qcvm->localstack_used + i] = ((int *)qcvm->globals)[f->parm_start + i];
+	qcvm->localstack_used += c;
+	STAT(if (qcvm->localstack_used > qcvm->stats.max_localstack_used) qcvm->stats.max_localstack_used = qcvm->localstack_used);
+
+	// copy parameters
+	o = f->parm_start;
+	for (i = 0; i < f->numparms; i++)
+	{
+		for (j = 0; j < f->parm_size[i]; j++)
+		{
+			((int *)qcvm->globals)[o] = ((int *)qcvm->globals)[OFS_PARM0 + i*3 + j];
+			o++;
+		}
+	}
+
+	qcvm->xfunction = f;
+	if (sampling)
+	{
+		PR_BARRIER();
+		qcvm->sampleseq++;
+	}
+	return f->first_statement - 1;	// offset the s++
+}
+
+/*
+====================
+PR_LeaveFunction
+====================
+*/
+static int PR_LeaveFunction (NVM* qcvm)
+{
+	int	i, c;
+	qboolean	sampling = qcvm->sampling;
+
+	if (qcvm->depth <= 0)
+		Errorf(qcvm, "prog stack underflow");
+
+	if (sampling)
+	{
+		qcvm->sampleseq++;
+		PR_BARRIER();
+	}
+
+	// Restore locals from the stack
+	c = qcvm->xfunction->locals;
+	qcvm->localstack_used -= c;
+	if (qcvm->localstack_used < 0)
+		PR_RunError(qcvm, "PR_ExecuteProgram: locals stack underflow");
+
+	for (i = 0; i < c; i++)
+		((int *)qcvm->globals)[qcvm->xfunction->parm_start + i] = qcvm->localstack[qcvm->localstack_used + i];
+
+	// up stack
+	qcvm->depth--;
+	qcvm->xfunction = qcvm->stack[qcvm->depth].f;
+	if (sampling)
+	{
+		PR_BARRIER();
+		qcvm->sampleseq++;
+	}
+	return qcvm->stack[qcvm->depth].s;
+}
+
+#define OPA ((eval_t *)&qcvm->globals[st->a])
+#define OPB ((eval_t *)&qcvm->globals[st->b])
+#define OPC ((eval_t *)&qcvm->globals[st->c])
+
+/*
+===============================================================================
+
+THREADS
+
+A builtin can suspend the QC that called it with nvmSuspend. Once the builtin
+returns, the frames of the innermost running loop are detached from the VM
+into a prthread_t, saving each frame's local slots and unwinding the local
+stack as if the functions had returned, and the host call that started the
+QC returns. Resuming re-enters the frames on top of whatever is on the stack
+at that point and restores the saved locals.
+
+===============================================================================
+*/
+
+static prthread_t *PR_GetThread (NVM* qcvm, int id)
+{
+	int		slot = (id & 0xffff) - 1;
+
+	if (slot < 0 || slot >= qcvm->numthreads || qcvm->threads[slot].id != id)
+		return NULL;
+	return &qcvm->threads[slot];
+}
+
+/* NULL when every slot an id can name is in use or the table can't grow */
+static prthread_t *PR_NewThread (NVM* qcvm)
+{
+	prthread_t	*t;
+	int		slot, n;
+
+	for (slot = 0; slot < qcvm->numthreads; slot++)
+	{
+		if (qcvm->threads[slot].state == NVM_THREAD_NONE)
+			break;
+	}
+	if (slot == qcvm->numthreads)
+	{
+		if (slot == 0xffff)
+		{
+			Errorf(qcvm, "PR_NewThread: too many threads");
+			return NULL;
+		}
+		n = qcvm->numthreads ? qcvm->numthreads * 2 : 16;
+		if (n > 0xffff)
+			n = 0xffff;
+		t = (prthread_t *) qcvm->alloc_callback(qcvm, qcvm->threads, n * sizeof(prthread_t), "threads");
+		if (!t)
+		{
+			Errorf(qcvm, "PR_NewThread: out of memory");
+			return NULL;
+		}
+		qcvm->threads = t;
+		memset(qcvm->threads + qcvm->numthreads, 0, (n - qcvm->numthreads) * sizeof(prthread_t));
+		qcvm->numthreads = n;
+	}
+
+	t = &qcvm->threads[slot];
+	qcvm->threadserial = (qcvm->threadserial + 1) & 0x7fff;
+	t->id = (qcvm->threadserial << 16) | (slot + 1);
+	t->state = NVM_THREAD_RUNNING;
+	t->wakepending = false;
+	t->killed = false;
+	t->next = -1;
+	return t;
+}
+
+static void PR_ReleaseThread (prthread_t *t)
+{
+	t->id = 0;
+	t->state = NVM_THREAD_NONE;
+}
+
+static void PR_FreeThreads (NVM* qcvm)
+{
+	int		i;
+
+	for (i = 0; i < qcvm->numthreads; i++)
+	{
+		if (qcvm->threads[i].frames)
+			qcvm->alloc_callback(qcvm, qcvm->threads[i].frames, 0, "thread frames");
+		if (qcvm->threads[i].locals)
+			qcvm->alloc_callback(qcvm, qcvm->threads[i].locals, 0, "thread locals");
+	}
+	if (qcvm->threads)
+		qcvm->alloc_callback(qcvm, qcvm->threads, 0, "threads");
+	qcvm->threads = NULL;
+	qcvm->numthreads = 0;
+	qcvm->readyhead = qcvm->readytail = -1;
+}
+
+static void PR_MakeReady (NVM* qcvm, prthread_t *t)
+{
+	int		slot = t - qcvm->threads;
+
+	t->state = NVM_THREAD_READY;
+	t->wakepending = false;
+	t->next = -1;
+	if (qcvm->readytail >= 0)
+		qcvm->threads[qcvm->readytail].next = slot;
+	else
+		qcvm->readyhead = slot;
+	qcvm->readytail = slot;
+}
+
+/*
+====================
+PR_DetachThread
+
+Moves the frames above exitdepth into the innermost loop's thread. When
+there is no memory to save them in, they are still on the stack and the
+run ends with an error as any other would.
+====================
+*/
+static void PR_DetachThread (NVM* qcvm, int exitdepth, nvmstatus_t status)
+{
+	prthread_t	*t = PR_GetThread(qcvm, qcvm->xthread);
+	dfunction_t	*f;
+	prstack_t	*frames;
+	int		i, k, n, *locals;
+
+	k = qcvm->depth - exitdepth;
+	for (i = 0, n = qcvm->xfunction->locals; i < k - 1; i++)
+		n += qcvm->stack[qcvm->depth - 1 - i].f->locals;
+
+	if (t->maxframes < k)
+	{
+		frames = (prstack_t *) qcvm->alloc_callback(qcvm, t->frames, k * sizeof(prstack_t), "thread frames");
+		if (!frames)
+			PR_RunError(qcvm, "out of memory for thread frames");
+		t->frames = frames;
+		t->maxframes = k;
+	}
+	if (t->maxlocals < n)
+	{
+		locals = (int *) qcvm->alloc_callback(qcvm, t->locals, n * sizeof(int), "thread locals");
+		if (!locals)
+			PR_RunError(qcvm, "out of memory for thread locals");
+		t->locals = locals;
+		t->maxlocals = n;
+	}
+	t->numframes = k;
+	t->numlocals = n;
+	t->statement = qcvm->xstatement;
+	memcpy(t->returnvalue, &qcvm->globals[OFS_RETURN], sizeof(t->returnvalue));
+
+	for (i = k - 1; i >= 0; i--)
+	{
+		f = qcvm->xfunction;
+		n -= f->locals;
+		memcpy(t->locals + n, &qcvm->globals[f->parm_start], f->locals * sizeof(int));
+		t->frames[i].f = f;
+		t->frames[i].s = qcvm->stack[qcvm->depth - 1].s;
+		if (qcvm->profiling)
+			PR_ProfileLeave(qcvm, 0);
+		qcvm->xstatement = PR_LeaveFunction(qcvm);
+	}
+
+	if (t->killed)
+		PR_ReleaseThread(t);
+	else if (status == NVM_YIELDED || t->wakepending)
+		PR_MakeReady(qcvm, t);
+	else
+		t->state = NVM_THREAD_WAITING;
+}
+
+static void PR_AttachThread (NVM* qcvm, prthread_t *t)
+{
+	dfunction_t	*f;
+	int		i, n;
+
+	for (i = 0, n = 0; i < t->numframes; i++)
+	{
+		f = t->frames[i].f;
+		if (i)
+			qcvm->xstatement = t->frames[i].s;
+		if (qcvm->profiling)
+			PR_ProfilePush(qcvm, f, 0);
+		PR_EnterFunction(qcvm, f);
+		memcpy(&qcvm->globals[f->parm_start], t->locals + n, f->locals * sizeof(int));
+		n += f->locals;
+	}
+	memcpy(&qcvm->globals[OFS_RETURN], t->returnvalue, sizeof(t->returnvalue));
+	t->state = NVM_THREAD_RUNNING;
+}
+
+/*
+===============================================================================
+
+VERIFIER
+
+nvmLoadProgs tries to prove every statement safe to run without checks: the
+opcode is known, the globals it reads and writes exist, and branches land
+inside the function they are in. Progs that pass run the unchecked
+interpreter. Anything else, or a VM the host asked for with nvmSetChecked,
+runs the checked one, which tests each statement as it gets to it and also
+bounds checks entities, fields and pointers, since those are only known at
+run time.
+
+===============================================================================
+*/
+
+static qboolean PR_OperandValid (NVM* qcvm, int kind, int operand, int statement, int first, int end)
+{
+	if (kind == PR_OPBRANCH)
+		return operand >= first - statement && operand < end - statement;
+	return !kind || (operand >= 0 && operand <= qcvm->progs->numglobals - kind);
+}
+
+/*
+====================
+PR_StatementError
+
+Returns what is wrong with the statement, or NULL. Branches have to land in
+[first, end), and OP_STATE needs the system globals it writes through.
+====================
+*/
+static const char *PR_StatementError (NVM* qcvm, dstatement_t *st, int first, int end)
+{
+	const propinfo_t	*info;
+	int		s = st - qcvm->statements;
+
+	if (st->op >= OP_NUMOPS)
+		return "bad opcode";
+	info = &pr_opinfo[st->op];
+	if (info->unsupported)
+		return "unsupported opcode";
+	if (st->op == OP_STATE && !qcvm->global_struct)
+		return "OP_STATE without system globals";
+	if (!PR_OperandValid(qcvm, info->a, st->a, s, first, end))
+		return info->a == PR_OPBRANCH ? "branch out of function" : "operand a out of range";
+	if (!PR_OperandValid(qcvm, info->b, st->b, s, first, end))
+		return info->b == PR_OPBRANCH ? "branch out of function" : "operand b out of range";
+	if (!PR_OperandValid(qcvm, info->c, st->c, s, first, end))
+		return "operand c out of range";
+	return NULL;
+}
+
+/*
+====================
+PR_FunctionError
+
+Returns why entering the function would step outside the globals or the
+statements, or NULL.
+====================
+*/
+static const char *PR_FunctionError (NVM* qcvm, dfunction_t *f)
+{
+	int	i, size;
+
+	if (f->first_statement < 0)
+		return NULL;	/* builtin */
+	if (f->first_statement >= qcvm->progs->numstatements)
+		return "first statement out of range";
+	if (f->numparms < 0 || f->numparms > MAX_PARMS)
+		return "bad parameter count";
+	for (i = size = 0; i < f->numparms; i++)
+	{
+		if (f->parm_size[i] < 0 || f->parm_size[i] > 3)
+			return "bad parameter size";
+		size += f->parm_size[i];
+	}
+	if (f->locals < 0 || f->parm_start < 0 ||
+		f->parm_start + (f->locals > size ? f->locals : size) > qcvm->progs->numglobals)
+		return "locals out of range";
+	return NULL;
+}
+
+static int PR_FunctionStartCompare (const void *a, const void *b)
+{
+	return (*(dfunction_t **)a)->first_statement - (*(dfunction_t **)b)->first_statement;
+}
+
+/*
+====================
+PR_VerifyProgs
+
+A function's statements run up to the next function's first statement, and
+the last of them has to be a return or a goto so nothing falls through.
+====================
+*/
+static qboolean PR_VerifyProgs (NVM* qcvm, const char *filename)
+{
+	dfunction_t	**sorted, *f;
+	const char	*error = NULL;
+	int		i, numsorted, s, end;
+
+	sorted = (dfunction_t **) qcvm->alloc_callback(qcvm, NULL, qcvm->progs->numfunctions * sizeof(*sorted), "verifier");
+	numsorted = 0;
+	f = NULL;
+	s = 0;
+	for (i = 1; i < qcvm->progs->numfunctions; i++)
+	{
+		f = &qcvm->functions[i];
+		if ((error = PR_FunctionError(qcvm, f)))
+			break;
+		if (f->first_statement > 0)
+			sorted[numsorted++] = f;
+	}
+	if (!error)
+		qsort(sorted, numsorted, sizeof(*sorted), PR_FunctionStartCompare);
+	for (i = 0; i < numsorted && !error; i++)
+	{
+		f = sorted[i];
+		if (i + 1 < numsorted && sorted[i + 1]->first_statement == f->first_statement)
+			continue;	/* aliases, the last one checks the body */
+		end = (i + 1 < numsorted) ? sorted[i + 1]->first_statement : qcvm->progs->numstatements;
+		for (s = f->first_statement; s < end; s++)
+		{
+			if ((error = PR_StatementError(qcvm, &qcvm->statements[s], f->first_statement, end)))
+				break;
+		}
+		if (error)
+			break;
+		s = end - 1;
+		if (qcvm->statements[s].op != OP_DONE && qcvm->statements[s].op != OP_RETURN && qcvm->statements[s].op != OP_GOTO)
+			error = "falls off the end";
+	}
+	qcvm->alloc_callback(qcvm, sorted, 0, "verifier");
+
+	if (error)
+	{
+		Printf (qcvm, "%s: %s in %s (statement %i), running with checks\n", filename, error, f ? PR_GetString(qcvm, f->s_name) : "?", s);
+		return false;
+	}
+	return true;
+}
+
+/*
+====================
+PR_CheckStatement
+
+The checked interpreter's per statement verifier. It does not know where the
+current function ends, so branches only have to stay inside the statements.
+====================
+*/
+static void PR_CheckStatement (NVM* qcvm, dstatement_t *st)
+{
+	const char	*error;
+	int		s = st - qcvm->statements;
+
+	if (s <= 0 || s >= qcvm->progs->numstatements)
+	{
+		qcvm->xstatement = 0;
+		PR_RunError(qcvm, "statement %i out of range", s);
+	}
+	qcvm->xstatement = s;
+	if ((error = PR_StatementError(qcvm, st, 0, qcvm->progs->numstatements)))
+		PR_RunError(qcvm, "%s", error);
+}
+
+/*
+====================
+PR_CheckEdict
+
+Entity references have to be to one of the allocated edicts, and the field
+has to fit inside its fields.
+====================
+*/
+static edict_t *PR_CheckEdict (NVM* qcvm, int edict, int field, int size)
+{
+	if (edict < 0 || edict % qcvm->edict_size || edict / qcvm->edict_size >= qcvm->max_edicts)
+		PR_RunError(qcvm, "bad entity reference %i", edict);
+	if (field < 0 || field + size > qcvm->progs->entityfields)
+		PR_RunError(qcvm, "bad field offset %i", field);
+	return PROG_TO_EDICT(edict);
+}
+
+/*
+====================
+PR_CheckPointer
+
+Pointers made by OP_ADDRESS point at an entity's fields.
+====================
+*/
+static eval_t *PR_CheckPointer (NVM* qcvm, int ofs, int size)
+{
+	int	field;
+
+	field = ofs % qcvm->edict_size - (int)offsetof(edict_t, v);
+	if (ofs < 0 || (ofs & 3) || ofs / qcvm->edict_size >= qcvm->max_edicts ||
+		field < 0 || field + size * 4 > qcvm->progs->entityfields * 4)
+		PR_RunError(qcvm, "bad pointer %i", ofs);
+	return (eval_t *)((byte *)qcvm->edicts + ofs);
+}
+
+/*
+====================
+PR_CheckArray
+
+OP_LOADA indexes the globals from its first operand.
+====================
+*/
+static void PR_CheckArray (NVM* qcvm, int base, int index, int size)
+{
+	if (index < 0 || index > qcvm->progs->numglobals - size - base)
+		PR_RunError(qcvm, "array index %i out of bounds", index);
+}
+
+void nvmSetChecked(NVM* qcvm, bool checked)
+{
+	qcvm->checked = checked;
+}
+
+/*
+====================
+PR_Random
+
+For OP_RAND*: [0, 1), from a per VM xorshift so runs can be reproduced by
+setting qcvm->randseed.
+====================
+*/
+static float PR_Random (NVM* qcvm)
+{
+	unsigned int	x = qcvm->randseed;
+
+	if (qcvm->worker)
+		PR_ParallelAbort(qcvm);	// the sequence depends on the order thinks run in
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	qcvm->randseed = x;
+	return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+/*
+===============================================================================
+
+INLINER
+
+With nvmSetInlining, nvmLoadProgs splices small leaf functions into their
+direct call sites once the progs have verified. A leaf makes no calls and
+only branches forward, so an inlined copy always runs to its end before any
+other QC can, and every copy of one function can share a block of fresh
+globals in place of its locals. The callee's own parm_start range, which
+fteqcc may overlap with other functions' locals, is never touched, so there
+is nothing to save or restore. Parameters are copied in from OFS_PARM*, and
+returns become a store to OFS_RETURN and a jump past the copy.
+
+A call site qualifies when its function global is never an output operand
+and is not a saved variable. The host must not rebind function globals
+that QC calls directly.
+
+===============================================================================
+*/
+
+typedef struct
+{
+	int		end;		/* first statement after the body */
+	int		span;		/* slots of parms and locals */
+	int		size;		/* statements in an inlined copy, 0 when it can not be inlined */
+	int		scratch;	/* its fresh globals, 0 until a call site is inlined */
+} prinlinefunc_t;
+
+void nvmSetInlining(NVM* qcvm, int max_statements)
+{
+	qcvm->inlinelimit = max_statements;
+}
+
+/*
+====================
+PR_InlineSize
+
+How many statements an inlined copy of f takes, or 0 if it is not a leaf,
+is too big, or uses its locals in a way the remapping can not follow.
+====================
+*/
+static int PR_InlineSize (NVM* qcvm, dfunction_t *f, prinlinefunc_t *fi)
+{
+	const propinfo_t	*info;
+	dstatement_t	*st;
+	unsigned int	operands[3];
+	int		kinds[3];
+	int		s, i, size, first = f->first_statement, last = f->parm_start + fi->span;
+
+	if (first <= 0 || fi->end - first > qcvm->inlinelimit || f->parm_start < RESERVED_OFS)
+		return 0;
+
+	for (i = size = 0; i < f->numparms; i++)
+		size += f->parm_size[i] == 3 ? 1 : f->parm_size[i];
+
+	for (s = first; s < fi->end; s++)
+	{
+		st = &qcvm->statements[s];
+		if ((st->op >= OP_CALL0 && st->op <= OP_CALL8) || (st->op >= OP_CALL1H && st->op <= OP_CALL8H) ||
+			(st->op >= OP_LOADA_F && st->op <= OP_LOADA_I))
+			return 0;
+		if (st->op == OP_RETURN || st->op == OP_DONE)
+		{
+			size += s < fi->end - 1 ? 2 : 1;
+			continue;
+		}
+
+		info = &pr_opinfo[st->op];
+		operands[0] = st->a, operands[1] = st->b, operands[2] = st->c;
+		kinds[0] = info->a, kinds[1] = info->b, kinds[2] = info->c;
+		for (i = 0; i < 3; i++)
+		{
+			if (kinds[i] == PR_OPBRANCH && (int)operands[i] <= 0)
+				return 0;	/* loops could run out of budget halfway */
+			if (kinds[i] > 0 && (int)operands[i] < last && (int)operands[i] + kinds[i] > f->parm_start &&
+				((int)operands[i] < f->parm_start || (int)operands[i] + kinds[i] > last))
+				return 0;	/* straddles the locals */
+		}
+		size++;
+	}
+	return size;
+}
+
+/*
+====================
+PR_InlineCopy
+
+Writes an inlined copy of f to out[n], returns where it ends.
+====================
+*/
+static int PR_InlineCopy (NVM* qcvm, dstatement_t *out, int n, dfunction_t *f, prinlinefunc_t *fi)
+{
+	const propinfo_t	*info;
+	dstatement_t	*st;
+	unsigned int	*operands[3];
+	int		kinds[3];
+	int		s, t, i, j, o, body, pos, end = n + fi->size;
+
+#define	REMAP(x)	((int)(x) >= f->parm_start && (int)(x) < f->parm_start + fi->span ? (x) - f->parm_start + fi->scratch : (x))
+
+	for (i = o = 0; i < f->numparms; i++)
+	{
+		if (f->parm_size[i] == 3)
+		{
+			out[n].op = OP_STORE_V;
+			out[n].a = OFS_PARM0 + i * 3;
+			out[n].b = fi->scratch + o;
+			out[n++].c = 0;
+		}
+		else for (j = 0; j < f->parm_size[i]; j++)
+		{
+			out[n].op = OP_STORE_F;
+			out[n].a = OFS_PARM0 + i * 3 + j;
+			out[n].b = fi->scratch + o + j;
+			out[n++].c = 0;
+		}
+		o += f->parm_size[i];
+	}
+
+	body = n;
+	for (s = f->first_statement; s < fi->end; s++)
+	{
+		st = &qcvm->statements[s];
+		if (st->op == OP_RETURN || st->op == OP_DONE)
+		{
+			out[n].op = OP_STORE_V;
+			out[n].a = REMAP(st->a);
+			out[n].b = OFS_RETURN;
+			out[n++].c = 0;
+			if (s < fi->end - 1)
+			{
+				out[n].op = OP_GOTO;
+				out[n].a = end - n;
+				out[n].b = out[n].c = 0;
+				n++;
+			}
+			continue;
+		}
+
+		out[n] = *st;
+		info = &pr_opinfo[st->op];
+		operands[0] = &out[n].a, operands[1] = &out[n].b, operands[2] = &out[n].c;
+		kinds[0] = info->a, kinds[1] = info->b, kinds[2] = info->c;
+		for (i = 0; i < 3; i++)
+		{
+			if (kinds[i] > 0)
+				*operands[i] = REMAP(*operands[i]);
+			else if (kinds[i] == PR_OPBRANCH)
+			{
+				// returns before the target take an extra statement for their jump
+				t = s + (int)*operands[i];
+				for (pos = body + t - f->first_statement, j = f->first_statement; j < t; j++)
+				{
+					if (qcvm->statements[j].op == OP_RETURN || qcvm->statements[j].op == OP_DONE)
+						pos++;
+				}
+				*operands[i] = pos - n;
+			}
+		}
+		n++;
+	}
+#undef REMAP
+	return n;
+}
+
+/*
+====================
+PR_InlineFunctions
+
+Rebuilds the statements with every qualifying call site replaced by a copy of
+its callee, and the globals with the callees' fresh slots appended. Returns
+false when nothing was inlined.
+====================
+*/
+static qboolean PR_InlineFunctions (NVM* qcvm)
+{
+	dfunction_t	**sorted, *f;
+	prinlinefunc_t	*funcs;
+	dstatement_t	*statements, *st;
+	prinlined_t	*ranges;
+	float		*globals;
+	int		*map, *site;
+	byte		*unsafe, *temp;
+	const propinfo_t	*info;
+	int		numstatements = qcvm->progs->numstatements, numglobals = qcvm->progs->numglobals;
+	int		numfunctions = qcvm->progs->numfunctions;
+	int		i, j, s, n, t, numsorted, numsites, extra, fnum;
+
+	temp = (byte *) qcvm->alloc_callback(qcvm, NULL, numfunctions * (sizeof(*sorted) + sizeof(*funcs)) +
+		(2 * numstatements + 1) * sizeof(int) + numglobals, "inliner");
+	if (!temp)
+		return false;
+	sorted = (dfunction_t **)temp;
+	funcs = (prinlinefunc_t *)(sorted + numfunctions);
+	map = (int *)(funcs + numfunctions);
+	site = map + numstatements + 1;
+	unsafe = (byte *)(site + numstatements);
+	memset(funcs, 0, numfunctions * sizeof(*funcs));
+	memset(site, 0, numstatements * sizeof(*site));
+	memset(unsafe, 0, numglobals);
+
+	// where each function's body ends
+	for (i = 1, numsorted = 0; i < numfunctions; i++)
+	{
+		if (qcvm->functions[i].first_statement > 0)
+			sorted[numsorted++] = &qcvm->functions[i];
+	}
+	qsort(sorted, numsorted, sizeof(*sorted), PR_FunctionStartCompare);
+	for (i = 0; i < numsorted; i++)
+	{
+		for (j = i + 1; j < numsorted && sorted[j]->first_statement == sorted[i]->first_statement; j++)
+			;
+		f = sorted[i];
+		fnum = f - qcvm->functions;
+		funcs[fnum].end = j < numsorted ? sorted[j]->first_statement : numstatements;
+		for (j = n = 0; j < f->numparms; j++)
+			n += f->parm_size[j];
+		funcs[fnum].span = f->locals > n ? f->locals : n;
+		funcs[fnum].size = PR_InlineSize(qcvm, f, &funcs[fnum]);
+	}
+
+	// function globals that might not hold the same function at run time
+	for (s = 0; s < numstatements; s++)
+	{
+		st = &qcvm->statements[s];
+		info = &pr_opinfo[st->op];
+		for (i = 0; i < info->b; i++)
+			unsafe[st->b + i] = true;
+		for (i = 0; i < info->c; i++)
+			unsafe[st->c + i] = true;
+	}
+	for (i = 0; i < qcvm->progs->numglobaldefs; i++)
+	{
+		if ((qcvm->globaldefs[i].type & DEF_SAVEGLOBAL) && qcvm->globaldefs[i].ofs < (unsigned int)numglobals)
+			unsafe[qcvm->globaldefs[i].ofs] = true;
+	}
+
+	for (s = n = numsites = extra = 0; s < numstatements; s++)
+	{
+		st = &qcvm->statements[s];
+		n++;
+		if (st->op < OP_CALL0 || st->op > OP_CALL8 || unsafe[st->a])
+			continue;
+		fnum = ((int *)qcvm->globals)[st->a];
+		if (fnum <= 0 || fnum >= numfunctions || !funcs[fnum].size)
+			continue;
+		if (!funcs[fnum].scratch)
+		{
+			funcs[fnum].scratch = numglobals + extra;
+			extra += funcs[fnum].span + 2;	/* returns always read 3 slots */
+		}
+		site[s] = fnum;
+		n += funcs[fnum].size - 1;
+		numsites++;
+	}
+	if (!numsites)
+	{
+		qcvm->alloc_callback(qcvm, temp, 0, "inliner");
+		return false;
+	}
+
+	qcvm->inlined = qcvm->alloc_callback(qcvm, NULL, n * sizeof(dstatement_t) + (numglobals + extra) * sizeof(float) + numsites * sizeof(prinlined_t), "inlined progs");
+	if (!qcvm->inlined)
+		Errorf (qcvm, "PR_InlineFunctions: out of memory");
+	statements = (dstatement_t *)qcvm->inlined;
+	globals = (float *)(statements + n);
+	ranges = (prinlined_t *)(globals + numglobals + extra);
+
+	// callees' fresh slots start out like their own ones
+	memcpy(globals, qcvm->globals, numglobals * sizeof(float));
+	memset(globals + numglobals, 0, extra * sizeof(float));
+	for (i = 1; i < numfunctions; i++)
+	{
+		if (funcs[i].scratch)
+			memcpy(globals + funcs[i].scratch, qcvm->globals + qcvm->functions[i].parm_start, funcs[i].span * sizeof(float));
+	}
+
+	for (s = n = numsites = 0; s < numstatements; s++)
+	{
+		map[s] = n;
+		if (!site[s])
+		{
+			statements[n++] = qcvm->statements[s];
+			continue;
+		}
+		ranges[numsites].first = n;
+		n = PR_InlineCopy(qcvm, statements, n, &qcvm->functions[site[s]], &funcs[site[s]]);
+		ranges[numsites].end = n;
+		ranges[numsites++].function = site[s];
+	}
+	map[numstatements] = n;
+
+	// relink the branches that were copied as they were
+	for (s = 0; s < numstatements; s++)
+	{
+		if (site[s])
+			continue;
+		st = &statements[map[s]];
+		info = &pr_opinfo[st->op];
+		if (info->a == PR_OPBRANCH)
+			t = s + (int)st->a, st->a = map[t] - map[s];
+		if (info->b == PR_OPBRANCH)
+			t = s + (int)st->b, st->b = map[t] - map[s];
+		if (info->c == PR_OPBRANCH)
+			t = s + (int)st->c, st->c = map[t] - map[s];
+	}
+	for (i = 1; i < numfunctions; i++)
+	{
+		if (qcvm->functions[i].first_statement > 0)
+			qcvm->functions[i].first_statement = map[qcvm->functions[i].first_statement];
+	}
+
+	DPrintf (qcvm, "inlined %i call sites, %i statements, %i globals\n", numsites, n - numstatements, extra);
+	qcvm->statements = statements;
+	qcvm->globals = globals;
+	qcvm->progs->numstatements = n;
+	qcvm->progs->numglobals = numglobals + extra;
+	qcvm->inlinedranges = ranges;
+	qcvm->numinlinedranges = numsites;
+
+	qcvm->alloc_callback(qcvm, temp, 0, "inliner");
+	return true;
+}
+
+/*
+===============================================================================
+
+STRIPPING
+
+With nvmSetStripping, nvmLoadProgs drops the bodies of functions that can't
+be reached once the progs have verified, and packs the ones left into a
+dense block of statements. The roots are the host's entry points, matched by
+name with a trailing * matching any suffix, function variables and saved
+function globals. A body reaches every function whose number is the initial
+value of a global it uses that is a function def or has no def at all. Bodies
+move whole and branches are relative, so nothing in them changes.
+
+A stripped function keeps its number and its def with NVM_STRIP_FUNCTIONS
+alone, and calling it is a run time error. Edicts don't exist at load, so the
+spawn functions the host looks up by classname have to be entry points, and
+so do thinks a savegame may name. Strings are always kept: string_t values
+in globals, fields and the host's own state are offsets into them.
+
+===============================================================================
+*/
+
+void nvmSetStripping(NVM* qcvm, const char* const* entry_points, int count, int flags)
+{
+	size_t	size;
+	int		i;
+
+	if (qcvm->striproots)
+		qcvm->alloc_callback(qcvm, qcvm->striproots, 0, "strip roots");
+	qcvm->striproots = NULL;
+	qcvm->striprootssize = 0;
+	qcvm->stripflags = 0;
+	if (count <= 0 || !(flags & NVM_STRIP_FUNCTIONS))
+		return;
+
+	for (i = 0, size = 1; i < count; i++)
+		size += strlen(entry_points[i]) + 1;
+	qcvm->striproots = (char *) qcvm->alloc_callback(qcvm, NULL, size, "strip roots");
+	if (!qcvm->striproots)
+		return;
+	for (i = 0, size = 0; i < count; i++)
+	{
+		strcpy(qcvm->striproots + size, entry_points[i]);
+		size += strlen(entry_points[i]) + 1;
+	}
+	qcvm->striproots[size++] = 0;
+	qcvm->striprootssize = size;
+	qcvm->stripflags = flags;
+}
+
+/*
+====================
+PR_StripRoot
+
+If a function of this name is one of the host's entry points
+====================
+*/
+static qboolean PR_StripRoot (NVM* qcvm, const char *name)
+{
+	const char	*root;
+	size_t		len;
+
+	for (root = qcvm->striproots; *root; root += len + 1)
+	{
+		len = strlen(root);
+		if (root[len - 1] == '*' ? !strncmp(name, root, len - 1) : !strcmp(name, root))
+			return true;
+	}
+	return false;
+}
+
+static void PR_StripReach (NVM* qcvm, byte *reached, int *work, int *numwork, int fnum)
+{
+	if (fnum > 0 && fnum < qcvm->progs->numfunctions && !reached[fnum])
+	{
+		reached[fnum] = true;
+		work[(*numwork)++] = fnum;
+	}
+}
+
+/*
+====================
+PR_StripDefs
+
+Drops the global defs of the stripped functions and of the locals only they
+use. Saved globals always stay.
+====================
+*/
+static int PR_StripDefs (NVM* qcvm)
+{
+	dfunction_t	*f;
+	ddef_t		*def;
+	byte		*locals;
+	int		numglobals = qcvm->progs->numglobals;
+	int		i, j, n, span, fnum;
+
+	locals = (byte *) qcvm->alloc_callback(qcvm, NULL, numglobals, "stripper");
+	if (!locals)
+		return 0;
+	memset(locals, 0, numglobals);
+
+	// 1 for a stripped function's locals, 2 once a live one uses them too
+	for (i = 1; i < qcvm->progs->numfunctions; i++)
+	{
+		f = &qcvm->functions[i];
+		if (f->first_statement <= 0 && !PR_Stripped(f))
+			continue;
+		for (j = span = 0; j < f->numparms; j++)
+			span += f->parm_size[j];
+		if (f->locals > span)
+			span = f->locals;
+		for (j = f->parm_start; j < f->parm_start + span; j++)
+		{
+			if (f->first_statement)
+				locals[j] = 2;
+			else if (!locals[j])
+				locals[j] = 1;
+		}
+	}
+
+	for (i = n = 0; i < qcvm->progs->numglobaldefs; i++)
+	{
+		def = &qcvm->globaldefs[i];
+		if (!(def->type & DEF_SAVEGLOBAL) && def->ofs < (unsigned int)numglobals)
+		{
+			if (locals[def->ofs] == 1)
+				continue;
+			fnum = ((int *)qcvm->globals)[def->ofs];
+			if (def->type == ev_function && fnum > 0 && fnum < qcvm->progs->numfunctions &&
+				PR_Stripped(&qcvm->functions[fnum]) && def->s_name == qcvm->functions[fnum].s_name)
+				continue;
+		}
+		qcvm->globaldefs[n++] = *def;
+	}
+	qcvm->alloc_callback(qcvm, locals, 0, "stripper");
+
+	i = qcvm->progs->numglobaldefs - n;
+	qcvm->progs->numglobaldefs = n;
+	return i;
+}
+
+/*
+====================
+PR_StripFunctions
+
+Only for verified progs, whose bodies are known to end where the next
+function starts and to branch only within themselves.
+====================
+*/
+static void PR_StripFunctions (NVM* qcvm)
+{
+	dfunction_t	**sorted, *f;
+	dstatement_t	*st;
+	const propinfo_t	*info;
+	byte		*temp, *reached, *kind;
+	int		*work, *end;
+	int		numfunctions = qcvm->progs->numfunctions, numglobals = qcvm->progs->numglobals;
+	int		i, j, k, s, n, g, fnum, numsorted, numwork, live, operands[3], counts[3];
+
+	temp = (byte *) qcvm->alloc_callback(qcvm, NULL, numfunctions * (sizeof(*sorted) + 2 * sizeof(int) + 1) + numglobals, "stripper");
+	if (!temp)
+		return;
+	sorted = (dfunction_t **)temp;
+	work = (int *)(sorted + numfunctions);
+	end = work + numfunctions;
+	reached = (byte *)(end + numfunctions);
+	kind = reached + numfunctions;
+	memset(reached, 0, numfunctions);
+	memset(kind, 0, numglobals);
+
+	// where each body ends
+	for (i = 1, numsorted = 0; i < numfunctions; i++)
+	{
+		if (qcvm->functions[i].first_statement > 0)
+			sorted[numsorted++] = &qcvm->functions[i];
+	}
+	qsort(sorted, numsorted, sizeof(*sorted), PR_FunctionStartCompare);
+	for (i = 0; i < numsorted; i = j)
+	{
+		for (j = i + 1; j < numsorted && sorted[j]->first_statement == sorted[i]->first_statement; j++)
+			;
+		for (k = i; k < j; k++)
+			end[sorted[k] - qcvm->functions] = j < numsorted ? sorted[j]->first_statement : qcvm->progs->numstatements;
+	}
+
+	// globals that may hold a function: 1 for function defs, 2 for other defs
+	for (i = 0; i < qcvm->progs->numglobaldefs; i++)
+	{
+		g = qcvm->globaldefs[i].ofs;
+		k = qcvm->globaldefs[i].type & ~DEF_SAVEGLOBAL;
+		for (j = 0; j < (k == ev_vector ? 3 : 1) && g + j < numglobals; j++)
+		{
+			if (kind[g + j] != 1)
+				kind[g + j] = k == ev_function ? 1 : 2;
+		}
+	}
+
+	// the roots
+	numwork = 0;
+	for (i = 1; i < numfunctions; i++)
+	{
+		if (PR_StripRoot(qcvm, PR_GetString(qcvm, qcvm->functions[i].s_name)))
+			PR_StripReach(qcvm, reached, work, &numwork, i);
+	}
+	if (!numwork)
+	{
+		Printf (qcvm, "no entry points for stripping, keeping every function\n");
+		qcvm->alloc_callback(qcvm, temp, 0, "stripper");
+		return;
+	}
+	for (i = 0; i < qcvm->progs->numglobaldefs; i++)
+	{
+		g = qcvm->globaldefs[i].ofs;
+		if ((qcvm->globaldefs[i].type & ~DEF_SAVEGLOBAL) != ev_function || g >= numglobals)
+			continue;
+		fnum = ((int *)qcvm->globals)[g];
+		if (fnum <= 0 || fnum >= numfunctions)
+			continue;
+		if ((qcvm->globaldefs[i].type & DEF_SAVEGLOBAL) || qcvm->globaldefs[i].s_name != qcvm->functions[fnum].s_name)
+			PR_StripReach(qcvm, reached, work, &numwork, fnum);
+	}
+
+	while (numwork)
+	{
+		f = &qcvm->functions[work[--numwork]];
+		if (f->first_statement <= 0)
+			continue;
+		for (s = f->first_statement; s < end[f - qcvm->functions]; s++)
+		{
+			st = &qcvm->statements[s];
+			info = &pr_opinfo[st->op];
+			operands[0] = st->a, counts[0] = info->a;
+			operands[1] = st->b, counts[1] = info->b;
+			operands[2] = st->c, counts[2] = info->c;
+			for (k = 0; k < 3; k++)
+			{
+				for (j = 0; j < counts[k]; j++)
+				{
+					g = operands[k] + j;
+					if (kind[g] != 2)
+						PR_StripReach(qcvm, reached, work, &numwork, ((int *)qcvm->globals)[g]);
+				}
+			}
+		}
+	}
+
+	qcvm->strippedfuncs = (byte *) qcvm->alloc_callback(qcvm, NULL, (numfunctions + 7) >> 3, "stripped functions");
+	if (!qcvm->strippedfuncs)
+	{
+		qcvm->alloc_callback(qcvm, temp, 0, "stripper");
+		return;
+	}
+	memset(qcvm->strippedfuncs, 0, (numfunctions + 7) >> 3);
+
+	// pack the live bodies, aliases of one live body all stay
+	n = numsorted ? sorted[0]->first_statement : qcvm->progs->numstatements;
+	for (i = 0; i < numsorted; i = j)
+	{
+		for (j = i, live = false; j < numsorted && sorted[j]->first_statement == sorted[i]->first_statement; j++)
+			live |= reached[sorted[j] - qcvm->functions];
+		s = sorted[i]->first_statement;
+		k = end[sorted[i] - qcvm->functions] - s;
+		if (live)
+			memmove(&qcvm->statements[n], &qcvm->statements[s], k * sizeof(dstatement_t));
+		for (g = i; g < j; g++)
+		{
+			if (live)
+				sorted[g]->first_statement = n;
+			else
+			{
+				sorted[g]->first_statement = 0;
+				fnum = sorted[g] - qcvm->functions;
+				qcvm->strippedfuncs[fnum >> 3] |= 1 << (fnum & 7);
+				qcvm->stripped.functions++;
+			}
+		}
+		if (live)
+			n += k;
+	}
+	qcvm->stripped.statements = qcvm->progs->numstatements - n;
+	qcvm->progs->numstatements = n;
+
+	if (qcvm->stripflags & NVM_STRIP_DEFS)
+		qcvm->stripped.defs = PR_StripDefs(qcvm);
+
+	qcvm->alloc_callback(qcvm, temp, 0, "stripper");
+	DPrintf (qcvm, "stripped %i functions, %i statements, %i defs\n",
+		qcvm->stripped.functions, qcvm->stripped.statements, qcvm->stripped.defs);
+}
+
+/*
+===============================================================================
+
+LAYOUT
+
+nvmLayoutProfileBegin counts how often every statement runs, and
+nvmLayoutProfileSave writes the counts to a file. A later nvmLoadProgs with
+nvmSetLayoutProfile pointing at it reorders the verified statements: the
+bodies that ran most come first and the ones that never ran last, and within
+a body that ran the blocks that never ran move after the ones that did. A
+block that fell through into one that is no longer next gets a goto. Every
+branch is relinked and every function's first statement moved.
+
+The counts are for the image the load passes made before the layout pass, so
+they only apply to the same progs loaded with the same inlining and stripping
+settings, and can't be collected on a VM that was laid out. Bodies with
+inlined copies in them keep their block order, so an inlined range stays in
+one piece. Counting runs everything with the checked interpreter.
+
+===============================================================================
+*/
+
+#define	PR_LAYOUT_MAGIC		(('N') | ('V' << 8) | ('M' << 16) | ('L' << 24))
+#define	PR_LAYOUT_VERSION	1
+
+/* a layout profile file, the counts follow */
+typedef struct
+{
+	int		magic;
+	int		version;
+	unsigned int	progssize;
+	unsigned int	progshash;
+	int		inlinelimit;
+	int		stripflags;
+	unsigned int	striphash;
+	int		numstatements;
+} prlayoutheader_t;
+
+typedef struct
+{
+	int		start, end;
+	unsigned long long	heat;	/* statements run in the body */
+	qboolean	inlined;		/* has inlined copies, keeps its block order */
+} prlayoutbody_t;
+
+void nvmSetLayoutProfile(NVM* qcvm, const char* path)
+{
+	if (qcvm->layoutpath)
+		qcvm->alloc_callback(qcvm, qcvm->layoutpath, 0, "layout profile path");
+	qcvm->layoutpath = NULL;
+	if (!path)
+		return;
+	qcvm->layoutpath = (char *) qcvm->alloc_callback(qcvm, NULL, strlen(path) + 1, "layout profile path");
+	if (qcvm->layoutpath)
+		strcpy(qcvm->layoutpath, path);
+}
+
+bool nvmLayoutProfileBegin(NVM* qcvm)
+{
+	if (!qcvm->progs)
+		return false;
+	if (qcvm->laidout)
+	{
+		Printf (qcvm, "nvmLayoutProfileBegin: the progs were laid out by a profile, load them without one\n");
+		return false;
+	}
+	if (!qcvm->statementcounts)
+		qcvm->statementcounts = (unsigned int *) qcvm->alloc_callback(qcvm, NULL, qcvm->progs->numstatements * sizeof(unsigned int), "statement counts");
+	if (!qcvm->statementcounts)
+		return false;
+	memset(qcvm->statementcounts, 0, qcvm->progs->numstatements * sizeof(unsigned int));
+	return true;
+}
+
+void nvmLayoutProfileEnd(NVM* qcvm)
+{
+	if (qcvm->statementcounts)
+		qcvm->alloc_callback(qcvm, qcvm->statementcounts, 0, "statement counts");
+	qcvm->statementcounts = NULL;
+}
+
+bool nvmLayoutProfileSave(NVM* qcvm, const char* path)
+{
+	prlayoutheader_t	h;
+	FILE		*f;
+	qboolean	ok;
+
+	if (!qcvm->statementcounts)
+		return false;
+	memset(&h, 0, sizeof(h));
+	h.magic = PR_LAYOUT_MAGIC;
+	h.version = PR_LAYOUT_VERSION;
+	h.progssize = qcvm->progssize;
+	h.progshash = qcvm->progshash;
+	h.inlinelimit = qcvm->inlinelimit > 0 ? qcvm->inlinelimit : 0;
+	h.stripflags = qcvm->stripflags;
+	h.striphash = qcvm->striproots ? PR_BlockChecksum((const byte *)qcvm->striproots, qcvm->striprootssize) : 0;
+	h.numstatements = qcvm->progs->numstatements;
+
+	f = fopen(path, "wb");
+	if (!f)
+	{
+		Printf (qcvm, "couldn't write %s\n", path);
+		return false;
+	}
+	ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+		fwrite(qcvm->statementcounts, sizeof(unsigned int), h.numstatements, f) == (size_t)h.numstatements;
+	if (fclose(f) != 0)
+		ok = false;
+	if (!ok)
+		Printf (qcvm, "couldn't write %s\n", path);
+	return ok;
+}
+
+/*
+====================
+PR_LayoutRead
+
+The nvmSetLayoutProfile file, whose checksum goes in the progs cache key
+====================
+*/
+static void *PR_LayoutRead (NVM* qcvm, size_t *size)
+{
+	void	*data;
+	FILE	*f;
+	long	n;
+
+	qcvm->layouthash = 0;
+	if (!qcvm->layoutpath || !(f = fopen(qcvm->layoutpath, "rb")))
+		return NULL;
+	fseek(f, 0, SEEK_END);
+	n = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	data = n > 0 ? qcvm->alloc_callback(qcvm, NULL, n, "layout profile") : NULL;
+	if (data && fread(data, 1, n, f) != (size_t)n)
+	{
+		qcvm->alloc_callback(qcvm, data, 0, "layout profile");
+		data = NULL;
+	}
+	fclose(f);
+	if (!data)
+		return NULL;
+	*size = n;
+	qcvm->layouthash = PR_BlockChecksum((const byte *)data, n);
+	return data;
+}
+
+static int PR_LayoutBodyCompare (const void *a, const void *b)
+{
+	const prlayoutbody_t	*x = (const prlayoutbody_t *)a, *y = (const prlayoutbody_t *)b;
+
+	if (x->heat != y->heat)
+		return x->heat > y->heat ? -1 : 1;
+	return x->start - y->start;
+}
+
+static int PR_InlinedRangeCompare (const void *a, const void *b)
+{
+	return ((const prinlined_t *)a)->first - ((const prinlined_t *)b)->first;
+}
+
+/*
+====================
+PR_LayoutBody
+
+Copies one body's blocks to out at n, the ones that ran first, and returns
+where the next body goes. A goto added after a block that fell through is
+left in fixups to be pointed at the old statement that followed it.
+====================
+*/
+static int PR_LayoutBody (NVM* qcvm, const unsigned int *counts, const prlayoutbody_t *body, dstatement_t *out, int n,
+	int *map, int *blocks, byte *leader, int *fixups, int *numfixups, int *moved)
+{
+	const propinfo_t	*info;
+	dstatement_t	*st;
+	int		s, b, op, numblocks, end, pass;
+
+	memset(leader + body->start, 0, body->end - body->start);
+	for (s = body->start; s < body->end; s++)
+	{
+		st = &qcvm->statements[s];
+		info = &pr_opinfo[st->op];
+		if (info->a == PR_OPBRANCH)
+			leader[s + (int)st->a] = true;
+		if (info->b == PR_OPBRANCH)
+			leader[s + (int)st->b] = true;
+		if (info->c == PR_OPBRANCH)
+			leader[s + (int)st->c] = true;
+		if (info->a == PR_OPBRANCH || info->b == PR_OPBRANCH || info->c == PR_OPBRANCH ||
+			st->op == OP_DONE || st->op == OP_RETURN)
+			leader[s + 1] = true;	/* may be the next body's start, which is reset before use */
+	}
+
+	// the entry, then the blocks that ran, then the rest
+	numblocks = 0;
+	blocks[numblocks++] = body->start;
+	for (pass = 0; pass < 2; pass++)
+	{
+		for (s = body->start + 1; s < body->end; s++)
+		{
+			if (leader[s] && (counts[s] > 0) == !pass)
+			{
+				blocks[numblocks++] = s;
+				*moved += pass;
+			}
+		}
+	}
+
+	for (b = 0; b < numblocks; b++)
+	{
+		for (end = blocks[b] + 1; end < body->end && !leader[end]; end++)
+			;
+		for (s = blocks[b]; s < end; s++)
+		{
+			map[s] = n;
+			out[n++] = qcvm->statements[s];
+		}
+		op = qcvm->statements[end - 1].op;
+		if (op != OP_GOTO && op != OP_DONE && op != OP_RETURN && (b + 1 == numblocks || blocks[b + 1] != end))
+		{
+			memset(&out[n], 0, sizeof(out[n]));
+			out[n].op = OP_GOTO;
+			fixups[2 * *numfixups] = n++;
+			fixups[2 * *numfixups + 1] = end;
+			(*numfixups)++;
+		}
+	}
+	return n;
+}
+
+/*
+====================
+PR_LayoutStatements
+
+Only for verified progs, see LAYOUT. Returns true if the statements moved.
+====================
+*/
+static qboolean PR_LayoutStatements (NVM* qcvm, const void *data, size_t size)
+{
+	const prlayoutheader_t	*h = (const prlayoutheader_t *)data;
+	const unsigned int	*counts;
+	prlayoutbody_t	*bodies;
+	dfunction_t	**sorted;
+	dstatement_t	*out, *st;
+	prinlined_t	*r;
+	const propinfo_t	*info;
+	byte		*temp, *leader;
+	int		*map, *blocks, *fixups;
+	int		numstatements = qcvm->progs->numstatements, numfunctions = qcvm->progs->numfunctions;
+	int		i, j, s, n, numsorted, numbodies, numfixups, hot, moved;
+
+	if (size < sizeof(*h) || h->magic != PR_LAYOUT_MAGIC || h->version != PR_LAYOUT_VERSION ||
+		h->progssize != qcvm->progssize || h->progshash != qcvm->progshash ||
+		h->inlinelimit != (qcvm->inlinelimit > 0 ? qcvm->inlinelimit : 0) || h->stripflags != qcvm->stripflags ||
+		h->striphash != (qcvm->striproots ? PR_BlockChecksum((const byte *)qcvm->striproots, qcvm->striprootssize) : 0) ||
+		h->numstatements != numstatements || (size - sizeof(*h)) / sizeof(unsigned int) < (size_t)numstatements)
+	{
+		Printf (qcvm, "%s wasn't made from these progs and load settings, not laying them out\n", qcvm->layoutpath);
+		return false;
+	}
+	counts = (const unsigned int *)(h + 1);
+
+	// every block may need a goto, and there are no more blocks than statements
+	temp = (byte *) qcvm->alloc_callback(qcvm, NULL, numfunctions * (sizeof(*sorted) + sizeof(*bodies)) +
+		4 * numstatements * sizeof(int) + 2 * numstatements * sizeof(dstatement_t) + numstatements + 1, "layout");
+	if (!temp)
+		return false;
+	sorted = (dfunction_t **)temp;
+	bodies = (prlayoutbody_t *)(sorted + numfunctions);
+	out = (dstatement_t *)(bodies + numfunctions);
+	map = (int *)(out + 2 * numstatements);
+	blocks = map + numstatements;
+	fixups = blocks + numstatements;
+	leader = (byte *)(fixups + 2 * numstatements);
+
+	for (i = 1, numsorted = 0; i < numfunctions; i++)
+	{
+		if (qcvm->functions[i].first_statement > 0)
+			sorted[numsorted++] = &qcvm->functions[i];
+	}
+	if (!numsorted)
+	{
+		qcvm->alloc_callback(qcvm, temp, 0, "layout");
+		return false;
+	}
+	qsort(sorted, numsorted, sizeof(*sorted), PR_FunctionStartCompare);
+	for (i = numbodies = 0; i < numsorted; i = j)
+	{
+		for (j = i + 1; j < numsorted && sorted[j]->first_statement == sorted[i]->first_statement; j++)
+			;
+		bodies[numbodies].start = sorted[i]->first_statement;
+		bodies[numbodies].end = j < numsorted ? sorted[j]->first_statement : numstatements;
+		bodies[numbodies].heat = 0;
+		bodies[numbodies].inlined = false;
+		for (s = bodies[numbodies].start; s < bodies[numbodies].end; s++)
+			bodies[numbodies].heat += counts[s];
+		numbodies++;
+	}
+	for (i = j = 0; i < qcvm->numinlinedranges; i++)
+	{
+		while (j + 1 < numbodies && bodies[j].end <= qcvm->inlinedranges[i].first)
+			j++;
+		bodies[j].inlined = true;
+	}
+	qsort(bodies, numbodies, sizeof(*bodies), PR_LayoutBodyCompare);
+
+	// whatever comes before the first body stays where it is
+	for (n = 0; n < sorted[0]->first_statement; n++)
+	{
+		map[n] = n;
+		out[n] = qcvm->statements[n];
+	}
+	for (i = numfixups = hot = moved = 0; i < numbodies; i++)
+	{
+		if (!bodies[i].heat || bodies[i].inlined)
+		{
+			for (s = bodies[i].start; s < bodies[i].end; s++)
+			{
+				map[s] = n;
+				out[n++] = qcvm->statements[s];
+			}
+		}
+		else
+			n = PR_LayoutBody(qcvm, counts, &bodies[i], out, n, map, blocks, leader, fixups, &numfixups, &moved);
+		if (bodies[i].heat)
+			hot++;
+	}
+
+	// relink the branches, which all stay within their bodies
+	for (s = 0; s < numstatements; s++)
+	{
+		st = &out[map[s]];
+		info = &pr_opinfo[st->op];
+		if (info->a == PR_OPBRANCH)
+			st->a = map[s + (int)st->a] - map[s];
+		if (info->b == PR_OPBRANCH)
+			st->b = map[s + (int)st->b] - map[s];
+		if (info->c == PR_OPBRANCH)
+			st->c = map[s + (int)st->c] - map[s];
+	}
+	for (i = 0; i < numfixups; i++)
+		out[fixups[2 * i]].a = map[fixups[2 * i + 1]] - fixups[2 * i];
+	for (i = 1; i < numfunctions; i++)
+	{
+		if (qcvm->functions[i].first_statement > 0)
+			qcvm->functions[i].first_statement = map[qcvm->functions[i].first_statement];
+	}
+	for (i = 0; i < qcvm->numinlinedranges; i++)
+	{
+		r = &qcvm->inlinedranges[i];
+		r->end = map[r->end - 1] + 1;
+		r->first = map[r->first];
+	}
+	if (qcvm->numinlinedranges)
+		qsort(qcvm->inlinedranges, qcvm->numinlinedranges, sizeof(prinlined_t), PR_InlinedRangeCompare);
+
+	qcvm->layout = qcvm->alloc_callback(qcvm, NULL, n * sizeof(dstatement_t), "laid out statements");
+	if (!qcvm->layout)
+		Errorf (qcvm, "PR_LayoutStatements: out of memory");
+	memcpy(qcvm->layout, out, n * sizeof(dstatement_t));
+	DPrintf (qcvm, "laid out %i bodies, %i of them hot, %i cold blocks moved, %i gotos added\n", numbodies, hot, moved, numfixups);
+	qcvm->statements = (dstatement_t *)qcvm->layout;
+	qcvm->progs->numstatements = n;
+	qcvm->laidout = true;
+
+	qcvm->alloc_callback(qcvm, temp, 0, "layout");
+	return true;
+}
+
+/*
+====================
+PR_MarkTailCalls
+
+Marks every OP_CALLn that the next statement only returns the result of, in
+its c operand which the compilers leave unused. Unchecked execution leaves the
+caller's frame before entering a QC function from such a call. Globals can't
+be pointed at, so nothing the callee runs can miss the caller's locals. Runs
+after the other passes, on verified progs, as they move statements apart.
+====================
+*/
+static void PR_MarkTailCalls (NVM* qcvm)
+{
+	dstatement_t	*st;
+	int		s, n;
+
+	for (s = n = 0; s < qcvm->progs->numstatements; s++)
+	{
+		st = &qcvm->statements[s];
+		if (st->op < OP_CALL0 || st->op > OP_CALL8)
+			continue;
+		st->c = s + 1 < qcvm->progs->numstatements && (st[1].op == OP_RETURN || st[1].op == OP_DONE) && st[1].a == OFS_RETURN;
+		n += st->c;
+	}
+	if (n)
+		DPrintf (qcvm, "%i tail calls\n", n);
+}
+
+/*
+====================
+PR_InlinedFunction
+
+The function an inlined statement was copied from, or NULL.
+====================
+*/
+static dfunction_t *PR_InlinedFunction (NVM* qcvm, int statement)
+{
+	int	lo = 0, hi = qcvm->numinlinedranges, mid;
+
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		if (statement < qcvm->inlinedranges[mid].first)
+			hi = mid;
+		else if (statement >= qcvm->inlinedranges[mid].end)
+			lo = mid + 1;
+		else
+			return &qcvm->functions[qcvm->inlinedranges[mid].function];
+	}
+	return NULL;
+}
+
+/*
+====================
+PR_CallCacheAlloc
+
+One set of NVM_CALLCACHE_WAYS per OP_CALL site, rounded up to a power of two
+so a site's set is just its statement number masked. Sites that share a set
+only cost each other misses.
+====================
+*/
+static void PR_CallCacheAlloc (NVM* qcvm)
+{
+	unsigned int	sites, sets;
+	int		i;
+
+	if (qcvm->callcache)
+	{
+		qcvm->alloc_callback(qcvm, qcvm->callcache, 0, "call cache");
+		qcvm->callcache = NULL;
+	}
+
+	sites = 0;
+	for (i = 0; i < qcvm->progs->numstatements; i++)
+	{
+		if (qcvm->statements[i].op >= OP_CALL0 && qcvm->statements[i].op <= OP_CALL8)
+			sites++;
+	}
+	for (sets = 1; sets < sites; sets <<= 1)
+		;
+
+	qcvm->callcache = (prcallcache_t *) qcvm->alloc_callback(qcvm, NULL, sets * NVM_CALLCACHE_WAYS * sizeof(prcallcache_t), "call cache");
+	if (!qcvm->callcache)
+		Errorf (qcvm, "PR_CallCacheAlloc: out of memory");
+	qcvm->callcachemask = sets - 1;
+	PR_CallCacheFlush(qcvm);
+}
+
+/*
+====================
+PR_CallCacheFlush
+
+The cache holds builtin pointers and what functions resolved to, so it has to
+be emptied whenever builtins are rebound.
+====================
+*/
+static void PR_CallCacheFlush (NVM* qcvm)
+{
+	unsigned int	i;
+
+	if (!qcvm->callcache)
+		return;
+	qcvm->callcacheserial++;
+	for (i = 0; i < (qcvm->callcachemask + 1) * NVM_CALLCACHE_WAYS; i++)
+		qcvm->callcache[i].statement = -1;
+}
+
+/*
+====================
+PR_CallCacheMiss
+
+Resolves a call from qcvm->xstatement to fnum, with the checks a cache hit
+gets to skip, and makes it the set's most recent way.
+====================
+*/
+static prcallcache_t *PR_CallCacheMiss (NVM* qcvm, prcallcache_t *set, func_t fnum)
+{
+	dfunction_t	*f;
+	const char	*error;
+	BuiltinFunction	call = NULL;
+	int		i, builtin = -1;
+
+	if (fnum < 0 || fnum >= qcvm->progs->numfunctions)
+		PR_RunError(qcvm, "bad function %i", fnum);
+	f = &qcvm->functions[fnum];
+	if ((!qcvm->verified || qcvm->checked) && (error = PR_FunctionError(qcvm, f)))
+		PR_RunError(qcvm, "%s: %s", PR_GetString(qcvm, f->s_name), error);
+	if (PR_Stripped(f))
+		PR_RunError(qcvm, "%s was stripped at load", PR_GetString(qcvm, f->s_name));
+
+	// resolve everything first, the set must not keep a half filled way if this errors
+	if (f->first_statement < 0)
+	{
+		builtin = -f->first_statement;
+		call = PR_Builtin(qcvm, builtin);
+		if (qcvm->capture && qcvm->capture->replaying)
+			call = PR_ReplayBuiltin;	// nothing needs to be bound
+		else if (!call)
+		{
+			builtin = 0;	//just invoke the fixme builtin.
+			call = PR_Builtin(qcvm, 0);
+			if (!call)
+				PR_RunError(qcvm, "%s: builtin #%i is not bound", PR_GetString(qcvm, f->s_name), -f->first_statement);
+		}
+		if (qcvm->capture && !qcvm->capture->replaying)
+			call = PR_CaptureBuiltin;
+#ifndef NVM_NO_STATS
+		if (!qcvm->builtincalls)
+		{
+			qcvm->builtincalls = (unsigned int *) qcvm->alloc_callback(qcvm, NULL, qcvm->maxbuiltins * sizeof(unsigned int), "builtin call counts");
+			if (!qcvm->builtincalls)
+				PR_RunError(qcvm, "out of memory for builtin call counts");
+			memset(qcvm->builtincalls, 0, qcvm->maxbuiltins * sizeof(unsigned int));
+		}
+#endif
+	}
+
+	for (i = NVM_CALLCACHE_WAYS - 1; i > 0; i--)
+		set[i] = set[i - 1];
+	set->statement = qcvm->xstatement;
+	set->function = fnum;
+	set->f = f;
+	set->builtin = builtin;
+	set->call = call;
+	return set;
+}
+
+#define	PR_RUNAWAY_LIMIT	0x10000000	//spike -- was decimal 100000
+
+/*
+===============================================================================
+
+PARALLEL
+
+nvmExecuteForEdicts with NVM_EDICTS_PARALLEL splits the batch between
+nvmSetParallelThreads workers, each running its part on a copy of the VM
+with its own globals and stacks. The edicts stay shared and as they were
+before the batch: a think's first write to one makes it a private copy, and
+every edict a think reads or writes is logged. Once the workers are done, a
+think that wrote an edict another think touched conflicts, and so does that
+other think. The copies the rest made are committed, which gives the same
+result in any order, and the conflicting thinks run again serially in batch
+order. What a batch does depends on the batch alone, not on how the threads
+were scheduled.
+
+Whatever a worker can not log ends the think and leaves it to the serial
+pass: builtins not marked with nvmSetParallelSafe, QC functions that write
+globals other than their own locals, OP_RAND*, temp strings, run time
+errors and running out of stack or log space. A safe builtin may only use its parameters and
+return value, edicts it looks at are not logged.
+
+===============================================================================
+*/
+
+#define	PR_REPLAY		255		/* status of a think left to the serial pass */
+#define	PR_MAX_WORKERS	64
+#define	PR_WORKER_ALIGN(x)	(((x) + 15) & ~(size_t)15)
+
+void nvmSetParallelThreads(NVM* qcvm, int threads)
+{
+	qcvm->parallelthreads = threads < PR_MAX_WORKERS ? threads : PR_MAX_WORKERS;
+}
+
+static prparallel_t *PR_Parallel (NVM* qcvm)
+{
+	if (!qcvm->parallel)
+	{
+		qcvm->parallel = (prparallel_t *) qcvm->alloc_callback(qcvm, NULL, sizeof(prparallel_t), "parallel");
+		if (!qcvm->parallel)
+			Errorf (qcvm, "PR_Parallel: out of memory");
+		memset(qcvm->parallel, 0, sizeof(prparallel_t));
+	}
+	return qcvm->parallel;
+}
+
+void nvmSetParallelSafe(NVM* qcvm, BuiltinFunction builtin, bool safe)
+{
+	prparallel_t	*p = PR_Parallel(qcvm);
+	BuiltinFunction	*list;
+	int		i;
+
+	for (i = 0; i < p->numsafe && p->safe[i] != builtin; i++)
+		;
+	if (!safe)
+	{
+		if (i < p->numsafe)
+			p->safe[i] = p->safe[--p->numsafe];
+		return;
+	}
+	if (i < p->numsafe)
+		return;
+	if (p->numsafe == p->maxsafe)
+	{
+		list = (BuiltinFunction *) qcvm->alloc_callback(qcvm, p->safe, (p->maxsafe + 16) * sizeof(*list), "parallel");
+		if (!list)
+			Errorf (qcvm, "nvmSetParallelSafe: out of memory");
+		p->safe = list;
+		p->maxsafe += 16;
+	}
+	p->safe[p->numsafe++] = builtin;
+}
+
+static void PR_ParallelFree (NVM* qcvm)
+{
+	prparallel_t	*p = qcvm->parallel;
+	int		i;
+
+	if (!p)
+		return;
+	PR_LanesFree(qcvm);
+	for (i = 0; i < p->maxworkers; i++)
+	{
+		if (p->workers[i].block)
+			qcvm->alloc_callback(qcvm, p->workers[i].block, 0, "parallel worker");
+	}
+	if (p->workers)
+		qcvm->alloc_callback(qcvm, p->workers, 0, "parallel");
+	if (p->block)
+		qcvm->alloc_callback(qcvm, p->block, 0, "parallel");
+	if (p->unsafe)
+		qcvm->alloc_callback(qcvm, p->unsafe, 0, "parallel");
+	if (p->safe)
+		qcvm->alloc_callback(qcvm, p->safe, 0, "parallel");
+	qcvm->alloc_callback(qcvm, p, 0, "parallel");
+	qcvm->parallel = NULL;
+}
+
+/*
+====================
+PR_ParallelAbort
+
+Ends the think a worker is running, which then runs in the serial pass.
+====================
+*/
+static void PR_ParallelAbort (NVM* qcvm)
+{
+	longjmp(*(jmp_buf *)qcvm->errorjmp, 1);
+}
+
+static void *PR_WorkerAlloc (NVM* qcvm, void *ptr, size_t size, const char *name)
+{
+	PR_ParallelAbort(qcvm);	// the host's allocator need not be thread safe
+	return NULL;
+}
+
+static qboolean PR_ParallelSafe (prparallel_t *p, BuiltinFunction builtin)
+{
+	int		i;
+
+	for (i = 0; i < p->numsafe; i++)
+	{
+		if (p->safe[i] == builtin)
+			return true;
+	}
+	return false;
+}
+
+/*
+====================
+PR_ParallelEdict
+
+The edict at prog offset e as the running think sees it, logging the access.
+A write gets the think its own copy.
+====================
+*/
+static edict_t *PR_ParallelEdict (NVM* qcvm, int e, qboolean write)
+{
+	prworker_t	*w = qcvm->worker;
+	int		n = e / qcvm->edict_size;
+	edict_t	*ed;
+
+	if (e < 0 || n >= qcvm->num_edicts)
+		PR_ParallelAbort(qcvm);
+	if (w->writestamp[n] == w->serial)
+		return (edict_t *)(w->slots + w->shadow[n] * qcvm->edict_size);
+	ed = PROG_TO_EDICT(n * qcvm->edict_size);
+	if (!write && w->readstamp[n] == w->serial)
+		return ed;
+
+	if (w->numtouches == w->maxtouches || (write && w->numslots == w->maxslots))
+	{
+		w->overflowed = true;
+		PR_ParallelAbort(qcvm);
+	}
+	w->touches[w->numtouches * 2] = w->think;
+	w->touches[w->numtouches * 2 + 1] = n << 1 | write;
+	w->numtouches++;
+	if (!write)
+	{
+		w->readstamp[n] = w->serial;
+		return ed;
+	}
+
+	w->slotowner[w->numslots * 2] = w->think;
+	w->slotowner[w->numslots * 2 + 1] = n;
+	w->shadow[n] = w->numslots++;
+	w->writestamp[n] = w->serial;
+	return (edict_t *) memcpy(w->slots + w->shadow[n] * qcvm->edict_size, ed, qcvm->edict_size);
+}
+
+static eval_t *PR_ParallelPointer (NVM* qcvm, int ofs, int size, qboolean write)
+{
+	int		base = ofs / qcvm->edict_size * qcvm->edict_size;
+
+	if (ofs < 0 || ofs - base + size * 4 > qcvm->edict_size)
+		PR_ParallelAbort(qcvm);
+	return (eval_t *)((byte *)PR_ParallelEdict(qcvm, base, write) + ofs - base);
+}
+
+/*
+====================
+PR_OutputOperand
+
+The globals a statement writes: returns how many, from *operand on.
+====================
+*/
+static int PR_OutputOperand (dstatement_t *st, unsigned int *operand)
+{
+	switch (st->op)
+	{
+	case OP_STORE_F:
+	case OP_STORE_V:
+	case OP_STORE_S:
+	case OP_STORE_ENT:
+	case OP_STORE_FLD:
+	case OP_STORE_FNC:
+	case OP_MULSTORE_F:
+	case OP_MULSTORE_VF:
+	case OP_DIVSTORE_F:
+	case OP_ADDSTORE_F:
+	case OP_ADDSTORE_V:
+	case OP_SUBSTORE_F:
+	case OP_SUBSTORE_V:
+	case OP_BITSETSTORE_F:
+	case OP_BITCLRSTORE_F:
+	case OP_STORE_I:
+	case OP_STORE_IF:
+	case OP_STORE_FI:
+	case OP_STORE_P:
+		*operand = st->b;
+		return pr_opinfo[st->op].b;
+	}
+	*operand = st->c;
+	return pr_opinfo[st->op].c > 0 ? pr_opinfo[st->op].c : 0;
+}
+
+/*
+====================
+PR_ParallelUnsafe
+
+Finds the shared globals, the named ones that are not among some function's
+parms and locals, and the functions a worker can not run: those writing a
+shared global, since other thinks could be reading it.
+====================
+*/
+static qboolean PR_ParallelUnsafe (NVM* qcvm)
+{
+	prparallel_t	*p = qcvm->parallel;
+	dfunction_t	**sorted, *f;
+	dstatement_t	*st;
+	byte		*shared;
+	unsigned int	o;
+	int		numfunctions = qcvm->progs->numfunctions, numglobals = qcvm->progs->numglobals;
+	int		i, j, n, s, end, size;
+
+	p->unsafe = (byte *) qcvm->alloc_callback(qcvm, NULL, numfunctions + numglobals, "parallel");
+	sorted = (dfunction_t **) qcvm->alloc_callback(qcvm, NULL, numfunctions * sizeof(*sorted), "parallel");
+	if (!p->unsafe || !sorted)
+	{
+		if (sorted)
+			qcvm->alloc_callback(qcvm, sorted, 0, "parallel");
+		if (p->unsafe)
+			qcvm->alloc_callback(qcvm, p->unsafe, 0, "parallel");
+		p->unsafe = NULL;
+		return false;
+	}
+	p->shared = shared = p->unsafe + numfunctions;
+	memset(p->unsafe, 0, numfunctions);
+	memset(shared, 0, numglobals);
+
+	for (i = 0; i < qcvm->progs->numglobaldefs; i++)
+	{
+		o = qcvm->globaldefs[i].ofs;
+		size = (qcvm->globaldefs[i].type & ~DEF_SAVEGLOBAL) == ev_vector ? 3 : 1;
+		for (j = o; j < (int)o + size && j < numglobals; j++)
+			shared[j] = j >= RESERVED_OFS;
+	}
+	for (i = 1, n = 0; i < numfunctions; i++)
+	{
+		f = &qcvm->functions[i];
+		if (f->first_statement <= 0)
+			continue;
+		sorted[n++] = f;
+		for (j = size = 0; j < f->numparms; j++)
+			size += f->parm_size[j];
+		if (size < f->locals)
+			size = f->locals;
+		for (j = f->parm_start; j < f->parm_start + size && j < numglobals; j++)
+			shared[j] = false;
+	}
+
+	qsort(sorted, n, sizeof(*sorted), PR_FunctionStartCompare);
+	for (i = 0; i < n; i++)
+	{
+		for (j = i + 1; j < n && sorted[j]->first_statement == sorted[i]->first_statement; j++)
+			;
+		end = j < n ? sorted[j]->first_statement : qcvm->progs->numstatements;
+		for (s = sorted[i]->first_statement; s < end; s++)
+		{
+			st = &qcvm->statements[s];
+			for (j = PR_OutputOperand(st, &o) - 1; j >= 0; j--)
+			{
+				if (o + j < (unsigned int)numglobals && shared[o + j])
+					break;
+			}
+			if (j >= 0)
+			{
+				p->unsafe[sorted[i] - qcvm->functions] = true;
+				break;
+			}
+		}
+	}
+	qcvm->alloc_callback(qcvm, sorted, 0, "parallel");
+	return true;
+}
+
+/*
+====================
+PR_ParallelSetup
+
+Sizes the batch's arrays and every worker's block, and copies the VM into
+the workers. Returns false when something could not be allocated.
+====================
+*/
+static qboolean PR_ParallelSetup (NVM* qcvm, int numworkers)
+{
+	prparallel_t	*p = qcvm->parallel;
+	prworker_t	*w;
+	NVM			*vm;
+	byte		*b;
+	size_t		size, stamps, callcache;
+	int			i, slice, numglobals = qcvm->progs->numglobals;
+	int			stacksize = qcvm->stacksize > 16 ? qcvm->stacksize : 16;
+	int			localstacksize = qcvm->localstacksize > 256 ? qcvm->localstacksize : 256;
+
+	if (numworkers > p->maxworkers)
+	{
+		w = (prworker_t *) qcvm->alloc_callback(qcvm, p->workers, numworkers * sizeof(*w), "parallel");
+		if (!w)
+			return false;
+		memset(w + p->maxworkers, 0, (numworkers - p->maxworkers) * sizeof(*w));
+		p->workers = w;
+		p->maxworkers = numworkers;
+	}
+	p->numworkers = numworkers;
+
+	size = PR_WORKER_ALIGN(p->count) + PR_WORKER_ALIGN(p->count * sizeof(nvmedictstatus_t)) +
+		PR_WORKER_ALIGN(p->count * sizeof(int)) + qcvm->max_edicts * sizeof(int);
+	if (size > p->blocksize)
+	{
+		if (p->block)
+			qcvm->alloc_callback(qcvm, p->block, 0, "parallel");
+		p->block = qcvm->alloc_callback(qcvm, NULL, size, "parallel");
+		p->blocksize = p->block ? size : 0;
+		if (!p->block)
+			return false;
+	}
+	b = (byte *)p->block;
+	p->status = (unsigned char *)b;
+	p->replayresults = (nvmedictstatus_t *)(b += PR_WORKER_ALIGN(p->count));
+	p->replays = (int *)(b += PR_WORKER_ALIGN(p->count * sizeof(nvmedictstatus_t)));
+	p->owner = (int *)(b + PR_WORKER_ALIGN(p->count * sizeof(int)));
+
+#ifndef NVM_NO_STATS
+	if (!qcvm->builtincalls)
+	{
+		qcvm->builtincalls = (unsigned int *) qcvm->alloc_callback(qcvm, NULL, qcvm->maxbuiltins * sizeof(unsigned int), "builtin call counts");
+		if (!qcvm->builtincalls)
+			return false;
+		memset(qcvm->builtincalls, 0, qcvm->maxbuiltins * sizeof(unsigned int));
+	}
+#endif
+
+	for (i = 0; i < numworkers; i++)
+	{
+		w = &p->workers[i];
+		w->parallel = p;
+		w->first = p->count * i / numworkers;
+		w->end = p->count * (i + 1) / numworkers;
+		slice = w->end - w->first;
+		if (w->overflowed)
+		{
+			w->maxslots *= 2;
+			w->maxtouches *= 2;
+			w->overflowed = false;
+		}
+		if (w->maxslots < slice + 8)
+			w->maxslots = slice + 8;
+		if (w->maxtouches < slice * 8 + 64)
+			w->maxtouches = slice * 8 + 64;
+
+		// pointers first, the rest of the block only needs 4 byte alignment
+		stamps = PR_WORKER_ALIGN(qcvm->max_edicts * 3 * sizeof(int));
+		callcache = (qcvm->callcachemask + 1) * NVM_CALLCACHE_WAYS * sizeof(prcallcache_t);
+		size = PR_WORKER_ALIGN(sizeof(NVM)) + PR_WORKER_ALIGN(stacksize * sizeof(prstack_t)) + PR_WORKER_ALIGN(callcache) +
+			stamps + PR_WORKER_ALIGN(localstacksize * sizeof(int)) + PR_WORKER_ALIGN(qcvm->maxbuiltins * sizeof(unsigned int)) +
+			PR_WORKER_ALIGN(numglobals * sizeof(float)) + PR_WORKER_ALIGN(w->maxslots * 2 * sizeof(int)) +
+			PR_WORKER_ALIGN(w->maxtouches * 2 * sizeof(int)) + (size_t)w->maxslots * qcvm->edict_size;
+		if (size > w->blocksize)
+		{
+			if (w->block)
+				qcvm->alloc_callback(qcvm, w->block, 0, "parallel worker");
+			w->block = qcvm->alloc_callback(qcvm, NULL, size, "parallel worker");
+			w->blocksize = w->block ? size : 0;
+			if (!w->block)
+				return false;
+		}
+
+		b = (byte *)w->block;
+		w->vm = vm = (NVM *)b;
+		*vm = *qcvm;
+		vm->stack = (prstack_t *)(b += PR_WORKER_ALIGN(sizeof(NVM)));
+		vm->callcache = (prcallcache_t *)(b += PR_WORKER_ALIGN(stacksize * sizeof(prstack_t)));
+		w->readstamp = (unsigned int *)(b += PR_WORKER_ALIGN(callcache));
+		w->writestamp = w->readstamp + qcvm->max_edicts;
+		w->shadow = (int *)(w->writestamp + qcvm->max_edicts);
+		vm->localstack = (int *)(b += stamps);
+		vm->builtincalls = (unsigned int *)(b += PR_WORKER_ALIGN(localstacksize * sizeof(int)));
+		vm->globals = (float *)(b += PR_WORKER_ALIGN(qcvm->maxbuiltins * sizeof(unsigned int)));
+		w->slotowner = (int *)(b += PR_WORKER_ALIGN(numglobals * sizeof(float)));
+		w->touches = (int *)(b += PR_WORKER_ALIGN(w->maxslots * 2 * sizeof(int)));
+		w->slots = b + PR_WORKER_ALIGN(w->maxtouches * 2 * sizeof(int));
+		w->numslots = w->numtouches = 0;
+
+		memset(w->readstamp, 0, qcvm->max_edicts * 2 * sizeof(int));
+		w->serial = 0;
+		// the worker's call cache lasts until the VM's is flushed
+		if (w->callcache != vm->callcache || w->callcacheserial != qcvm->callcacheserial)
+		{
+			memcpy(vm->callcache, qcvm->callcache, callcache);
+			w->callcache = vm->callcache;
+			w->callcacheserial = qcvm->callcacheserial;
+		}
+
+		vm->worker = w;
+		vm->parallel = NULL;
+		vm->alloc_callback = PR_WorkerAlloc;
+		memcpy(vm->globals, qcvm->globals, numglobals * sizeof(float));
+		vm->global_struct = (globalvars_t *)(vm->globals + ((float *)qcvm->global_struct - qcvm->globals));
+		vm->stacksize = stacksize;
+		vm->localstacksize = localstacksize;
+		vm->depth = vm->localstack_used = 0;
+		vm->xthread = 0;
+		vm->errorjmp = NULL;
+		vm->suspended = vm->suspendrequest = false;
+		vm->profiling = vm->sampling = vm->trace = false;
+		memset(&vm->stats, 0, sizeof(vm->stats));
+		memset(vm->builtincalls, 0, qcvm->maxbuiltins * sizeof(unsigned int));
+	}
+	return true;
+}
+
+/*
+====================
+PR_WorkerRun
+
+Runs a worker's part of the batch, see nvmExecuteForEdicts.
+====================
+*/
+static void PR_WorkerRun (prworker_t *w)
+{
+	NVM			*qcvm = w->vm;
+	prparallel_t	*p = w->parallel;
+	jmp_buf		errorjmp;
+	volatile int	i = w->first;
+	int			n;
+	func_t		fnum;
+	edict_t		*ed;
+
+	if (setjmp(errorjmp))
+	{
+		while (qcvm->depth > 0)
+			PR_LeaveFunction(qcvm);
+		p->status[i++] = PR_REPLAY;
+	}
+	qcvm->errorjmp = &errorjmp;
+
+	for ( ; i < w->end; i++)
+	{
+		w->think = i;
+		w->serial++;
+		p->status[i] = NVM_EDICT_SKIPPED;
+		n = p->edict_nums ? p->edict_nums[i] : i;
+		if (n < 0 || n >= qcvm->num_edicts)
+			continue;
+		ed = PR_ParallelEdict(qcvm, n * qcvm->edict_size, false);
+		if (ed->free)
+			continue;
+		fnum = p->ofs >= 0 ? E_INT(ed, p->ofs) : p->func;
+		if (!fnum)
+			continue;
+		if (fnum < 0 || fnum >= qcvm->progs->numfunctions || qcvm->functions[fnum].first_statement <= 0 || p->unsafe[fnum])
+		{
+			p->status[i] = PR_REPLAY;
+			continue;
+		}
+
+		if (p->flags & NVM_EDICTS_THINKTIME)
+		{
+			ed = PR_ParallelEdict(qcvm, n * qcvm->edict_size, true);
+			qcvm->global_struct->time = ed->v.nextthink > p->time ? ed->v.nextthink : p->time;
+			ed->v.nextthink = 0;
+		}
+		qcvm->global_struct->self = n * qcvm->edict_size;
+		PR_ExecuteParallel(qcvm, PR_EnterFunction(qcvm, &qcvm->functions[fnum]), 0, 0, 0);
+		p->status[i] = NVM_EDICT_RAN;
+	}
+	qcvm->errorjmp = NULL;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI PR_WorkerThread (LPVOID w)
+{
+	PR_WorkerRun((prworker_t *)w);
+	return 0;
+}
+#else
+static void *PR_WorkerThread (void *w)
+{
+	PR_WorkerRun((prworker_t *)w);
+	return NULL;
+}
+#endif
+
+/*
+====================
+PR_ParallelBatch
+
+nvmExecuteForEdicts for NVM_EDICTS_PARALLEL: returns the errors of the
+serial pass, or -1 when the batch can't be run this way and has to be run
+serially from the start.
+====================
+*/
+static int PR_ParallelBatch (NVM* qcvm, int field_or_func, int ofs, const int* edict_nums, int count, int flags, nvmedictstatus_t* results)
+{
+	prparallel_t	*p;
+	prworker_t	*w;
+#ifdef _WIN32
+	HANDLE		threads[PR_MAX_WORKERS];
+#else
+	pthread_t	threads[PR_MAX_WORKERS];
+#endif
+	qboolean	started[PR_MAX_WORKERS];
+	int			numworkers = qcvm->parallelthreads < count ? qcvm->parallelthreads : count;
+	int			gofs = (float *)qcvm->global_struct - qcvm->globals;
+	int			i, j, k, e, t, n, errors;
+
+	// the workers need the system globals in their copy of the globals, and the unchecked interpreter
+	if (numworkers < 2 || !qcvm->verified || qcvm->checked || qcvm->statementcounts || qcvm->capture || qcvm->profiling || qcvm->sampling || qcvm->trace ||
+		!qcvm->callcache || gofs < 0 || gofs + (int)(sizeof(globalvars_t) / sizeof(float)) > qcvm->progs->numglobals)
+		return -1;
+	p = PR_Parallel(qcvm);
+	if (p->busy || (!p->unsafe && !PR_ParallelUnsafe(qcvm)))
+		return -1;
+	p->edict_nums = edict_nums;
+	p->count = count;
+	p->ofs = ofs;
+	p->func = ofs < 0 ? field_or_func : 0;
+	p->flags = flags;
+	p->time = qcvm->global_struct->time;
+	if (!PR_ParallelSetup(qcvm, numworkers))
+		return -1;
+	p->busy = true;
+
+	for (i = 1; i < numworkers; i++)
+	{
+#ifdef _WIN32
+		threads[i] = CreateThread(NULL, 0, PR_WorkerThread, &p->workers[i], 0, NULL);
+		started[i] = threads[i] != NULL;
+#else
+		started[i] = !pthread_create(&threads[i], NULL, PR_WorkerThread, &p->workers[i]);
+#endif
+	}
+	PR_WorkerRun(&p->workers[0]);
+	for (i = 1; i < numworkers; i++)
+	{
+		if (!started[i])
+			PR_WorkerRun(&p->workers[i]);
+#ifdef _WIN32
+		else
+		{
+			WaitForSingleObject(threads[i], INFINITE);
+			CloseHandle(threads[i]);
+		}
+#else
+		else
+			pthread_join(threads[i], NULL);
+#endif
+	}
+
+	// an edict written by one think and touched by another sends both to the serial pass
+	for (e = 0; e < qcvm->num_edicts; e++)
+		p->owner[e] = -1;
+	for (i = 0; i < numworkers; i++)
+	{
+		w = &p->workers[i];
+		for (k = 0; k < w->numtouches; k++)
+		{
+			t = w->touches[k * 2];
+			e = w->touches[k * 2 + 1] >> 1;
+			if (w->touches[k * 2 + 1] & 1)
+				p->owner[e] = p->owner[e] == -1 || p->owner[e] == t ? t : -2;
+		}
+	}
+	for (i = 0; i < numworkers; i++)
+	{
+		w = &p->workers[i];
+		for (k = 0; k < w->numtouches; k++)
+		{
+			t = w->touches[k * 2];
+			j = p->owner[w->touches[k * 2 + 1] >> 1];
+			if (j != -1 && j != t)
+			{
+				p->status[t] = PR_REPLAY;
+				if (j >= 0)
+					p->status[j] = PR_REPLAY;
+			}
+		}
+	}
+
+	// the others never saw each other's edicts, so their copies can go in as they are
+	for (i = 0; i < numworkers; i++)
+	{
+		w = &p->workers[i];
+		for (k = 0; k < w->numslots; k++)
+		{
+			if (p->status[w->slotowner[k * 2]] != PR_REPLAY)
+				memcpy(PROG_TO_EDICT(w->slotowner[k * 2 + 1] * qcvm->edict_size), w->slots + k * qcvm->edict_size, qcvm->edict_size);
+		}
+#ifndef NVM_NO_STATS
+		qcvm->stats.statements += w->vm->stats.statements;
+		qcvm->stats.function_calls += w->vm->stats.function_calls;
+		qcvm->stats.tail_calls += w->vm->stats.tail_calls;
+		qcvm->stats.builtin_calls += w->vm->stats.builtin_calls;
+		for (j = 0; j < OP_NUMOPS; j++)
+			qcvm->stats.opcodes[j] += w->vm->stats.opcodes[j];
+		for (j = 0; j < qcvm->maxbuiltins; j++)
+			qcvm->builtincalls[j] += w->vm->builtincalls[j];
+		if (qcvm->stats.max_depth < w->vm->stats.max_depth)
+			qcvm->stats.max_depth = w->vm->stats.max_depth;
+		if (qcvm->stats.max_localstack_used < w->vm->stats.max_localstack_used)
+			qcvm->stats.max_localstack_used = w->vm->stats.max_localstack_used;
+#endif
+	}
+
+	for (i = n = 0; i < count; i++)
+	{
+		if (p->status[i] == PR_REPLAY)
+			p->replays[n++] = edict_nums ? edict_nums[i] : i;
+	}
+	STAT(qcvm->stats.parallel_thinks += count);
+	STAT(qcvm->stats.parallel_replays += n);
+	errors = n ? nvmExecuteForEdicts(qcvm, field_or_func, p->replays, n, flags & ~NVM_EDICTS_PARALLEL, p->replayresults) : 0;
+	if (results)
+	{
+		for (i = n = 0; i < count; i++)
+			results[i] = p->status[i] == PR_REPLAY ? p->replayresults[n++] : (nvmedictstatus_t)p->status[i];
+	}
+	p->busy = false;
+	return errors;
+}
+
+/*
+===============================================================================
+
+LANES
+
+nvmExecuteForEdicts with NVM_EDICTS_LANES runs edicts that have the same
+function NVM_LANES at a time, in lockstep: each statement runs once for all
+the lanes that are at it. Every lane has its own copy of the globals, laid
+out so that a global's lanes are next to each other, which makes the
+arithmetic a loop over the lanes the compiler can vectorize. Lanes that
+branch apart run separately, lowest statement first, until they meet again.
+
+A chunk has to come out as if its edicts had run one after another. Every
+edict a lane reads or writes is logged, along with the old value of all it
+stores, and an edict one lane wrote and another touched undoes the chunk and
+runs it serially, and so does a run time error. Builtins marked with
+nvmSetParallelSafe are called a lane at a time; a function that calls any
+other builtin or a QC function, or uses an opcode other than the float,
+vector, entity and branch ones, runs serially from then on, like functions
+that write shared globals. So does one that calls a builtin that makes a temp
+string, as the lanes would share nvmTempString's ring.
+
+===============================================================================
+*/
+
+#define	PR_LANES_RAN			0
+#define	PR_LANES_REPLAY			1	/* undone, the chunk runs serially */
+#define	PR_LANES_UNSUPPORTED	2	/* undone, and so is every later chunk of the function */
+
+#define	PR_LANE_SHARED	255			/* owner of an edict more than one lane touched */
+#define	PR_LANE_DONE	0x7fffffff	/* pc of a lane that returned */
+
+static void PR_LanesFree (NVM* qcvm)
+{
+	prlanes_t	*l;
+
+	if (!qcvm->parallel || !(l = qcvm->parallel->lanes))
+		return;
+	if (l->globals)
+		qcvm->alloc_callback(qcvm, l->globals, 0, "lanes");
+	if (l->shared)
+		qcvm->alloc_callback(qcvm, l->shared, 0, "lanes");
+	if (l->stamp)
+		qcvm->alloc_callback(qcvm, l->stamp, 0, "lanes");
+	if (l->owner)
+		qcvm->alloc_callback(qcvm, l->owner, 0, "lanes");
+	if (l->written)
+		qcvm->alloc_callback(qcvm, l->written, 0, "lanes");
+	if (l->undo)
+		qcvm->alloc_callback(qcvm, l->undo, 0, "lanes");
+	if (l->list)
+		qcvm->alloc_callback(qcvm, l->list, 0, "lanes");
+	if (l->unsupported)
+		qcvm->alloc_callback(qcvm, l->unsupported, 0, "lanes");
+	qcvm->alloc_callback(qcvm, l, 0, "lanes");
+	qcvm->parallel->lanes = NULL;
+}
+
+/*
+====================
+PR_LanesAlloc
+
+Sizes the lanes for the progs, the edicts and a batch of count, NULL when
+something could not be allocated. The globals of new lanes start out as the
+VM's.
+====================
+*/
+static prlanes_t *PR_LanesAlloc (NVM* qcvm, int count, int selfofs, int timeofs)
+{
+	prlanes_t	*l = qcvm->parallel->lanes;
+	void		*p;
+	int			i, k, numglobals = qcvm->progs->numglobals;
+
+	if (!l)
+	{
+		l = (prlanes_t *) qcvm->alloc_callback(qcvm, NULL, sizeof(prlanes_t), "lanes");
+		if (!l)
+			return NULL;
+		memset(l, 0, sizeof(*l));
+		qcvm->parallel->lanes = l;
+	}
+	if (l->numglobals != numglobals)
+	{
+		if (!(p = qcvm->alloc_callback(qcvm, l->globals, numglobals * NVM_LANES * sizeof(prlaneval_t), "lanes")))
+			return NULL;
+		l->globals = (prlaneval_t *)p;
+		l->numglobals = numglobals;
+		for (i = 0; i < numglobals; i++)
+		{
+			for (k = 0; k < NVM_LANES; k++)
+				l->globals[i * NVM_LANES + k]._float = qcvm->globals[i];
+		}
+	}
+	if (!l->shared)
+	{
+		for (i = l->numshared = 0; i < numglobals; i++)
+			l->numshared += qcvm->parallel->shared[i] && i != selfofs && i != timeofs;
+		if (!(l->shared = (int *) qcvm->alloc_callback(qcvm, NULL, (l->numshared + 1) * sizeof(int), "lanes")))
+			return NULL;
+		for (i = l->numshared = 0; i < numglobals; i++)
+		{
+			if (qcvm->parallel->shared[i] && i != selfofs && i != timeofs)
+				l->shared[l->numshared++] = i;
+		}
+	}
+	if (l->maxedicts < qcvm->max_edicts)
+	{
+		if (!(p = qcvm->alloc_callback(qcvm, l->stamp, qcvm->max_edicts * sizeof(unsigned int), "lanes")))
+			return NULL;
+		l->stamp = (unsigned int *)p;
+		if (!(p = qcvm->alloc_callback(qcvm, l->owner, qcvm->max_edicts, "lanes")))
+			return NULL;
+		l->owner = (unsigned char *)p;
+		if (!(p = qcvm->alloc_callback(qcvm, l->written, qcvm->max_edicts, "lanes")))
+			return NULL;
+		l->written = (byte *)p;
+		memset(l->stamp, 0, qcvm->max_edicts * sizeof(unsigned int));
+		l->serial = 0;
+		l->maxedicts = qcvm->max_edicts;
+	}
+	if (!l->unsupported)
+	{
+		if (!(l->unsupported = (byte *) qcvm->alloc_callback(qcvm, NULL, qcvm->progs->numfunctions, "lanes")))
+			return NULL;
+		memset(l->unsupported, 0, qcvm->progs->numfunctions);
+	}
+	if (l->maxlist < count)
+	{
+		if (!(p = qcvm->alloc_callback(qcvm, l->list, count * sizeof(int), "lanes")))
+			return NULL;
+		l->list = (int *)p;
+		l->maxlist = count;
+	}
+	return l;
+}
+
+/*
+====================
+PR_LaneTouch
+
+Logs that a lane read or wrote edict n, false once that makes the chunk
+differ from running its edicts one after another.
+====================
+*/
+static qboolean PR_LaneTouch (prlanes_t *l, int n, int lane, qboolean write)
+{
+	if (l->stamp[n] != l->serial)
+	{
+		l->stamp[n] = l->serial;
+		l->owner[n] = lane;
+		l->written[n] = write;
+		return true;
+	}
+	if (l->owner[n] != lane)
+		l->owner[n] = PR_LANE_SHARED;
+	l->written[n] |= write;
+	return l->owner[n] != PR_LANE_SHARED || !l->written[n];
+}
+
+static edict_t *PR_LaneEdict (NVM* qcvm, int lane, int e, int field, int size)
+{
+	prlanes_t	*l = qcvm->parallel->lanes;
+	int			n;
+
+	if (field < 0 || field + size > qcvm->progs->entityfields)
+		return NULL;
+	if (e != l->read[lane])
+	{
+		n = e / qcvm->edict_size;
+		if (e < 0 || e != n * qcvm->edict_size || n >= qcvm->num_edicts || !PR_LaneTouch(l, n, lane, false))
+			return NULL;
+		l->read[lane] = e;
+	}
+	return PROG_TO_EDICT(e);
+}
+
+/*
+====================
+PR_LaneStore
+
+Stores count ints at byte offset ofs of the edicts for a lane, logging the
+old values so the chunk can be undone. False if it has to be.
+====================
+*/
+static qboolean PR_LaneStore (NVM* qcvm, int lane, int ofs, const int *values, int count)
+{
+	prlanes_t	*l = qcvm->parallel->lanes;
+	int			n, i, *p;
+
+	if (ofs & 3)
+		return false;
+	if (ofs < l->wrote[lane] || ofs + count * 4 > l->wrote[lane] + qcvm->edict_size)
+	{
+		n = ofs / qcvm->edict_size;
+		if (ofs < 0 || n >= qcvm->num_edicts || ofs - n * qcvm->edict_size + count * 4 > qcvm->edict_size ||
+			!PR_LaneTouch(l, n, lane, true))
+			return false;
+		l->wrote[lane] = n * qcvm->edict_size;
+	}
+	if (l->numundo + count > l->maxundo)
+	{
+		p = (int *) qcvm->alloc_callback(qcvm, l->undo, (l->maxundo + 256) * 2 * sizeof(int), "lanes");
+		if (!p)
+			return false;
+		l->undo = p;
+		l->maxundo += 256;
+	}
+	p = (int *)((byte *)qcvm->edicts + ofs);
+	for (i = 0; i < count; i++)
+	{
+		l->undo[l->numundo * 2] = ofs / 4 + i;
+		l->undo[l->numundo * 2 + 1] = p[i];
+		l->numundo++;
+		p[i] = values[i];
+	}
+	return true;
+}
+
+static void PR_LanesUndo (NVM* qcvm)
+{
+	prlanes_t	*l = qcvm->parallel->lanes;
+
+	while (l->numundo > 0)
+	{
+		l->numundo--;
+		((int *)qcvm->edicts)[l->undo[l->numundo * 2]] = l->undo[l->numundo * 2 + 1];
+	}
+}
+
+/*
+====================
+PR_ExecuteLanes
+
+Runs f in the first numlanes lanes, which have their self and time set.
+Returns PR_LANES_RAN, or why the chunk has to be undone.
+====================
+*/
+#define	LA		(lg + st->a * NVM_LANES)
+#define	LB		(lg + st->b * NVM_LANES)
+#define	LC		(lg + st->c * NVM_LANES)
+#define	LV(x,j)	((x) + (j) * NVM_LANES)
+/* every lane is computed, only the active ones keep the result */
+#define	LANES(out,type,expr) \
+	do { \
+		for (i = 0; i < NVM_LANES; i++) \
+			r[i].type = (expr); \
+		for (i = 0; i < NVM_LANES; i++) \
+			(out)[i]._int = (r[i]._int & active[i]) | ((out)[i]._int & ~active[i]); \
+	} while (0)
+
+static int PR_ExecuteLanes (NVM* qcvm, dfunction_t *f, int numlanes, int selfofs, int timeofs)
+{
+	prlanes_t		*l = qcvm->parallel->lanes;
+	prlaneval_t		*lg = l->globals;
+	dstatement_t	*st;
+	dfunction_t		*newf;
+	BuiltinFunction	call;
+	edict_t			*ed;
+	int				i, j, n, pc, steps, values[3];
+	unsigned int	tempstrings;
+	int				lanepc[NVM_LANES], active[NVM_LANES];	// active is -1 for the lanes at pc
+	prlaneval_t		r[NVM_LANES];
+
+	for (i = 0; i < NVM_LANES; i++)
+		lanepc[i] = i < numlanes ? f->first_statement : PR_LANE_DONE;
+
+	for (steps = 0; ; steps++)
+	{
+		pc = PR_LANE_DONE;
+		for (i = 0; i < NVM_LANES; i++)
+		{
+			if (lanepc[i] < pc)
+				pc = lanepc[i];
+		}
+		if (pc == PR_LANE_DONE)
+			return PR_LANES_RAN;
+		if (steps >= PR_RUNAWAY_LIMIT)
+			return PR_LANES_REPLAY;	// for the runaway loop error
+
+		for (i = n = 0; i < NVM_LANES; i++)
+		{
+			active[i] = -(lanepc[i] == pc);
+			lanepc[i] += active[i] & (pc + 1 - lanepc[i]);
+			n -= active[i];
+		}
+		st = &qcvm->statements[pc];
+		STAT(qcvm->stats.statements += n);
+		STAT(qcvm->stats.opcodes[st->op] += n);
+
+		switch (st->op)
+		{
+		case OP_ADD_F:
+			LANES(LC, _float, LA[i]._float + LB[i]._float);
+			break;
+		case OP_SUB_F:
+			LANES(LC, _float, LA[i]._float - LB[i]._float);
+			break;
+		case OP_MUL_F:
+			LANES(LC, _float, LA[i]._float * LB[i]._float);
+			break;
+		case OP_DIV_F:
+			LANES(LC, _float, LA[i]._float / LB[i]._float);
+			break;
+		case OP_ADD_V:
+			for (j = 0; j < 3; j++)
+				LANES(LV(LC, j), _float, LV(LA, j)[i]._float + LV(LB, j)[i]._float);
+			break;
+		case OP_SUB_V:
+			for (j = 0; j < 3; j++)
+				LANES(LV(LC, j), _float, LV(LA, j)[i]._float - LV(LB, j)[i]._float);
+			break;
+		case OP_MUL_V:
+			LANES(LC, _float, LA[i]._float * LB[i]._float + LV(LA, 1)[i]._float * LV(LB, 1)[i]._float +
+				LV(LA, 2)[i]._float * LV(LB, 2)[i]._float);
+			break;
+		case OP_MUL_FV:
+			for (j = 0; j < 3; j++)
+				LANES(LV(LC, j), _float, LA[i]._float * LV(LB, j)[i]._float);
+			break;
+		case OP_MUL_VF:
+			for (j = 0; j < 3; j++)
+				LANES(LV(LC, j), _float, LB[i]._float * LV(LA, j)[i]._float);
+			break;
+
+		case OP_BITAND:
+			LANES(LC, _float, (int)LA[i]._float & (int)LB[i]._float);
+			break;
+		case OP_BITOR:
+			LANES(LC, _float, (int)LA[i]._float | (int)LB[i]._float);
+			break;
+
+		case OP_GE:
+			LANES(LC, _float, LA[i]._float >= LB[i]._float);
+			break;
+		case OP_LE:
+			LANES(LC, _float, LA[i]._float <= LB[i]._float);
+			break;
+		case OP_GT:
+			LANES(LC, _float, LA[i]._float > LB[i]._float);
+			break;
+		case OP_LT:
+			LANES(LC, _float, LA[i]._float < LB[i]._float);
+			break;
+		case OP_AND:
+			LANES(LC, _float, LA[i]._float && LB[i]._float);
+			break;
+		case OP_OR:
+			LANES(LC, _float, LA[i]._float || LB[i]._float);
+			break;
+
+		case OP_NOT_F:
+			LANES(LC, _float, !LA[i]._float);
+			break;
+		case OP_NOT_V:
+			LANES(LC, _float, !LA[i]._float && !LV(LA, 1)[i]._float && !LV(LA, 2)[i]._float);
+			break;
+		case OP_NOT_FNC:
+		case OP_NOT_ENT:	// only the world is at offset 0
+			LANES(LC, _float, !LA[i]._int);
+			break;
+
+		case OP_EQ_F:
+			LANES(LC, _float, LA[i]._float == LB[i]._float);
+			break;
+		case OP_EQ_V:
+			LANES(LC, _float, LA[i]._float == LB[i]._float && LV(LA, 1)[i]._float == LV(LB, 1)[i]._float &&
+				LV(LA, 2)[i]._float == LV(LB, 2)[i]._float);
+			break;
+		case OP_EQ_E:
+		case OP_EQ_FNC:
+			LANES(LC, _float, LA[i]._int == LB[i]._int);
+			break;
+		case OP_NE_F:
+			LANES(LC, _float, LA[i]._float != LB[i]._float);
+			break;
+		case OP_NE_V:
+			LANES(LC, _float, LA[i]._float != LB[i]._float || LV(LA, 1)[i]._float != LV(LB, 1)[i]._float ||
+				LV(LA, 2)[i]._float != LV(LB, 2)[i]._float);
+			break;
+		case OP_NE_E:
+		case OP_NE_FNC:
+			LANES(LC, _float, LA[i]._int != LB[i]._int);
+			break;
+
+		case OP_STORE_F:
+		case OP_STORE_ENT:
+		case OP_STORE_FLD:
+		case OP_STORE_S:
+		case OP_STORE_FNC:
+			LANES(LB, _int, LA[i]._int);
+			break;
+		case OP_STORE_V:
+			for (j = 0; j < 3; j++)
+				LANES(LV(LB, j), _int, LV(LA, j)[i]._int);
+			break;
+
+		case OP_STOREP_F:
+		case OP_STOREP_ENT:
+		case OP_STOREP_FLD:
+		case OP_STOREP_S:
+		case OP_STOREP_FNC:
+			for (i = 0; i < NVM_LANES; i++)
+			{
+				if (active[i] && !PR_LaneStore(qcvm, i, LB[i]._int, &LA[i]._int, 1))
+					return PR_LANES_REPLAY;
+			}
+			break;
+		case OP_STOREP_V:
+			for (i = 0; i < NVM_LANES; i++)
+			{
+				if (!active[i])
+					continue;
+				for (j = 0; j < 3; j++)
+					values[j] = LV(LA, j)[i]._int;
+				if (!PR_LaneStore(qcvm, i, LB[i]._int, values, 3))
+					return PR_LANES_REPLAY;
+			}
+			break;
+
+		case OP_ADDRESS:
+			LANES(LC, _int, LA[i]._int + (int)offsetof(edict_t, v) + LB[i]._int * 4);
+			break;
+
+		case OP_LOAD_F:
+		case OP_LOAD_FLD:
+		case OP_LOAD_ENT:
+		case OP_LOAD_S:
+		case OP_LOAD_FNC:
+			for (i = 0; i < NVM_LANES; i++)
+			{
+				if (!active[i])
+					continue;
+				if (!(ed = PR_LaneEdict(qcvm, i, LA[i]._int, LB[i]._int, 1)))
+					return PR_LANES_REPLAY;
+				LC[i]._int = ((int *)&ed->v)[LB[i]._int];
+			}
+			break;
+		case OP_LOAD_V:
+			for (i = 0; i < NVM_LANES; i++)
+			{
+				if (!active[i])
+					continue;
+				if (!(ed = PR_LaneEdict(qcvm, i, LA[i]._int, LB[i]._int, 3)))
+					return PR_LANES_REPLAY;
+				for (j = 0; j < 3; j++)
+					values[j] = ((int *)&ed->v)[LB[i]._int + j];
+				for (j = 0; j < 3; j++)
+					LV(LC, j)[i]._int = values[j];
+			}
+			break;
+
+		case OP_IFNOT:
+		case OP_IF:
+			for (i = 0; i < NVM_LANES; i++)
+			{
+				if (active[i] && (LA[i]._int != 0) == (st->op == OP_IF))
+					lanepc[i] = pc + (int)st->b;
+			}
+			break;
+		case OP_IFNOT_F:
+		case OP_IF_F:
+			for (i = 0; i < NVM_LANES; i++)
+			{
+				if (active[i] && (LA[i]._float != 0) == (st->op == OP_IF_F))
+					lanepc[i] = pc + (int)st->b;
+			}
+			break;
+		case OP_GOTO:
+			for (i = 0; i < NVM_LANES; i++)
+			{
+				if (active[i])
+					lanepc[i] = pc + (int)st->a;
+			}
+			break;
+
+		case OP_DONE:
+		case OP_RETURN:
+			for (i = 0; i < NVM_LANES; i++)
+			{
+				if (active[i])
+					lanepc[i] = PR_LANE_DONE;
+			}
+			break;
+
+		case OP_CALL0:
+		case OP_CALL1:
+		case OP_CALL2:
+		case OP_CALL3:
+		case OP_CALL4:
+		case OP_CALL5:
+		case OP_CALL6:
+		case OP_CALL7:
+		case OP_CALL8:
+			// a lane at a time, with its parms, self and time in the VM's globals
+			for (i = 0; i < NVM_LANES; i++)
+			{
+				if (!active[i])
+					continue;
+				if (LA[i]._int <= 0 || LA[i]._int >= qcvm->progs->numfunctions)
+					return PR_LANES_REPLAY;
+				newf = &qcvm->functions[LA[i]._int];
+				if (newf->first_statement >= 0)
+					return PR_LANES_UNSUPPORTED;
+				call = PR_Builtin(qcvm, -newf->first_statement);
+				if (!call || !PR_ParallelSafe(qcvm->parallel, call))
+					return PR_LANES_UNSUPPORTED;
+
+				qcvm->argc = st->op - OP_CALL0;
+				for (j = OFS_PARM0; j < OFS_PARM0 + qcvm->argc * 3; j++)
+					qcvm->globals[j] = lg[j * NVM_LANES + i]._float;
+				qcvm->globals[selfofs] = lg[selfofs * NVM_LANES + i]._float;
+				qcvm->globals[timeofs] = lg[timeofs * NVM_LANES + i]._float;
+				qcvm->xstatement = pc;
+				STAT(qcvm->stats.builtin_calls++);
+				STAT(if (qcvm->builtincalls) qcvm->builtincalls[-newf->first_statement]++);
+				tempstrings = qcvm->tempstringcount;
+				call(qcvm);
+				if (qcvm->tempstringcount != tempstrings)
+					return PR_LANES_UNSUPPORTED;	// the lanes would share the ring
+				for (j = OFS_RETURN; j < OFS_RETURN + 3; j++)
+					lg[j * NVM_LANES + i]._float = qcvm->globals[j];
+			}
+			break;
+
+		case OP_STATE:
+			for (i = 0; i < NVM_LANES; i++)
+			{
+				if (!active[i])
+					continue;
+				values[0] = lg[selfofs * NVM_LANES + i]._int;
+				((float *)values)[1] = lg[timeofs * NVM_LANES + i]._float + 0.1;
+				if (!PR_LaneStore(qcvm, i, values[0] + (int)offsetof(edict_t, v.nextthink), values + 1, 1) ||
+					!PR_LaneStore(qcvm, i, values[0] + (int)offsetof(edict_t, v.frame), &LA[i]._int, 1) ||
+					!PR_LaneStore(qcvm, i, values[0] + (int)offsetof(edict_t, v.think), &LB[i]._int, 1))
+					return PR_LANES_REPLAY;
+			}
+			break;
+
+		default:
+			return PR_LANES_UNSUPPORTED;
+		}
+	}
+}
+
+#undef	LA
+#undef	LB
+#undef	LC
+#undef	LV
+#undef	LANES
+
+static int PR_LanesRun (NVM* qcvm, dfunction_t *f, int numlanes, int selfofs, int timeofs)
+{
+	jmp_buf		errorjmp;
+	void		*olderrorjmp = qcvm->errorjmp;
+	dfunction_t	*oldfunction = qcvm->xfunction;
+	int			r;
+
+	// an error in a builtin undoes the chunk, the serial run reports it
+	if (setjmp(errorjmp))
+		r = PR_LANES_REPLAY;
+	else
+	{
+		qcvm->errorjmp = &errorjmp;
+		qcvm->xfunction = f;
+		r = PR_ExecuteLanes(qcvm, f, numlanes, selfofs, timeofs);
+	}
+	qcvm->errorjmp = olderrorjmp;
+	qcvm->xfunction = oldfunction;
+	return r;
+}
+
+/*
+====================
+PR_LanesBatch
+
+nvmExecuteForEdicts for NVM_EDICTS_LANES: the batch is cut into chunks of
+consecutive edicts with the same function, each run in lanes or, when that
+can't be done, serially. Returns the errors, or -1 when the whole batch has
+to be run serially.
+====================
+*/
+static int PR_LanesBatch (NVM* qcvm, int field_or_func, int ofs, const int* edict_nums, int count, int flags, nvmedictstatus_t* results)
+{
+	prparallel_t	*p;
+	prlanes_t	*l;
+	dfunction_t	*f = NULL;
+	edict_t		*ed;
+	int			gofs = (float *)qcvm->global_struct - qcvm->globals;
+	int			selfofs, timeofs, i, j, k, n, o, r, start, end, fnum, numlanes, errors;
+	int			lanes[NVM_LANES], self;
+	float		time;
+
+	if (!qcvm->verified || qcvm->checked || qcvm->statementcounts || qcvm->capture || qcvm->profiling || qcvm->sampling || qcvm->trace ||
+		gofs < 0 || gofs + (int)(sizeof(globalvars_t) / sizeof(float)) > qcvm->progs->numglobals)
+		return -1;
+	p = PR_Parallel(qcvm);
+	if (!p->unsafe && !PR_ParallelUnsafe(qcvm))
+		return -1;
+	selfofs = (float *)&qcvm->global_struct->self - qcvm->globals;
+	timeofs = (float *)&qcvm->global_struct->time - qcvm->globals;
+	if ((p->lanes && p->lanes->busy) || !(l = PR_LanesAlloc(qcvm, count, selfofs, timeofs)))
+		return -1;
+	if (!edict_nums)
+	{
+		for (i = 0; i < count; i++)
+			l->list[i] = i;
+		edict_nums = l->list;
+	}
+	self = qcvm->global_struct->self;
+	time = qcvm->global_struct->time;
+	l->stale = true;
+	l->busy = true;
+
+	errors = 0;
+	for (start = end = 0; start < count; start = end)
+	{
+		if (!++l->serial)
+		{
+			memset(l->stamp, 0, l->maxedicts * sizeof(unsigned int));
+			l->serial = 1;
+		}
+
+		// a chunk, with the edicts skipped before and in it
+		for (numlanes = 0; end < count; end++)
+		{
+			n = edict_nums[end];
+			fnum = 0;
+			if (n >= 0 && n < qcvm->num_edicts)
+			{
+				ed = (edict_t *)((byte *)qcvm->edicts + n * qcvm->edict_size);
+				fnum = ed->free ? 0 : ofs >= 0 ? E_INT(ed, ofs) : field_or_func;
+				if (fnum && (numlanes == NVM_LANES || fnum < 0 || fnum >= qcvm->progs->numfunctions ||
+					(numlanes && &qcvm->functions[fnum] != f)))
+					break;
+				// the lanes before it in the batch may change what was checked
+				PR_LaneTouch(l, n, numlanes, false);
+			}
+			if (results)
+				results[end] = NVM_EDICT_SKIPPED;
+			if (!fnum)
+				continue;
+			f = &qcvm->functions[fnum];
+			if (f->first_statement <= 0 || p->unsafe[fnum] || l->unsupported[fnum])
+				break;
+			lanes[numlanes++] = end;
+		}
+
+		r = PR_LANES_REPLAY;
+		if (numlanes)
+		{
+			if (l->stale)
+			{
+				for (i = 0; i < l->numshared; i++)
+				{
+					for (k = 0; k < NVM_LANES; k++)
+						l->globals[l->shared[i] * NVM_LANES + k]._float = qcvm->globals[l->shared[i]];
+				}
+				l->stale = false;
+			}
+			l->numundo = 0;
+			r = PR_LANES_RAN;
+			for (k = 0; k < numlanes; k++)
+			{
+				l->globals[selfofs * NVM_LANES + k]._int = n = edict_nums[lanes[k]] * qcvm->edict_size;
+				l->globals[timeofs * NVM_LANES + k]._float = time;
+				// the locals and parms PR_EnterFunction would give f
+				for (i = 0; i < f->locals; i++)
+					l->globals[(f->parm_start + i) * NVM_LANES + k]._int = ((int *)qcvm->globals)[f->parm_start + i];
+				for (i = 0, o = f->parm_start; i < f->numparms; i++)
+				{
+					for (j = 0; j < f->parm_size[i]; j++, o++)
+						l->globals[o * NVM_LANES + k]._int = ((int *)qcvm->globals)[OFS_PARM0 + i * 3 + j];
+				}
+				l->read[k] = n;	// logged when the chunk was formed
+				l->wrote[k] = -qcvm->edict_size;
+				if (flags & NVM_EDICTS_THINKTIME)
+				{
+					ed = PROG_TO_EDICT(n);
+					if (ed->v.nextthink > time)
+						l->globals[timeofs * NVM_LANES + k]._float = ed->v.nextthink;
+					i = 0;
+					if (!PR_LaneStore(qcvm, k, n + (int)offsetof(edict_t, v.nextthink), &i, 1))
+						r = PR_LANES_REPLAY;
+				}
+			}
+			if (r == PR_LANES_RAN)
+				r = PR_LanesRun(qcvm, f, numlanes, selfofs, timeofs);
+			qcvm->global_struct->self = self;
+			qcvm->global_struct->time = time;
+			STAT(qcvm->stats.lane_thinks += numlanes);
+			if (r == PR_LANES_RAN)
+			{
+				for (k = 0; results && k < numlanes; k++)
+					results[lanes[k]] = NVM_EDICT_RAN;
+				STAT(qcvm->stats.function_calls += numlanes);
+				continue;
+			}
+			PR_LanesUndo(qcvm);
+			if (r == PR_LANES_UNSUPPORTED)
+				l->unsupported[f - qcvm->functions] = true;
+			STAT(qcvm->stats.lane_replays += numlanes);
+		}
+		else if (end < count)
+			end++;	// one that can't run in lanes, on its own
+		else
+			continue;
+
+		errors += nvmExecuteForEdicts(qcvm, field_or_func, edict_nums + start, end - start,
+			flags & ~(NVM_EDICTS_LANES | NVM_EDICTS_PARALLEL), results ? results + start : NULL);
+		l->stale = true;
+	}
+	l->busy = false;
+	return errors;
+}
+
+/*
+====================
+PR_ExecuteProgram
+
+Runs from the statement after the given one until the stack unwinds to
+exitdepth. With a budget, execution is suspended once that many statements
+have run; the limit is only checked on backward branches and calls, which
+any long running code has to go through, so it may overrun by a few
+statements.
+
+Progs that passed the verifier run the unchecked copy of the loop, unless a
+layout profile's counts or a trace want the checked one's per statement
+hooks. The parallel copy is only run by PR_WorkerRun.
+====================
+*/
+#define	PR_EXECUTE	PR_ExecuteUnchecked
+#define	PR_CHECKED	0
+#define	PR_PARALLEL	0
+#include "pr_execloop.h"
+
+#define	PR_EXECUTE	PR_ExecuteChecked
+#define	PR_CHECKED	1
+#define	PR_PARALLEL	0
+#include "pr_execloop.h"
+
+#define	PR_EXECUTE	PR_ExecuteParallel
+#define	PR_CHECKED	0
+#define	PR_PARALLEL	1
+#include "pr_execloop.h"
+
+static nvmstatus_t PR_ExecuteProgram (NVM* qcvm, int statement, int exitdepth, int budget, int thread)
+{
+	if (qcvm->verified && !qcvm->checked && !qcvm->statementcounts && !qcvm->trace)
+		return PR_ExecuteUnchecked(qcvm, statement, exitdepth, budget, thread);
+	return PR_ExecuteChecked(qcvm, statement, exitdepth, budget, thread);
+}
+#undef OPA
+#undef OPB
+#undef OPC
+
+static dfunction_t *PR_CheckFunction (NVM* qcvm, func_t fnum)
+{
+	if (!fnum || fnum >= qcvm->progs->numfunctions)
+	{
+		// if (qcvm->global_struct->self) ED_Print (PROG_TO_EDICT(qcvm->global_struct->self));
+		Errorf (qcvm, "PR_ExecuteProgram: NULL function");
+	}
+
+	//FIXME: if this is a builtin, then we're going to crash.
+
+	if (!qcvm->verified || qcvm->checked)
+	{
+		const char *error = PR_FunctionError(qcvm, &qcvm->functions[fnum]);
+		if (error)
+			Errorf (qcvm, "PR_ExecuteProgram: %s: %s", PR_GetString(qcvm, qcvm->functions[fnum].s_name), error);
+	}
+	if (PR_Stripped(&qcvm->functions[fnum]))
+		Errorf (qcvm, "PR_ExecuteProgram: %s was stripped at load", PR_GetString(qcvm, qcvm->functions[fnum].s_name));
+
+	return &qcvm->functions[fnum];
+}
+
+void nvmExecuteFunction(NVM* qcvm, func_t fnum)
+{
+	dfunction_t	*f = PR_CheckFunction(qcvm, fnum);
+	int		exitdepth;
+
+// make a stack frame
+	exitdepth = qcvm->depth;
+
+	if (qcvm->profiling)
+	{
+		if (!qcvm->depth)
+			qcvm->profile->current = 0;
+		PR_ProfileEnter(qcvm, f, 0);
+	}
+	if (qcvm->capture)
+		PR_CaptureEnter(qcvm, fnum);
+	PR_ExecuteProgram(qcvm, PR_EnterFunction(qcvm, f), exitdepth, 0, 0);
+	if (qcvm->capture)
+		PR_CaptureLeave(qcvm);
+}
+
+/*
+====================
+nvmExecuteBudget
+
+Like nvmExecuteFunction, but gives up after roughly max_statements and
+returns NVM_YIELDED, leaving the QC stack in place for nvmResume. Other
+functions may be executed while one is suspended, but only one budgeted
+call can be suspended at a time.
+====================
+*/
+nvmstatus_t nvmExecuteBudget(NVM* qcvm, func_t fnum, int max_statements)
+{
+	dfunction_t	*f = PR_CheckFunction(qcvm, fnum);
+	int		exitdepth, hostnode = 0;
+	nvmstatus_t	status;
+
+	if (qcvm->suspended)
+		Errorf (qcvm, "nvmExecuteBudget: a budgeted call is already suspended");
+
+	exitdepth = qcvm->depth;
+
+	if (qcvm->profiling)
+	{
+		if (!qcvm->depth)
+			qcvm->profile->current = 0;
+		hostnode = qcvm->profile->current;
+		PR_ProfileEnter(qcvm, f, 0);
+	}
+	status = PR_ExecuteProgram(qcvm, PR_EnterFunction(qcvm, f), exitdepth, max_statements, 0);
+	if (status == NVM_YIELDED && qcvm->profiling)
+	{	// the time until the resume belongs to the host
+		qcvm->suspendprofnode = qcvm->profile->current;
+		qcvm->profile->current = hostnode;
+	}
+	return status;
+}
+
+nvmstatus_t nvmResume(NVM* qcvm, int max_statements)
+{
+	int		hostnode = 0;
+	nvmstatus_t	status;
+
+	if (!qcvm->suspended)
+		return NVM_COMPLETED;
+	qcvm->suspended = false;
+
+	if (qcvm->profiling)
+	{
+		PR_ProfileFlush(qcvm, 0);
+		hostnode = qcvm->profile->current;
+		if (qcvm->suspendprofnode < qcvm->profile->numnodes)
+			qcvm->profile->current = qcvm->suspendprofnode;
+	}
+	memcpy(&qcvm->globals[OFS_RETURN], qcvm->suspendreturn, sizeof(qcvm->suspendreturn));
+	status = PR_ExecuteProgram(qcvm, qcvm->suspendstatement, qcvm->suspendexitdepth, max_statements, 0);
+	if (status == NVM_YIELDED && qcvm->profiling)
+	{
+		qcvm->suspendprofnode = qcvm->profile->current;
+		qcvm->profile->current = hostnode;
+	}
+	return status;
+}
+
+/*
+====================
+nvmExecuteForEdicts
+
+Runs a function for each of count edicts (0 to count - 1 when edict_nums
+is NULL) with self set to it. With NVM_EDICTS_FIELD, field_or_func is a
+function field and each edict runs its own; free edicts, edicts out of
+range and edicts whose field is 0 are skipped. The host side of a call is
+done once for the batch, and a run time error only ends the edict it
+happened in. self, and time with NVM_EDICTS_THINKTIME, are restored
+afterwards. Returns how many edicts failed, results gets each one's
+outcome if it isn't NULL.
+====================
+*/
+int nvmExecuteForEdicts(NVM* qcvm, int field_or_func, const int* edict_nums, int count, int flags, nvmedictstatus_t* results)
+{
+	jmp_buf		errorjmp;
+	void		*olderrorjmp = qcvm->errorjmp;
+	volatile int	i = 0, errors = 0;
+	volatile func_t	lastfunc = 0;
+	int			exitdepth = qcvm->depth, oldthread = qcvm->xthread;
+	int			n, ofs = -1, self;
+	float		time;
+	func_t		fnum;
+	dfunction_t	*f;
+	edict_t		*ed;
+	prthread_t	*t;
+	BuiltinFunction	builtin;
+	const char	*error;
+	nvmedictstatus_t	status;
+
+	if (!qcvm->global_struct)
+	{
+		Errorf(qcvm, "nvmExecuteForEdicts: no system globals");
+		return 0;
+	}
+	if (flags & NVM_EDICTS_FIELD)
+	{
+		if (field_or_func < 0 || field_or_func >= qcvm->progs->numfielddefs || qcvm->fielddefs[field_or_func].type != ev_function)
+		{
+			Errorf(qcvm, "nvmExecuteForEdicts: %i is not a function field", field_or_func);
+			return 0;
+		}
+		ofs = qcvm->fielddefs[field_or_func].ofs;
+	}
+	else
+		lastfunc = PR_CheckFunction(qcvm, field_or_func) - qcvm->functions;
+	if (qcvm->capture)
+		PR_CaptureEdicts(qcvm, field_or_func, edict_nums, count, flags);
+	if ((flags & NVM_EDICTS_PARALLEL) && (n = PR_ParallelBatch(qcvm, field_or_func, ofs, edict_nums, count, flags, results)) >= 0)
+		return n;
+	if ((flags & NVM_EDICTS_LANES) && (n = PR_LanesBatch(qcvm, field_or_func, ofs, edict_nums, count, flags, results)) >= 0)
+		return n;
+	time = qcvm->global_struct->time;
+	self = qcvm->global_struct->self;
+
+	if (setjmp(errorjmp))
+	{	// from PR_RunError, take down what the edict's QC left behind
+		while (qcvm->depth > exitdepth)
+		{
+			if (qcvm->profiling)
+				PR_ProfileLeave(qcvm, 0);
+			PR_LeaveFunction(qcvm);
+		}
+		if (qcvm->xthread != oldthread && (t = PR_GetThread(qcvm, qcvm->xthread)) != NULL)
+			PR_ReleaseThread(t);	// made by nvmSuspend before the error
+		qcvm->xthread = oldthread;
+		qcvm->suspendrequest = false;
+		if (results)
+			results[i] = NVM_EDICT_ERROR;
+		errors++;
+		i++;
+	}
+	qcvm->errorjmp = &errorjmp;
+
+	for ( ; i < count; i++)
+	{
+		status = NVM_EDICT_SKIPPED;
+		n = edict_nums ? edict_nums[i] : i;
+		if (n < 0 || n >= qcvm->num_edicts)
+			goto next;
+		ed = (edict_t *)((byte *)qcvm->edicts + n * qcvm->edict_size);
+		if (ed->free)
+			goto next;
+		fnum = ofs >= 0 ? E_INT(ed, ofs) : field_or_func;
+		if (!fnum)
+			goto next;
+
+		// a field mostly holds the same function from one edict to the next
+		if (fnum != lastfunc)
+		{
+			error = NULL;
+			if (fnum < 0 || fnum >= qcvm->progs->numfunctions)
+				error = "bad function";
+			else if (!qcvm->verified || qcvm->checked)
+				error = PR_FunctionError(qcvm, &qcvm->functions[fnum]);
+			if (!error && PR_Stripped(&qcvm->functions[fnum]))
+				error = "function was stripped at load";
+			if (error)
+			{
+				Printf(qcvm, "nvmExecuteForEdicts: edict %i: %s\n", n, error);
+				status = NVM_EDICT_ERROR;
+				errors++;
+				goto next;
+			}
+			lastfunc = fnum;
+		}
+		f = &qcvm->functions[fnum];
+
+		if (flags & NVM_EDICTS_THINKTIME)
+		{
+			qcvm->global_struct->time = ed->v.nextthink > time ? ed->v.nextthink : time;
+			ed->v.nextthink = 0;
+		}
+		qcvm->global_struct->self = EDICT_TO_PROG(ed);
+
+		if (f->first_statement < 0)
+		{
+			builtin = PR_Builtin(qcvm, -f->first_statement);
+			if (qcvm->capture)
+			{	// the wrappers can't find fnum from an OP_CALL
+				qcvm->capture->direct = fnum;
+				builtin = qcvm->capture->replaying ? PR_ReplayBuiltin : builtin ? PR_CaptureBuiltin : NULL;
+			}
+			if (!builtin)
+			{
+				Printf(qcvm, "nvmExecuteForEdicts: edict %i: builtin #%i is not bound\n", n, -f->first_statement);
+				status = NVM_EDICT_ERROR;
+				errors++;
+				goto next;
+			}
+			builtin(qcvm);
+			status = NVM_EDICT_RAN;
+			goto next;
+		}
+
+		if (qcvm->profiling)
+		{
+			if (!qcvm->depth)
+				qcvm->profile->current = 0;
+			PR_ProfileEnter(qcvm, f, 0);
+		}
+		if (PR_ExecuteProgram(qcvm, PR_EnterFunction(qcvm, f), exitdepth, 0, 0) == NVM_SUSPENDED)
+			status = NVM_EDICT_SUSPENDED;
+		else
+			status = NVM_EDICT_RAN;
+next:
+		if (results)
+			results[i] = status;
+	}
+
+	qcvm->errorjmp = olderrorjmp;
+	qcvm->global_struct->self = self;
+	if (flags & NVM_EDICTS_THINKTIME)
+		qcvm->global_struct->time = time;
+	if (qcvm->capture)
+		PR_CaptureLeave(qcvm);
+	return errors;
+}
+
+/*
+====================
+nvmSuspend
+
+Called from a builtin: once the builtin returns, the QC that called it is
+suspended until nvmWake makes it ready and nvmRunThreads resumes it. The
+call that started the QC (nvmExecuteFunction and friends) returns right
+away. Returns the thread id to wake it with; the builtin's return value is
+kept for the resume unless nvmWake replaces it. Returns 0 and leaves the
+QC running when no thread can be made for it.
+====================
+*/
+int nvmSuspend(NVM* qcvm)
+{
+	prthread_t	*t;
+
+	if (qcvm->worker)
+		PR_ParallelAbort(qcvm);
+	if (qcvm->depth <= 0)
+	{
+		Errorf(qcvm, "nvmSuspend: no QC running");
+		return 0;
+	}
+	if (!qcvm->xthread)
+	{
+		t = PR_NewThread(qcvm);
+		if (!t)
+			return 0;
+		qcvm->xthread = t->id;
+	}
+	qcvm->suspendrequest = true;
+	return qcvm->xthread;
+}
+
+void nvmWake(NVM* qcvm, int thread, const eval_t* result)
+{
+	prthread_t	*t = PR_GetThread(qcvm, thread);
+
+	if (!t)
+		return;
+	if (result)
+		memcpy(t->returnvalue, result, sizeof(t->returnvalue));
+	if (t->state == NVM_THREAD_RUNNING)
+		t->wakepending = true;
+	else if (t->state == NVM_THREAD_WAITING)
+		PR_MakeReady(qcvm, t);
+}
+
+void nvmKillThread(NVM* qcvm, int thread)
+{
+	prthread_t	*t = PR_GetThread(qcvm, thread);
+	int		i, prev;
+
+	if (!t)
+		return;
+	if (t->state == NVM_THREAD_RUNNING)
+	{	// its frames are still on the stack, drop it when it suspends
+		t->killed = true;
+		return;
+	}
+	if (t->state == NVM_THREAD_READY)
+	{
+		for (i = qcvm->readyhead, prev = -1; i >= 0 && &qcvm->threads[i] != t; prev = i, i = qcvm->threads[i].next)
+			;
+		if (prev >= 0)
+			qcvm->threads[prev].next = t->next;
+		else
+			qcvm->readyhead = t->next;
+		if (qcvm->readytail == i)
+			qcvm->readytail = prev;
+	}
+	PR_ReleaseThread(t);
+}
+
+nvmthreadstate_t nvmThreadState(NVM* qcvm, int thread)
+{
+	prthread_t	*t = PR_GetThread(qcvm, thread);
+
+	return t ? t->state : NVM_THREAD_NONE;
+}
+
+/*
+====================
+nvmRunThreads
+
+Resumes up to max_threads of the threads that are ready (all of them with 0),
+in the order they became ready. With max_statements, a thread that runs out
+of statements goes to the back of the queue. Returns the number resumed.
+====================
+*/
+int nvmRunThreads(NVM* qcvm, int max_threads, int max_statements)
+{
+	prthread_t	*t;
+	int		i, n, count, id, exitdepth;
+
+	// only the threads that are ready now, not the ones requeued or woken while running these
+	for (count = 0, i = qcvm->readyhead; i >= 0; i = qcvm->threads[i].next)
+		count++;
+	if (max_threads > 0 && count > max_threads)
+		count = max_threads;
+
+	for (n = 0; n < count; n++)
+	{
+		i = qcvm->readyhead;
+		t = &qcvm->threads[i];
+		qcvm->readyhead = t->next;
+		if (qcvm->readyhead < 0)
+			qcvm->readytail = -1;
+		id = t->id;
+
+		exitdepth = qcvm->depth;
+		PR_AttachThread(qcvm, t);
+		if (PR_ExecuteProgram(qcvm, t->statement, exitdepth, max_statements, id) == NVM_COMPLETED)
+		{
+			if ((t = PR_GetThread(qcvm, id)) != NULL)	// the array may have grown
+				PR_ReleaseThread(t);
+		}
+	}
+	return n;
+}
+
+/*
+===============================================================================
+
+PROGS CACHE
+
+With nvmSetProgsCache, nvmLoadProgs keeps what it made of a progs image in
+<filename>.nvmc: the widened and inlined statements, the initial globals,
+the functions and defs and the verifier's verdict. The file is laid out to
+be mapped as it is, so a warm start checks the key and points the VM into
+the mapping instead of redoing the load-time passes. The key is the file's
+crc, hash and size, NVM_VERSION and the sizes of the structs in the lumps,
+and the inlining, stripping and layout settings. The file may have been
+changed since it was written, so a verified image is verified again once
+mapped; that is the one pass a warm start still makes. Globals and
+functions are written to at run time, the mapping is private so those
+pages are copied on write.
+
+===============================================================================
+*/
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#define	PR_CACHE_MAGIC		(('N') | ('V' << 8) | ('M' << 16) | ('C' << 24))
+#define	PR_CACHE_ALIGN		16
+
+typedef struct
+{
+	int		magic;
+	int		version;		/* NVM_VERSION */
+	int		headersize;		/* and the sizes of what the lumps hold, for builds that lay them out differently */
+	int		statementsize, functionsize, defsize, inlinedsize;
+	unsigned int	progssize;
+	unsigned int	progshash;
+	int		progscrc;
+	int		inlinelimit;
+	int		stripflags;
+	unsigned int	striphash;		/* of the entry points */
+	unsigned int	layouthash;		/* of the nvmSetLayoutProfile file */
+	int		verified;
+	int		laidout;
+	nvmstripstats_t	stripped;
+
+	int		numstatements, ofs_statements;
+	int		numglobals, ofs_globals;
+	int		numfunctions, ofs_functions;
+	int		numglobaldefs, ofs_globaldefs;
+	int		numfielddefs, ofs_fielddefs;
+	int		numinlinedranges, ofs_inlinedranges;
+	int		ofs_strippedfuncs;		/* (numfunctions + 7) / 8 bytes when any were stripped */
+} prcacheheader_t;
+
+static unsigned short	pr_crctable[256];
+
+/*
+====================
+PR_CRC
+
+The crc16 (CCITT) Quake keeps of progs files
+====================
+*/
+static unsigned short PR_CRC (const byte *data, size_t size)
+{
+	unsigned short	crc = 0xffff;
+	int		i, j;
+
+	if (!pr_crctable[1])
+	{
+		for (i = 0; i < 256; i++)
+		{
+			crc = i << 8;
+			for (j = 0; j < 8; j++)
+				crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+			pr_crctable[i] = crc;
+		}
+		crc = 0xffff;
+	}
+	while (size--)
+		crc = (crc << 8) ^ pr_crctable[(crc >> 8) ^ (unsigned char)*data++];
+	return crc;
+}
+
+#define	PR_MD4F(x, y, z)	(((x) & (y)) | (~(x) & (z)))
+#define	PR_MD4G(x, y, z)	(((x) & (y)) | ((x) & (z)) | ((y) & (z)))
+#define	PR_MD4H(x, y, z)	((x) ^ (y) ^ (z))
+#define	PR_ROL(x, n)		(((x) << (n)) | ((x) >> (32 - (n))))
+
+static void PR_MD4Block (unsigned int *state, const unsigned char *block)
+{
+	static const int	r2[16] = { 0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15 };
+	static const int	r3[16] = { 0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13, 3, 11, 7, 15 };
+	static const int	s1[4] = { 3, 7, 11, 19 }, s2[4] = { 3, 5, 9, 13 }, s3[4] = { 3, 9, 11, 15 };
+	unsigned int	x[16], v[4], t;
+	int		i;
+
+	for (i = 0; i < 16; i++)
+		x[i] = block[i*4] | (block[i*4+1] << 8) | (block[i*4+2] << 16) | ((unsigned int)block[i*4+3] << 24);
+	for (i = 0; i < 4; i++)
+		v[i] = state[i];
+
+	// each step updates a, d, c, b in turn
+	for (i = 0; i < 16; i++)
+	{
+		t = v[(16 - i) & 3] + PR_MD4F(v[(17 - i) & 3], v[(18 - i) & 3], v[(19 - i) & 3]) + x[i];
+		v[(16 - i) & 3] = PR_ROL(t, s1[i & 3]);
+	}
+	for (i = 0; i < 16; i++)
+	{
+		t = v[(16 - i) & 3] + PR_MD4G(v[(17 - i) & 3], v[(18 - i) & 3], v[(19 - i) & 3]) + x[r2[i]] + 0x5a827999;
+		v[(16 - i) & 3] = PR_ROL(t, s2[i & 3]);
+	}
+	for (i = 0; i < 16; i++)
+	{
+		t = v[(16 - i) & 3] + PR_MD4H(v[(17 - i) & 3], v[(18 - i) & 3], v[(19 - i) & 3]) + x[r3[i]] + 0x6ed9eba1;
+		v[(16 - i) & 3] = PR_ROL(t, s3[i & 3]);
+	}
+
+	for (i = 0; i < 4; i++)
+		state[i] += v[i];
+}
+
+/*
+====================
+PR_BlockChecksum
+
+The MD4 of a block folded to 32 bits, as Quake's Com_BlockChecksum
+====================
+*/
+static unsigned int PR_BlockChecksum (const byte *data, size_t size)
+{
+	unsigned int	state[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+	unsigned char	tail[128];
+	unsigned long long	bits = (unsigned long long)size * 8;
+	size_t	i, n;
+
+	for (i = 0; i + 64 <= size; i += 64)
+		PR_MD4Block(state, (const unsigned char *)data + i);
+
+	n = size - i;
+	memcpy(tail, data + i, n);
+	tail[n++] = 0x80;
+	while (n % 64 != 56)
+		tail[n++] = 0;
+	for (i = 0; i < 8; i++)
+		tail[n++] = (unsigned char)(bits >> (i * 8));
+	for (i = 0; i < n; i += 64)
+		PR_MD4Block(state, tail + i);
+
+	return state[0] ^ state[1] ^ state[2] ^ state[3];
+}
+
+static void PR_CacheFree (NVM* qcvm)
+{
+	if (!qcvm->cache)
+		return;
+#ifdef _WIN32
+	qcvm->alloc_callback(qcvm, qcvm->cache, 0, "progs cache");
+#else
+	munmap(qcvm->cache, qcvm->cachesize);
+#endif
+	qcvm->cache = NULL;
+	qcvm->cachesize = 0;
+}
+
+static unsigned int PR_CacheStripHash (NVM* qcvm)
+{
+	return qcvm->striproots ? PR_BlockChecksum((const byte *)qcvm->striproots, qcvm->striprootssize) : 0;
+}
+
+static qboolean PR_CacheLump (prcacheheader_t *h, size_t size, int ofs, int count, size_t elementsize)
+{
+	return ofs >= (int)sizeof(*h) && !(ofs % PR_CACHE_ALIGN) && PR_LumpValid(size, ofs, count, elementsize);
+}
+
+/*
+====================
+PR_CacheLoad
+
+Points the VM into filename's cache if it has one for this image. The
+progs header has been byte swapped, the lumps haven't.
+====================
+*/
+static qboolean PR_CacheLoad (NVM* qcvm, const char *filename)
+{
+	char		path[1024];
+	prcacheheader_t	*h;
+	void		*cache;
+	size_t		size;
+
+	if (snprintf(path, sizeof(path), "%s.nvmc", filename) >= (int)sizeof(path))
+		return false;
+#ifdef _WIN32
+	{
+		FILE	*f = fopen(path, "rb");
+		long	n;
+
+		if (!f)
+			return false;
+		fseek(f, 0, SEEK_END);
+		n = ftell(f);
+		fseek(f, 0, SEEK_SET);
+		cache = n > 0 ? qcvm->alloc_callback(qcvm, NULL, n, "progs cache") : NULL;
+		if (cache && fread(cache, 1, n, f) != (size_t)n)
+		{
+			qcvm->alloc_callback(qcvm, cache, 0, "progs cache");
+			cache = NULL;
+		}
+		fclose(f);
+		if (!cache)
+			return false;
+		size = n;
+	}
+#else
+	{
+		struct stat	st;
+		int		fd = open(path, O_RDONLY);
+
+		if (fd < 0)
+			return false;
+		if (fstat(fd, &st) < 0 || st.st_size <= 0)
+		{
+			close(fd);
+			return false;
+		}
+		size = st.st_size;
+		cache = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (cache == MAP_FAILED)
+			return false;
+	}
+#endif
+	qcvm->cache = cache;
+	qcvm->cachesize = size;
+
+	h = (prcacheheader_t *)cache;
+	if (size < sizeof(*h) || h->magic != PR_CACHE_MAGIC || h->version != NVM_VERSION || h->headersize != sizeof(*h) ||
+		h->statementsize != sizeof(dstatement_t) || h->functionsize != sizeof(dfunction_t) ||
+		h->defsize != sizeof(ddef_t) || h->inlinedsize != sizeof(prinlined_t) ||
+		h->progssize != qcvm->progssize || h->progshash != qcvm->progshash || h->progscrc != qcvm->progscrc ||
+		h->inlinelimit != (qcvm->inlinelimit > 0 ? qcvm->inlinelimit : 0) ||
+		h->stripflags != qcvm->stripflags || h->striphash != PR_CacheStripHash(qcvm) || h->layouthash != qcvm->layouthash ||
+		h->numfunctions != qcvm->progs->numfunctions || h->numglobaldefs > qcvm->progs->numglobaldefs ||
+		h->numfielddefs != qcvm->progs->numfielddefs ||
+		!PR_CacheLump(h, size, h->ofs_statements, h->numstatements, sizeof(dstatement_t)) ||
+		!PR_CacheLump(h, size, h->ofs_globals, h->numglobals, sizeof(float)) ||
+		!PR_CacheLump(h, size, h->ofs_functions, h->numfunctions, sizeof(dfunction_t)) ||
+		!PR_CacheLump(h, size, h->ofs_globaldefs, h->numglobaldefs, sizeof(ddef_t)) ||
+		!PR_CacheLump(h, size, h->ofs_fielddefs, h->numfielddefs, sizeof(ddef_t)) ||
+		!PR_CacheLump(h, size, h->ofs_inlinedranges, h->numinlinedranges, sizeof(prinlined_t)) ||
+		!PR_CacheLump(h, size, h->ofs_strippedfuncs, h->stripped.functions ? (h->numfunctions + 7) >> 3 : 0, 1))
+	{
+		DPrintf(qcvm, "%s is out of date\n", path);
+		PR_CacheFree(qcvm);
+		return false;
+	}
+
+	qcvm->statements = (dstatement_t *)((byte *)cache + h->ofs_statements);
+	qcvm->globals = (float *)((byte *)cache + h->ofs_globals);
+	qcvm->functions = (dfunction_t *)((byte *)cache + h->ofs_functions);
+	qcvm->globaldefs = (ddef_t *)((byte *)cache + h->ofs_globaldefs);
+	qcvm->fielddefs = (ddef_t *)((byte *)cache + h->ofs_fielddefs);
+	qcvm->inlinedranges = (prinlined_t *)((byte *)cache + h->ofs_inlinedranges);
+	qcvm->numinlinedranges = h->numinlinedranges;
+	qcvm->progs->numstatements = h->numstatements;
+	qcvm->progs->numglobals = h->numglobals;
+	qcvm->progs->numglobaldefs = h->numglobaldefs;
+	qcvm->verified = h->verified;
+	qcvm->laidout = h->laidout;
+	qcvm->stripped = h->stripped;
+	if (h->stripped.functions)
+	{
+		qcvm->strippedfuncs = (byte *) qcvm->alloc_callback(qcvm, NULL, (h->numfunctions + 7) >> 3, "stripped functions");
+		if (!qcvm->strippedfuncs)
+		{
+			PR_CacheFree(qcvm);
+			return false;
+		}
+		memcpy(qcvm->strippedfuncs, (byte *)cache + h->ofs_strippedfuncs, (h->numfunctions + 7) >> 3);
+	}
+	DPrintf(qcvm, "%s loaded from %s\n", filename, path);
+	return true;
+}
+
+static size_t PR_CacheAlign (size_t ofs)
+{
+	return (ofs + PR_CACHE_ALIGN - 1) & ~(size_t)(PR_CACHE_ALIGN - 1);
+}
+
+/*
+====================
+PR_CacheWrite
+
+Saves the freshly loaded image for PR_CacheLoad. Written to a temporary file
+named for the process and the VM and renamed, so instances starting together,
+in one process or several, never map half a cache.
+====================
+*/
+static void PR_CacheWrite (NVM* qcvm, const char *filename)
+{
+	char		path[1024], temp[1100];
+	prcacheheader_t	h;
+	const void	*lumps[7];
+	size_t		sizes[7], ofs;
+	static const char	zeros[PR_CACHE_ALIGN];
+	FILE		*f;
+	qboolean	ok;
+	int			i;
+
+	if (snprintf(path, sizeof(path), "%s.nvmc", filename) >= (int)sizeof(path))
+		return;
+#ifdef _WIN32
+	snprintf(temp, sizeof(temp), "%s.%p.tmp", path, (void *)qcvm);
+#else
+	snprintf(temp, sizeof(temp), "%s.%u.%p.tmp", path, (unsigned int)getpid(), (void *)qcvm);
+#endif
+
+	memset(&h, 0, sizeof(h));
+	h.magic = PR_CACHE_MAGIC;
+	h.version = NVM_VERSION;
+	h.headersize = sizeof(h);
+	h.statementsize = sizeof(dstatement_t);
+	h.functionsize = sizeof(dfunction_t);
+	h.defsize = sizeof(ddef_t);
+	h.inlinedsize = sizeof(prinlined_t);
+	h.progssize = qcvm->progssize;
+	h.progshash = qcvm->progshash;
+	h.progscrc = qcvm->progscrc;
+	h.inlinelimit = qcvm->inlinelimit > 0 ? qcvm->inlinelimit : 0;
+	h.stripflags = qcvm->stripflags;
+	h.striphash = PR_CacheStripHash(qcvm);
+	h.layouthash = qcvm->layouthash;
+	h.verified = qcvm->verified;
+	h.laidout = qcvm->laidout;
+	h.stripped = qcvm->stripped;
+	h.numstatements = qcvm->progs->numstatements;
+	h.numglobals = qcvm->progs->numglobals;
+	h.numfunctions = qcvm->progs->numfunctions;
+	h.numglobaldefs = qcvm->progs->numglobaldefs;
+	h.numfielddefs = qcvm->progs->numfielddefs;
+	h.numinlinedranges = qcvm->numinlinedranges;
+
+	lumps[0] = qcvm->statements, sizes[0] = h.numstatements * sizeof(dstatement_t);
+	lumps[1] = qcvm->globals, sizes[1] = h.numglobals * sizeof(float);
+	lumps[2] = qcvm->functions, sizes[2] = h.numfunctions * sizeof(dfunction_t);
+	lumps[3] = qcvm->globaldefs, sizes[3] = h.numglobaldefs * sizeof(ddef_t);
+	lumps[4] = qcvm->fielddefs, sizes[4] = h.numfielddefs * sizeof(ddef_t);
+	lumps[5] = qcvm->inlinedranges, sizes[5] = h.numinlinedranges * sizeof(prinlined_t);
+	lumps[6] = qcvm->strippedfuncs, sizes[6] = qcvm->strippedfuncs ? (h.numfunctions + 7) >> 3 : 0;
+	ofs = PR_CacheAlign(sizeof(h));
+	h.ofs_statements = ofs, ofs = PR_CacheAlign(ofs + sizes[0]);
+	h.ofs_globals = ofs, ofs = PR_CacheAlign(ofs + sizes[1]);
+	h.ofs_functions = ofs, ofs = PR_CacheAlign(ofs + sizes[2]);
+	h.ofs_globaldefs = ofs, ofs = PR_CacheAlign(ofs + sizes[3]);
+	h.ofs_fielddefs = ofs, ofs = PR_CacheAlign(ofs + sizes[4]);
+	h.ofs_inlinedranges = ofs, ofs = PR_CacheAlign(ofs + sizes[5]);
+	h.ofs_strippedfuncs = ofs;
+
+	f = fopen(temp, "wb");
+	if (!f)
+	{
+		DPrintf(qcvm, "couldn't write %s\n", path);
+		return;
+	}
+	ok = fwrite(&h, sizeof(h), 1, f) == 1;
+	ofs = sizeof(h);
+	for (i = 0; i < 7 && ok; i++)
+	{
+		ok = fwrite(zeros, 1, PR_CacheAlign(ofs) - ofs, f) == PR_CacheAlign(ofs) - ofs;
+		ofs = PR_CacheAlign(ofs);
+		if (ok && sizes[i])
+			ok = fwrite(lumps[i], 1, sizes[i], f) == sizes[i];
+		ofs += sizes[i];
+	}
+	if (fclose(f) != 0)
+		ok = false;
+#ifdef _WIN32
+	if (ok)
+		remove(path);
+#endif
+	if (!ok || rename(temp, path) != 0)
+	{
+		remove(temp);
+		DPrintf(qcvm, "couldn't write %s\n", path);
+	}
+}
+
+void nvmSetProgsCache(NVM* qcvm, bool enable)
+{
+	qcvm->usecache = enable;
+}
+
+/*
+===============================================================================
+
+RELOAD
+
+nvmReloadProgs loads a new image into a VM that already has state. Globals
+the progs save (DEF_SAVEGLOBAL) and every edict's fields are carried over
+by name where the type still matches. Values that depend on the image are
+remapped: functions and fields by name, entities by number, and strings
+from the old image are copied into VM owned strings. Fields the old image
+didn't have start out zero, globals it didn't have keep their initial value.
+
+===============================================================================
+*/
+
+typedef struct
+{
+	const char	*name;			/* NULL when empty */
+	int		index;
+} prnameslot_t;
+
+/* open addressing name -> index, over one lump of the new image */
+typedef struct
+{
+	prnameslot_t	*slots;
+	unsigned int	mask;
+} prnameindex_t;
+
+/* one def carried over */
+typedef struct
+{
+	int		oldofs, newofs;
+	int		type;
+} prreloaddef_t;
+
+typedef struct
+{
+	// the old image, copies of whatever nvmLoadProgs frees
+	const char	*strings;
+	int		stringssize;
+	dfunction_t	*functions;
+	int		numfunctions;
+	ddef_t	*globaldefs;
+	int		numglobaldefs;
+	ddef_t	*fielddefs;
+	int		numfielddefs;
+	float	*globals;
+	int		numglobals;
+	int		entityfields;
+	int		edict_size;
+	int		edict_headerofs;
+	edict_t	*edicts;
+
+	// old -> new
+	int		*functionmap;	/* [numfunctions] */
+	int		*fieldmap;		/* [entityfields] */
+	int		*stringmap;		/* [stringssize], 0 until copied */
+
+	// for the new image, allocated before it replaces the old one
+	prnameindex_t	functionindex, globalindex, fieldindex;
+	edict_t	*newedicts;		/* [max_edicts], NULL without edicts */
+} prreload_t;
+
+static unsigned int PR_NameHash (const char *name)
+{
+	unsigned int	h = 2166136261u;
+
+	while (*name)
+		h = (h ^ (unsigned char)*name++) * 16777619u;
+	return h;
+}
+
+/* count is at least how many names will be added */
+static qboolean PR_NameIndexInit (NVM* qcvm, prnameindex_t *ni, int count)
+{
+	unsigned int	size;
+
+	for (size = 16; size < 2 * (unsigned int)count; size *= 2)
+		;
+	ni->slots = (prnameslot_t *) qcvm->alloc_callback(qcvm, NULL, size * sizeof(prnameslot_t), "reload");
+	if (!ni->slots)
+		return false;
+	memset(ni->slots, 0, size * sizeof(prnameslot_t));
+	ni->mask = size - 1;
+	return true;
+}
+
+/* the first def of a name wins, unnamed ones are left out */
+static void PR_NameIndexAdd (prnameindex_t *ni, const char *name, int index)
+{
+	unsigned int	i;
+
+	if (!*name)
+		return;
+	for (i = PR_NameHash(name) & ni->mask; ni->slots[i].name; i = (i + 1) & ni->mask)
+	{
+		if (!strcmp(ni->slots[i].name, name))
+			return;
+	}
+	ni->slots[i].name = name;
+	ni->slots[i].index = index;
+}
+
+static int PR_NameIndexFind (prnameindex_t *ni, const char *name)
+{
+	unsigned int	i;
+
+	for (i = PR_NameHash(name) & ni->mask; ni->slots[i].name; i = (i + 1) & ni->mask)
+	{
+		if (!strcmp(ni->slots[i].name, name))
+			return ni->slots[i].index;
+	}
+	return -1;
+}
+
+static const char *PR_ReloadName (prreload_t *r, int s_name)
+{
+	return s_name > 0 && s_name < r->stringssize ? r->strings + s_name : "";
+}
+
+/*
+====================
+PR_ReloadValue
+
+One slot of an old value of type as the new image needs it
+====================
+*/
+static int PR_ReloadValue (NVM* qcvm, prreload_t *r, int type, int v)
+{
+	char	*s;
+	int		n;
+
+	switch (type)
+	{
+	case ev_string:
+		// negative ones are already the VM's
+		if (v <= 0 || v >= r->stringssize)
+			return v;
+		if (!r->stringmap[v])
+		{
+			n = strlen(r->strings + v) + 1;
+			r->stringmap[v] = PR_AllocString(qcvm, n, &s);
+			memcpy(s, r->strings + v, n);
+		}
+		return r->stringmap[v];
+	case ev_function:
+		return v > 0 && v < r->numfunctions ? r->functionmap[v] : 0;
+	case ev_field:
+		return v >= 0 && v < r->entityfields ? r->fieldmap[v] : 0;
+	case ev_entity:
+		if (v <= 0 || v % r->edict_size || v / r->edict_size >= qcvm->num_edicts)
+			return 0;
+		return v / r->edict_size * qcvm->edict_size;
+	case ev_pointer:
+		// into the old globals or edicts, nothing sensible to point at any more
+		return 0;
+	default:
+		return v;
+	}
+}
+
+static void PR_ReloadCopy (NVM* qcvm, prreload_t *r, prreloaddef_t *d, int *to, const int *from)
+{
+	if (d->type == ev_vector)
+		memcpy(to, from, 3 * sizeof(int));
+	else
+		*to = PR_ReloadValue(qcvm, r, d->type, *from);
+}
+
+static void PR_ReloadFree (NVM* qcvm, prreload_t *r)
+{
+	if (r->functionindex.slots)
+		qcvm->alloc_callback(qcvm, r->functionindex.slots, 0, "reload");
+	if (r->globalindex.slots)
+		qcvm->alloc_callback(qcvm, r->globalindex.slots, 0, "reload");
+	if (r->fieldindex.slots)
+		qcvm->alloc_callback(qcvm, r->fieldindex.slots, 0, "reload");
+	if (r->newedicts)
+		qcvm->alloc_callback(qcvm, r->newedicts, 0, "edicts");
+}
+
+/*
+====================
+PR_ReloadAlloc
+
+Allocates what PR_ReloadMigrate needs for the image in data, sized from its
+header, as nothing can fail once nvmLoadProgs has replaced the old image.
+Loading only drops defs, so the header's counts are enough.
+====================
+*/
+static qboolean PR_ReloadAlloc (NVM* qcvm, prreload_t *r, const char *data, size_t size)
+{
+	const dprograms_t	*header = (const dprograms_t *) data;
+	int		headerofs, edict_size;
+
+	if (size < PROG_V6_HEADERSIZE)
+		return true;	// nvmLoadProgs turns it down
+	if (!PR_NameIndexInit(qcvm, &r->functionindex, LittleLong(header->numfunctions)) ||
+		!PR_NameIndexInit(qcvm, &r->globalindex, LittleLong(header->numglobaldefs)) ||
+		!PR_NameIndexInit(qcvm, &r->fieldindex, LittleLong(header->numfielddefs)))
+		return false;
+	if (r->edicts)
+	{
+		edict_size = PR_EdictSize(qcvm, LittleLong(header->entityfields), &headerofs);
+		r->newedicts = (edict_t *) qcvm->alloc_callback(qcvm, NULL, qcvm->max_edicts * edict_size, "edicts");
+		if (!r->newedicts)
+			return false;
+		memset(r->newedicts, 0, qcvm->max_edicts * edict_size);
+	}
+	return true;
+}
+
+/*
+====================
+PR_ReloadMigrate
+
+Carries the old image's state in r over to the one nvmLoadProgs just loaded,
+into what PR_ReloadAlloc allocated for it
+====================
+*/
+static void PR_ReloadMigrate (NVM* qcvm, prreload_t *r, prreloaddef_t *defs)
+{
+	prnameindex_t	*functions = &r->functionindex, *globals = &r->globalindex, *fields = &r->fieldindex;
+	ddef_t		*od, *nd;
+	dfunction_t	*nf;
+	edict_t		*from, *to;
+	int			numglobals, numfields;
+	int			i, j, k, n;
+
+	for (i = 1; i < qcvm->progs->numfunctions; i++)
+		PR_NameIndexAdd(functions, PR_GetString(qcvm, qcvm->functions[i].s_name), i);
+	for (i = 0; i < qcvm->progs->numglobaldefs; i++)
+	{
+		if (qcvm->globaldefs[i].type & DEF_SAVEGLOBAL)
+			PR_NameIndexAdd(globals, PR_GetString(qcvm, qcvm->globaldefs[i].s_name), i);
+	}
+	for (i = 0; i < qcvm->progs->numfielddefs; i++)
+		PR_NameIndexAdd(fields, PR_GetString(qcvm, qcvm->fielddefs[i].s_name), i);
+
+	for (i = 1; i < r->numfunctions; i++)
+	{
+		n = PR_NameIndexFind(functions, PR_ReloadName(r, r->functions[i].s_name));
+		r->functionmap[i] = n > 0 ? n : 0;
+
+		// builtins bound by name keep their numbers
+		j = -r->functions[i].first_statement;
+		if (n > 0 && j > qcvm->auto_ext_builtin_number && j < qcvm->maxbuiltins)
+		{
+			nf = &qcvm->functions[n];
+			if (nf->first_statement == 0 && !nf->parm_start && !nf->locals)
+				nf->first_statement = -j;
+		}
+	}
+
+	for (i = 0, numfields = 0; i < r->numfielddefs; i++)
+	{
+		od = &r->fielddefs[i];
+		n = PR_NameIndexFind(fields, PR_ReloadName(r, od->s_name));
+		if (n < 0)
+			continue;
+		nd = &qcvm->fielddefs[n];
+		k = od->type == ev_vector ? 3 : 1;
+		if (nd->type != od->type || od->ofs + k > (unsigned int)r->entityfields || nd->ofs + k > (unsigned int)qcvm->progs->entityfields)
+			continue;
+		for (j = 0; j < k; j++)
+			r->fieldmap[od->ofs + j] = nd->ofs + j;
+		defs[numfields].oldofs = od->ofs;
+		defs[numfields].newofs = nd->ofs;
+		defs[numfields].type = od->type;
+		numfields++;
+	}
+
+	for (i = 0, numglobals = numfields; i < r->numglobaldefs; i++)
+	{
+		od = &r->globaldefs[i];
+		if (!(od->type & DEF_SAVEGLOBAL))
+			continue;
+		n = PR_NameIndexFind(globals, PR_ReloadName(r, od->s_name));
+		if (n < 0)
+			continue;
+		nd = &qcvm->globaldefs[n];
+		k = (od->type & ~DEF_SAVEGLOBAL) == ev_vector ? 3 : 1;
+		if (nd->type != od->type || od->ofs + k > (unsigned int)r->numglobals || nd->ofs + k > (unsigned int)qcvm->progs->numglobals)
+			continue;
+		defs[numglobals].oldofs = od->ofs;
+		defs[numglobals].newofs = nd->ofs;
+		defs[numglobals].type = od->type & ~DEF_SAVEGLOBAL;
+		numglobals++;
+	}
+
+	// entities are remapped by number, so the new block has to exist first
+	if (r->newedicts)
+	{
+		for (i = 0; i < qcvm->num_edicts; i++)
+		{
+			from = (edict_t *)((byte *)r->edicts + i * r->edict_size);
+			to = (edict_t *)((byte *)r->newedicts + i * qcvm->edict_size);
+			memcpy(to, from, offsetof(edict_t, v));
+			memcpy((byte *)to + qcvm->edict_headerofs, (byte *)from + r->edict_headerofs, qcvm->edict_header);
+			for (j = 0; j < numfields; j++)
+				PR_ReloadCopy(qcvm, r, &defs[j], (int *)&to->v + defs[j].newofs, (int *)&from->v + defs[j].oldofs);
+		}
+		qcvm->edicts = r->newedicts;
+		r->newedicts = NULL;
+	}
+
+	for (j = numfields; j < numglobals; j++)
+		PR_ReloadCopy(qcvm, r, &defs[j], (int *)qcvm->globals + defs[j].newofs, (int *)r->globals + defs[j].oldofs);
+
+	DPrintf(qcvm, "reload: %i fields of %i edicts and %i globals carried over\n", numfields, qcvm->num_edicts, numglobals - numfields);
+}
+
+/*
+====================
+nvmReloadProgs
+
+Like nvmLoadProgs, but keeps the VM's state. The old image must still be
+valid and data must be a different buffer; the old one can go once this
+returns. QC can't be running, suspended or waiting in a thread, since
+those hold on to the old code. Profiles and samples of the old image are
+dropped. Without the memory for it the old image stays, but if the new image
+doesn't load the VM is left without progs, as with nvmLoadProgs.
+====================
+*/
+bool nvmReloadProgs(NVM* qcvm, const char* filename, const char* data, size_t size, bool fatal)
+{
+	prreload_t	r;
+	prreloaddef_t	*defs;
+	float		*globals = qcvm->globals;
+	globalvars_t	*global_struct = qcvm->global_struct;
+	void		*block;
+	size_t		blocksize;
+	qboolean	ok;
+	int			i;
+
+	if (!qcvm->progs)
+		return nvmLoadProgs(qcvm, filename, data, size, fatal);
+	if (qcvm->depth > 0 || qcvm->suspended)
+	{
+		Printf(qcvm, "%s: can't reload while QC is running\n", filename);
+		return false;
+	}
+	for (i = 0; i < qcvm->numthreads; i++)
+	{
+		if (qcvm->threads[i].state != NVM_THREAD_NONE)
+		{
+			Printf(qcvm, "%s: can't reload with QC threads alive\n", filename);
+			return false;
+		}
+	}
+
+	nvmSamplingEnd(qcvm);
+	PR_SamplerFree(qcvm);
+	PR_ProfileFree(qcvm);
+
+	// strings stay in the old image, the rest may be in blocks nvmLoadProgs frees
+	memset(&r, 0, sizeof(r));
+	r.strings = qcvm->strings;
+	r.stringssize = qcvm->stringssize;
+	r.numfunctions = qcvm->progs->numfunctions;
+	r.numglobaldefs = qcvm->progs->numglobaldefs;
+	r.numfielddefs = qcvm->progs->numfielddefs;
+	r.numglobals = qcvm->progs->numglobals;
+	r.entityfields = qcvm->progs->entityfields;
+	r.edict_size = qcvm->edict_size;
+	r.edict_headerofs = qcvm->edict_headerofs;
+	r.edicts = qcvm->edicts;
+
+	blocksize = (r.numglobaldefs + r.numfielddefs) * (sizeof(ddef_t) + sizeof(prreloaddef_t)) +
+		r.numfunctions * sizeof(dfunction_t) +
+		(r.numglobals + r.numfunctions + r.entityfields + r.stringssize) * sizeof(int);
+	block = qcvm->alloc_callback(qcvm, NULL, blocksize, "reload");
+	if (!block)
+		return false;
+	r.functions = (dfunction_t *) block;
+	r.globaldefs = (ddef_t *)(r.functions + r.numfunctions);
+	r.fielddefs = r.globaldefs + r.numglobaldefs;
+	defs = (prreloaddef_t *)(r.fielddefs + r.numfielddefs);
+	r.globals = (float *)(defs + r.numglobaldefs + r.numfielddefs);
+	r.functionmap = (int *)(r.globals + r.numglobals);
+	r.fieldmap = r.functionmap + r.numfunctions;
+	r.stringmap = r.fieldmap + r.entityfields;
+	memcpy(r.functions, qcvm->functions, r.numfunctions * sizeof(dfunction_t));
+	memcpy(r.globaldefs, qcvm->globaldefs, r.numglobaldefs * sizeof(ddef_t));
+	memcpy(r.fielddefs, qcvm->fielddefs, r.numfielddefs * sizeof(ddef_t));
+	memcpy(r.globals, qcvm->globals, r.numglobals * sizeof(float));
+	memset(r.functionmap, 0, (r.numfunctions + r.entityfields + r.stringssize) * sizeof(int));
+
+	// the old image stays as it was if this fails
+	ok = PR_ReloadAlloc(qcvm, &r, data, size);
+	if (!ok)
+		Printf(qcvm, "%s: out of memory for reload\n", filename);
+	else if ((ok = nvmLoadProgs(qcvm, filename, data, size, fatal)))
+	{
+		qcvm->xfunction = NULL;
+		// nvmLoadProgs found it again, unless the host keeps it elsewhere
+		if (global_struct && ((float *)global_struct < globals || (float *)global_struct >= globals + r.numglobals))
+			qcvm->global_struct = global_struct;
+		PR_ReloadMigrate(qcvm, &r, defs);
+		if (r.edicts)
+			qcvm->alloc_callback(qcvm, r.edicts, 0, "edicts");
+	}
+	PR_ReloadFree(qcvm, &r);
+	qcvm->alloc_callback(qcvm, block, 0, "reload");
+	return ok;
+}
+
+/*
+===============================================================================
+
+CAPTURE
+
+nvmCaptureBegin logs what the host does to a VM so nvmReplay can do it again
+without the host. Every nvmExecuteFunction and nvmExecuteForEdicts call is
+logged along with what the host changed since QC last ran: globals, edicts,
+num_edicts, the OP_RAND seed and the strings in the string slots. A builtin
+is logged as its function, any QC it runs, and what it changed by the time
+it returned. Changes are found against a copy of the state as it last was,
+compared word by word, so capturing is slow but the log only holds what
+changed.
+
+nvmReplay runs a log on a VM loaded from the same progs, with or without
+the same inlining, stripping and layout, and needs no builtins bound: each
+builtin call applies what the logged one did. Batches run serially while a
+capture or replay is on. nvmExecuteBudget, nvmResume and threads are not
+logged.
+
+===============================================================================
+*/
+
+#define	PR_CAPTURE_MAGIC	(('N') | ('V' << 8) | ('M' << 16) | ('R' << 24))
+#define	PR_CAPTURE_VERSION	1
+
+/* each event is an int, then what it carries */
+enum
+{
+	PR_CAPTURE_END,
+	PR_CAPTURE_BUILTINS,	/* count, then a function and its first_statement for each builtin */
+	PR_CAPTURE_ENTER,		/* nvmExecuteFunction: the function, a state */
+	PR_CAPTURE_EDICTS,		/* nvmExecuteForEdicts: field_or_func, count, flags, has a list, the list, a state */
+	PR_CAPTURE_BUILTIN,		/* a builtin was called: the function */
+	PR_CAPTURE_RETURN		/* the builtin returned: a state */
+};
+
+/* a state is num_edicts, the seed, runs of changed globals, runs of changed
+   edict words, both as start, count, words and ending with a start of -1,
+   then changed string slots as slot, length or -1 when empty, characters,
+   ending with a slot of -1 */
+
+typedef struct
+{
+	int		magic;
+	int		version;
+	unsigned int	progssize;
+	unsigned int	progshash;
+	int		edict_size;
+} prcaptureheader_t;
+
+static void PR_CaptureWrite (prcapture_t *c, const void *data, size_t size)
+{
+	if (!c->failed && size && fwrite(data, 1, size, (FILE *)c->f) != size)
+		c->failed = true;
+}
+
+static void PR_CaptureInt (prcapture_t *c, int v)
+{
+	PR_CaptureWrite(c, &v, sizeof(v));
+}
+
+/*
+====================
+PR_CaptureRuns
+
+Logs the words of now that differ from shadow, and updates shadow. Short
+stretches of equal words go in with the runs around them, long ones are
+skipped a block at a time.
+====================
+*/
+static void PR_CaptureRuns (prcapture_t *c, const int *now, int *shadow, int count, qboolean write)
+{
+	int		i = 0, j, last;
+
+	if (!write)
+	{
+		memcpy(shadow, now, count * sizeof(int));
+		return;
+	}
+	for (;;)
+	{
+		while (i < count)
+		{
+			if (count - i >= 256 && !memcmp(now + i, shadow + i, 256 * sizeof(int)))
+				i += 256;
+			else if (count - i >= 16 && !memcmp(now + i, shadow + i, 16 * sizeof(int)))
+				i += 16;
+			else if (now[i] == shadow[i])
+				i++;
+			else
+				break;
+		}
+		if (i >= count)
+			break;
+		for (j = last = i; j < count && j - last <= 3; j++)
+		{
+			if (now[j] != shadow[j])
+				last = j;
+		}
+		PR_CaptureInt(c, i);
+		PR_CaptureInt(c, last + 1 - i);
+		PR_CaptureWrite(c, now + i, (last + 1 - i) * sizeof(int));
+		memcpy(shadow + i, now + i, (last + 1 - i) * sizeof(int));
+		i = last + 1;
+	}
+	PR_CaptureInt(c, -1);
+}
+
+/*
+====================
+PR_CaptureState
+
+Logs what changed when write is set, and brings the shadow up to date
+either way. Edicts are left out of the shadow until they are logged, they
+are too big to copy every time QC hands control back.
+====================
+*/
+static void PR_CaptureState (NVM* qcvm, qboolean write)
+{
+	prcapture_t	*c = qcvm->capture;
+	int		numglobals = qcvm->progs->numglobals;
+	int		words = numglobals + qcvm->num_edicts * qcvm->edict_size / (int)sizeof(int);
+	int		i, len, numstrings;
+	const char	*s;
+	char	*copy;
+	void	*p;
+
+	if (words > c->shadowsize)
+	{
+		p = qcvm->alloc_callback(qcvm, c->shadow, words * sizeof(int), "capture shadow");
+		if (!p)
+		{
+			c->failed = true;
+			return;
+		}
+		c->shadow = (int *) p;
+		memset(c->shadow + c->shadowsize, 0, (words - c->shadowsize) * sizeof(int));
+		c->shadowsize = words;
+	}
+	if (qcvm->numknownstrings > c->numstrings)
+	{
+		p = qcvm->alloc_callback(qcvm, c->strings, qcvm->numknownstrings * sizeof(char *), "capture strings");
+		if (!p)
+		{
+			c->failed = true;
+			return;
+		}
+		c->strings = (char **) p;
+		memset(c->strings + c->numstrings, 0, (qcvm->numknownstrings - c->numstrings) * sizeof(char *));
+		c->numstrings = qcvm->numknownstrings;
+	}
+
+	if (write)
+	{
+		PR_CaptureInt(c, qcvm->num_edicts);
+		PR_CaptureInt(c, (int)qcvm->randseed);
+	}
+	PR_CaptureRuns(c, (const int *)qcvm->globals, c->shadow, numglobals, write);
+	if (write)	// edict words QC wrote go in with the host's, the replay already has them
+		PR_CaptureRuns(c, (const int *)qcvm->edicts, c->shadow + numglobals, words - numglobals, true);
+
+	numstrings = c->numstrings;
+	for (i = 0; i < numstrings; i++)
+	{
+		s = i < qcvm->numknownstrings ? qcvm->knownstrings[i] : NULL;
+		if (s == c->strings[i] || (s && c->strings[i] && !strcmp(s, c->strings[i])))
+			continue;
+		copy = NULL;
+		len = s ? (int)strlen(s) : -1;
+		if (s && (copy = (char *) qcvm->alloc_callback(qcvm, NULL, len + 1, "capture string")) != NULL)
+			memcpy(copy, s, len + 1);
+		if (c->strings[i])
+			qcvm->alloc_callback(qcvm, c->strings[i], 0, "capture string");
+		c->strings[i] = copy;
+		if (write)
+		{
+			PR_CaptureInt(c, i);
+			PR_CaptureInt(c, len);
+			PR_CaptureWrite(c, s, len > 0 ? len : 0);
+		}
+	}
+	if (write)
+		PR_CaptureInt(c, -1);
+}
+
+static void PR_CaptureEnter (NVM* qcvm, func_t fnum)
+{
+	if (qcvm->capture->replaying)
+		return;
+	PR_CaptureInt(qcvm->capture, PR_CAPTURE_ENTER);
+	PR_CaptureInt(qcvm->capture, fnum);
+	PR_CaptureState(qcvm, true);
+}
+
+static void PR_CaptureEdicts (NVM* qcvm, int field_or_func, const int* edict_nums, int count, int flags)
+{
+	prcapture_t	*c = qcvm->capture;
+
+	if (c->replaying)
+		return;
+	PR_CaptureInt(c, PR_CAPTURE_EDICTS);
+	PR_CaptureInt(c, field_or_func);
+	PR_CaptureInt(c, count);
+	PR_CaptureInt(c, flags);
+	PR_CaptureInt(c, edict_nums != NULL);
+	if (edict_nums && count > 0)
+		PR_CaptureWrite(c, edict_nums, count * sizeof(int));
+	PR_CaptureState(qcvm, true);
+}
+
+/*
+====================
+PR_CaptureLeave
+
+QC handed control back to the host, what it left is not the host's doing
+====================
+*/
+static void PR_CaptureLeave (NVM* qcvm)
+{
+	if (!qcvm->capture->replaying)
+		PR_CaptureState(qcvm, false);
+}
+
+/*
+====================
+PR_CaptureBuiltin
+
+What the call cache calls instead of every builtin while capturing
+====================
+*/
+static void PR_CaptureBuiltin (NVM* qcvm)
+{
+	prcapture_t	*c = qcvm->capture;
+	func_t		fnum = c->direct ? c->direct : G_INT(qcvm->statements[qcvm->xstatement].a);
+	BuiltinFunction	call;
+
+	c->direct = 0;
+	call = PR_Builtin(qcvm, -qcvm->functions[fnum].first_statement);
+	if (!call)
+		call = PR_Builtin(qcvm, 0);
+	PR_CaptureState(qcvm, false);
+	PR_CaptureInt(c, PR_CAPTURE_BUILTIN);
+	PR_CaptureInt(c, fnum);
+	call(qcvm);
+	if (qcvm->capture != c)
+		return;	// nvmCaptureEnd from the builtin
+	PR_CaptureInt(c, PR_CAPTURE_RETURN);
+	PR_CaptureState(qcvm, true);
+}
+
+bool nvmCaptureBegin(NVM* qcvm, const char* path)
+{
+	prcaptureheader_t	h;
+	prcapture_t	*c;
+	FILE		*f;
+	int			i, n;
+
+	nvmCaptureEnd(qcvm);
+	if (!qcvm->progs)
+		return false;
+	f = fopen(path, "wb");
+	if (!f)
+	{
+		Printf (qcvm, "couldn't write %s\n", path);
+		return false;
+	}
+	c = (prcapture_t *) qcvm->alloc_callback(qcvm, NULL, sizeof(prcapture_t), "capture");
+	if (!c)
+	{
+		fclose(f);
+		return false;
+	}
+	memset(c, 0, sizeof(*c));
+	c->f = f;
+
+	memset(&h, 0, sizeof(h));
+	h.magic = PR_CAPTURE_MAGIC;
+	h.version = PR_CAPTURE_VERSION;
+	h.progssize = qcvm->progssize;
+	h.progshash = qcvm->progshash;
+	h.edict_size = qcvm->edict_size;
+	PR_CaptureWrite(c, &h, sizeof(h));
+
+	// nvmAddExtBuiltin numbers builtins as they are bound
+	for (i = n = 0; i < qcvm->progs->numfunctions; i++)
+		n += qcvm->functions[i].first_statement < 0;
+	PR_CaptureInt(c, PR_CAPTURE_BUILTINS);
+	PR_CaptureInt(c, n);
+	for (i = 0; i < qcvm->progs->numfunctions; i++)
+	{
+		if (qcvm->functions[i].first_statement < 0)
+		{
+			PR_CaptureInt(c, i);
+			PR_CaptureInt(c, qcvm->functions[i].first_statement);
+		}
+	}
+
+	qcvm->capture = c;
+	PR_CallCacheFlush(qcvm);
+	if (c->failed)
+	{
+		Printf (qcvm, "couldn't write %s\n", path);
+		nvmCaptureEnd(qcvm);
+		return false;
+	}
+	return true;
+}
+
+void nvmCaptureEnd(NVM* qcvm)
+{
+	prcapture_t	*c = qcvm->capture;
+	int			i;
+
+	if (!c)
+		return;
+	if (!c->replaying)
+	{
+		PR_CaptureInt(c, PR_CAPTURE_END);
+		if (fclose((FILE *)c->f) != 0 || c->failed)
+			Printf (qcvm, "nvmCaptureEnd: the capture log is incomplete\n");
+	}
+	if (c->log)
+		qcvm->alloc_callback(qcvm, c->log, 0, "replay log");
+	for (i = 0; i < c->numstrings; i++)
+	{
+		if (c->strings[i])
+			qcvm->alloc_callback(qcvm, c->strings[i], 0, "capture string");
+	}
+	if (c->strings)
+		qcvm->alloc_callback(qcvm, c->strings, 0, "capture strings");
+	if (c->shadow)
+		qcvm->alloc_callback(qcvm, c->shadow, 0, "capture shadow");
+	qcvm->alloc_callback(qcvm, c, 0, "capture");
+	qcvm->capture = NULL;
+	PR_CallCacheFlush(qcvm);
+}
+
+static void PR_ReplayFail (NVM* qcvm, const char *error, ...)
+{
+	va_list	argptr;
+	char	string[1024];
+
+	if (qcvm->capture->failed)
+		return;
+	qcvm->capture->failed = true;
+	va_start (argptr, error);
+	vsnprintf (string, sizeof(string), error, argptr);
+	va_end (argptr);
+	Printf (qcvm, "nvmReplay: %s\n", string);
+}
+
+/* data may be NULL to skip size bytes */
+static qboolean PR_ReplayRead (NVM* qcvm, void *data, size_t size)
+{
+	prcapture_t	*c = qcvm->capture;
+
+	if (c->failed)
+		return false;
+	if (size > c->logsize - c->logpos)
+	{
+		PR_ReplayFail(qcvm, "the log ends early");
+		return false;
+	}
+	if (data)
+		memcpy(data, c->log + c->logpos, size);
+	c->logpos += size;
+	return true;
+}
+
+static int PR_ReplayInt (NVM* qcvm)
+{
+	prcapture_t	*c = qcvm->capture;
+	int		v;
+
+	if (c->logsize - c->logpos >= sizeof(v) && !c->failed)
+	{
+		memcpy(&v, c->log + c->logpos, sizeof(v));
+		c->logpos += sizeof(v);
+		return v;
+	}
+	return PR_ReplayRead(qcvm, &v, sizeof(v)) ? v : -1;
+}
+
+/*
+====================
+PR_ReplayRuns
+
+Reads runs of words into data, which holds count. With skip, words past
+count are dropped: the inliner's scratch globals, when the capture was
+inlined differently.
+====================
+*/
+static qboolean PR_ReplayRuns (NVM* qcvm, int *data, int count, qboolean skip)
+{
+	int		start, n, past;
+
+	while ((start = PR_ReplayInt(qcvm)) != -1)
+	{
+		n = PR_ReplayInt(qcvm);
+		if (start < 0 || n <= 0 || (!skip && n > count - start))
+		{
+			PR_ReplayFail(qcvm, "the log does not fit the progs");
+			return false;
+		}
+		past = n > count - start ? n - (count > start ? count - start : 0) : 0;
+		if (!PR_ReplayRead(qcvm, past < n ? data + start : NULL, (n - past) * sizeof(int)) ||
+			!PR_ReplayRead(qcvm, NULL, past * sizeof(int)))
+			return false;
+	}
+	return !qcvm->capture->failed;
+}
+
+/*
+====================
+PR_ReplayString
+
+Puts a logged string in its slot, owned by the VM
+====================
+*/
+static qboolean PR_ReplayString (NVM* qcvm, int slot, int len)
+{
+	char	*s = NULL;
+
+	if (slot < 0 || len < -1)
+	{
+		PR_ReplayFail(qcvm, "the log is corrupt");
+		return false;
+	}
+	if (len >= 0)
+	{
+		s = (char *) qcvm->alloc_callback(qcvm, NULL, len + 1, "string");
+		if (!s || !PR_ReplayRead(qcvm, s, len))
+		{
+			if (s)
+				qcvm->alloc_callback(qcvm, s, 0, "string");
+			PR_ReplayFail(qcvm, "out of memory");
+			return false;
+		}
+		s[len] = 0;
+	}
+	while (slot >= qcvm->maxknownstrings)
+		PR_AllocStringSlots(qcvm);
+	for ( ; qcvm->numknownstrings <= slot; qcvm->numknownstrings++)
+		qcvm->knownstrings[qcvm->numknownstrings] = NULL;
+	PR_ClearEngineString(qcvm, -1 - slot);
+	if (s)
+	{
+		qcvm->knownstrings[slot] = s;
+		qcvm->knownzone[slot >> 3] |= 1u << (slot & 7);
+	}
+	return true;
+}
+
+static qboolean PR_ReplayState (NVM* qcvm)
+{
+	int		numedicts, slot;
+	void	*p;
+
+	numedicts = PR_ReplayInt(qcvm);
+	qcvm->randseed = (unsigned int)PR_ReplayInt(qcvm);
+	if (qcvm->capture->failed)
+		return false;
+	if (numedicts < 0)
+	{
+		PR_ReplayFail(qcvm, "the log is corrupt");
+		return false;
+	}
+	if (numedicts > qcvm->max_edicts)
+	{
+		p = qcvm->alloc_callback(qcvm, qcvm->edicts, numedicts * qcvm->edict_size, "edicts");
+		if (!p)
+		{
+			PR_ReplayFail(qcvm, "out of memory");
+			return false;
+		}
+		qcvm->edicts = (edict_t *) p;
+		memset((byte *)qcvm->edicts + qcvm->max_edicts * qcvm->edict_size, 0, (numedicts - qcvm->max_edicts) * qcvm->edict_size);
+		qcvm->max_edicts = numedicts;
+	}
+	qcvm->num_edicts = numedicts;
+
+	if (!PR_ReplayRuns(qcvm, (int *)qcvm->globals, qcvm->progs->numglobals, true) ||
+		!PR_ReplayRuns(qcvm, (int *)qcvm->edicts, numedicts * qcvm->edict_size / (int)sizeof(int), false))
+		return false;
+	while ((slot = PR_ReplayInt(qcvm)) != -1)
+	{
+		if (!PR_ReplayString(qcvm, slot, PR_ReplayInt(qcvm)))
+			return false;
+	}
+	return !qcvm->capture->failed;
+}
+
+/*
+====================
+PR_ReplayEvent
+
+Reads and does one event, returns which it was or -1 once the replay failed
+====================
+*/
+static int PR_ReplayEvent (NVM* qcvm)
+{
+	int		event, i, n, fnum, first, field_or_func, count, flags;
+	int		*edict_nums = NULL;
+
+	switch (event = PR_ReplayInt(qcvm))
+	{
+	case PR_CAPTURE_END:
+		break;
+	case PR_CAPTURE_BUILTINS:
+		n = PR_ReplayInt(qcvm);
+		for (i = 0; i < n && !qcvm->capture->failed; i++)
+		{
+			fnum = PR_ReplayInt(qcvm);
+			first = PR_ReplayInt(qcvm);
+			if (fnum <= 0 || fnum >= qcvm->progs->numfunctions || first >= 0 || -first >= qcvm->maxbuiltins)
+				PR_ReplayFail(qcvm, "the log does not fit the progs");
+			else if (!PR_Stripped(&qcvm->functions[fnum]))
+				qcvm->functions[fnum].first_statement = first;
+		}
+		break;
+	case PR_CAPTURE_ENTER:
+		fnum = PR_ReplayInt(qcvm);
+		if (fnum <= 0 || fnum >= qcvm->progs->numfunctions)
+			PR_ReplayFail(qcvm, "the log does not fit the progs");
+		else if (PR_ReplayState(qcvm))
+			nvmExecuteFunction(qcvm, fnum);
+		break;
+	case PR_CAPTURE_EDICTS:
+		field_or_func = PR_ReplayInt(qcvm);
+		count = PR_ReplayInt(qcvm);
+		flags = PR_ReplayInt(qcvm);
+		if (PR_ReplayInt(qcvm) && count > 0 && !qcvm->capture->failed)
+		{
+			edict_nums = (int *) qcvm->alloc_callback(qcvm, NULL, count * sizeof(int), "replay edicts");
+			if (!edict_nums)
+				PR_ReplayFail(qcvm, "out of memory");
+			PR_ReplayRead(qcvm, edict_nums, count * sizeof(int));
+		}
+		if (PR_ReplayState(qcvm))
+			nvmExecuteForEdicts(qcvm, field_or_func, edict_nums, count, flags, NULL);
+		if (edict_nums)
+			qcvm->alloc_callback(qcvm, edict_nums, 0, "replay edicts");
+		break;
+	case PR_CAPTURE_RETURN:
+		PR_ReplayState(qcvm);
+		break;
+	default:
+		PR_ReplayFail(qcvm, "the log is corrupt");
+		break;
+	}
+	return qcvm->capture->failed ? -1 : event;
+}
+
+/*
+====================
+PR_ReplayBuiltin
+
+What the call cache calls instead of every builtin while replaying: the QC
+the logged builtin ran is run again, and what it changed is changed again.
+====================
+*/
+static void PR_ReplayBuiltin (NVM* qcvm)
+{
+	prcapture_t	*c = qcvm->capture;
+	func_t		fnum = c->direct ? c->direct : G_INT(qcvm->statements[qcvm->xstatement].a);
+	int			event;
+
+	c->direct = 0;
+	if (c->failed)
+		return;
+	if (PR_ReplayInt(qcvm) != PR_CAPTURE_BUILTIN || PR_ReplayInt(qcvm) != fnum)
+	{
+		PR_ReplayFail(qcvm, "%s was not called when the log was", PR_GetString(qcvm, qcvm->functions[fnum].s_name));
+		return;
+	}
+	while ((event = PR_ReplayEvent(qcvm)) == PR_CAPTURE_ENTER || event == PR_CAPTURE_EDICTS)
+		;
+	if (event != PR_CAPTURE_RETURN)
+		PR_ReplayFail(qcvm, "the log is corrupt");
+}
+
+bool nvmReplay(NVM* qcvm, const char* path)
+{
+	prcaptureheader_t	h;
+	prcapture_t	*c;
+	FILE		*f;
+	long		size;
+	int			event;
+	qboolean	ok;
+
+	nvmCaptureEnd(qcvm);
+	if (!qcvm->progs)
+		return false;
+	f = fopen(path, "rb");
+	if (!f)
+	{
+		Printf (qcvm, "couldn't read %s\n", path);
+		return false;
+	}
+	if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != PR_CAPTURE_MAGIC || h.version != PR_CAPTURE_VERSION)
+	{
+		Printf (qcvm, "nvmReplay: %s is not a capture log\n", path);
+		fclose(f);
+		return false;
+	}
+	if (h.progssize != qcvm->progssize || h.progshash != qcvm->progshash || h.edict_size != qcvm->edict_size)
+	{
+		Printf (qcvm, "nvmReplay: %s was captured with other progs\n", path);
+		fclose(f);
+		return false;
+	}
+	c = (prcapture_t *) qcvm->alloc_callback(qcvm, NULL, sizeof(prcapture_t), "capture");
+	if (!c)
+	{
+		fclose(f);
+		return false;
+	}
+	memset(c, 0, sizeof(*c));
+	c->replaying = true;
+
+	// read it all up front, replaying is what gets timed
+	fseek(f, 0, SEEK_END);
+	size = ftell(f) - (long)sizeof(h);
+	fseek(f, sizeof(h), SEEK_SET);
+	if (size > 0 && (c->log = (byte *) qcvm->alloc_callback(qcvm, NULL, size, "replay log")) != NULL)
+		c->logsize = fread(c->log, 1, size, f);
+	fclose(f);
+	qcvm->capture = c;
+	PR_CallCacheFlush(qcvm);
+
+	while ((event = PR_ReplayEvent(qcvm)) == PR_CAPTURE_BUILTINS || event == PR_CAPTURE_ENTER || event == PR_CAPTURE_EDICTS)
+		;
+	if (event != PR_CAPTURE_END)
+		PR_ReplayFail(qcvm, "%s does not end where it should", path);
+	ok = !c->failed;
+	nvmCaptureEnd(qcvm);
+	return ok;
+}
+
+/*
+===============================================================================
+
+STRING BUILTINS
+
+ftos, vtos, etos, strcat and sprintf for hosts to bind with nvmAddExtBuiltin
+or nvmAddStringBuiltins. They return temp strings: nvmTempString hands out
+the buffers of a ring of NVM_TEMPSTRINGS, allocated with the first one, each
+holding on to a string slot of its own. A temp string is overwritten once
+NVM_TEMPSTRINGS more have been made, as with the engines' own, so QC has to
+copy any it keeps. Nothing is allocated per call, and floats are formatted
+by PR_FormatFloat rather than sprintf, with the same output.
+
+===============================================================================
+*/
+
+static const double pr_pow10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9 };
+
+/*
+====================
+nvmTempString
+
+The next buffer of the ring and the string it is, for builtins to fill. The
+ring and the string slots belong to the VM, so a parallel worker's think goes
+to the serial pass instead, and PR_ExecuteLanes sees tempstringcount move.
+====================
+*/
+string_t nvmTempString (NVM* qcvm, char **buffer)
+{
+	string_t	*slot;
+	int		i;
+
+	if (qcvm->worker)
+		PR_ParallelAbort(qcvm);
+	if (!qcvm->tempstrings)
+	{
+		qcvm->tempstrings = (char *) qcvm->alloc_callback(qcvm, NULL, NVM_TEMPSTRINGS * NVM_TEMPSTRING_SIZE, "temp strings");
+		if (!qcvm->tempstrings)
+			PR_RunError(qcvm, "out of memory for temp strings");
+		memset(qcvm->tempstrings, 0, NVM_TEMPSTRINGS * NVM_TEMPSTRING_SIZE);
+		memset(qcvm->tempstringslots, 0, sizeof(qcvm->tempstringslots));
+	}
+
+	i = qcvm->tempstringcount++ % NVM_TEMPSTRINGS;
+	*buffer = qcvm->tempstrings + i * NVM_TEMPSTRING_SIZE;
+	slot = &qcvm->tempstringslots[i];
+	// a replay or the host may have given the slot to something else
+	if (!*slot || -1 - *slot >= qcvm->numknownstrings || qcvm->knownstrings[-1 - *slot] != *buffer)
+		*slot = PR_SetEngineString(qcvm, *buffer);
+	return *slot;
+}
+
+/*
+====================
+PR_FormatInt
+
+Writes v as %d would, returns the length.
+====================
+*/
+static int PR_FormatInt (char *out, int v)
+{
+	char		digits[12];
+	unsigned int	u = v < 0 ? 0u - (unsigned int)v : (unsigned int)v;
+	int		n = 0, len = 0;
+
+	do
+	{
+		digits[n++] = '0' + u % 10;
+		u /= 10;
+	} while (u);
+	if (v < 0)
+		out[len++] = '-';
+	while (n)
+		out[len++] = digits[--n];
+	out[len] = 0;
+	return len;
+}
+
+/*
+====================
+PR_FormatFloat
+
+Writes v as %<width>.<precision>f would, returns the length. A float times a
+power of ten up to 1e9 is exact in a double, so rounding the product to the
+nearest integer, ties to even, is what printf's exact decimal expansion gives.
+Values too large for that go to snprintf.
+====================
+*/
+static int PR_FormatFloat (char *out, size_t size, float v, int width, int precision)
+{
+	char			digits[24];
+	double			x, frac;
+	unsigned long long	n;
+	unsigned int		bits;
+	int			i, len, numdigits, neg;
+
+	memcpy(&bits, &v, sizeof(bits));
+	neg = bits >> 31;
+	x = (neg ? -(double)v : (double)v) * pr_pow10[precision];
+	if (!(x < 1e18))	// NaN too
+		return snprintf(out, size, "%*.*f", width, precision, v);
+
+	n = (unsigned long long)x;
+	frac = x - (double)n;
+	if (frac > 0.5 || (frac == 0.5 && (n & 1)))
+		n++;
+	numdigits = 0;
+	do
+	{
+		digits[numdigits++] = '0' + n % 10;
+		n /= 10;
+	} while (n);
+	while (numdigits <= precision)
+		digits[numdigits++] = '0';
+
+	len = neg + numdigits + (precision > 0);
+	for (i = 0; i < width - len; i++)
+		*out++ = ' ';
+	if (neg)
+		*out++ = '-';
+	while (numdigits)
+	{
+		if (numdigits-- == precision)
+			*out++ = '.';
+		*out++ = digits[numdigits];
+	}
+	*out = 0;
+	return i + len;
+}
+
+/*
+====================
+PR_FormatQuakeFloat
+
+%d for whole numbers, %5.1f for the rest, as ftos has always printed them.
+====================
+*/
+static int PR_FormatQuakeFloat (char *out, size_t size, float v)
+{
+	if (v > -2147483648.0f && v < 2147483648.0f && v == (int)v)
+		return PR_FormatInt(out, (int)v);
+	return PR_FormatFloat(out, size, v, 5, 1);
+}
+
+void nvmBuiltinFtos (NVM* qcvm)
+{
+	char	*s;
+
+	G_INT(OFS_RETURN) = nvmTempString(qcvm, &s);
+	PR_FormatQuakeFloat(s, NVM_TEMPSTRING_SIZE, G_FLOAT(OFS_PARM0));
+}
+
+void nvmBuiltinVtos (NVM* qcvm)
+{
+	char	*s;
+	float	*v = G_VECTOR(OFS_PARM0);
+	int	i, len = 0;
+
+	G_INT(OFS_RETURN) = nvmTempString(qcvm, &s);
+	for (i = 0; i < 3; i++)
+	{
+		s[len++] = i ? ' ' : '\'';
+		len += PR_FormatFloat(s + len, NVM_TEMPSTRING_SIZE - 1 - len, v[i], 5, 1);
+	}
+	s[len++] = '\'';
+	s[len] = 0;
+}
+
+void nvmBuiltinEtos (NVM* qcvm)
+{
+	char	*s;
+
+	G_INT(OFS_RETURN) = nvmTempString(qcvm, &s);
+	memcpy(s, "entity ", 7);
+	PR_FormatInt(s + 7, G_INT(OFS_PARM0) / qcvm->edict_size);
+}
+
+/*
+====================
+PR_Append
+
+Copies as much of str as fits after len, returns the new length.
+====================
+*/
+static int PR_Append (char *out, int len, const char *str)
+{
+	while (*str && len < NVM_TEMPSTRING_SIZE - 1)
+		out[len++] = *str++;
+	out[len] = 0;
+	return len;
+}
+
+void nvmBuiltinStrcat (NVM* qcvm)
+{
+	char	*s;
+	int	i, len = 0;
+
+	G_INT(OFS_RETURN) = nvmTempString(qcvm, &s);
+	for (i = 0; i < qcvm->argc; i++)
+		len = PR_Append(s, len, G_STRING(OFS_PARM0 + i * 3));
+	s[len] = 0;
+}
+
+/*
+====================
+PR_SprintfNumber
+
+A width or precision, from the format or from the next parameter for a *.
+False when there is neither.
+====================
+*/
+static qboolean PR_SprintfNumber (NVM* qcvm, const char **f, int *arg, int *n)
+{
+	if (**f == '*')
+	{
+		(*f)++;
+		*n = *arg < qcvm->argc ? (int)G_FLOAT(OFS_PARM0 + *arg * 3) : 0;
+		(*arg)++;
+		return true;
+	}
+	if (**f < '0' || **f > '9')
+		return false;
+	for (*n = 0; **f >= '0' && **f <= '9'; (*f)++)
+	{
+		if (*n < NVM_TEMPSTRING_SIZE)
+			*n = *n * 10 + **f - '0';
+	}
+	return true;
+}
+
+/*
+====================
+nvmBuiltinSprintf
+
+string sprintf(string format, ...) with the C conversions: d i o u x X c
+take floats converted to int, e E f F g G take floats and s takes strings.
+Flags, width and precision are as in C, a * takes them from the next
+parameter. Plain %s and %d and %f without flags are formatted here, the rest
+by snprintf. Missing parameters read as 0 or "".
+====================
+*/
+void nvmBuiltinSprintf (NVM* qcvm)
+{
+	const char	*f, *start, *str;
+	char		*s, spec[48], flags[8], num[64];
+	int		len = 0, arg = 1, numflags, width, precision, n;
+	float		v;
+
+	f = G_STRING(OFS_PARM0);
+	G_INT(OFS_RETURN) = nvmTempString(qcvm, &s);
+	while (*f && len < NVM_TEMPSTRING_SIZE - 1)
+	{
+		if (*f != '%' || f[1] == '%')
+		{
+			s[len++] = *f;
+			f += *f == '%' ? 2 : 1;
+			continue;
+		}
+
+		start = f++;
+		for (numflags = 0; *f && strchr("-+ #0", *f); f++)
+		{
+			if (numflags < (int)sizeof(flags) - 2)
+				flags[numflags++] = *f;
+		}
+		if (!PR_SprintfNumber(qcvm, &f, &arg, &width))
+			width = -1;
+		else if (width < 0)
+		{	// a negative * width left-justifies
+			flags[numflags++] = '-';
+			width = -width;
+		}
+		precision = -1;
+		if (*f == '.')
+		{
+			f++;
+			if (!PR_SprintfNumber(qcvm, &f, &arg, &precision))
+				precision = 0;
+			if (precision < 0)
+				precision = -1;
+		}
+		width = width < NVM_TEMPSTRING_SIZE ? width : NVM_TEMPSTRING_SIZE;
+		precision = precision < NVM_TEMPSTRING_SIZE ? precision : NVM_TEMPSTRING_SIZE;
+		if (!*f || !strchr("diouxXceEfFgGs", *f))
+		{	// not a conversion, keep it as it is
+			while (start < f && len < NVM_TEMPSTRING_SIZE - 1)
+				s[len++] = *start++;
+			continue;
+		}
+
+		flags[numflags] = 0;
+		n = sprintf(spec, "%%%s", flags);
+		if (width >= 0)
+			n += sprintf(spec + n, "%i", width);
+		if (precision >= 0)
+			n += sprintf(spec + n, ".%i", precision);
+		spec[n++] = *f;
+		spec[n] = 0;
+
+		if (*f == 's')
+		{
+			str = arg < qcvm->argc ? G_STRING(OFS_PARM0 + arg * 3) : "";
+			if (!numflags && width < 0 && precision < 0)
+				len = PR_Append(s, len, str);
+			else
+				len += snprintf(s + len, NVM_TEMPSTRING_SIZE - len, spec, str);
+		}
+		else
+		{
+			v = arg < qcvm->argc ? G_FLOAT(OFS_PARM0 + arg * 3) : 0;
+			if ((*f == 'd' || *f == 'i') && !numflags && width < 0 && precision < 0)
+			{
+				PR_FormatInt(num, (int)v);
+				len = PR_Append(s, len, num);
+			}
+			else if (*f == 'f' && !numflags && width < 32 && precision < 10)
+			{
+				PR_FormatFloat(num, sizeof(num), v, width, precision < 0 ? 6 : precision);
+				len = PR_Append(s, len, num);
+			}
+			else if (strchr("diouxXc", *f))
+				len += snprintf(s + len, NVM_TEMPSTRING_SIZE - len, spec, (int)v);
+			else
+				len += snprintf(s + len, NVM_TEMPSTRING_SIZE - len, spec, (double)v);
+		}
+		if (len > NVM_TEMPSTRING_SIZE - 1)
+			len = NVM_TEMPSTRING_SIZE - 1;
+		arg++;
+		f++;
+	}
+	s[len] = 0;
+}
+
+/*
+====================
+nvmAddStringBuiltins
+
+Binds the ones the progs declare as #0 by their usual names.
+====================
+*/
+void nvmAddStringBuiltins (NVM* qcvm)
+{
+	nvmAddExtBuiltin(qcvm, 0, "ftos", nvmBuiltinFtos);
+	nvmAddExtBuiltin(qcvm, 0, "vtos", nvmBuiltinVtos);
+	nvmAddExtBuiltin(qcvm, 0, "etos", nvmBuiltinEtos);
+	nvmAddExtBuiltin(qcvm, 0, "strcat", nvmBuiltinStrcat);
+	nvmAddExtBuiltin(qcvm, 0, "sprintf", nvmBuiltinSprintf);
+}
+
+/*
+===============================================================================
+
+ALLOCATOR
+
+nvmAllocCallback is an AllocCallback hosts can hand to nvmCreateVM instead of
+their own. Its state lives in front of the NVM struct, so every VM has a
+private allocator and VMs never contend on a shared heap lock. Structures
+built at load time come from an arena that rewinds once they are all freed,
+which nvmLoadProgs does before it builds new ones. Small blocks, mostly
+strings and thread and profiler nodes, come from size class pools. Edicts
+can be backed by huge pages. Every block carries a header naming its tag,
+so live and peak bytes are kept per name for nvmGetAllocStats, and
+everything still allocated is released with the NVM struct.
+
+===============================================================================
+*/
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+enum
+{
+	PR_BLOCK_POOL,
+	PR_BLOCK_ARENA,
+	PR_BLOCK_LARGE,
+	PR_BLOCK_HUGE
+};
+
+#define	PR_POOL_CLASSES		5		/* 16, 32, 64, 128 and 256 bytes */
+#define	PR_POOL_SLAB		16384
+#define	PR_ARENA_CHUNK		65536
+#define	PR_ALLOC_TAGS		64
+#define	PR_HUGE_PAGE		(2 * 1024 * 1024)
+
+typedef union prallochdr_u
+{
+	struct
+	{
+		size_t		size;		/* what was asked for; the mapping's length for huge blocks */
+		unsigned short	tag;
+		unsigned char	kind;
+		unsigned char	sizeclass;
+	} h;
+	union prallochdr_u	*nextfree;	/* pool blocks on a free list */
+	double		align[2];
+} prallochdr_t;
+
+/* large and huge blocks are linked so they can all be released with the VM */
+typedef union prlargelink_u
+{
+	struct
+	{
+		union prlargelink_u	*prev, *next;
+	} l;
+	double		align[2];
+} prlargelink_t;
+
+typedef struct prchunk_s
+{
+	struct prchunk_s	*next;
+	size_t		size;
+	size_t		used;
+	double		align;
+} prchunk_t;
+
+typedef struct
+{
+	nvmalloctag_t	tags[PR_ALLOC_TAGS];	/* 0 catches names past the end */
+	unsigned char	tagkinds[PR_ALLOC_TAGS];	/* PR_BLOCK_ARENA, PR_BLOCK_HUGE or PR_BLOCK_POOL for the rest */
+	int			numtags;
+
+	prallochdr_t	*freelists[PR_POOL_CLASSES];
+	prchunk_t		*slabs;
+
+	prchunk_t		*arena;			/* current chunk first */
+	int			arenalive;
+	prallochdr_t	*arenalast;		/* can still grow in place */
+
+	prlargelink_t	*large;
+	prlargelink_t	*huge;
+	qboolean		hugepages;
+} prallocator_t;
+
+#define	PR_ALLOCATOR_SIZE	((sizeof(prallocator_t) + 63) & ~(size_t)63)
+#define	PR_ALLOCATOR(vm)	((prallocator_t *)((byte *)(vm) - PR_ALLOCATOR_SIZE))
+
+/* what gets built once per nvmLoadProgs and freed together */
+static const char *pr_arenatags[] =
+{
+	"progs lumps",
+	"inlined progs",
+	"call cache",
+	"progs cache"
+};
+
+static int PR_AllocTag (prallocator_t *a, const char *name)
+{
+	size_t	i;
+
+	if (!name)
+		return 0;
+	for (i = 1; i < (size_t)a->numtags; i++)
+	{
+		if (a->tags[i].name == name)
+			return i;
+	}
+	for (i = 1; i < (size_t)a->numtags; i++)
+	{
+		if (!strcmp(a->tags[i].name, name))
+			return i;
+	}
+	if (a->numtags == PR_ALLOC_TAGS)
+		return 0;
+
+	a->tags[a->numtags].name = name;
+	a->tagkinds[a->numtags] = !strcmp(name, "edicts") ? PR_BLOCK_HUGE : PR_BLOCK_POOL;
+	for (i = 0; i < sizeof(pr_arenatags) / sizeof(pr_arenatags[0]); i++)
+	{
+		if (!strcmp(name, pr_arenatags[i]))
+			a->tagkinds[a->numtags] = PR_BLOCK_ARENA;
+	}
+	return a->numtags++;
+}
+
+static void PR_AllocAccount (prallocator_t *a, prallochdr_t *hdr, size_t size, int tag)
+{
+	nvmalloctag_t	*t = &a->tags[tag];
+
+	hdr->h.size = size;
+	hdr->h.tag = tag;
+	t->bytes += size;
+	if (t->bytes > t->peak)
+		t->peak = t->bytes;
+	t->count++;
+}
+
+static void PR_AllocUnaccount (prallocator_t *a, prallochdr_t *hdr)
+{
+	nvmalloctag_t	*t = &a->tags[hdr->h.tag];
+
+	t->bytes -= hdr->h.size;
+	t->count--;
+}
+
+static prallochdr_t *PR_PoolAlloc (prallocator_t *a, size_t size)
+{
+	prallochdr_t	*hdr;
+	prchunk_t		*slab;
+	size_t		blocksize, n;
+	int			c;
+
+	for (c = 0; (size_t)16 << c < size; c++)
+		;
+	if (!a->freelists[c])
+	{
+		blocksize = sizeof(prallochdr_t) + ((size_t)16 << c);
+		slab = (prchunk_t *) malloc(sizeof(prchunk_t) + PR_POOL_SLAB);
+		if (!slab)
+			return NULL;
+		slab->next = a->slabs;
+		slab->size = PR_POOL_SLAB;
+		a->slabs = slab;
+		for (n = 0; n + blocksize <= PR_POOL_SLAB; n += blocksize)
+		{
+			hdr = (prallochdr_t *)((byte *)(slab + 1) + n);
+			hdr->nextfree = a->freelists[c];
+			a->freelists[c] = hdr;
+		}
+	}
+	hdr = a->freelists[c];
+	a->freelists[c] = hdr->nextfree;
+	hdr->h.kind = PR_BLOCK_POOL;
+	hdr->h.sizeclass = c;
+	return hdr;
+}
+
+static prallochdr_t *PR_ArenaAlloc (prallocator_t *a, size_t size)
+{
+	prallochdr_t	*hdr;
+	prchunk_t		*chunk = a->arena;
+	size_t		need = sizeof(prallochdr_t) + ((size + 15) & ~(size_t)15);
+
+	if (!chunk || chunk->used + need > chunk->size)
+	{
+		chunk = (prchunk_t *) malloc(sizeof(prchunk_t) + (need > PR_ARENA_CHUNK ? need : PR_ARENA_CHUNK));
+		if (!chunk)
+			return NULL;
+		chunk->size = need > PR_ARENA_CHUNK ? need : PR_ARENA_CHUNK;
+		chunk->used = 0;
+		chunk->next = a->arena;
+		a->arena = chunk;
+	}
+	hdr = (prallochdr_t *)((byte *)(chunk + 1) + chunk->used);
+	chunk->used += need;
+	hdr->h.kind = PR_BLOCK_ARENA;
+	a->arenalive++;
+	a->arenalast = hdr;
+	return hdr;
+}
+
+/* the last arena block grows in place while its chunk has room */
+static qboolean PR_ArenaGrow (prallocator_t *a, prallochdr_t *hdr, size_t size)
+{
+	prchunk_t	*chunk = a->arena;
+	size_t	oldneed = sizeof(prallochdr_t) + ((hdr->h.size + 15) & ~(size_t)15);
+	size_t	need = sizeof(prallochdr_t) + ((size + 15) & ~(size_t)15);
+
+	if (hdr != a->arenalast || chunk->used - oldneed + need > chunk->size)
+		return false;
+	chunk->used = chunk->used - oldneed + need;
+	return true;
+}
+
+static void PR_ArenaFree (prallocator_t *a, prallochdr_t *hdr)
+{
+	prchunk_t	*chunk, *next;
+
+	if (hdr == a->arenalast)
+	{
+		a->arena->used = (byte *)hdr - (byte *)(a->arena + 1);
+		a->arenalast = NULL;
+	}
+	if (--a->arenalive)
+		return;
+
+	// nothing left: rewind to the oldest chunk, it is the one to keep
+	for (chunk = a->arena; chunk && chunk->next; chunk = next)
+	{
+		next = chunk->next;
+		free(chunk);
+	}
+	a->arena = chunk;
+	if (chunk)
+		chunk->used = 0;
+}
+
+static void PR_BlockLink (prlargelink_t **list, prlargelink_t *link)
+{
+	link->l.prev = NULL;
+	link->l.next = *list;
+	if (*list)
+		(*list)->l.prev = link;
+	*list = link;
+}
+
+static void PR_BlockUnlink (prlargelink_t **list, prlargelink_t *link)
+{
+	if (link->l.prev)
+		link->l.prev->l.next = link->l.next;
+	else
+		*list = link->l.next;
+	if (link->l.next)
+		link->l.next->l.prev = link->l.prev;
+}
+
+static prallochdr_t *PR_LargeAlloc (prallocator_t *a, size_t size)
+{
+	prlargelink_t	*link = (prlargelink_t *) malloc(sizeof(prlargelink_t) + sizeof(prallochdr_t) + size);
+	prallochdr_t	*hdr;
+
+	if (!link)
+		return NULL;
+	PR_BlockLink(&a->large, link);
+	hdr = (prallochdr_t *)(link + 1);
+	hdr->h.kind = PR_BLOCK_LARGE;
+	return hdr;
+}
+
+/*
+====================
+PR_HugeAlloc
+
+Explicit huge pages when the system has them reserved, otherwise a mapping
+the kernel is asked to back with transparent huge pages. Elsewhere edicts are
+just a large block.
+====================
+*/
+static prallochdr_t *PR_HugeAlloc (prallocator_t *a, size_t size)
+{
+#if !defined(_WIN32) && defined(MAP_ANONYMOUS)
+	prlargelink_t	*link;
+	prallochdr_t	*hdr;
+	size_t	length = (sizeof(prlargelink_t) + sizeof(prallochdr_t) + size + PR_HUGE_PAGE - 1) & ~(size_t)(PR_HUGE_PAGE - 1);
+	void	*p = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+	p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (p == MAP_FAILED)
+	{
+		p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return NULL;
+#ifdef MADV_HUGEPAGE
+		madvise(p, length, MADV_HUGEPAGE);
+#endif
+	}
+	link = (prlargelink_t *)p;
+	PR_BlockLink(&a->huge, link);
+	hdr = (prallochdr_t *)(link + 1);
+	hdr->h.kind = PR_BLOCK_HUGE;
+	hdr->h.size = length;
+	return hdr;
+#else
+	return NULL;
+#endif
+}
+
+static void PR_HugeFree (prallocator_t *a, prallochdr_t *hdr)
+{
+#if !defined(_WIN32) && defined(MAP_ANONYMOUS)
+	prlargelink_t	*link = (prlargelink_t *)hdr - 1;
+
+	PR_BlockUnlink(&a->huge, link);
+	munmap(link, hdr->h.size);
+#endif
+}
+
+static void PR_BlockFree (prallocator_t *a, prallochdr_t *hdr)
+{
+	PR_AllocUnaccount(a, hdr);
+	switch (hdr->h.kind)
+	{
+	case PR_BLOCK_POOL:
+		hdr->nextfree = a->freelists[hdr->h.sizeclass];
+		a->freelists[hdr->h.sizeclass] = hdr;
+		break;
+	case PR_BLOCK_ARENA:
+		PR_ArenaFree(a, hdr);
+		break;
+	case PR_BLOCK_LARGE:
+		PR_BlockUnlink(&a->large, (prlargelink_t *)hdr - 1);
+		free((prlargelink_t *)hdr - 1);
+		break;
+	case PR_BLOCK_HUGE:
+		PR_HugeFree(a, hdr);
+		break;
+	}
+}
+
+static prallochdr_t *PR_BlockAlloc (prallocator_t *a, size_t size, int tag)
+{
+	prallochdr_t	*hdr = NULL;
+
+	if (a->tagkinds[tag] == PR_BLOCK_HUGE && a->hugepages)
+		hdr = PR_HugeAlloc(a, size);
+	if (hdr)	// the whole mapping is what the VM holds on to
+		size = hdr->h.size;
+	else if (a->tagkinds[tag] == PR_BLOCK_ARENA)
+		hdr = PR_ArenaAlloc(a, size);
+	else if (size <= (size_t)16 << (PR_POOL_CLASSES - 1))
+		hdr = PR_PoolAlloc(a, size);
+	else
+		hdr = PR_LargeAlloc(a, size);
+	if (hdr)
+		PR_AllocAccount(a, hdr, size, tag);
+	return hdr;
+}
+
+/*
+====================
+PR_AllocatorFree
+
+Releases the NVM struct and every block that is still allocated with it.
+====================
+*/
+static void PR_AllocatorFree (prallocator_t *a)
+{
+	prchunk_t		*chunk, *next;
+	prlargelink_t	*link, *nextlink;
+
+	for (link = a->large; link; link = nextlink)
+	{
+		nextlink = link->l.next;
+		free(link);
+	}
+#if !defined(_WIN32) && defined(MAP_ANONYMOUS)
+	for (link = a->huge; link; link = nextlink)
+	{
+		nextlink = link->l.next;
+		munmap(link, ((prallochdr_t *)(link + 1))->h.size);
+	}
+#endif
+	for (chunk = a->slabs; chunk; chunk = next)
+	{
+		next = chunk->next;
+		free(chunk);
+	}
+	for (chunk = a->arena; chunk; chunk = next)
+	{
+		next = chunk->next;
+		free(chunk);
+	}
+	free(a);
+}
+
+void* nvmAllocCallback(NVM* vm, void* ptr, size_t size, const char* name)
+{
+	prallocator_t	*a;
+	prallochdr_t	*hdr, *newhdr;
+	size_t		oldsize;
+	int			tag;
+
+	if (!vm)
+	{	// the NVM struct, with the allocator in front of it
+		if (ptr)
+			return NULL;
+		a = (prallocator_t *) calloc(1, PR_ALLOCATOR_SIZE + size);
+		if (!a)
+			return NULL;
+		a->tags[0].name = "other";
+		a->tagkinds[0] = PR_BLOCK_POOL;
+		a->numtags = 1;
+		return (byte *)a + PR_ALLOCATOR_SIZE;
+	}
+
+	a = PR_ALLOCATOR(vm);
+	if (ptr == vm)
+	{
+		if (!size)
+			PR_AllocatorFree(a);
+		return NULL;	/* the NVM struct never moves */
+	}
+
+	if (!ptr)
+	{
+		hdr = PR_BlockAlloc(a, size, PR_AllocTag(a, name));
+		if (!hdr)
+			return NULL;
+		a->tags[hdr->h.tag].allocations++;
+		return hdr + 1;
+	}
+
+	hdr = (prallochdr_t *)ptr - 1;
+	if (!size)
+	{
+		PR_BlockFree(a, hdr);
+		return NULL;
+	}
+
+	// grow or shrink in place where the block allows it
+	tag = hdr->h.tag;
+	if ((hdr->h.kind == PR_BLOCK_POOL && size <= (size_t)16 << hdr->h.sizeclass) ||
+		(hdr->h.kind == PR_BLOCK_ARENA && PR_ArenaGrow(a, hdr, size)))
+	{
+		PR_AllocUnaccount(a, hdr);
+		PR_AllocAccount(a, hdr, size, tag);
+		return ptr;
+	}
+	if (hdr->h.kind == PR_BLOCK_LARGE)
+	{
+		prlargelink_t	*link = (prlargelink_t *)hdr - 1, *moved;
+
+		PR_AllocUnaccount(a, hdr);
+		PR_BlockUnlink(&a->large, link);
+		moved = (prlargelink_t *) realloc(link, sizeof(prlargelink_t) + sizeof(prallochdr_t) + size);
+		if (moved)
+			link = moved;
+		PR_BlockLink(&a->large, link);
+		hdr = (prallochdr_t *)(link + 1);
+		PR_AllocAccount(a, hdr, moved ? size : hdr->h.size, tag);
+		return moved ? hdr + 1 : NULL;	/* on failure the old block is still valid */
+	}
+
+	newhdr = PR_BlockAlloc(a, size, tag);
+	if (!newhdr)
+		return NULL;
+	oldsize = hdr->h.kind == PR_BLOCK_HUGE ? hdr->h.size - sizeof(prlargelink_t) - sizeof(prallochdr_t) : hdr->h.size;
+	memcpy(newhdr + 1, ptr, size < oldsize ? size : oldsize);
+	PR_BlockFree(a, hdr);
+	return newhdr + 1;
+}
+
+bool nvmSetHugePages(NVM* vm, bool enable)
+{
+	if (vm->alloc_callback != nvmAllocCallback)
+		return false;
+#if !defined(_WIN32) && defined(MAP_ANONYMOUS)
+	PR_ALLOCATOR(vm)->hugepages = enable;
+	return true;
+#else
+	return !enable;
+#endif
+}
+
+int nvmGetAllocStats(NVM* vm, nvmalloctag_t* tags, int max_tags)
+{
+	prallocator_t	*a;
+	int		i;
+
+	if (vm->alloc_callback != nvmAllocCallback)
+		return 0;
+	a = PR_ALLOCATOR(vm);
+	for (i = 0; i < a->numtags && i < max_tags; i++)
+		tags[i] = a->tags[i];
+	return a->numtags;
 }
-#undef OPA
-#undef OPB
-#undef OPC
@@ -0,0 +1,886 @@
+/*
+pr_execloop.h -- the interpreter loop
+
+Included three times by nethervm.c: PR_EXECUTE names the function, PR_CHECKED
+selects the checked interpreter for progs that did not verify (see VERIFIER
+in nethervm.c) and PR_PARALLEL the one workers run, which goes through the
+running think's copies of the edicts it writes (see PARALLEL).
+*/
+
+#if PR_PARALLEL
+#define	PR_POINTER(ofs,size)	PR_ParallelPointer(qcvm, ofs, size, false)
+#define	PR_WPOINTER(ofs,size)	PR_ParallelPointer(qcvm, ofs, size, true)
+#define	PR_EDICT(e)				PR_ParallelEdict(qcvm, e, false)
+#define	PR_WEDICT(e)			PR_ParallelEdict(qcvm, e, true)
+#define	PR_PROFILE(n)			/* the workers share the functions */
+#else
+#if PR_CHECKED
+#define	PR_POINTER(ofs,size)	PR_CheckPointer(qcvm, ofs, size)
+#else
+#define	PR_POINTER(ofs,size)	((eval_t *)((byte *)qcvm->edicts + (ofs)))
+#endif
+#define	PR_WPOINTER(ofs,size)	PR_POINTER(ofs, size)
+#define	PR_EDICT(e)				PROG_TO_EDICT(e)
+#define	PR_WEDICT(e)			PROG_TO_EDICT(e)
+#define	PR_PROFILE(n)			(qcvm->xfunction->profile += (n))
+#endif
+
+static nvmstatus_t PR_EXECUTE (NVM* qcvm, int statement, int exitdepth, int budget, int thread)
+{
+	eval_t		*ptr;
+	dstatement_t	*st;
+	dfunction_t	*newf;
+	prcallcache_t	*call;
+	int profile, startprofile, limit, ofs;
+	edict_t		*ed;
+	int		oldthread;
+	nvmstatus_t	status;
+	eval_t		*swtch = NULL;
+	int		swtchtype = 0, i;
+
+	limit = (budget > 0 && budget < PR_RUNAWAY_LIMIT) ? budget : PR_RUNAWAY_LIMIT;
+
+	oldthread = qcvm->xthread;
+	qcvm->xthread = thread;
+
+	st = &qcvm->statements[statement];
+	startprofile = profile = 0;
+
+    while (1)
+    {
+		st++;	/* next statement */
+		profile++;
+
+#if PR_CHECKED
+		PR_CheckStatement(qcvm, st);
+		if (qcvm->statementcounts)
+			qcvm->statementcounts[st - qcvm->statements]++;
+		if (qcvm->trace)
+			PR_PrintStatement(qcvm, st);
+#endif
+#if !PR_PARALLEL
+		qcvm->samplestatement = st - qcvm->statements;
+#endif
+
+		STAT(qcvm->stats.opcodes[st->op]++);
+
+		switch (st->op)
+		{
+		case OP_ADD_F:
+			OPC->_float = OPA->_float + OPB->_float;
+			break;
+		case OP_ADD_V:
+			OPC->vector[0] = OPA->vector[0] + OPB->vector[0];
+			OPC->vector[1] = OPA->vector[1] + OPB->vector[1];
+			OPC->vector[2] = OPA->vector[2] + OPB->vector[2];
+			break;
+
+		case OP_SUB_F:
+			OPC->_float = OPA->_float - OPB->_float;
+			break;
+		case OP_SUB_V:
+			OPC->vector[0] = OPA->vector[0] - OPB->vector[0];
+			OPC->vector[1] = OPA->vector[1] - OPB->vector[1];
+			OPC->vector[2] = OPA->vector[2] - OPB->vector[2];
+			break;
+
+		case OP_MUL_F:
+			OPC->_float = OPA->_float * OPB->_float;
+			break;
+		case OP_MUL_V:
+			OPC->_float = OPA->vector[0] * OPB->vector[0] +
+					  OPA->vector[1] * OPB->vector[1] +
+					  OPA->vector[2] * OPB->vector[2];
+			break;
+		case OP_MUL_FV:
+			OPC->vector[0] = OPA->_float * OPB->vector[0];
+			OPC->vector[1] = OPA->_float * OPB->vector[1];
+			OPC->vector[2] = OPA->_float * OPB->vector[2];
+			break;
+		case OP_MUL_VF:
+			OPC->vector[0] = OPB->_float * OPA->vector[0];
+			OPC->vector[1] = OPB->_float * OPA->vector[1];
+			OPC->vector[2] = OPB->_float * OPA->vector[2];
+			break;
+
+		case OP_DIV_F:
+			OPC->_float = OPA->_float / OPB->_float;
+			break;
+
+		case OP_BITAND:
+			OPC->_float = (int)OPA->_float & (int)OPB->_float;
+			break;
+
+		case OP_BITOR:
+			OPC->_float = (int)OPA->_float | (int)OPB->_float;
+			break;
+
+		case OP_GE:
+			OPC->_float = OPA->_float >= OPB->_float;
+			break;
+		case OP_LE:
+			OPC->_float = OPA->_float <= OPB->_float;
+			break;
+		case OP_GT:
+			OPC->_float = OPA->_float > OPB->_float;
+			break;
+		case OP_LT:
+			OPC->_float = OPA->_float < OPB->_float;
+			break;
+		case OP_AND:
+			OPC->_float = OPA->_float && OPB->_float;
+			break;
+		case OP_OR:
+			OPC->_float = OPA->_float || OPB->_float;
+			break;
+
+		case OP_NOT_F:
+			OPC->_float = !OPA->_float;
+			break;
+		case OP_NOT_V:
+			OPC->_float = !OPA->vector[0] && !OPA->vector[1] && !OPA->vector[2];
+			break;
+		case OP_NOT_S:
+			OPC->_float = !OPA->string || !*PR_GetString(qcvm, OPA->string);
+			break;
+		case OP_NOT_FNC:
+			OPC->_float = !OPA->function;
+			break;
+		case OP_NOT_ENT:
+			OPC->_float = (PROG_TO_EDICT(OPA->edict) == qcvm->edicts);
+			break;
+
+		case OP_EQ_F:
+			OPC->_float = OPA->_float == OPB->_float;
+			break;
+		case OP_EQ_V:
+			OPC->_float = (OPA->vector[0] == OPB->vector[0]) &&
+					  (OPA->vector[1] == OPB->vector[1]) &&
+					  (OPA->vector[2] == OPB->vector[2]);
+			break;
+		case OP_EQ_S:
+			OPC->_float = !strcmp(PR_GetString(qcvm, OPA->string), PR_GetString(qcvm, OPB->string));
+			break;
+		case OP_EQ_E:
+			OPC->_float = OPA->_int == OPB->_int;
+			break;
+		case OP_EQ_FNC:
+			OPC->_float = OPA->function == OPB->function;
+			break;
+
+		case OP_NE_F:
+			OPC->_float = OPA->_float != OPB->_float;
+			break;
+		case OP_NE_V:
+			OPC->_float = (OPA->vector[0] != OPB->vector[0]) ||
+					  (OPA->vector[1] != OPB->vector[1]) ||
+					  (OPA->vector[2] != OPB->vector[2]);
+			break;
+		case OP_NE_S:
+			OPC->_float = strcmp(PR_GetString(qcvm, OPA->string), PR_GetString(qcvm, OPB->string));
+			break;
+		case OP_NE_E:
+			OPC->_float = OPA->_int != OPB->_int;
+			break;
+		case OP_NE_FNC:
+			OPC->_float = OPA->function != OPB->function;
+			break;
+
+		case OP_STORE_F:
+		case OP_STORE_ENT:
+		case OP_STORE_FLD:	// integers
+		case OP_STORE_S:
+		case OP_STORE_FNC:	// pointers
+			OPB->_int = OPA->_int;
+			break;
+		case OP_STORE_V:
+			OPB->vector[0] = OPA->vector[0];
+			OPB->vector[1] = OPA->vector[1];
+			OPB->vector[2] = OPA->vector[2];
+			break;
+
+		case OP_STOREP_F:
+		case OP_STOREP_ENT:
+		case OP_STOREP_FLD:	// integers
+		case OP_STOREP_S:
+		case OP_STOREP_FNC:	// pointers
+			ptr = PR_WPOINTER(OPB->_int, 1);
+			ptr->_int = OPA->_int;
+			break;
+		case OP_STOREP_V:
+			ptr = PR_WPOINTER(OPB->_int, 3);
+			ptr->vector[0] = OPA->vector[0];
+			ptr->vector[1] = OPA->vector[1];
+			ptr->vector[2] = OPA->vector[2];
+			break;
+
+		case OP_ADDRESS:
+			ed = PROG_TO_EDICT(OPA->edict);
+#if PR_CHECKED
+			PR_CheckEdict(qcvm, OPA->edict, OPB->_int, 1);
+#endif
+	#if 0
+			if (ed == (edict_t *)qcvm->edicts && sv.state == ss_active)
+			{
+				qcvm->xstatement = st - qcvm->statements;
+				PR_RunError("assignment to world entity");
+			}
+	#endif
+			OPC->_int = (byte *)((int *)&ed->v + OPB->_int) - (byte *)qcvm->edicts;
+			break;
+
+		case OP_LOAD_F:
+		case OP_LOAD_FLD:
+		case OP_LOAD_ENT:
+		case OP_LOAD_S:
+		case OP_LOAD_FNC:
+			ed = PR_EDICT(OPA->edict);
+#if PR_CHECKED
+			PR_CheckEdict(qcvm, OPA->edict, OPB->_int, 1);
+#endif
+			OPC->_int = ((eval_t *)((int *)&ed->v + OPB->_int))->_int;
+			break;
+
+		case OP_LOAD_V:
+			ed = PR_EDICT(OPA->edict);
+#if PR_CHECKED
+			PR_CheckEdict(qcvm, OPA->edict, OPB->_int, 3);
+#endif
+			ptr = (eval_t *)((int *)&ed->v + OPB->_int);
+			OPC->vector[0] = ptr->vector[0];
+			OPC->vector[1] = ptr->vector[1];
+			OPC->vector[2] = ptr->vector[2];
+			break;
+
+		case OP_IFNOT:
+			if (!OPA->_int)
+			{
+				ofs = st->b;
+				st += ofs - 1;	/* -1 to offset the st++ */
+				if (ofs <= 0 && profile >= limit)
+					goto outofbudget;
+			}
+			break;
+
+		case OP_IF:
+			if (OPA->_int)
+			{
+				ofs = st->b;
+				st += ofs - 1;	/* -1 to offset the st++ */
+				if (ofs <= 0 && profile >= limit)
+					goto outofbudget;
+			}
+			break;
+
+		case OP_GOTO:
+			ofs = st->a;
+			st += ofs - 1;		/* -1 to offset the st++ */
+			if (ofs <= 0 && profile >= limit)
+				goto outofbudget;
+			break;
+
+		case OP_CALL0:
+		case OP_CALL1:
+		case OP_CALL2:
+		case OP_CALL3:
+		case OP_CALL4:
+		case OP_CALL5:
+		case OP_CALL6:
+		case OP_CALL7:
+		case OP_CALL8:
+			PR_PROFILE(profile - startprofile);
+			STAT(qcvm->stats.statements += profile - startprofile);
+			qcvm->xstatement = st - qcvm->statements;
+			qcvm->argc = st->op - OP_CALL0;
+			if (!OPA->function)
+				PR_RunError(qcvm, "NULL function");
+			/* the site's inline cache, only a miss resolves and checks the function */
+			call = &qcvm->callcache[(qcvm->xstatement & qcvm->callcachemask) * NVM_CALLCACHE_WAYS];
+			if (call->statement != qcvm->xstatement || call->function != OPA->function)
+			{
+				for (i = 1; i < NVM_CALLCACHE_WAYS; i++)
+				{
+					if (call[i].statement == qcvm->xstatement && call[i].function == OPA->function)
+						break;
+				}
+				call = i < NVM_CALLCACHE_WAYS ? &call[i] : PR_CallCacheMiss(qcvm, call, OPA->function);
+			}
+			newf = call->f;
+#if PR_PARALLEL
+			if (call->builtin >= 0 ? !PR_ParallelSafe(qcvm->worker->parallel, call->call) : qcvm->worker->parallel->unsafe[call->function])
+				PR_ParallelAbort(qcvm);
+#endif
+			if (qcvm->profiling)
+				PR_ProfileEnter(qcvm, newf, profile - startprofile);
+			startprofile = profile;
+			if (call->builtin >= 0)
+			{ // Built-in function
+				STAT(qcvm->stats.builtin_calls++);
+				STAT(qcvm->builtincalls[call->builtin]++);
+				call->call(qcvm);
+				if (qcvm->profiling)
+					PR_ProfileLeave(qcvm, 0);
+				if (qcvm->suspendrequest)
+					goto suspend;
+			}
+			else
+			{ // Normal function
+#if !PR_CHECKED
+				/* a tail call, checked runs and the profiler keep every frame */
+				if (st->c && !qcvm->profiling)
+				{
+					STAT(qcvm->stats.tail_calls++);
+					qcvm->xstatement = PR_LeaveFunction(qcvm);
+				}
+#endif
+				st = &qcvm->statements[PR_EnterFunction(qcvm, newf)];
+			}
+			if (profile >= limit)
+				goto outofbudget;
+			break;
+
+		case OP_DONE:
+		case OP_RETURN:
+			PR_PROFILE(profile - startprofile);
+			STAT(qcvm->stats.statements += profile - startprofile);
+			if (qcvm->profiling)
+				PR_ProfileLeave(qcvm, profile - startprofile);
+			startprofile = profile;
+			qcvm->xstatement = st - qcvm->statements;
+			qcvm->globals[OFS_RETURN] = qcvm->globals[st->a];
+			qcvm->globals[OFS_RETURN + 1] = qcvm->globals[st->a + 1];
+			qcvm->globals[OFS_RETURN + 2] = qcvm->globals[st->a + 2];
+			st = &qcvm->statements[PR_LeaveFunction(qcvm)];
+			if (qcvm->depth == exitdepth)
+			{ // Done
+				qcvm->xthread = oldthread;
+				return NVM_COMPLETED;
+			}
+			break;
+
+		case OP_STATE:
+#if PR_CHECKED
+			if (!qcvm->global_struct)
+				PR_RunError(qcvm, "OP_STATE without system globals");
+			PR_CheckEdict(qcvm, qcvm->global_struct->self, 0, 0);
+#endif
+			ed = PR_WEDICT(qcvm->global_struct->self);
+			ed->v.nextthink = qcvm->global_struct->time + 0.1;
+			ed->v.frame = OPA->_float;
+			ed->v.think = OPB->function;
+			break;
+
+	/* fteqcc extensions */
+
+		case OP_MULSTORE_F:
+			OPB->_float *= OPA->_float;
+			break;
+		case OP_MULSTORE_VF:
+			OPB->vector[0] *= OPA->_float;
+			OPB->vector[1] *= OPA->_float;
+			OPB->vector[2] *= OPA->_float;
+			break;
+		case OP_MULSTOREP_F:
+			ptr = PR_WPOINTER(OPB->_int, 1);
+			OPC->_float = (ptr->_float *= OPA->_float);
+			break;
+		case OP_MULSTOREP_VF:
+			ptr = PR_WPOINTER(OPB->_int, 3);
+			OPC->vector[0] = (ptr->vector[0] *= OPA->_float);
+			OPC->vector[1] = (ptr->vector[1] *= OPA->_float);
+			OPC->vector[2] = (ptr->vector[2] *= OPA->_float);
+			break;
+
+		case OP_DIVSTORE_F:
+			OPB->_float /= OPA->_float;
+			break;
+		case OP_DIVSTOREP_F:
+			ptr = PR_WPOINTER(OPB->_int, 1);
+			OPC->_float = (ptr->_float /= OPA->_float);
+			break;
+
+		case OP_ADDSTORE_F:
+			OPB->_float += OPA->_float;
+			break;
+		case OP_ADDSTORE_V:
+			OPB->vector[0] += OPA->vector[0];
+			OPB->vector[1] += OPA->vector[1];
+			OPB->vector[2] += OPA->vector[2];
+			break;
+		case OP_ADDSTOREP_F:
+			ptr = PR_WPOINTER(OPB->_int, 1);
+			OPC->_float = (ptr->_float += OPA->_float);
+			break;
+		case OP_ADDSTOREP_V:
+			ptr = PR_WPOINTER(OPB->_int, 3);
+			OPC->vector[0] = (ptr->vector[0] += OPA->vector[0]);
+			OPC->vector[1] = (ptr->vector[1] += OPA->vector[1]);
+			OPC->vector[2] = (ptr->vector[2] += OPA->vector[2]);
+			break;
+
+		case OP_SUBSTORE_F:
+			OPB->_float -= OPA->_float;
+			break;
+		case OP_SUBSTORE_V:
+			OPB->vector[0] -= OPA->vector[0];
+			OPB->vector[1] -= OPA->vector[1];
+			OPB->vector[2] -= OPA->vector[2];
+			break;
+		case OP_SUBSTOREP_F:
+			ptr = PR_WPOINTER(OPB->_int, 1);
+			OPC->_float = (ptr->_float -= OPA->_float);
+			break;
+		case OP_SUBSTOREP_V:
+			ptr = PR_WPOINTER(OPB->_int, 3);
+			OPC->vector[0] = (ptr->vector[0] -= OPA->vector[0]);
+			OPC->vector[1] = (ptr->vector[1] -= OPA->vector[1]);
+			OPC->vector[2] = (ptr->vector[2] -= OPA->vector[2]);
+			break;
+
+		case OP_BITSETSTORE_F:
+			OPB->_float = (int)OPB->_float | (int)OPA->_float;
+			break;
+		case OP_BITSETSTOREP_F:
+			ptr = PR_WPOINTER(OPB->_int, 1);
+			ptr->_float = (int)ptr->_float | (int)OPA->_float;
+			break;
+		case OP_BITCLRSTORE_F:
+			OPB->_float = (int)OPB->_float & ~(int)OPA->_float;
+			break;
+		case OP_BITCLRSTOREP_F:
+			ptr = PR_WPOINTER(OPB->_int, 1);
+			ptr->_float = (int)ptr->_float & ~(int)OPA->_float;
+			break;
+
+		case OP_RAND0:
+			OPC->_float = PR_Random(qcvm);
+			break;
+		case OP_RAND1:
+			OPC->_float = PR_Random(qcvm) * OPA->_float;
+			break;
+		case OP_RAND2:
+			if (OPA->_float < OPB->_float)
+				OPC->_float = OPA->_float + PR_Random(qcvm) * (OPB->_float - OPA->_float);
+			else
+				OPC->_float = OPB->_float + PR_Random(qcvm) * (OPA->_float - OPB->_float);
+			break;
+		case OP_RANDV0:
+			OPC->vector[0] = PR_Random(qcvm);
+			OPC->vector[1] = PR_Random(qcvm);
+			OPC->vector[2] = PR_Random(qcvm);
+			break;
+		case OP_RANDV1:
+			OPC->vector[0] = PR_Random(qcvm) * OPA->vector[0];
+			OPC->vector[1] = PR_Random(qcvm) * OPA->vector[1];
+			OPC->vector[2] = PR_Random(qcvm) * OPA->vector[2];
+			break;
+		case OP_RANDV2:
+			for (i = 0; i < 3; i++)
+			{
+				if (OPA->vector[i] < OPB->vector[i])
+					OPC->vector[i] = OPA->vector[i] + PR_Random(qcvm) * (OPB->vector[i] - OPA->vector[i]);
+				else
+					OPC->vector[i] = OPB->vector[i] + PR_Random(qcvm) * (OPA->vector[i] - OPB->vector[i]);
+			}
+			break;
+
+		case OP_SWITCH_F:
+		case OP_SWITCH_V:
+		case OP_SWITCH_S:
+		case OP_SWITCH_E:
+		case OP_SWITCH_FNC:
+		case OP_SWITCH_I:
+			swtch = OPA;
+			swtchtype = st->op;
+			ofs = st->b;
+			st += ofs - 1;	/* to the case table */
+			if (ofs <= 0 && profile >= limit)
+				goto outofbudget;
+			break;
+
+		case OP_CASE:
+			switch (swtchtype)
+			{
+			case OP_SWITCH_F:
+				i = swtch->_float == OPA->_float;
+				break;
+			case OP_SWITCH_V:
+				i = swtch->vector[0] == OPA->vector[0] && swtch->vector[1] == OPA->vector[1] && swtch->vector[2] == OPA->vector[2];
+				break;
+			case OP_SWITCH_S:
+				i = swtch->string == OPA->string || !strcmp(PR_GetString(qcvm, swtch->string), PR_GetString(qcvm, OPA->string));
+				break;
+			case OP_SWITCH_E:
+			case OP_SWITCH_FNC:
+			case OP_SWITCH_I:
+				i = swtch->_int == OPA->_int;
+				break;
+			default:
+				qcvm->xstatement = st - qcvm->statements;
+				PR_RunError(qcvm, "OP_CASE with no switch");
+			}
+			if (i)
+			{
+				ofs = st->b;
+				st += ofs - 1;
+				if (ofs <= 0 && profile >= limit)
+					goto outofbudget;
+			}
+			break;
+
+		case OP_CASERANGE:
+			switch (swtchtype)
+			{
+			case OP_SWITCH_F:
+				i = swtch->_float >= OPA->_float && swtch->_float <= OPB->_float;
+				break;
+			case OP_SWITCH_I:
+				i = swtch->_int >= OPA->_int && swtch->_int <= OPB->_int;
+				break;
+			default:
+				qcvm->xstatement = st - qcvm->statements;
+				PR_RunError(qcvm, "OP_CASERANGE with no float or int switch");
+			}
+			if (i)
+			{
+				ofs = st->c;
+				st += ofs - 1;
+				if (ofs <= 0 && profile >= limit)
+					goto outofbudget;
+			}
+			break;
+
+		case OP_STORE_I:
+		case OP_STORE_P:
+			OPB->_int = OPA->_int;
+			break;
+		case OP_STORE_IF:
+			OPB->_float = (float)OPA->_int;
+			break;
+		case OP_STORE_FI:
+			OPB->_int = (int)OPA->_float;
+			break;
+
+		case OP_ADD_I:
+			OPC->_int = OPA->_int + OPB->_int;
+			break;
+		case OP_ADD_FI:
+			OPC->_float = OPA->_float + (float)OPB->_int;
+			break;
+		case OP_ADD_IF:
+			OPC->_float = (float)OPA->_int + OPB->_float;
+			break;
+
+		case OP_SUB_I:
+			OPC->_int = OPA->_int - OPB->_int;
+			break;
+		case OP_SUB_FI:
+			OPC->_float = OPA->_float - (float)OPB->_int;
+			break;
+		case OP_SUB_IF:
+			OPC->_float = (float)OPA->_int - OPB->_float;
+			break;
+
+		case OP_CONV_ITOF:
+			OPC->_float = (float)OPA->_int;
+			break;
+		case OP_CONV_FTOI:
+			OPC->_int = (int)OPA->_float;
+			break;
+		case OP_CP_ITOF:
+			ptr = PR_POINTER(OPA->_int, 1);
+			OPC->_float = (float)ptr->_int;
+			break;
+		case OP_CP_FTOI:
+			ptr = PR_POINTER(OPA->_int, 1);
+			OPC->_int = (int)ptr->_float;
+			break;
+
+		case OP_LOAD_I:
+			ed = PR_EDICT(OPA->edict);
+#if PR_CHECKED
+			PR_CheckEdict(qcvm, OPA->edict, OPB->_int, 1);
+#endif
+			OPC->_int = ((eval_t *)((int *)&ed->v + OPB->_int))->_int;
+			break;
+
+		case OP_STOREP_I:
+			ptr = PR_WPOINTER(OPB->_int, 1);
+			ptr->_int = OPA->_int;
+			break;
+		case OP_STOREP_IF:
+			ptr = PR_WPOINTER(OPB->_int, 1);
+			ptr->_float = (float)OPA->_int;
+			break;
+		case OP_STOREP_FI:
+			ptr = PR_WPOINTER(OPB->_int, 1);
+			ptr->_int = (int)OPA->_float;
+			break;
+
+		case OP_BITAND_I:
+			OPC->_int = OPA->_int & OPB->_int;
+			break;
+		case OP_BITOR_I:
+			OPC->_int = OPA->_int | OPB->_int;
+			break;
+		case OP_BITXOR_I:
+			OPC->_int = OPA->_int ^ OPB->_int;
+			break;
+		case OP_RSHIFT_I:
+			OPC->_int = OPA->_int >> (OPB->_int & 31);
+			break;
+		case OP_LSHIFT_I:
+			OPC->_int = (int)((unsigned int)OPA->_int << (OPB->_int & 31));
+			break;
+
+		case OP_MUL_I:
+			OPC->_int = (int)((unsigned int)OPA->_int * (unsigned int)OPB->_int);
+			break;
+		case OP_DIV_I:
+			if (!OPB->_int)
+				OPC->_int = 0;	/* fteqcc gives 0 rather than trapping */
+			else if (OPB->_int == -1)
+				OPC->_int = (int)(0u - (unsigned int)OPA->_int);	/* INT_MIN / -1 traps too */
+			else
+				OPC->_int = OPA->_int / OPB->_int;
+			break;
+
+		case OP_EQ_I:
+			OPC->_int = OPA->_int == OPB->_int;
+			break;
+		case OP_NE_I:
+			OPC->_int = OPA->_int != OPB->_int;
+			break;
+		case OP_NOT_I:
+			OPC->_int = !OPA->_int;
+			break;
+
+		case OP_IFNOT_S:
+		case OP_IF_S:
+			if ((OPA->string && *PR_GetString(qcvm, OPA->string)) == (st->op == OP_IF_S))
+			{
+				ofs = st->b;
+				st += ofs - 1;
+				if (ofs <= 0 && profile >= limit)
+					goto outofbudget;
+			}
+			break;
+
+		case OP_IFNOT_F:
+		case OP_IF_F:
+			if ((OPA->_float != 0) == (st->op == OP_IF_F))
+			{	/* unlike OP_IF, -0 is false */
+				ofs = st->b;
+				st += ofs - 1;
+				if (ofs <= 0 && profile >= limit)
+					goto outofbudget;
+			}
+			break;
+
+		case OP_DIV_VF:
+			OPC->vector[0] = OPA->vector[0] / OPB->_float;
+			OPC->vector[1] = OPA->vector[1] / OPB->_float;
+			OPC->vector[2] = OPA->vector[2] / OPB->_float;
+			break;
+
+		case OP_ADD_PIW:
+			OPC->_int = OPA->_int + OPB->_int * 4;
+			break;
+
+		case OP_LOADA_F:
+		case OP_LOADA_S:
+		case OP_LOADA_ENT:
+		case OP_LOADA_FLD:
+		case OP_LOADA_FNC:
+		case OP_LOADA_I:
+#if PR_CHECKED
+			PR_CheckArray(qcvm, st->a, OPB->_int, 1);
+#endif
+			OPC->_int = (&OPA->_int)[OPB->_int];
+			break;
+		case OP_LOADA_V:
+#if PR_CHECKED
+			PR_CheckArray(qcvm, st->a, OPB->_int, 3);
+#endif
+			ptr = (eval_t *)(&OPA->_int + OPB->_int);
+			OPC->vector[0] = ptr->vector[0];
+			OPC->vector[1] = ptr->vector[1];
+			OPC->vector[2] = ptr->vector[2];
+			break;
+
+		case OP_LOADP_F:
+		case OP_LOADP_S:
+		case OP_LOADP_ENT:
+		case OP_LOADP_FLD:
+		case OP_LOADP_FNC:
+		case OP_LOADP_I:
+			ptr = PR_POINTER(OPA->_int + OPB->_int * 4, 1);
+			OPC->_int = ptr->_int;
+			break;
+		case OP_LOADP_V:
+			ptr = PR_POINTER(OPA->_int + OPB->_int * 4, 3);
+			OPC->vector[0] = ptr->vector[0];
+			OPC->vector[1] = ptr->vector[1];
+			OPC->vector[2] = ptr->vector[2];
+			break;
+
+		case OP_LE_I:
+			OPC->_int = OPA->_int <= OPB->_int;
+			break;
+		case OP_GE_I:
+			OPC->_int = OPA->_int >= OPB->_int;
+			break;
+		case OP_LT_I:
+			OPC->_int = OPA->_int < OPB->_int;
+			break;
+		case OP_GT_I:
+			OPC->_int = OPA->_int > OPB->_int;
+			break;
+
+		case OP_LE_IF:
+			OPC->_int = (float)OPA->_int <= OPB->_float;
+			break;
+		case OP_GE_IF:
+			OPC->_int = (float)OPA->_int >= OPB->_float;
+			break;
+		case OP_LT_IF:
+			OPC->_int = (float)OPA->_int < OPB->_float;
+			break;
+		case OP_GT_IF:
+			OPC->_int = (float)OPA->_int > OPB->_float;
+			break;
+
+		case OP_LE_FI:
+			OPC->_int = OPA->_float <= (float)OPB->_int;
+			break;
+		case OP_GE_FI:
+			OPC->_int = OPA->_float >= (float)OPB->_int;
+			break;
+		case OP_LT_FI:
+			OPC->_int = OPA->_float < (float)OPB->_int;
+			break;
+		case OP_GT_FI:
+			OPC->_int = OPA->_float > (float)OPB->_int;
+			break;
+
+		case OP_EQ_IF:
+			OPC->_int = (float)OPA->_int == OPB->_float;
+			break;
+		case OP_EQ_FI:
+			OPC->_int = OPA->_float == (float)OPB->_int;
+			break;
+		case OP_NE_IF:
+			OPC->_int = (float)OPA->_int != OPB->_float;
+			break;
+		case OP_NE_FI:
+			OPC->_int = OPA->_float != (float)OPB->_int;
+			break;
+
+		case OP_MUL_IF:
+			OPC->_float = (float)OPA->_int * OPB->_float;
+			break;
+		case OP_MUL_FI:
+			OPC->_float = OPA->_float * (float)OPB->_int;
+			break;
+		case OP_MUL_VI:
+			OPC->vector[0] = OPA->vector[0] * (float)OPB->_int;
+			OPC->vector[1] = OPA->vector[1] * (float)OPB->_int;
+			OPC->vector[2] = OPA->vector[2] * (float)OPB->_int;
+			break;
+		case OP_MUL_IV:
+			OPC->vector[0] = (float)OPA->_int * OPB->vector[0];
+			OPC->vector[1] = (float)OPA->_int * OPB->vector[1];
+			OPC->vector[2] = (float)OPA->_int * OPB->vector[2];
+			break;
+		case OP_DIV_IF:
+			OPC->_float = (float)OPA->_int / OPB->_float;
+			break;
+		case OP_DIV_FI:
+			OPC->_float = OPA->_float / (float)OPB->_int;
+			break;
+
+		case OP_BITAND_IF:
+			OPC->_int = OPA->_int & (int)OPB->_float;
+			break;
+		case OP_BITOR_IF:
+			OPC->_int = OPA->_int | (int)OPB->_float;
+			break;
+		case OP_BITAND_FI:
+			OPC->_int = (int)OPA->_float & OPB->_int;
+			break;
+		case OP_BITOR_FI:
+			OPC->_int = (int)OPA->_float | OPB->_int;
+			break;
+
+		case OP_AND_I:
+			OPC->_int = OPA->_int && OPB->_int;
+			break;
+		case OP_OR_I:
+			OPC->_int = OPA->_int || OPB->_int;
+			break;
+		case OP_AND_IF:
+			OPC->_int = OPA->_int && OPB->_float;
+			break;
+		case OP_OR_IF:
+			OPC->_int = OPA->_int || OPB->_float;
+			break;
+		case OP_AND_FI:
+			OPC->_int = OPA->_float && OPB->_int;
+			break;
+		case OP_OR_FI:
+			OPC->_int = OPA->_float || OPB->_int;
+			break;
+
+		case OP_BOUNDCHECK:
+			if ((unsigned int)OPA->_int < st->c || (unsigned int)OPA->_int >= st->b)
+			{
+				qcvm->xstatement = st - qcvm->statements;
+				PR_RunError(qcvm, "array index %i out of bounds, must be %u <= index < %u", OPA->_int, st->c, st->b);
+			}
+			break;
+
+		default:
+			qcvm->xstatement = st - qcvm->statements;
+			PR_RunError(qcvm, "Bad opcode %i", st->op);
+	}
+    }	/* end of while(1) loop */
+
+outofbudget:
+	qcvm->xstatement = st - qcvm->statements;
+	if (limit == PR_RUNAWAY_LIMIT)
+		PR_RunError(qcvm, "runaway loop error");
+	status = NVM_YIELDED;
+	goto stop;
+
+suspend:
+	qcvm->xstatement = st - qcvm->statements;
+	qcvm->suspendrequest = false;
+	status = NVM_SUSPENDED;
+
+stop:
+	PR_PROFILE(profile - startprofile);
+	STAT(qcvm->stats.statements += profile - startprofile);
+	if (qcvm->profiling)
+		PR_ProfileFlush(qcvm, profile - startprofile);
+
+	if (qcvm->xthread)
+		PR_DetachThread(qcvm, exitdepth, status);
+	else
+	{	// a builtin's return value may not have been picked up yet, and the host is free to run other QC until the resume
+		qcvm->suspended = true;
+		qcvm->suspendstatement = qcvm->xstatement;
+		qcvm->suspendexitdepth = exitdepth;
+		memcpy(qcvm->suspendreturn, &qcvm->globals[OFS_RETURN], sizeof(qcvm->suspendreturn));
+	}
+	qcvm->xthread = oldthread;
+	return status;
+}
+
+#undef PR_POINTER
+#undef PR_WPOINTER
+#undef PR_EDICT
+#undef PR_WEDICT
+#undef PR_PROFILE
+#undef PR_EXECUTE
+#undef PR_CHECKED
+#undef PR_PARALLEL
@@ -1,16 +1,34 @@
 #include <assert.h>
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <setjmp.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "nethervm/nethervm.h"
 
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
 static NVM* vm;
 static int counter = 0;
+static int failures = 0;
+static jmp_buf* expected_error = NULL;
+static bool use_progs_cache = false;
+static const char* const* strip_roots = NULL;
+static int num_strip_roots = 0;
 
 static void builtin_counter_increase(NVM* qcvm)
 {
-    int value = G_INT(OFS_PARM0);
+    int value = (int)G_FLOAT(OFS_PARM0);
     counter += value;
 }
 
@@ -20,6 +38,15 @@ static void builtin_print(NVM* qcvm)
     printf("%s\n", msg);
 }
 
+static int waiting[4];
+static int numwaiting = 0;
+
+static void builtin_wait_value(NVM* qcvm)
+{
+    waiting[numwaiting++ & 3] = nvmSuspend(qcvm);
+    G_FLOAT(OFS_RETURN) = 0;
+}
+
 static void* alloc_callback(NVM* vm, void* oldptr, size_t size, const char* name)
 {
     if (oldptr == NULL) {
@@ -44,13 +71,31 @@ static void print_callback(NVM* vm, const char* msg, bool debug)
 
 static void error_callback(NVM* vm, const char* msg)
 {
+    if (expected_error) {
+        printf("expected NVM error: %s\n", msg);
+        longjmp(*expected_error, 1);
+    }
     fprintf(stderr, "NVM error: %s\n", msg);
     exit(EXIT_FAILURE);
 }
 
+static bool WriteFile(const char* filename, const char* data, size_t size)
+{
+    FILE *f = fopen(filename, "wb");
+    if (f == NULL)
+        return false;
+    bool ok = fwrite(data, 1, size, f) == size;
+    fclose(f);
+    return ok;
+}
+
 static bool ReadFile(const char* filename, char** data, size_t* size)
 {
     FILE *f = fopen(filename, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "can't open %s\n", filename);
+        return false;
+    }
     fseek(f, 0, SEEK_END);
     long fsize = ftell(f);
     fseek(f, 0, SEEK_SET);  /* same as rewind(f); */
@@ -63,30 +108,828 @@ static bool ReadFile(const char* filename, char** data, size_t* size)
 
     *data = content;
     *size = fsize;
+    return true;
+}
+
+/* nvmLoadProgs works in the buffer it is given, so every VM gets its own copy, freed with it by DestroyTestVM */
+static NVM* CreateTestVM(const char* filename, const char* data, size_t size, int inlining, const char* layout)
+{
+    char* copy = malloc(size + 1);
+    memcpy(copy, data, size + 1);
+
+    NVM* qcvm = nvmCreateVM(alloc_callback, print_callback, error_callback, copy);
+    if (inlining > 0)
+        nvmSetInlining(qcvm, inlining);
+    if (layout)
+        nvmSetLayoutProfile(qcvm, layout);
+    nvmSetProgsCache(qcvm, use_progs_cache);
+    if (strip_roots)
+        nvmSetStripping(qcvm, strip_roots, num_strip_roots, NVM_STRIP_FUNCTIONS);
+    if (!nvmLoadProgs(qcvm, filename, copy, size, false)) {
+        nvmDestroyVM(qcvm);
+        free(copy);
+        return NULL;
+    }
+    nvmAddExtBuiltin(qcvm, 0, "counter_increase", builtin_counter_increase);
+    nvmAddExtBuiltin(qcvm, 0, "print", builtin_print);
+    nvmAddExtBuiltin(qcvm, 0, "wait_value", builtin_wait_value);
+    return qcvm;
+}
+
+static void DestroyTestVM(NVM* qcvm)
+{
+    void* copy = qcvm->user_data;
+    nvmDestroyVM(qcvm);
+    free(copy);
+}
+
+static edict_t* TestEdict(NVM* qcvm, int num)
+{
+    return (edict_t*)((byte*)qcvm->edicts + num * qcvm->edict_size);
+}
+
+static float RunCompute(NVM* qcvm)
+{
+    nvmExecuteFunction(qcvm, nvmFindFunction(qcvm, "compute"));
+    return G_FLOAT(OFS_RETURN);
+}
+
+/* the first statement of an image whose op is one of ops, -1 if none */
+static int FindStatement(const char* data, const unsigned short* ops, int numops)
+{
+    const dprograms_t* progs = (const dprograms_t*)data;
+    const dstatement16_t* st = (const dstatement16_t*)(data + progs->ofs_statements);
+
+    for (int i = 1; i < progs->numstatements; i++) {
+        for (int j = 0; j < numops; j++) {
+            if (st[i].op == ops[j])
+                return i;
+        }
+    }
+    return -1;
+}
+
+static bool LoadsVerified(const char* filename, const char* data, size_t size)
+{
+    NVM* qcvm = CreateTestVM(filename, data, size, 0, NULL);
+    if (qcvm == NULL)
+        return false;
+    bool verified = qcvm->verified;
+    DestroyTestVM(qcvm);
+    return verified;
+}
+
+/*
+the verifier is what lets a progs run without checks, so an image with a branch
+out of its function, an operand out of the globals or an opcode no interpreter
+runs must not pass it
+*/
+static void TestVerifier(const char* filename, const char* data, size_t size)
+{
+    static const unsigned short branches[] = { OP_IF, OP_IFNOT, OP_GOTO };
+    static const unsigned short adds[] = { OP_ADD_F };
+    char* bad = malloc(size + 1);
+    dstatement16_t* st = (dstatement16_t*)(bad + ((const dprograms_t*)data)->ofs_statements);
+    int branch = FindStatement(data, branches, 3);
+    int add = FindStatement(data, adds, 1);
+
+    CHECK(LoadsVerified(filename, data, size));
+    /* a truncated image fails to load, and without fatal it doesn't call the error callback */
+    CHECK(CreateTestVM(filename, data, size / 2, 0, NULL) == NULL);
+    CHECK(branch > 0);
+    CHECK(add > 0);
+    if (branch <= 0 || add <= 0) {
+        free(bad);
+        return;
+    }
+
+    memcpy(bad, data, size + 1);
+    if (st[branch].op == OP_GOTO)
+        st[branch].a = 30000;
+    else
+        st[branch].b = 30000;
+    CHECK(!LoadsVerified(filename, bad, size));
+
+    memcpy(bad, data, size + 1);
+    st[add].a = 32000;
+    CHECK(!LoadsVerified(filename, bad, size));
+
+    memcpy(bad, data, size + 1);
+    st[add].c = 32000;
+    CHECK(!LoadsVerified(filename, bad, size));
+
+    memcpy(bad, data, size + 1);
+    st[add].op = OP_NUMOPS;
+    CHECK(!LoadsVerified(filename, bad, size));
+
+    free(bad);
+}
+
+/* inlining moves statements around, but must not change what they compute */
+static void TestInlining(const char* filename, const char* data, size_t size)
+{
+    NVM* qcvm = CreateTestVM(filename, data, size, 0, NULL);
+    float expected = RunCompute(qcvm);
+    DestroyTestVM(qcvm);
+
+    qcvm = CreateTestVM(filename, data, size, 64, NULL);
+    CHECK(qcvm->verified);
+    CHECK(qcvm->numinlinedranges > 0);
+    CHECK(RunCompute(qcvm) == expected);
+    DestroyTestVM(qcvm);
+}
+
+/* laying out from a profile moves statements around, but must not change what they compute */
+static void TestLayout(const char* filename, const char* data, size_t size)
+{
+    static const char* layout = "nethervmtest.nvml";
+    NVM* qcvm = CreateTestVM(filename, data, size, 0, NULL);
+    float expected = RunCompute(qcvm);
+    CHECK(nvmLayoutProfileBegin(qcvm));
+    RunCompute(qcvm);
+    CHECK(nvmLayoutProfileSave(qcvm, layout));
+    nvmLayoutProfileEnd(qcvm);
+    DestroyTestVM(qcvm);
+
+    qcvm = CreateTestVM(filename, data, size, 0, layout);
+    CHECK(qcvm->verified);
+    CHECK(qcvm->laidout);
+    CHECK(RunCompute(qcvm) == expected);
+    DestroyTestVM(qcvm);
+
+    remove(layout);
+}
+
+/* a budgeted call stops and resumes where it was, and gives what an unbudgeted one does */
+static void TestBudget(const char* filename, const char* data, size_t size)
+{
+    NVM* qcvm = CreateTestVM(filename, data, size, 0, NULL);
+    func_t count_up = nvmFindFunction(qcvm, "count_up");
+    jmp_buf errorjmp;
+    nvmstatus_t status;
+    int yields = 0;
+
+    nvmExecuteFunction(qcvm, count_up);
+    float expected = G_FLOAT(OFS_RETURN);
+    CHECK(expected == 4999 * 5000 / 2);
+
+    status = nvmExecuteBudget(qcvm, count_up, 1000);
+    CHECK(status == NVM_YIELDED);
+    CHECK(qcvm->suspended);
+
+    /* only one budgeted call can be suspended at a time */
+    expected_error = &errorjmp;
+    if (!setjmp(errorjmp)) {
+        nvmExecuteBudget(qcvm, count_up, 1000);
+        CHECK(!"a second budgeted call started");
+    }
+    expected_error = NULL;
+    CHECK(qcvm->suspended);
+
+    while (status == NVM_YIELDED && yields < 1000) {
+        yields++;
+        RunCompute(qcvm);   /* the host may run other QC between resumes */
+        status = nvmResume(qcvm, 1000);
+    }
+    CHECK(status == NVM_COMPLETED);
+    CHECK(yields > 10);
+    CHECK(!qcvm->suspended);
+    CHECK(qcvm->depth == 0);
+    CHECK(G_FLOAT(OFS_RETURN) == expected);
+    CHECK(nvmResume(qcvm, 1000) == NVM_COMPLETED);
+
+    DestroyTestVM(qcvm);
+}
+
+/* the first call in func, -1 if none */
+static int FindCall(NVM* qcvm, func_t func)
+{
+    for (int i = qcvm->functions[func].first_statement; i < qcvm->progs->numstatements; i++) {
+        if (qcvm->statements[i].op >= OP_CALL0 && qcvm->statements[i].op <= OP_CALL8)
+            return i;
+        if (qcvm->statements[i].op == OP_DONE)
+            break;
+    }
+    return -1;
+}
+
+/*
+tail recursion far deeper than the stack runs in one frame, and only a call whose
+result is returned as is becomes a tail call
+*/
+static void TestTailCalls(const char* filename, const char* data, size_t size)
+{
+    NVM* qcvm = CreateTestVM(filename, data, size, 0, NULL);
+    func_t sum_down = nvmFindFunction(qcvm, "sum_down");
+    func_t call_then_return = nvmFindFunction(qcvm, "call_then_return");
+    int tail = FindCall(qcvm, sum_down);
+    int notail = FindCall(qcvm, call_then_return);
+    jmp_buf errorjmp;
+    nvmstats_t stats;
+
+    CHECK(qcvm->verified);
+    CHECK(tail > 0 && qcvm->statements[tail].c);
+    CHECK(notail > 0 && !qcvm->statements[notail].c);
+
+    G_FLOAT(OFS_PARM0) = 5000;
+    G_FLOAT(OFS_PARM1) = 0;
+    nvmExecuteFunction(qcvm, sum_down);
+    CHECK(G_FLOAT(OFS_RETURN) == 5000 * 5001 / 2);
+    CHECK(qcvm->depth == 0);
+    nvmGetStats(qcvm, &stats);
+    CHECK(stats.tail_calls >= 5000);
+
+    G_FLOAT(OFS_PARM0) = 10;
+    nvmExecuteFunction(qcvm, call_then_return);
+    CHECK(G_FLOAT(OFS_RETURN) == 20);
+    CHECK(qcvm->depth == 0);
+    DestroyTestVM(qcvm);
+
+    /* the checked interpreter makes no tail calls, so the same recursion overflows */
+    qcvm = CreateTestVM(filename, data, size, 0, NULL);
+    nvmSetChecked(qcvm, true);
+    expected_error = &errorjmp;
+    if (!setjmp(errorjmp)) {
+        G_FLOAT(OFS_PARM0) = 5000;
+        G_FLOAT(OFS_PARM1) = 0;
+        nvmExecuteFunction(qcvm, sum_down);
+        CHECK(!"5000 frames fit the stack");
+    }
+    expected_error = NULL;
+    DestroyTestVM(qcvm);
+}
+
+static void StartWaiter(NVM* qcvm, float slot)
+{
+    G_FLOAT(OFS_PARM0) = slot;
+    nvmExecuteFunction(qcvm, nvmFindFunction(qcvm, "waiter"));
+}
+
+/* suspended QC keeps its frames and locals while other QC runs, and resumes with the value it was woken with */
+static void TestThreads(const char* filename, const char* data, size_t size)
+{
+    NVM* qcvm = CreateTestVM(filename, data, size, 0, NULL);
+    nvmhandle_t result1 = nvmGlobalHandle(qcvm, "result1", ev_float);
+    nvmhandle_t result2 = nvmGlobalHandle(qcvm, "result2", ev_float);
+    eval_t value;
+
+    numwaiting = 0;
+    StartWaiter(qcvm, 1);
+    StartWaiter(qcvm, 2);
+    StartWaiter(qcvm, 3);
+    CHECK(numwaiting == 3);
+    CHECK(qcvm->depth == 0);
+    for (int i = 0; i < 3; i++)
+        CHECK(nvmThreadState(qcvm, waiting[i]) == NVM_THREAD_WAITING);
+    CHECK(NVM_GLOBAL(qcvm, result1, float) == 0);
+    CHECK(NVM_GLOBAL(qcvm, result2, float) == 0);
+
+    /* nothing is ready yet, and other QC can run meanwhile */
+    CHECK(nvmRunThreads(qcvm, 0, 0) == 0);
+    RunCompute(qcvm);
+
+    nvmKillThread(qcvm, waiting[2]);
+    CHECK(nvmThreadState(qcvm, waiting[2]) == NVM_THREAD_NONE);
+    value._float = 1000;
+    nvmWake(qcvm, waiting[1], &value);
+    value._float = 100;
+    nvmWake(qcvm, waiting[0], &value);
+    CHECK(nvmThreadState(qcvm, waiting[0]) == NVM_THREAD_READY);
+    CHECK(nvmThreadState(qcvm, waiting[1]) == NVM_THREAD_READY);
+
+    CHECK(nvmRunThreads(qcvm, 0, 0) == 2);
+    CHECK(qcvm->depth == 0);
+    for (int i = 0; i < 3; i++)
+        CHECK(nvmThreadState(qcvm, waiting[i]) == NVM_THREAD_NONE);
+    CHECK(NVM_GLOBAL(qcvm, result1, float) == 10 + 1 * 2 + 100 + 1);
+    CHECK(NVM_GLOBAL(qcvm, result2, float) == 20 + 2 * 2 + 1000 + 2);
+
+    DestroyTestVM(qcvm);
+}
+
+/*
+a cold load writes the cache and a warm one maps it, with the same result; a
+cache made from other progs, a damaged one and a truncated one are not used,
+and one whose statements were changed is verified again and runs checked
+*/
+static void TestProgsCache(const char* data, size_t size, const char* reload_data, size_t reload_size)
+{
+    static const char* filename = "nethervmtest_cache.dat";
+    static const char* cachename = "nethervmtest_cache.dat.nvmc";
+    char* cache;
+    size_t cachesize;
+
+    remove(cachename);
+    use_progs_cache = true;
+
+    NVM* qcvm = CreateTestVM(filename, data, size, 0, NULL);
+    CHECK(qcvm->cache == NULL);
+    CHECK(qcvm->verified);
+    float expected = RunCompute(qcvm);
+    size_t statementssize = qcvm->progs->numstatements * sizeof(dstatement_t);
+    dstatement_t* statements = malloc(statementssize);
+    memcpy(statements, qcvm->statements, statementssize);
+    int add = -1, call = -1;
+    for (int i = 0; i < qcvm->progs->numstatements; i++) {
+        if (statements[i].op == OP_ADD_F && add < 0)
+            add = i;
+        if (statements[i].op >= OP_CALL0 && statements[i].op <= OP_CALL8 && !statements[i].c && call < 0)
+            call = i;
+    }
+    DestroyTestVM(qcvm);
+    CHECK(add > 0);
+    CHECK(call > 0);
+
+    qcvm = CreateTestVM(filename, data, size, 0, NULL);
+    CHECK(qcvm->cache != NULL);
+    CHECK(qcvm->verified);
+    CHECK(RunCompute(qcvm) == expected);
+    DestroyTestVM(qcvm);
+
+    CHECK(ReadFile(cachename, &cache, &cachesize));
+
+    /* other progs under the same name replace the cache */
+    qcvm = CreateTestVM(filename, reload_data, reload_size, 0, NULL);
+    CHECK(qcvm->cache == NULL);
+    CHECK(RunCompute(qcvm) == 1);
+    DestroyTestVM(qcvm);
+
+    CHECK(WriteFile(cachename, cache, cachesize / 2));
+    qcvm = CreateTestVM(filename, data, size, 0, NULL);
+    CHECK(qcvm->cache == NULL);
+    CHECK(RunCompute(qcvm) == expected);
+    DestroyTestVM(qcvm);
+
+    cache[0] ^= 0xff;
+    CHECK(WriteFile(cachename, cache, cachesize));
+    cache[0] ^= 0xff;
+    qcvm = CreateTestVM(filename, data, size, 0, NULL);
+    CHECK(qcvm->cache == NULL);
+    DestroyTestVM(qcvm);
+
+    size_t ofs = 0;
+    while (ofs + statementssize <= cachesize && memcmp(cache + ofs, statements, statementssize))
+        ofs += 4;
+    CHECK(ofs + statementssize <= cachesize);
+    if (ofs + statementssize <= cachesize && call > 0) {
+        /* a call marked as a tail call in the file is marked again from the statements */
+        ((dstatement_t*)(cache + ofs))[call].c = 1;
+        CHECK(WriteFile(cachename, cache, cachesize));
+        ((dstatement_t*)(cache + ofs))[call].c = 0;
+        qcvm = CreateTestVM(filename, data, size, 0, NULL);
+        CHECK(qcvm->cache != NULL);
+        CHECK(qcvm->verified);
+        CHECK(qcvm->statements[call].c == 0);
+        CHECK(RunCompute(qcvm) == expected);
+        DestroyTestVM(qcvm);
+    }
+    if (ofs + statementssize <= cachesize && add > 0) {
+        ((dstatement_t*)(cache + ofs))[add].a = 32000;
+        CHECK(WriteFile(cachename, cache, cachesize));
+        qcvm = CreateTestVM(filename, data, size, 0, NULL);
+        CHECK(qcvm->cache != NULL);
+        CHECK(!qcvm->verified);
+        DestroyTestVM(qcvm);
+    }
+
+    use_progs_cache = false;
+    free(statements);
+    free(cache);
+    remove(cachename);
+}
+
+/* stripping keeps what the entry points reach working, and the functions it dropped fail to run */
+static void TestStripping(const char* filename, const char* data, size_t size)
+{
+    static const char* const roots[] = { "comp*" };
+    nvmedictstatus_t results[2];
+    jmp_buf errorjmp;
+
+    NVM* qcvm = CreateTestVM(filename, data, size, 0, NULL);
+    float expected = RunCompute(qcvm);
+    int numstatements = qcvm->progs->numstatements;
+    DestroyTestVM(qcvm);
+
+    strip_roots = roots;
+    num_strip_roots = 1;
+    qcvm = CreateTestVM(filename, data, size, 0, NULL);
+    strip_roots = NULL;
+    num_strip_roots = 0;
+
+    CHECK(qcvm->verified);
+    CHECK(qcvm->stripped.functions > 0);
+    CHECK(qcvm->stripped.statements > 0);
+    CHECK(qcvm->stripped.statements == numstatements - qcvm->progs->numstatements);
+    CHECK(RunCompute(qcvm) == expected);
+
+    expected_error = &errorjmp;
+    if (!setjmp(errorjmp)) {
+        nvmExecuteFunction(qcvm, nvmFindFunction(qcvm, "count_up"));
+        CHECK(!"a stripped function ran");
+    }
+    expected_error = NULL;
+    CHECK(qcvm->depth == 0);
+
+    /* a think field naming a stripped function is that edict's error, not the batch's */
+    CHECK(nvmAllocEdicts(qcvm, 2));
+    memset(qcvm->edicts, 0, 2 * qcvm->edict_size);
+    qcvm->num_edicts = 2;
+    nvmhandle_t think = nvmFieldHandle(qcvm, "think", ev_function);
+    CHECK(think.ofs >= 0);
+    NVM_FIELD(TestEdict(qcvm, 1), think, func_t) = nvmFindFunction(qcvm, "mover");
+    CHECK(nvmExecuteForEdicts(qcvm, nvmFindField(qcvm, "think"), NULL, 2, NVM_EDICTS_FIELD, results) == 1);
+    CHECK(results[1] == NVM_EDICT_ERROR);
+
+    DestroyTestVM(qcvm);
+}
+
+/* fields and globals the new progs still have keep their values across nvmReloadProgs, new ones start at zero */
+static void TestReload(const char* filename, const char* data, size_t size, const char* reload_filename, const char* reload_data, size_t reload_size)
+{
+    NVM* qcvm = CreateTestVM(filename, data, size, 0, NULL);
+    CHECK(nvmAllocEdicts(qcvm, 4));
+    memset(qcvm->edicts, 0, 4 * qcvm->edict_size);
+    qcvm->num_edicts = 4;
+
+    nvmhandle_t kind = nvmFieldHandle(qcvm, "kind", ev_float);
+    nvmhandle_t health = nvmFieldHandle(qcvm, "health", ev_float);
+    nvmhandle_t enemy = nvmFieldHandle(qcvm, "enemy", ev_entity);
+    nvmhandle_t score = nvmGlobalHandle(qcvm, "score", ev_float);
+    CHECK(kind.ofs >= 0 && health.ofs >= 0 && enemy.ofs >= 0 && score.ofs >= 0);
+    NVM_FIELD(TestEdict(qcvm, 1), kind, float) = 3;
+    NVM_FIELD(TestEdict(qcvm, 1), health, float) = 10;
+    NVM_FIELD(TestEdict(qcvm, 1), enemy, int) = 2 * qcvm->edict_size;
+    NVM_FIELD(TestEdict(qcvm, 2), health, float) = 20;
+    NVM_GLOBAL(qcvm, score, float) = 7;
+
+    /* the old image is still read while the new one is loaded, both live until the VM goes */
+    char* reload_copy = malloc(reload_size + 1);
+    memcpy(reload_copy, reload_data, reload_size + 1);
+    CHECK(nvmReloadProgs(qcvm, reload_filename, reload_copy, reload_size, false));
+
+    kind = nvmFieldHandle(qcvm, "kind", ev_float);
+    health = nvmFieldHandle(qcvm, "health", ev_float);
+    enemy = nvmFieldHandle(qcvm, "enemy", ev_entity);
+    score = nvmGlobalHandle(qcvm, "score", ev_float);
+    nvmhandle_t armor = nvmFieldHandle(qcvm, "armor", ev_float);
+    CHECK(kind.ofs >= 0 && health.ofs >= 0 && enemy.ofs >= 0 && score.ofs >= 0 && armor.ofs >= 0);
+    if (kind.ofs >= 0 && health.ofs >= 0 && enemy.ofs >= 0 && score.ofs >= 0 && armor.ofs >= 0) {
+        CHECK(qcvm->num_edicts == 4);
+        CHECK(NVM_FIELD(TestEdict(qcvm, 1), kind, float) == 3);
+        CHECK(NVM_FIELD(TestEdict(qcvm, 1), health, float) == 10);
+        CHECK(NVM_FIELD(TestEdict(qcvm, 1), enemy, int) == 2 * qcvm->edict_size);
+        CHECK(NVM_FIELD(TestEdict(qcvm, 2), health, float) == 20);
+        CHECK(NVM_FIELD(TestEdict(qcvm, 1), armor, float) == 0);
+        CHECK(NVM_GLOBAL(qcvm, score, float) == 7);
+        CHECK(RunCompute(qcvm) == 8);
+    }
+
+    DestroyTestVM(qcvm);
+    free(reload_copy);
+}
+
+static bool allocator_checked = false;
+
+/* forwards to nvmAllocCallback, and checks that every tag is empty when the NVM struct itself goes */
+static void* alloc_checked_callback(NVM* vm, void* ptr, size_t size, const char* name)
+{
+    if (vm && ptr == vm && size == 0) {
+        nvmalloctag_t tags[64];
+
+        allocator_checked = true;
+        vm->alloc_callback = nvmAllocCallback;
+        int numtags = nvmGetAllocStats(vm, tags, 64);
+        CHECK(numtags > 1);
+        for (int i = 0; i < numtags && i < 64; i++) {
+            if (tags[i].bytes || tags[i].count)
+                fprintf(stderr, "'%s' still holds %zu bytes in %u blocks\n", tags[i].name, tags[i].bytes, tags[i].count);
+            CHECK(tags[i].bytes == 0 && tags[i].count == 0);
+        }
+    }
+    return nvmAllocCallback(vm, ptr, size, name);
+}
+
+/* a VM on the built-in allocator gives back every block it took by the time it is destroyed */
+static void TestAllocator(const char* filename, const char* data, size_t size, const char* reload_filename, const char* reload_data, size_t reload_size)
+{
+    char* copy = malloc(size + 1);
+    char* reload_copy = malloc(reload_size + 1);
+    nvmalloctag_t tags[64];
+    memcpy(copy, data, size + 1);
+    memcpy(reload_copy, reload_data, reload_size + 1);
+
+    NVM* qcvm = nvmCreateVM(nvmAllocCallback, print_callback, error_callback, copy);
+    nvmSetHugePages(qcvm, true);
+    CHECK(nvmLoadProgs(qcvm, filename, copy, size, false));
+    nvmAddExtBuiltin(qcvm, 0, "counter_increase", builtin_counter_increase);
+    nvmAddExtBuiltin(qcvm, 0, "print", builtin_print);
+    nvmAddStringBuiltins(qcvm);
+    CHECK(nvmAllocEdicts(qcvm, 16));
+    memset(qcvm->edicts, 0, 16 * qcvm->edict_size);
+    qcvm->num_edicts = 16;
+    nvmProfileBegin(qcvm);
+    RunCompute(qcvm);
+    nvmProfileEnd(qcvm);
+
+    int numtags = nvmGetAllocStats(qcvm, tags, 64);
+    size_t live = 0;
+    for (int i = 0; i < numtags && i < 64; i++)
+        live += tags[i].bytes;
+    CHECK(live > 0);
+
+    CHECK(nvmReloadProgs(qcvm, reload_filename, reload_copy, reload_size, false));
+    CHECK(RunCompute(qcvm) == 1);
+
+    qcvm->alloc_callback = alloc_checked_callback;
+    nvmDestroyVM(qcvm);
+    CHECK(allocator_checked);
+    free(copy);
+    free(reload_copy);
+}
+
+#define TEST_EDICTS 64
+
+static void SetupBatchEdicts(NVM* qcvm)
+{
+    nvmhandle_t origin = nvmFieldHandle(qcvm, "origin", ev_vector);
+    nvmhandle_t velocity = nvmFieldHandle(qcvm, "velocity", ev_vector);
+    nvmhandle_t kind = nvmFieldHandle(qcvm, "kind", ev_float);
+    nvmhandle_t health = nvmFieldHandle(qcvm, "health", ev_float);
+    nvmhandle_t enemy = nvmFieldHandle(qcvm, "enemy", ev_entity);
+
+    nvmAllocEdicts(qcvm, TEST_EDICTS);
+    memset(qcvm->edicts, 0, TEST_EDICTS * qcvm->edict_size);
+    qcvm->num_edicts = TEST_EDICTS;
+    for (int i = 0; i < TEST_EDICTS; i++) {
+        edict_t* e = TestEdict(qcvm, i);
+        float* o = &NVM_FIELD(e, origin, float);
+        float* v = &NVM_FIELD(e, velocity, float);
+        o[0] = i * 8.0f;
+        o[1] = -i * 0.75f;
+        o[2] = 0.1f * (i % 7);
+        v[0] = (i % 3) - 1.0f;
+        v[1] = i * 0.3f;
+        v[2] = -0.5f * (i % 5);
+        NVM_FIELD(e, kind, float) = (float)(i % 5);
+        NVM_FIELD(e, health, float) = 100.0f - i;
+        NVM_FIELD(e, enemy, int) = ((i * 7 + 3) % TEST_EDICTS) * qcvm->edict_size;
+    }
+}
+
+/* a batch run in lanes or spread over threads must leave the edicts as running them one at a time does */
+static void TestBatches(const char* filename, const char* data, size_t size)
+{
+    static const int modes[] = { 0, NVM_EDICTS_LANES, NVM_EDICTS_PARALLEL };
+    static const char* thinks[] = { "mover", "chaser" };
+    byte* expected = NULL;
+    size_t fieldsize = 0;
+
+    for (int m = 0; m < (int)(sizeof(modes) / sizeof(modes[0])); m++) {
+        NVM* qcvm = CreateTestVM(filename, data, size, 0, NULL);
+        nvmedictstatus_t results[TEST_EDICTS];
+        nvmstats_t stats;
+
+        CHECK(qcvm->global_struct != NULL);
+        if (modes[m] == NVM_EDICTS_PARALLEL)
+            nvmSetParallelThreads(qcvm, 4);
+        SetupBatchEdicts(qcvm);
+        qcvm->global_struct->time = 1.5f;
+        for (int t = 0; t < 2; t++) {
+            int errors = nvmExecuteForEdicts(qcvm, nvmFindFunction(qcvm, thinks[t]), NULL, TEST_EDICTS, modes[m], results);
+            CHECK(errors == 0);
+        }
+
+        nvmGetStats(qcvm, &stats);
+        if (modes[m] == NVM_EDICTS_LANES)
+            CHECK(stats.lane_thinks > 0);
+        if (modes[m] == NVM_EDICTS_PARALLEL)
+            CHECK(stats.parallel_thinks > 0);
+
+        fieldsize = qcvm->progs->entityfields * 4;
+        byte* fields = malloc(TEST_EDICTS * fieldsize);
+        for (int i = 0; i < TEST_EDICTS; i++)
+            memcpy(fields + i * fieldsize, &TestEdict(qcvm, i)->v, fieldsize);
+        if (expected == NULL)
+            expected = fields;
+        else {
+            CHECK(memcmp(fields, expected, TEST_EDICTS * fieldsize) == 0);
+            free(fields);
+        }
+        DestroyTestVM(qcvm);
+    }
+    free(expected);
+}
+
+/* ftos and sprintf's %f skip snprintf for speed, but must print what it would */
+static void TestFormatFloat(const char* filename, const char* data, size_t size)
+{
+    static const float values[] = {
+        0.0f, -0.0f, 0.5f, 1.5f, 2.5f, -2.5f, 0.05f, -0.05f, 0.125f, 0.45f, 1e-7f, 3.14159265f,
+        123456.789f, 999999.95f, 16777216.0f, 16777217.0f, 1e9f, 2147483648.0f, -2147483648.0f, 1e17f, 1e20f,
+        FLT_MAX, -FLT_MAX, FLT_MIN, INFINITY, -INFINITY, NAN
+    };
+    NVM* qcvm = CreateTestVM(filename, data, size, 0, NULL);
+    char format[16], expected[128];
+    char* buffer;
+
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+        float v = values[i];
+
+        G_FLOAT(OFS_PARM0) = v;
+        qcvm->argc = 1;
+        nvmBuiltinFtos(qcvm);
+        if (v > -2147483648.0f && v < 2147483648.0f && v == (int)v)
+            snprintf(expected, sizeof(expected), "%d", (int)v);
+        else
+            snprintf(expected, sizeof(expected), "%5.1f", v);
+        if (strcmp(G_STRING(OFS_RETURN), expected) != 0)
+            fprintf(stderr, "ftos(%.9g) gave '%s', expected '%s'\n", v, G_STRING(OFS_RETURN), expected);
+        CHECK(strcmp(G_STRING(OFS_RETURN), expected) == 0);
+
+        for (int width = -1; width <= 12; width += 13) {
+            for (int precision = -1; precision < 10; precision++) {
+                if (width < 0 && precision < 0)
+                    snprintf(format, sizeof(format), "%%f");
+                else if (width < 0)
+                    snprintf(format, sizeof(format), "%%.%df", precision);
+                else if (precision < 0)
+                    snprintf(format, sizeof(format), "%%%df", width);
+                else
+                    snprintf(format, sizeof(format), "%%%d.%df", width, precision);
+                snprintf(expected, sizeof(expected), format, v);
+
+                G_INT(OFS_PARM0) = nvmTempString(qcvm, &buffer);
+                strcpy(buffer, format);
+                G_FLOAT(OFS_PARM1) = v;
+                qcvm->argc = 2;
+                nvmBuiltinSprintf(qcvm);
+                if (strcmp(G_STRING(OFS_RETURN), expected) != 0)
+                    fprintf(stderr, "sprintf(\"%s\", %.9g) gave '%s', expected '%s'\n", format, v, G_STRING(OFS_RETURN), expected);
+                CHECK(strcmp(G_STRING(OFS_RETURN), expected) == 0);
+            }
+        }
+    }
+    DestroyTestVM(qcvm);
+}
+
+/* a version 7 header with an unknown secondary version or compressed lumps is refused rather than misread */
+static void TestVersion7Header(const char* filename, const char* data, size_t size)
+{
+    char* bad = malloc(size + 1);
+    dprograms_t* progs = (dprograms_t*)bad;
+
+    memcpy(bad, data, size + 1);
+    progs->secondaryversion ^= 1;
+    CHECK(CreateTestVM(filename, bad, size, 0, NULL) == NULL);
+
+    memcpy(bad, data, size + 1);
+    progs->blockscompressed = 1;
+    CHECK(CreateTestVM(filename, bad, size, 0, NULL) == NULL);
+
+    free(bad);
+}
+
+static int CallInt(NVM* qcvm, const char* name, int a, int b)
+{
+    G_INT(OFS_PARM0) = a;
+    G_INT(OFS_PARM1) = b;
+    nvmExecuteFunction(qcvm, nvmFindFunction(qcvm, name));
+    return G_INT(OFS_RETURN);
+}
+
+static float CallFloat(NVM* qcvm, const char* name, float a)
+{
+    G_FLOAT(OFS_PARM0) = a;
+    nvmExecuteFunction(qcvm, nvmFindFunction(qcvm, name));
+    return G_FLOAT(OFS_RETURN);
+}
+
+static bool HasOp(NVM* qcvm, unsigned int op)
+{
+    for (int i = 1; i < qcvm->progs->numstatements; i++) {
+        if (qcvm->statements[i].op == op)
+            return true;
+    }
+    return false;
+}
+
+/*
+fteqcc's integer division, switches and pointer loads from a version 7 progs,
+whose 32 bit statements are used in place; the checked interpreter has to agree
+*/
+static void TestExtendedOpcodes(const char* filename, const char* data, size_t size)
+{
+    static const unsigned int ops[] = { OP_DIV_I, OP_SWITCH_I, OP_SWITCH_F, OP_CASE, OP_LOADP_F, OP_LOADP_V };
+
+    for (int checked = 0; checked < 2; checked++) {
+        NVM* qcvm = CreateTestVM(filename, data, size, 0, NULL);
+        CHECK(qcvm != NULL);
+        if (qcvm == NULL)
+            return;
+        CHECK(qcvm->progs->version == PROG_EXTENDEDVERSION);
+        CHECK(qcvm->progs->secondaryversion == PROG_SECONDARYVERSION32);
+        CHECK(qcvm->verified);
+        for (int i = 0; i < (int)(sizeof(ops) / sizeof(ops[0])); i++)
+            CHECK(HasOp(qcvm, ops[i]));
+        nvmSetChecked(qcvm, checked);
+
+        CHECK(CallInt(qcvm, "idiv", 7, 2) == 3);
+        CHECK(CallInt(qcvm, "idiv", -7, 2) == -3);
+        CHECK(CallInt(qcvm, "idiv", 9, -1) == -9);
+        CHECK(CallInt(qcvm, "idiv", 7, 0) == 0);
+        CHECK(CallInt(qcvm, "idiv", INT_MIN, -1) == INT_MIN);
+        CHECK(CallInt(qcvm, "idiv", INT_MIN, 2) == INT_MIN / 2);
+
+        CHECK(CallInt(qcvm, "classify", 1, 0) == 10);
+        CHECK(CallInt(qcvm, "classify", 2, 0) == 23);
+        CHECK(CallInt(qcvm, "classify", 3, 0) == 3);
+        CHECK(CallInt(qcvm, "classify", 7, 0) == -1);
+        CHECK(CallFloat(qcvm, "classify_float", 0.5f) == 50);
+        CHECK(CallFloat(qcvm, "classify_float", 2) == 200);
+        CHECK(CallFloat(qcvm, "classify_float", 3) == 5);
+
+        nvmhandle_t origin = nvmFieldHandle(qcvm, "origin", ev_vector);
+        nvmAllocEdicts(qcvm, 2);
+        memset(qcvm->edicts, 0, 2 * qcvm->edict_size);
+        qcvm->num_edicts = 2;
+        float* o = &NVM_FIELD(TestEdict(qcvm, 1), origin, float);
+        o[0] = 1.5f;
+        o[1] = -2;
+        o[2] = 8;
+        int e = EDICT_TO_PROG(TestEdict(qcvm, 1));
+        G_INT(OFS_PARM1) = 2;
+        G_INT(OFS_PARM0) = e;
+        nvmExecuteFunction(qcvm, nvmFindFunction(qcvm, "origin_component"));
+        CHECK(G_FLOAT(OFS_RETURN) == 8);
+        G_INT(OFS_PARM0) = e;
+        nvmExecuteFunction(qcvm, nvmFindFunction(qcvm, "origin_of"));
+        CHECK(G_VECTOR(OFS_RETURN)[0] == 1.5f && G_VECTOR(OFS_RETURN)[1] == -2 && G_VECTOR(OFS_RETURN)[2] == 8);
+
+        DestroyTestVM(qcvm);
+    }
 }
 
 int main(int argc, char** argv)
 {
     const char* progs_filename = "progs.dat";
+    const char* reload_filename = "reload.dat";
+    const char* v7_filename = "v7.dat";
     if (argc > 1)
     {
         progs_filename = argv[1];
     }
+    if (argc > 2)
+    {
+        reload_filename = argv[2];
+    }
+    if (argc > 3)
+    {
+        v7_filename = argv[3];
+    }
 
     char* progs_data = NULL;
     size_t progs_size = 0;
     if (!ReadFile(progs_filename, &progs_data, &progs_size)) return 1;
+    char* reload_data = NULL;
+    size_t reload_size = 0;
+    if (!ReadFile(reload_filename, &reload_data, &reload_size)) return 1;
+    char* v7_data = NULL;
+    size_t v7_size = 0;
+    if (!ReadFile(v7_filename, &v7_data, &v7_size)) return 1;
 
-    vm = nvmCreateVM(alloc_callback, print_callback, error_callback, NULL);
-    if (nvmLoadProgs(vm, progs_filename, progs_data, progs_size, true))
+    vm = CreateTestVM(progs_filename, progs_data, progs_size, 0, NULL);
+    CHECK(vm != NULL);
+    if (vm)
     {
-        nvmAddExtBuiltin(vm, 0, "counter_increase", builtin_counter_increase);
-        nvmAddExtBuiltin(vm, 0, "print", builtin_print);
         nvmExecuteFunction(vm, nvmFindFunction(vm, "test_main"));
+        DestroyTestVM(vm);
     }
-    nvmDestroyVM(vm);
+    CHECK(counter == 2);
+
+    TestVerifier(progs_filename, progs_data, progs_size);
+    TestInlining(progs_filename, progs_data, progs_size);
+    TestLayout(progs_filename, progs_data, progs_size);
+    TestBudget(progs_filename, progs_data, progs_size);
+    TestThreads(progs_filename, progs_data, progs_size);
+    TestTailCalls(progs_filename, progs_data, progs_size);
+    TestReload(progs_filename, progs_data, progs_size, reload_filename, reload_data, reload_size);
+    TestStripping(progs_filename, progs_data, progs_size);
+    TestProgsCache(progs_data, progs_size, reload_data, reload_size);
+    TestAllocator(progs_filename, progs_data, progs_size, reload_filename, reload_data, reload_size);
+    TestBatches(progs_filename, progs_data, progs_size);
+    TestFormatFloat(progs_filename, progs_data, progs_size);
+    TestVersion7Header(v7_filename, v7_data, v7_size);
+    TestExtendedOpcodes(v7_filename, v7_data, v7_size);
+
     free(progs_data);
+    free(reload_data);
+    free(v7_data);
 
-    //assert(counter == 2);
+    if (failures)
+    {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("all checks passed\n");
     return 0;
-}
\ No newline at end of file
+}